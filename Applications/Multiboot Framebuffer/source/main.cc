@@ -97,7 +97,8 @@ public:
 		screen_pitch_(pitch),
 		screen_bits_per_pixel_(bpp),
 		framebuffer_(MapPhysicalMemory(physical_address_of_framebuffer,
-			(width * pitch + kPageSize - 1) / kPageSize)),
+			(width * pitch + kPageSize - 1) / kPageSize,
+			/*prefer_large_pages=*/true)),
 		next_texture_id_(1),
 		process_allowed_to_write_to_the_screen_(0) {
 		// Create the initial texture, which is the screen buffer.
@@ -143,7 +144,8 @@ public:
 		texture.owner = sender;
 		texture.width = request.GetWidth();
 		texture.height = request.GetHeight();
-		texture.shared_memory = SharedMemory::FromSize(texture.width * texture.height * 4);
+		texture.shared_memory = SharedMemory::FromSize(
+			texture.width * texture.height * 4, /*prefer_large_pages=*/true);
 
 		// Record what textures this process owns.		
 		auto process_information_itr = process_information_.find(sender);
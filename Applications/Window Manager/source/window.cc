@@ -475,7 +475,10 @@ bool Window::MouseEvent(int screen_x, int screen_y,
 					MouseListener::OnMouseHoverMessage message;
 					message.SetX(local_x);
 					message.SetY(local_y);
-					mouse_listener_.SendOnMouseHover(message);
+					// Only the latest position matters, so replace an
+					// earlier position the window hasn't received yet.
+					mouse_listener_.SendOnMouseHover(message,
+						::perception::kMessageCanCoalesce);
 				} else {
 					// We were clicked.
 					MouseListener::OnMouseClickMessage message;
@@ -0,0 +1,117 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+// Compares the thread-caching allocator with malloc on a workload that looks
+// like a busy service - lots of fibers that each allocate small objects,
+// release some of them, and leave the rest for a later fiber to release.
+
+#include <iostream>
+#include <stdlib.h>
+
+#include "perception/allocator.h"
+#include "perception/scheduler.h"
+#include "perception/time.h"
+
+using ::perception::AllocateMemory;
+using ::perception::Defer;
+using ::perception::FinishAnyPendingWork;
+using ::perception::GetTimeSinceKernelStarted;
+using ::perception::ReleaseMemory;
+
+namespace {
+
+// The number of fibers to run in each round.
+constexpr int kFibersPerRound = 2000;
+
+// The number of objects that each fiber allocates.
+constexpr int kObjectsPerFiber = 64;
+
+// Every this many objects is a large buffer rather than a small object.
+constexpr int kLargeObjectInterval = 16;
+
+// The number of rounds to run for each allocator.
+constexpr int kRounds = 5;
+
+// An allocator to benchmark.
+struct Allocator {
+	const char* name;
+	void* (*allocate)(size_t size);
+	void (*release)(void* ptr);
+};
+
+// The objects allocated by a fiber that a later fiber releases.
+struct Batch {
+	void* objects[kObjectsPerFiber];
+};
+
+// Returns the size of an object to allocate. The small sizes are around the
+// size of std::function captures, std::map nodes and Permebuf wrappers.
+size_t GetObjectSize(int fiber, int object) {
+	if (object % kLargeObjectInterval == kLargeObjectInterval - 1)
+		return 1024 << ((fiber + object) % 4);
+
+	constexpr size_t kSmallSizes[] = {24, 32, 48, 64, 96, 128, 256};
+	return kSmallSizes[(fiber * 7 + object) %
+		(sizeof(kSmallSizes) / sizeof(kSmallSizes[0]))];
+}
+
+// Allocates a batch of objects, releases half of them, and leaves the other
+// half for another fiber to release.
+void AllocateBatch(const Allocator& allocator, int fiber) {
+	Batch* batch = (Batch*)allocator.allocate(sizeof(Batch));
+	for (int i = 0; i < kObjectsPerFiber; i++) {
+		batch->objects[i] = allocator.allocate(GetObjectSize(fiber, i));
+		*(char*)batch->objects[i] = (char)i;
+	}
+
+	for (int i = 0; i < kObjectsPerFiber; i += 2)
+		allocator.release(batch->objects[i]);
+
+	Defer([&allocator, batch]() {
+		for (int i = 1; i < kObjectsPerFiber; i += 2)
+			allocator.release(batch->objects[i]);
+		allocator.release(batch);
+	});
+}
+
+void RunBenchmark(const Allocator& allocator) {
+	for (int round = 0; round < kRounds; round++) {
+		auto start = GetTimeSinceKernelStarted();
+		for (int fiber = 0; fiber < kFibersPerRound; fiber++)
+			Defer([&allocator, fiber]() { AllocateBatch(allocator, fiber); });
+		FinishAnyPendingWork();
+		auto duration = GetTimeSinceKernelStarted() - start;
+
+		size_t microseconds = duration.count() == 0 ? 1 : duration.count();
+		size_t allocations = (size_t)kFibersPerRound * (kObjectsPerFiber + 1);
+		std::cout << allocator.name << " round " << round << ": " <<
+			allocations << " allocations in " << microseconds << " us (" <<
+			(allocations * 1000000 / microseconds) <<
+			" allocations per second)" << std::endl;
+	}
+}
+
+}
+
+int main() {
+	Allocator allocators[] = {
+		{"Thread-caching allocator", &AllocateMemory, &ReleaseMemory},
+		{"malloc", &malloc, &free}
+	};
+
+	for (const Allocator& allocator : allocators)
+		RunBenchmark(allocator);
+	return 0;
+}
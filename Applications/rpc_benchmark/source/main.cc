@@ -0,0 +1,96 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Measures the round trip time of a mini message RPC. The first instance of
+// this application is the server, and it launches a second instance that is
+// the client.
+
+#include <iostream>
+
+#include "perception/launcher.h"
+#include "perception/processes.h"
+#include "perception/scheduler.h"
+#include "perception/time.h"
+#include "permebuf/Applications/rpc_benchmark/rpc_benchmark.permebuf.h"
+
+using ::perception::GetTimeSinceKernelStarted;
+using ::perception::HandOverControl;
+using ::perception::LaunchApplication;
+using ::perception::ProcessId;
+using ::perception::TerminateProcess;
+using ::permebuf::perception::benchmarks::RpcBenchmark;
+
+namespace {
+
+// The number of calls to make in each round.
+constexpr int kCallsPerRound = 100000;
+
+// The number of rounds to run.
+constexpr int kRounds = 5;
+
+class RpcBenchmarkServer : public RpcBenchmark::Server {
+public:
+	StatusOr<RpcBenchmark::PingResponse> HandlePing(
+		ProcessId sender,
+		const RpcBenchmark::PingRequest& request) override {
+		RpcBenchmark::PingResponse response;
+		response.SetValue(request.GetValue());
+		return response;
+	}
+};
+
+void RunClient(RpcBenchmark service) {
+	for (int round = 0; round < kRounds; round++) {
+		auto start = GetTimeSinceKernelStarted();
+		for (int i = 0; i < kCallsPerRound; i++) {
+			RpcBenchmark::PingRequest request;
+			request.SetValue(i);
+			auto status_or_response = service.CallPing(request);
+			if (!status_or_response ||
+				status_or_response->GetValue() != (size_t)i) {
+				std::cout << "Ping " << i << " failed." << std::endl;
+				return;
+			}
+		}
+		auto duration = GetTimeSinceKernelStarted() - start;
+
+		size_t microseconds = duration.count() == 0 ? 1 : duration.count();
+		std::cout << "Round " << round << ": " << kCallsPerRound <<
+			" calls in " << microseconds << " us (" <<
+			((size_t)kCallsPerRound * 1000000 / microseconds) <<
+			" calls per second)" << std::endl;
+	}
+}
+
+}
+
+int main() {
+	auto existing_server = RpcBenchmark::FindFirstInstance();
+	if (existing_server) {
+		// We're the client.
+		RunClient(*existing_server);
+		TerminateProcess();
+		return 0;
+	}
+
+	// We're the server, so launch the client.
+	RpcBenchmarkServer server;
+	if (!LaunchApplication("rpc_benchmark")) {
+		std::cout << "Couldn't launch the RPC benchmark client." << std::endl;
+		return 0;
+	}
+
+	HandOverControl();
+	return 0;
+}
@@ -1743,7 +1743,7 @@ ${thisService.cppClassName}::${thisService.cppClassName}(
 
 ${thisService.cppClassName}::${thisService.cppClassName}(
 	const ${thisService.cppClassName}& other) :
-	::PermebufService(other.GetProcessId(), other.GetMessageId()) {}
+	::PermebufService(other) {}
 
 std::optional<${thisService.cppClassName}> ${thisService.cppClassName}::FindFirstInstance() {
 	::perception::ProcessId process_id;
@@ -1895,12 +1895,12 @@ bool ${thisService.cppClassName}_Server::DelegateMessage(
 				case FieldType.MINIMESSAGE:
 					if (responseType == null) {
 						headerCpp +=
-`		::perception::Status Send${field.name}(const ${requestType.cppClassName}& request) const;
+`		::perception::Status Send${field.name}(const ${requestType.cppClassName}& request, size_t flags = 0) const;
 `;
 						sourceCpp += `
 ::perception::Status ${thisService.cppClassName}::Send${field.name}(
-	const ${requestType.cppClassName}& request) const {
-		return SendMiniMessage<${requestType.cppClassName}>(${field.number}, request);
+	const ${requestType.cppClassName}& request, size_t flags) const {
+		return SendMiniMessage<${requestType.cppClassName}>(${field.number}, request, flags);
 }
 `;
 						serverDelegator += `return ProcessMiniMessage<${requestType.cppClassName}>(
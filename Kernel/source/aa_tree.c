@@ -0,0 +1,181 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "aa_tree.h"
+
+// Returns the level of a node, where NULL is level 0.
+static size_t GetLevel(struct AATreeNode* node) {
+	return node == NULL ? 0 : node->level;
+}
+
+// Returns if node a is sorted before node b.
+static bool IsNodeBefore(struct AATree* tree, struct AATreeNode* a,
+	struct AATreeNode* b) {
+	size_t a_value = tree->calculate_node_value(a);
+	size_t b_value = tree->calculate_node_value(b);
+	if (a_value != b_value)
+		return a_value < b_value;
+	return (size_t)a < (size_t)b;
+}
+
+// Rotates right if the left child is at the same level, removing a left
+// horizontal link.
+static struct AATreeNode* Skew(struct AATreeNode* node) {
+	if (node == NULL || node->left == NULL || node->left->level != node->level)
+		return node;
+
+	struct AATreeNode* left = node->left;
+	node->left = left->right;
+	left->right = node;
+	return left;
+}
+
+// Rotates left and raises the middle node if there are two right horizontal
+// links in a row.
+static struct AATreeNode* Split(struct AATreeNode* node) {
+	if (node == NULL || node->right == NULL || node->right->right == NULL ||
+		node->right->right->level != node->level)
+		return node;
+
+	struct AATreeNode* right = node->right;
+	node->right = right->left;
+	right->left = node;
+	right->level++;
+	return right;
+}
+
+// Inserts a node under root, returning the new root.
+static struct AATreeNode* InsertNodeUnderRoot(struct AATree* tree,
+	struct AATreeNode* root, struct AATreeNode* node) {
+	if (root == NULL)
+		return node;
+
+	if (IsNodeBefore(tree, node, root))
+		root->left = InsertNodeUnderRoot(tree, root->left, node);
+	else
+		root->right = InsertNodeUnderRoot(tree, root->right, node);
+
+	return Split(Skew(root));
+}
+
+// Removes a node from under root, returning the new root.
+static struct AATreeNode* RemoveNodeUnderRoot(struct AATree* tree,
+	struct AATreeNode* root, struct AATreeNode* node) {
+	if (root == NULL)
+		return NULL;
+
+	if (root == node) {
+		if (root->left == NULL && root->right == NULL)
+			return NULL;
+
+		// Replace the node with its successor or predecessor, which is always
+		// at the bottom level.
+		struct AATreeNode* replacement;
+		if (root->left == NULL) {
+			replacement = root->right;
+			while (replacement->left != NULL)
+				replacement = replacement->left;
+			replacement->right =
+				RemoveNodeUnderRoot(tree, root->right, replacement);
+			replacement->left = NULL;
+		} else {
+			replacement = root->left;
+			while (replacement->right != NULL)
+				replacement = replacement->right;
+			replacement->left =
+				RemoveNodeUnderRoot(tree, root->left, replacement);
+			replacement->right = root->right;
+		}
+		replacement->level = root->level;
+		root = replacement;
+	} else if (IsNodeBefore(tree, node, root)) {
+		root->left = RemoveNodeUnderRoot(tree, root->left, node);
+	} else {
+		root->right = RemoveNodeUnderRoot(tree, root->right, node);
+	}
+
+	// Lower the level of this node if its children are too far below it.
+	size_t level = GetLevel(root->left) < GetLevel(root->right) ?
+		GetLevel(root->left) : GetLevel(root->right);
+	level++;
+	if (level < root->level) {
+		root->level = level;
+		if (root->right != NULL && level < root->right->level)
+			root->right->level = level;
+	}
+
+	// Rebalance.
+	root = Skew(root);
+	root->right = Skew(root->right);
+	if (root->right != NULL)
+		root->right->right = Skew(root->right->right);
+	root = Split(root);
+	root->right = Split(root->right);
+	return root;
+}
+
+// Initializes an empty AA tree.
+void InitializeAATree(struct AATree* tree,
+	size_t (*calculate_node_value)(struct AATreeNode* node)) {
+	tree->root = NULL;
+	tree->calculate_node_value = calculate_node_value;
+}
+
+// Inserts a node into an AA tree.
+void InsertNodeIntoAATree(struct AATree* tree, struct AATreeNode* node) {
+	node->left = NULL;
+	node->right = NULL;
+	node->level = 1;
+	tree->root = InsertNodeUnderRoot(tree, tree->root, node);
+}
+
+// Removes a node from an AA tree. The node must be in the tree.
+void RemoveNodeFromAATree(struct AATree* tree, struct AATreeNode* node) {
+	tree->root = RemoveNodeUnderRoot(tree, tree->root, node);
+}
+
+// Returns the node with the largest value that is less than or equal to
+// value, or NULL if there isn't one.
+struct AATreeNode* SearchForNodeLessThanOrEqualToValue(
+	struct AATree* tree, size_t value) {
+	struct AATreeNode* best = NULL;
+	struct AATreeNode* node = tree->root;
+	while (node != NULL) {
+		if (tree->calculate_node_value(node) <= value) {
+			best = node;
+			node = node->right;
+		} else {
+			node = node->left;
+		}
+	}
+	return best;
+}
+
+// Returns the node with the smallest value that is greater than or equal to
+// value, or NULL if there isn't one.
+struct AATreeNode* SearchForNodeGreaterThanOrEqualToValue(
+	struct AATree* tree, size_t value) {
+	struct AATreeNode* best = NULL;
+	struct AATreeNode* node = tree->root;
+	while (node != NULL) {
+		if (tree->calculate_node_value(node) >= value) {
+			best = node;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+	return best;
+}
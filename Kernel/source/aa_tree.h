@@ -0,0 +1,57 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include "types.h"
+
+// A node in an AA tree. Embed this in the struct that is being stored in the
+// tree. A struct can be in multiple trees by embedding multiple nodes.
+struct AATreeNode {
+	struct AATreeNode* left;
+	struct AATreeNode* right;
+	size_t level;
+};
+
+// An AA tree, which is a balanced binary search tree. Nodes are sorted by the
+// value returned from calculate_node_value, and nodes with the same value are
+// sorted by where they are in memory.
+struct AATree {
+	struct AATreeNode* root;
+
+	// Returns the value to sort a node by. The value must not change while the
+	// node is in the tree.
+	size_t (*calculate_node_value)(struct AATreeNode* node);
+};
+
+// Initializes an empty AA tree.
+extern void InitializeAATree(struct AATree* tree,
+	size_t (*calculate_node_value)(struct AATreeNode* node));
+
+// Inserts a node into an AA tree.
+extern void InsertNodeIntoAATree(struct AATree* tree, struct AATreeNode* node);
+
+// Removes a node from an AA tree. The node must be in the tree.
+extern void RemoveNodeFromAATree(struct AATree* tree, struct AATreeNode* node);
+
+// Returns the node with the largest value that is less than or equal to
+// value, or NULL if there isn't one.
+extern struct AATreeNode* SearchForNodeLessThanOrEqualToValue(
+	struct AATree* tree, size_t value);
+
+// Returns the node with the smallest value that is greater than or equal to
+// value, or NULL if there isn't one.
+extern struct AATreeNode* SearchForNodeGreaterThanOrEqualToValue(
+	struct AATree* tree, size_t value);
@@ -0,0 +1,216 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "acpi.h"
+
+#include "../../third_party/multiboot2.h"
+#include "cpu.h"
+#include "io.h"
+#include "physical_allocator.h"
+#include "text_terminal.h"
+#include "virtual_allocator.h"
+
+// #define DEBUG
+
+// The temporary mapping slot we use to read ACPI tables.
+#define ACPI_TEMPORARY_MAPPING 6
+
+// Offsets into the RSDP (root system description pointer).
+#define RSDP_REVISION 15
+#define RSDP_RSDT_ADDRESS 16
+#define RSDP_XSDT_ADDRESS 24
+
+// Offsets into the header that every system descriptor table starts with.
+#define SDT_SIGNATURE 0
+#define SDT_LENGTH 4
+#define SDT_HEADER_SIZE 36
+
+// Offsets into the MADT (multiple APIC description table).
+#define MADT_LOCAL_APIC_ADDRESS 36
+#define MADT_ENTRIES 44
+
+// Types of entries in the MADT.
+#define MADT_LOCAL_APIC 0
+#define MADT_IO_APIC 1
+#define MADT_LOCAL_APIC_ADDRESS_OVERRIDE 5
+
+// Bits in the flags of a local APIC entry in the MADT.
+#define LOCAL_APIC_ENABLED 1
+#define LOCAL_APIC_ONLINE_CAPABLE 2
+
+// The physical address of the local APICs, or 0 if we didn't find it.
+size_t local_apic_physical_address;
+
+// The physical address of the first IOAPIC, or 0 if we didn't find one.
+size_t io_apic_physical_address;
+
+// The first global system interrupt handled by the first IOAPIC.
+size_t io_apic_global_system_interrupt_base;
+
+// Reads a byte from physical memory.
+static uint8 ReadPhysicalByte(size_t address) {
+	uint8* page = (uint8*)TemporarilyMapPhysicalMemory(
+		address & ~(PAGE_SIZE - 1), ACPI_TEMPORARY_MAPPING);
+	return page[address & (PAGE_SIZE - 1)];
+}
+
+// Reads a little endian number from physical memory. The tables aren't
+// necessarily aligned, so this reads a byte at a time.
+static size_t ReadPhysicalNumber(size_t address, size_t bytes) {
+	size_t value = 0;
+	for (size_t i = 0; i < bytes; i++)
+		value |= (size_t)ReadPhysicalByte(address + i) << (i * 8);
+	return value;
+}
+
+// Returns if the table at the physical address has the signature.
+static bool TableHasSignature(size_t address, const char* signature) {
+	for (int i = 0; i < 4; i++) {
+		if (ReadPhysicalByte(address + SDT_SIGNATURE + i) != signature[i])
+			return false;
+	}
+	return true;
+}
+
+// Records a CPU that we found in the MADT.
+static void AddCpu(size_t local_apic_id) {
+	if (local_apic_id == cpus[0].local_apic_id) {
+		// This is the boot CPU, which we already know about.
+		return;
+	}
+
+	if (number_of_cpus == MAX_CPUS) {
+		PrintString("Too many CPUs, ignoring local APIC ");
+		PrintNumber(local_apic_id);
+		PrintChar('\n');
+		return;
+	}
+
+	struct Cpu* cpu = &cpus[number_of_cpus];
+	memset((unsigned char*)cpu, 0, sizeof(struct Cpu));
+	cpu->id = number_of_cpus;
+	cpu->local_apic_id = local_apic_id;
+	number_of_cpus++;
+}
+
+// Parses the MADT, which lists the local APICs (one per CPU) and IOAPICs.
+static void ParseMadt(size_t madt) {
+	size_t length = ReadPhysicalNumber(madt + SDT_LENGTH, 4);
+	local_apic_physical_address =
+		ReadPhysicalNumber(madt + MADT_LOCAL_APIC_ADDRESS, 4);
+
+	size_t entry = madt + MADT_ENTRIES;
+	while (entry + 2 <= madt + length) {
+		uint8 type = ReadPhysicalByte(entry);
+		uint8 entry_length = ReadPhysicalByte(entry + 1);
+		if (entry_length < 2)
+			break;  // Malformed table.
+
+		switch (type) {
+			case MADT_LOCAL_APIC: {
+				size_t local_apic_id = ReadPhysicalByte(entry + 3);
+				size_t flags = ReadPhysicalNumber(entry + 4, 4);
+				if (flags & (LOCAL_APIC_ENABLED | LOCAL_APIC_ONLINE_CAPABLE))
+					AddCpu(local_apic_id);
+				break;
+			}
+			case MADT_IO_APIC:
+				if (io_apic_physical_address == 0) {
+					io_apic_physical_address = ReadPhysicalNumber(entry + 4, 4);
+					io_apic_global_system_interrupt_base =
+						ReadPhysicalNumber(entry + 8, 4);
+				}
+				break;
+			case MADT_LOCAL_APIC_ADDRESS_OVERRIDE:
+				local_apic_physical_address = ReadPhysicalNumber(entry + 4, 8);
+				break;
+		}
+		entry += entry_length;
+	}
+
+#ifdef DEBUG
+	PrintString("Found ");
+	PrintNumber(number_of_cpus);
+	PrintString(" CPU(s), local APIC at ");
+	PrintHex(local_apic_physical_address);
+	PrintString(", IOAPIC at ");
+	PrintHex(io_apic_physical_address);
+	PrintChar('\n');
+#endif
+}
+
+// Finds the MADT from the RSDT or XSDT.
+static void FindMadt(size_t rsdp) {
+	size_t root_table;
+	size_t entry_size;
+	if (ReadPhysicalByte(rsdp + RSDP_REVISION) >= 2 &&
+		ReadPhysicalNumber(rsdp + RSDP_XSDT_ADDRESS, 8) != 0) {
+		// ACPI 2.0+ has an XSDT with 64-bit pointers.
+		root_table = ReadPhysicalNumber(rsdp + RSDP_XSDT_ADDRESS, 8);
+		entry_size = 8;
+	} else {
+		root_table = ReadPhysicalNumber(rsdp + RSDP_RSDT_ADDRESS, 4);
+		entry_size = 4;
+	}
+
+	size_t length = ReadPhysicalNumber(root_table + SDT_LENGTH, 4);
+	for (size_t entry = root_table + SDT_HEADER_SIZE;
+		entry + entry_size <= root_table + length;
+		entry += entry_size) {
+		size_t table = ReadPhysicalNumber(entry, entry_size);
+		if (TableHasSignature(table, "APIC")) {
+			ParseMadt(table);
+			return;
+		}
+	}
+}
+
+// Finds the ACPI tables from the multiboot header and populates the list of
+// CPUs and interrupt controllers from the MADT. Must be called before
+// DoneWithMultibootMemory().
+void InitializeAcpi() {
+	local_apic_physical_address = 0;
+	io_apic_physical_address = 0;
+	io_apic_global_system_interrupt_base = 0;
+
+	// We are now in higher half memory, so we have to add VIRTUAL_MEMORY_OFFSET.
+	struct multiboot_info* higher_half_multiboot_info =
+		(struct multiboot_info *)((size_t)&MultibootInfo + VIRTUAL_MEMORY_OFFSET);
+
+	// Loop through the multiboot sections, looking for the RSDP. Prefer the
+	// new (ACPI 2.0+) RSDP if we have both.
+	size_t rsdp = 0;
+	struct multiboot_tag *tag;
+	for(tag = (struct multiboot_tag *)(size_t)(higher_half_multiboot_info->addr + 8 + VIRTUAL_MEMORY_OFFSET);
+		tag->type != MULTIBOOT_TAG_TYPE_END;
+		tag = (struct multiboot_tag *)((size_t) tag + (size_t)((tag->size + 7) & ~7))) {
+		if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_NEW) {
+			rsdp = (size_t)((struct multiboot_tag_new_acpi *)tag)->rsdp -
+				VIRTUAL_MEMORY_OFFSET;
+		} else if (tag->type == MULTIBOOT_TAG_TYPE_ACPI_OLD && rsdp == 0) {
+			rsdp = (size_t)((struct multiboot_tag_old_acpi *)tag)->rsdp -
+				VIRTUAL_MEMORY_OFFSET;
+		}
+	}
+
+	if (rsdp == 0) {
+		// No ACPI, so we'll run on just the boot CPU.
+#ifdef DEBUG
+		PrintString("No ACPI tables found.\n");
+#endif
+		return;
+	}
+
+	FindMadt(rsdp);
+}
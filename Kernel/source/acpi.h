@@ -0,0 +1,35 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "types.h"
+
+// The microkernel only reads the ACPI tables it needs to find the other CPUs
+// and interrupt controllers. Everything else in ACPI is left to userland
+// drivers.
+
+// The physical address of the local APICs, or 0 if we didn't find it.
+extern size_t local_apic_physical_address;
+
+// The physical address of the first IOAPIC, or 0 if we didn't find one.
+extern size_t io_apic_physical_address;
+
+// The first global system interrupt handled by the first IOAPIC.
+extern size_t io_apic_global_system_interrupt_base;
+
+// Finds the ACPI tables from the multiboot header and populates the list of
+// CPUs and interrupt controllers from the MADT. Must be called before
+// DoneWithMultibootMemory().
+extern void InitializeAcpi();
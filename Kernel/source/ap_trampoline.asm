@@ -0,0 +1,147 @@
+; Copyright 2021 Google LLC
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;      http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+
+; The code that application processors (every CPU other than the boot CPU)
+; start executing when they are woken up. This is copied to
+; AP_TRAMPOLINE_ADDRESS in low memory by StartApplicationProcessors (smp.c),
+; because CPUs start in 16-bit real mode and can only begin executing in the
+; first 1 MB of memory. The fields at the end are filled in for each CPU before
+; it is started.
+
+; Where this code gets copied to. Must match AP_TRAMPOLINE_ADDRESS in smp.c.
+%define AP_TRAMPOLINE_ADDRESS 0x8000
+
+; Converts a label into the address it'll be at once the code is copied.
+%define ADDRESS(label) (AP_TRAMPOLINE_ADDRESS + (label) - ApTrampolineStart)
+
+%define VIRTUAL_MEMORY_OFFSET 0xFFFFFFFF80000000
+
+[GLOBAL ApTrampolineStart]
+[GLOBAL ApTrampolineEnd]
+[GLOBAL ApTrampolinePml4]
+[GLOBAL ApTrampolineKernelPml4]
+[GLOBAL ApTrampolineStack]
+[GLOBAL ApTrampolineCpu]
+[GLOBAL ApTrampolineEntryPoint]
+
+[BITS 16]
+ApTrampolineStart:
+	cli
+	cld
+
+	; Load our GDT, then enter protected mode.
+	xor ax, ax
+	mov ds, ax
+	o32 lgdt [ADDRESS(ApTrampolineGdtr)]
+
+	mov eax, cr0
+	or eax, 1
+	mov cr0, eax
+
+	jmp dword 0x18:ADDRESS(ApTrampoline32)
+
+[BITS 32]
+ApTrampoline32:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	; Load the PML4 that identity maps this code. It needs to be in the first
+	; 4 GB of memory because we're still in 32-bit mode.
+	mov eax, [ADDRESS(ApTrampolinePml4)]
+	mov cr3, eax
+
+	; Enable PAE (5) and OSFXSR (9) and OSXMMEXCPT (10) for FPU.
+	mov eax, cr4
+	or eax, (1 << 5) | (1 << 9) | (1 << 10)
+	mov cr4, eax
+
+	; Enable Load Mode (8) and System Call Extensions (0) in the MSR.
+	mov ecx, 0xC0000080
+	rdmsr
+	or eax, (1 << 8) | (1)
+	wrmsr
+
+	; Enable paging (31) and MP (1) for FPU.
+	mov eax, cr0
+	or eax, (1 << 31) | (1 << 1)
+
+	; Clear EM (2) for FPU.
+	and eax, ~(1 << 2)
+	mov cr0, eax
+
+	; Jump to long-mode.
+	jmp 0x08:ADDRESS(ApTrampoline64)
+
+[BITS 64]
+ApTrampoline64:
+	mov ax, 0x10
+	mov ds, ax
+	mov es, ax
+	mov ss, ax
+
+	; Jump to the copy of this code in higher half memory, so we can switch to
+	; the kernel's PML4, which doesn't identity map this code.
+	mov rax, VIRTUAL_MEMORY_OFFSET + ADDRESS(ApTrampolineHigherHalf)
+	jmp rax
+
+ApTrampolineHigherHalf:
+	mov rax, [VIRTUAL_MEMORY_OFFSET + ADDRESS(ApTrampolineKernelPml4)]
+	mov cr3, rax
+
+	mov rsp, [VIRTUAL_MEMORY_OFFSET + ADDRESS(ApTrampolineStack)]
+	mov rbp, rsp
+
+	; Call ApplicationProcessorEntryPoint(struct Cpu*), which doesn't return.
+	mov rdi, [VIRTUAL_MEMORY_OFFSET + ADDRESS(ApTrampolineCpu)]
+	mov rax, [VIRTUAL_MEMORY_OFFSET + ADDRESS(ApTrampolineEntryPoint)]
+	call rax
+
+; The GDT we use until ApplicationProcessorEntryPoint loads the CPU's own GDT.
+; The 64-bit segments match Gdt64 in boot.asm.
+align 8
+ApTrampolineGdt:
+	; Invalid segment
+	DQ 0x0000000000000000 ; 0x0
+	; Kernel code: RW, executable, code/data segment, present, 64-bit, ring 0
+	DQ 0x00209A0000000000 ; 0x8
+	; Kernel data: RW, data, code/data segment, present, ring 0
+	DQ 0x0000920000000000 ; 0x10
+	; 0->4GB is RW, executable, code/data segment, present, 4k, 32-bit
+	DQ 0x00CF9A000000FFFF ; 0x18
+
+; Reference to the GDT above.
+ApTrampolineGdtr:
+	DW 31 ; 32 bytes long
+	DD ADDRESS(ApTrampolineGdt)
+
+; Fields that StartApplicationProcessors fills in.
+align 8
+; The physical address of the PML4 that identity maps this code.
+ApTrampolinePml4:
+	DQ 0
+; The physical address of the kernel's PML4.
+ApTrampolineKernelPml4:
+	DQ 0
+; The top of the CPU's stack.
+ApTrampolineStack:
+	DQ 0
+; The CPU's struct Cpu.
+ApTrampolineCpu:
+	DQ 0
+; The address of ApplicationProcessorEntryPoint.
+ApTrampolineEntryPoint:
+	DQ 0
+ApTrampolineEnd:
@@ -0,0 +1,347 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "benchmarks.h"
+
+#include "io.h"
+#include "object_pools.h"
+#include "physical_allocator.h"
+#include "process.h"
+#include "service.h"
+#include "text_terminal.h"
+#include "timer.h"
+#include "virtual_allocator.h"
+
+// The number of fake processes to arm timers for.
+#define TIMER_BENCHMARK_PROCESSES 100
+
+// The number of timers to arm, spread across the processes.
+#define TIMER_BENCHMARK_TIMERS 100000
+
+// The number of pages to move back and forth between address spaces.
+#define PAGE_TRANSFER_BENCHMARK_PAGES 1000
+
+// The number of times to move the pages.
+#define PAGE_TRANSFER_BENCHMARK_ROUNDS 1000
+
+// The number of pages that each address space reads between switches.
+#define CONTEXT_SWITCH_BENCHMARK_PAGES 64
+
+// The number of times to switch between address spaces.
+#define CONTEXT_SWITCH_BENCHMARK_SWITCHES 100000
+
+// The most processes to create when benchmarking process lookups.
+#define PROCESS_LOOKUP_BENCHMARK_PROCESSES 1000
+
+// The number of lookups to time with each number of processes.
+#define PROCESS_LOOKUP_BENCHMARK_LOOKUPS 100000
+
+// The number of services, each with its own name, to register when
+// benchmarking service lookups.
+#define SERVICE_LOOKUP_BENCHMARK_SERVICES 1000
+
+// The number of service lookups to time.
+#define SERVICE_LOOKUP_BENCHMARK_LOOKUPS 100000
+
+// Returns the next number from a simple linear congruential generator, so the
+// benchmarks are repeatable.
+static size_t NextPseudoRandomNumber(size_t* seed) {
+	*seed = *seed * 6364136223846793005 + 1442695040888963407;
+	return *seed >> 33;
+}
+
+// Prints how long a benchmark took.
+static void PrintBenchmarkResult(const char* name, size_t operations,
+	size_t microseconds) {
+	PrintString(name);
+	PrintString(": ");
+	PrintNumber(operations);
+	PrintString(" operations in ");
+	PrintNumber(microseconds);
+	PrintString(" us\n");
+}
+
+// Arms timers across many processes, then cancels them all, like when those
+// processes are destroyed.
+static void BenchmarkTimerEvents() {
+	struct Process* processes[TIMER_BENCHMARK_PROCESSES];
+	for (int i = 0; i < TIMER_BENCHMARK_PROCESSES; i++) {
+		// The timer code only touches the process's list of timer events, so
+		// a zeroed process is enough.
+		processes[i] = AllocateProcess();
+		if (processes[i] == NULL) {
+			PrintString("Out of memory to benchmark timer events.\n");
+			for (int j = 0; j < i; j++)
+				ReleaseProcess(processes[j]);
+			return;
+		}
+		memset((unsigned char*)processes[i], 0, sizeof(struct Process));
+	}
+
+	// Schedule the timers far enough in the future that none of them will
+	// trigger while we're running.
+	size_t far_future = GetCurrentTimestampInMicroseconds() +
+		(size_t)60 * 60 * 1000000;
+	size_t seed = 1;
+
+	size_t start = GetCurrentTimestampInMicroseconds();
+	for (int i = 0; i < TIMER_BENCHMARK_TIMERS; i++) {
+		SendMessageToProcessAtMicroseconds(
+			processes[i % TIMER_BENCHMARK_PROCESSES],
+			far_future + NextPseudoRandomNumber(&seed) % 1000000, i);
+	}
+	size_t armed = GetCurrentTimestampInMicroseconds();
+
+	for (int i = 0; i < TIMER_BENCHMARK_PROCESSES; i++)
+		CancelAllTimerEventsForProcess(processes[i]);
+	size_t cancelled = GetCurrentTimestampInMicroseconds();
+
+	PrintBenchmarkResult("Arm timer events", TIMER_BENCHMARK_TIMERS,
+		armed - start);
+	PrintBenchmarkResult("Cancel timer events", TIMER_BENCHMARK_TIMERS,
+		cancelled - armed);
+
+	for (int i = 0; i < TIMER_BENCHMARK_PROCESSES; i++)
+		ReleaseProcess(processes[i]);
+}
+
+// Moves pages back and forth between two address spaces, like processes
+// sending each other large Permebuf messages, and counts how many times we
+// reload CR3 while doing it.
+static void BenchmarkPageTransfers() {
+	size_t pml4s[2];
+	pml4s[0] = CreateAddressSpace();
+	pml4s[1] = CreateAddressSpace();
+	if (pml4s[0] == OUT_OF_MEMORY || pml4s[1] == OUT_OF_MEMORY) {
+		PrintString("Out of memory to benchmark page transfers.\n");
+		if (pml4s[0] != OUT_OF_MEMORY)
+			FreeAddressSpace(pml4s[0]);
+		if (pml4s[1] != OUT_OF_MEMORY)
+			FreeAddressSpace(pml4s[1]);
+		return;
+	}
+
+	// Start the pages off a page into the address space, so the transfers
+	// don't line up with page tables.
+	size_t address = PAGE_SIZE;
+	for (size_t page = 0; page < PAGE_TRANSFER_BENCHMARK_PAGES; page++) {
+		if (GetOrCreateVirtualPage(pml4s[0], address + page * PAGE_SIZE) ==
+			OUT_OF_MEMORY) {
+			PrintString("Out of memory to benchmark page transfers.\n");
+			FreeAddressSpace(pml4s[0]);
+			FreeAddressSpace(pml4s[1]);
+			return;
+		}
+	}
+
+	size_t cr3_reloads_at_start = cr3_reloads;
+	size_t start = GetCurrentTimestampInMicroseconds();
+	size_t rounds;
+	for (rounds = 0; rounds < PAGE_TRANSFER_BENCHMARK_ROUNDS; rounds++) {
+		size_t from = rounds % 2;
+		size_t destination_address = FindFreePageRange(pml4s[1 - from],
+			PAGE_TRANSFER_BENCHMARK_PAGES);
+		if (destination_address == OUT_OF_MEMORY ||
+			!MovePagesBetweenAddressSpaces(pml4s[from], address,
+				pml4s[1 - from], destination_address,
+				PAGE_TRANSFER_BENCHMARK_PAGES)) {
+			PrintString("Couldn't move pages between address spaces.\n");
+			break;
+		}
+		address = destination_address;
+	}
+	size_t microseconds = GetCurrentTimestampInMicroseconds() - start;
+	size_t reloads = cr3_reloads - cr3_reloads_at_start;
+
+	PrintBenchmarkResult("Page transfers",
+		rounds * PAGE_TRANSFER_BENCHMARK_PAGES, microseconds);
+	PrintString("CR3 reloads: ");
+	PrintNumber(reloads);
+	PrintString(" (");
+	PrintNumber(microseconds == 0 ? 0 : reloads * 1000000 / microseconds);
+	PrintString(" per second)\n");
+
+	FreeAddressSpace(pml4s[0]);
+	FreeAddressSpace(pml4s[1]);
+}
+
+// Switches back and forth between two address spaces and reads some pages in
+// each, like two processes messaging each other. With PCIDs, the
+// pages stay in the TLB while the other address space is running.
+static void BenchmarkContextSwitches() {
+	size_t pml4s[2];
+	pml4s[0] = CreateAddressSpace();
+	pml4s[1] = CreateAddressSpace();
+	if (pml4s[0] == OUT_OF_MEMORY || pml4s[1] == OUT_OF_MEMORY) {
+		PrintString("Out of memory to benchmark context switches.\n");
+		if (pml4s[0] != OUT_OF_MEMORY)
+			FreeAddressSpace(pml4s[0]);
+		if (pml4s[1] != OUT_OF_MEMORY)
+			FreeAddressSpace(pml4s[1]);
+		return;
+	}
+
+	size_t address = PAGE_SIZE;
+	for (int i = 0; i < 2; i++) {
+		for (size_t page = 0; page < CONTEXT_SWITCH_BENCHMARK_PAGES; page++) {
+			if (GetOrCreateVirtualPage(pml4s[i], address + page * PAGE_SIZE) ==
+				OUT_OF_MEMORY) {
+				PrintString("Out of memory to benchmark context switches.\n");
+				FreeAddressSpace(pml4s[0]);
+				FreeAddressSpace(pml4s[1]);
+				return;
+			}
+		}
+	}
+
+	size_t original_pml4 = current_pml4;
+	size_t cr3_reloads_at_start = cr3_reloads;
+	size_t start = GetCurrentTimestampInMicroseconds();
+	for (size_t i = 0; i < CONTEXT_SWITCH_BENCHMARK_SWITCHES; i++) {
+		SwitchToAddressSpace(pml4s[i % 2]);
+		for (size_t page = 0; page < CONTEXT_SWITCH_BENCHMARK_PAGES; page++)
+			(void)*(volatile size_t*)(address + page * PAGE_SIZE);
+	}
+	size_t microseconds = GetCurrentTimestampInMicroseconds() - start;
+	size_t reloads = cr3_reloads - cr3_reloads_at_start;
+	SwitchToAddressSpace(original_pml4);
+
+	PrintBenchmarkResult(pcids_enabled ? "Context switches (with PCIDs)" :
+		"Context switches (without PCIDs)", CONTEXT_SWITCH_BENCHMARK_SWITCHES,
+		microseconds);
+	PrintString("CR3 reloads: ");
+	PrintNumber(reloads);
+	PrintChar('\n');
+
+	FreeAddressSpace(pml4s[0]);
+	FreeAddressSpace(pml4s[1]);
+}
+
+// Looks up processes by PID, like SEND_MESSAGE does, and by name, like
+// GET_PROCESSES does, with 1, 10, 100, and 1000 processes. The time per lookup
+// should stay flat as the number of processes grows.
+static void BenchmarkProcessLookups() {
+	static struct Process* processes[PROCESS_LOOKUP_BENCHMARK_PROCESSES];
+	size_t processes_created = 0;
+	size_t seed = 1;
+
+	for (size_t count = 1; count <= PROCESS_LOOKUP_BENCHMARK_PROCESSES;
+		count *= 10) {
+		while (processes_created < count) {
+			struct Process* process = CreateProcess(false);
+			if (process == (struct Process*)ERROR) {
+				PrintString("Out of memory to benchmark process lookups.\n");
+				count = PROCESS_LOOKUP_BENCHMARK_PROCESSES;
+				break;
+			}
+
+			// Give each process its own name.
+			char name[] = "Benchmark 0000";
+			size_t number = processes_created;
+			for (int digit = sizeof(name) - 2; digit >= 10; digit--) {
+				name[digit] = '0' + number % 10;
+				number /= 10;
+			}
+			SetProcessName(process, name, sizeof(name) - 1);
+			processes[processes_created++] = process;
+		}
+		if (processes_created < count)
+			break;
+
+		size_t start = GetCurrentTimestampInMicroseconds();
+		for (int i = 0; i < PROCESS_LOOKUP_BENCHMARK_LOOKUPS; i++) {
+			size_t pid =
+				processes[NextPseudoRandomNumber(&seed) % count]->pid;
+			if (GetProcessFromPid(pid) == NULL)
+				PrintString("Couldn't find process by PID.\n");
+		}
+		size_t looked_up_by_pid = GetCurrentTimestampInMicroseconds();
+		for (int i = 0; i < PROCESS_LOOKUP_BENCHMARK_LOOKUPS; i++) {
+			struct Process* process =
+				processes[NextPseudoRandomNumber(&seed) % count];
+			if (FindNextProcessWithName(process->name, processes[0]) !=
+				process)
+				PrintString("Couldn't find process by name.\n");
+		}
+		size_t looked_up_by_name = GetCurrentTimestampInMicroseconds();
+
+		PrintString("With ");
+		PrintNumber(count);
+		PrintString(" processes:\n");
+		PrintBenchmarkResult(" Process lookups by PID",
+			PROCESS_LOOKUP_BENCHMARK_LOOKUPS, looked_up_by_pid - start);
+		PrintBenchmarkResult(" Process lookups by name",
+			PROCESS_LOOKUP_BENCHMARK_LOOKUPS,
+			looked_up_by_name - looked_up_by_pid);
+	}
+
+	for (size_t i = 0; i < processes_created; i++)
+		DestroyProcess(processes[i]);
+}
+
+// Writes the name of the benchmark service with the given number into name,
+// which must be SERVICE_NAME_LENGTH long.
+static void GetBenchmarkServiceName(size_t number, char* name) {
+	memset((unsigned char*)name, 0, SERVICE_NAME_LENGTH);
+	CopyString((const unsigned char*)"Benchmark 0000", SERVICE_NAME_LENGTH, 14,
+		(unsigned char*)name);
+	for (int digit = 13; digit >= 10; digit--) {
+		name[digit] = '0' + number % 10;
+		number /= 10;
+	}
+}
+
+// Times looking up services by name.
+static void BenchmarkServiceLookups() {
+	struct Process* process = CreateProcess(false);
+	if (process == (struct Process*)ERROR) {
+		PrintString("Out of memory to benchmark service lookups.\n");
+		return;
+	}
+
+	char name[SERVICE_NAME_LENGTH];
+	for (size_t i = 0; i < SERVICE_LOOKUP_BENCHMARK_SERVICES; i++) {
+		GetBenchmarkServiceName(i, name);
+		RegisterService(name, process, i);
+	}
+
+	size_t seed = 1;
+	size_t start = GetCurrentTimestampInMicroseconds();
+	for (int i = 0; i < SERVICE_LOOKUP_BENCHMARK_LOOKUPS; i++) {
+		size_t number =
+			NextPseudoRandomNumber(&seed) % SERVICE_LOOKUP_BENCHMARK_SERVICES;
+		GetBenchmarkServiceName(number, name);
+		struct Service* service =
+			FindNextServiceByPidAndMidWithName(name, 0, 0);
+		if (service == NULL || service->message_id != number)
+			PrintString("Couldn't find service by name.\n");
+	}
+	size_t end = GetCurrentTimestampInMicroseconds();
+
+	PrintBenchmarkResult("Service lookups by name",
+		SERVICE_LOOKUP_BENCHMARK_LOOKUPS, end - start);
+
+	DestroyProcess(process);
+}
+
+// Runs the kernel benchmarks and prints the results to the text terminal.
+void RunKernelBenchmarks() {
+	PrintString("Running kernel benchmarks...\n");
+	BenchmarkTimerEvents();
+	BenchmarkPageTransfers();
+	BenchmarkContextSwitches();
+	BenchmarkProcessLookups();
+	BenchmarkServiceLookups();
+}
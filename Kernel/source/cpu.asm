@@ -0,0 +1,73 @@
+; Copyright 2021 Google LLC
+;
+; Licensed under the Apache License, Version 2.0 (the "License");
+; you may not use this file except in compliance with the License.
+; You may obtain a copy of the License at
+;
+;      http://www.apache.org/licenses/LICENSE-2.0
+;
+; Unless required by applicable law or agreed to in writing, software
+; distributed under the License is distributed on an "AS IS" BASIS,
+; WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+; See the License for the specific language governing permissions and
+; limitations under the License.
+
+[BITS 64]
+
+; Offsets into struct Cpu (cpu.h).
+%define CPU_TLB_FLUSH_REQUESTED 40
+%define CPU_HOLDS_KERNEL_LOCK 41
+%define CPU_CR3 56
+
+; Values for tlb_flush_requested (cpu.h).
+%define TLB_FLUSH_EVERYTHING 2
+
+; The page global enable bit in CR4.
+%define CR4_PGE (1 << 7)
+
+[GLOBAL AcquireKernelLock]
+[EXTERN kernel_lock]
+
+; Spins until we hold the kernel lock. Interrupts must be disabled. All
+; registers are preserved, so this can be called from the interrupt and
+; syscall stubs before they have saved the thread's registers.
+AcquireKernelLock:
+	push rax
+.try_to_acquire:
+	lock bts qword [kernel_lock], 0
+	jnc .acquired
+.wait:
+	pause
+
+	; Another CPU might be holding the lock while it waits for us to flush our
+	; TLB, so check for that while we wait.
+	cmp byte [gs:CPU_TLB_FLUSH_REQUESTED], 0
+	je .still_locked
+
+	; Flush the address space by reloading CR3 with this CPU's current PML4 and
+	; PCID (the CPU asking us to flush might have changed it.)
+	mov rax, [gs:CPU_CR3]
+	mov cr3, rax
+
+	; Kernel pages are global and survive reloading CR3. Toggling CR4.PGE
+	; flushes everything, for every PCID.
+	cmp byte [gs:CPU_TLB_FLUSH_REQUESTED], TLB_FLUSH_EVERYTHING
+	jne .flushed
+	mov rax, cr4
+	xor rax, CR4_PGE
+	mov cr4, rax
+	xor rax, CR4_PGE
+	mov cr4, rax
+
+.flushed:
+	mov byte [gs:CPU_TLB_FLUSH_REQUESTED], 0
+
+.still_locked:
+	test qword [kernel_lock], 1
+	jnz .wait
+	jmp .try_to_acquire
+
+.acquired:
+	mov byte [gs:CPU_HOLDS_KERNEL_LOCK], 1
+	pop rax
+	ret
@@ -0,0 +1,127 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "cpu.h"
+
+#include "io.h"
+#include "local_apic.h"
+#include "virtual_allocator.h"
+
+// The model specific register that stores the GS segment's base address.
+#define GSBASE_MSR 0xC0000101
+
+// The model specific register that SWAPGS swaps the GS segment's base address
+// with.
+#define KERNEL_GSBASE_MSR 0xC0000102
+
+// Every CPU, indexed by ID.
+struct Cpu cpus[MAX_CPUS];
+
+// The number of CPUs that we have found.
+size_t number_of_cpus;
+
+// Set to 1 when a CPU holds the kernel lock. This is accessed from
+// cpu.asm, interrupts.asm, and syscall.asm.
+volatile size_t kernel_lock;
+
+// Initializes the boot CPU. This needs to be called before anything else
+// because everything else depends on GetCurrentCpu().
+void InitializeBootCpu() {
+	number_of_cpus = 1;
+	kernel_lock = 0;
+
+	struct Cpu* cpu = &cpus[0];
+	memset((unsigned char*)cpu, 0, sizeof(struct Cpu));
+	cpu->id = 0;
+	cpu->is_online = true;
+
+	// Bits 24-31 of EBX from CPUID leaf 1 contain the local APIC ID.
+	uint32 eax, ebx, ecx, edx;
+	asm volatile("cpuid"
+		: "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx)
+		: "a"(1));
+	cpu->local_apic_id = ebx >> 24;
+
+	LoadCpuSegment(cpu);
+}
+
+// Points GS at the CPU's struct. Called by each CPU as it starts.
+void LoadCpuSegment(struct Cpu* cpu) {
+	cpu->self = cpu;
+	wrmsr(GSBASE_MSR, (size_t)cpu);
+	// The user's GS. This gets swapped in with SWAPGS when we return to
+	// userland.
+	wrmsr(KERNEL_GSBASE_MSR, 0);
+}
+
+// Releases the kernel lock.
+void ReleaseKernelLock() {
+	GetCurrentCpu()->holds_kernel_lock = false;
+	__atomic_store_n(&kernel_lock, 0, __ATOMIC_RELEASE);
+}
+
+// Asks a CPU to flush its TLB. flush is TLB_FLUSH_ADDRESS_SPACE or
+// TLB_FLUSH_EVERYTHING.
+static void RequestTlbFlush(struct Cpu* cpu, uint8 flush) {
+	cpu->tlb_flush_requested = flush;
+	// Interrupt the CPU in case it is running userland code or halted. It
+	// flushes the TLB while waiting for the kernel lock.
+	SendRescheduleInterrupt(cpu);
+}
+
+// Waits for a CPU to flush its TLB.
+static void WaitForTlbFlush(struct Cpu* cpu) {
+	while (cpu->tlb_flush_requested)
+		asm volatile("pause");
+}
+
+// Flushes the TLB of the other CPUs that have the address space loaded, or
+// of every other CPU if it's the kernel's address space. Returns once they
+// have all flushed.
+void FlushTlbOnOtherCpus(size_t pml4) {
+	if (number_of_cpus == 1)
+		return;
+
+	struct Cpu* this_cpu = GetCurrentCpu();
+	for (size_t i = 0; i < number_of_cpus; i++) {
+		struct Cpu* cpu = &cpus[i];
+		if (cpu == this_cpu || !cpu->is_online)
+			continue;
+		if (pml4 == kernel_pml4)
+			RequestTlbFlush(cpu, TLB_FLUSH_EVERYTHING);
+		else if (cpu->pml4 == pml4)
+			RequestTlbFlush(cpu, TLB_FLUSH_ADDRESS_SPACE);
+	}
+
+	for (size_t i = 0; i < number_of_cpus; i++) {
+		struct Cpu* cpu = &cpus[i];
+		if (cpu != this_cpu)
+			WaitForTlbFlush(cpu);
+	}
+}
+
+// Stops another CPU from running the thread it is running, because we're
+// destroying the thread. The thread's registers are discarded.
+void EvictRunningThreadFromCpu(struct Cpu* cpu) {
+	cpu->thread = NULL;
+	cpu->running_thread_was_evicted = true;
+	cpu->regs = &cpu->evicted_thread_regs;
+
+	// The CPU loads its CR3 when it flushes its TLB, so it will no longer be
+	// in the address space of the thread's process once this returns.
+	cpu->pml4 = kernel_pml4;
+	cpu->cr3 = kernel_pml4;
+	RequestTlbFlush(cpu, TLB_FLUSH_ADDRESS_SPACE);
+	WaitForTlbFlush(cpu);
+}
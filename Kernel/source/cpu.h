@@ -0,0 +1,186 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "registers.h"
+#include "thread.h"
+#include "types.h"
+
+// The maximum number of CPUs we support.
+#define MAX_CPUS 32
+
+// State that is local to each CPU. The GS segment points to the Cpu struct of
+// the CPU we're executing on while we're in the kernel.
+//
+// The code in syscall.asm, exceptions.asm, interrupts.asm, and cpu.asm depends
+// on the layout of the first fields in this struct.
+struct Cpu {
+	// Pointer back to this struct, so we can read it from GS:0.
+	struct Cpu* self;
+
+	// Registers of the thread that is executing on this CPU. Accessed through
+	// currently_executing_thread_regs.
+	struct Registers* regs;
+
+	// The top of this CPU's interrupt stack.
+	size_t interrupt_stack_top;
+
+	// Temporary place to put the user's stack pointer during a syscall.
+	size_t syscall_user_stack_pointer;
+
+	// The address of the PML4 loaded in this CPU. Accessed through
+	// current_pml4.
+	size_t pml4;
+
+	// Set to TLB_FLUSH_ADDRESS_SPACE or TLB_FLUSH_EVERYTHING by another CPU
+	// when it wants us to flush our TLB. We clear this once the TLB has been
+	// flushed.
+	volatile uint8 tlb_flush_requested;
+
+	// Does this CPU hold the kernel lock?
+	uint8 holds_kernel_lock;
+
+	// The error code of the last exception that this CPU handled.
+	size_t exception_error_code;
+
+	// The value we loaded into CR3 - the PML4 and, if PCIDs are enabled, the
+	// address space's PCID. Reloading this flushes the address space's
+	// entries from the TLB.
+	size_t cr3;
+
+	// The ID of the CPU, which is also the index into the cpus array.
+	size_t id;
+
+	// The ID of this CPU's local APIC.
+	size_t local_apic_id;
+
+	// Is this CPU running and able to schedule threads?
+	volatile bool is_online;
+
+	// The thread executing on this CPU. This can be NULL if all threads are
+	// asleep. Accessed through running_thread.
+	struct Thread* thread;
+
+	// The idle registers to return to when no thread is awake.
+	struct Registers* idle_regs;
+
+	// Set when another CPU destroys the thread that was running on this CPU.
+	bool running_thread_was_evicted;
+
+	// Where we save the registers of a thread that was evicted by another CPU.
+	struct Registers evicted_thread_regs;
+
+	// Queues of awake threads this CPU can cycle through, one for each priority
+	// level.
+	struct Thread* first_awake_thread[NUMBER_OF_PRIORITY_LEVELS];
+	struct Thread* last_awake_thread[NUMBER_OF_PRIORITY_LEVELS];
+
+	// Bitmap of the priority levels that have at least one awake thread. Bit 0
+	// is the highest priority.
+	size_t priority_levels_with_awake_threads;
+
+	// The number of threads in this CPU's queues.
+	size_t awake_threads;
+
+	// The number of time slices that have expired on this CPU.
+	size_t time_slices;
+
+	// The number of time slices that have expired on this CPU since we last
+	// boosted the priority of all awake threads.
+	size_t time_slices_since_priority_boost;
+
+	// The timestamp, in microseconds, that the running thread's time slice
+	// ends at.
+	size_t time_slice_ends_at;
+
+	// A thread that the running thread is handing this CPU to, because the
+	// running thread is about to sleep until the thread does something for it.
+	// This thread gets the rest of the running thread's time slice.
+	struct Thread* thread_receiving_time_slice;
+
+	// The thread whose FPU registers are loaded in this CPU, or NULL.
+	struct Thread* fpu_owner;
+
+	// Has the running thread used the FPU during its time slice? The FPU is
+	// disabled until it does.
+	bool fpu_enabled;
+
+	// This CPU's global descriptor table. A copy of Gdt64 in boot.asm, but with
+	// this CPU's TSS.
+	uint64 gdt[7];
+
+	// This CPU's task state segment.
+	uint32 tss[26];
+};
+
+// Offsets into struct Cpu, for the assembly code.
+_Static_assert(__builtin_offsetof(struct Cpu, regs) == 8,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, interrupt_stack_top) == 16,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, syscall_user_stack_pointer) == 24,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, pml4) == 32,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, tlb_flush_requested) == 40,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, holds_kernel_lock) == 41,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, exception_error_code) == 48,
+	"Update the CPU_* offsets in the .asm files.");
+_Static_assert(__builtin_offsetof(struct Cpu, cr3) == 56,
+	"Update the CPU_* offsets in the .asm files.");
+
+// Values for tlb_flush_requested. Kernel pages are global, so they're only
+// flushed with TLB_FLUSH_EVERYTHING.
+#define TLB_FLUSH_ADDRESS_SPACE 1
+#define TLB_FLUSH_EVERYTHING 2
+
+// Every CPU, indexed by ID.
+extern struct Cpu cpus[MAX_CPUS];
+
+// The number of CPUs that we have found.
+extern size_t number_of_cpus;
+
+// Returns the CPU that we are executing on.
+static inline struct Cpu* GetCurrentCpu() {
+	struct Cpu* cpu;
+	asm volatile("mov %%gs:0, %0" : "=r"(cpu));
+	return cpu;
+}
+
+// Initializes the boot CPU. This needs to be called before anything else
+// because everything else depends on GetCurrentCpu().
+extern void InitializeBootCpu();
+
+// Points GS at the CPU's struct. Called by each CPU as it starts.
+extern void LoadCpuSegment(struct Cpu* cpu);
+
+// Spins until we hold the kernel lock. Only one CPU at a time can execute
+// inside of the kernel. Interrupts must be disabled. The interrupt and syscall
+// handlers acquire the lock on entry, and JumpIntoThread releases it.
+extern void AcquireKernelLock();
+
+// Releases the kernel lock.
+extern void ReleaseKernelLock();
+
+// Flushes the TLB of the other CPUs that have the address space loaded, or
+// of every other CPU if it's the kernel's address space. Returns once they
+// have all flushed.
+extern void FlushTlbOnOtherCpus(size_t pml4);
+
+// Stops another CPU from running the thread it is running, because we're
+// destroying the thread. The thread's registers are discarded.
+extern void EvictRunningThreadFromCpu(struct Cpu* cpu);
@@ -140,6 +140,16 @@ bool LoadMemory(size_t to_start, size_t to_end, struct Process* process) {
 	size_t to_first_page = to_start & ~(PAGE_SIZE - 1); // Round down.
 	size_t to_last_page = (to_end + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); // Round up.
 
+	// The pages that are entirely ours can be mapped to the zero page, so
+	// they're only backed by physical memory once they're written to. This
+	// fails if any of them are already mapped, such as by another segment, in
+	// which case we fall back to touching each page.
+	size_t to_first_whole_page = (to_start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	if (to_last_page > to_first_whole_page &&
+		AllocateVirtualMemoryAt(pml4, to_first_whole_page,
+			(to_last_page - to_first_whole_page) / PAGE_SIZE))
+		to_last_page = to_first_whole_page;
+
 	size_t to_page = to_first_page;
 	for (; to_page < to_last_page; to_page += PAGE_SIZE) {
 		size_t physical_page_address = GetOrCreateVirtualPage(pml4, to_page);
@@ -163,6 +173,44 @@ bool LoadMemory(size_t to_start, size_t to_end, struct Process* process) {
 	return true;
 }
 
+// Maps data from the module into the process's memory. The pages that are
+// entirely covered by the data are mapped straight from the module rather than
+// copied, read-only or copy-on-write if the segment is writable, and the
+// partial pages at either end are copied.
+bool MapIntoMemory(size_t from_start,
+	size_t to_start, size_t to_end, bool writable, struct Process* process) {
+	// The module's pages have to line up with the process's pages.
+	size_t to_first_whole_page = (to_start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); // Round up.
+	size_t to_last_whole_page = to_end & ~(PAGE_SIZE - 1); // Round down.
+	if ((from_start & (PAGE_SIZE - 1)) != (to_start & (PAGE_SIZE - 1)) ||
+		to_last_whole_page <= to_first_whole_page) {
+		return CopyIntoMemory(from_start, to_start, to_end, process);
+	}
+
+	size_t from_first_whole_page = from_start + (to_first_whole_page - to_start);
+
+#ifdef DEBUG
+	PrintString("Map memory ");
+	PrintHex(from_first_whole_page);
+	PrintString(" to ");
+	PrintHex(to_first_whole_page);
+	PrintString("->");
+	PrintHex(to_last_whole_page);
+	PrintChar('\n');
+#endif
+
+	if (!MapSharedPhysicalPagesAt(process->pml4, to_first_whole_page,
+		from_first_whole_page - VIRTUAL_MEMORY_OFFSET,
+		(to_last_whole_page - to_first_whole_page) / PAGE_SIZE, writable)) {
+		// Some of the pages are already mapped, such as by another segment.
+		return CopyIntoMemory(from_start, to_start, to_end, process);
+	}
+
+	return CopyIntoMemory(from_start, to_start, to_first_whole_page, process) &&
+		CopyIntoMemory(from_first_whole_page +
+			(to_last_whole_page - to_first_whole_page), to_last_whole_page,
+			to_end, process);
+}
 
 bool LoadSegments(const Elf64_Ehdr* header,
 			size_t memory_start, size_t memory_end,
@@ -238,8 +286,9 @@ bool LoadSegments(const Elf64_Ehdr* header,
 
 			size_t to_address = segment_header->p_vaddr;
 			size_t to_end = to_address + from_size;
-			// Copy the data from the file into memory.
-			if (!CopyIntoMemory(from_start, to_address, to_end, process)) {
+			// Map the data from the file into memory.
+			if (!MapIntoMemory(from_start, to_address, to_end,
+				(segment_header->p_flags & PF_W) != 0, process)) {
 				return false;
 			}
 		}
@@ -310,7 +359,7 @@ void LoadElfProcess(size_t memory_start, size_t memory_end, char* name) {
 		return;
 	}
 
-	CopyString(name, PROCESS_NAME_LENGTH, name_length, process->name);
+	SetProcessName(process, name, name_length);
 
 	if (!LoadSegments(header, memory_start, memory_end, process)) {
 		PrintString("Destroying process.\n");
@@ -46,6 +46,12 @@
 [GLOBAL isr30]
 [GLOBAL isr31]
 
+; Offsets into struct Cpu (cpu.h).
+%define CPU_REGS 8
+%define CPU_INTERRUPT_STACK_TOP 16
+%define CPU_HOLDS_KERNEL_LOCK 41
+%define CPU_EXCEPTION_ERROR_CODE 48
+
 ;  0: Divide By Zero Exception
 isr0:
     cli
@@ -265,20 +271,35 @@ isr31:
     jmp exception_common_stub
 
 [EXTERN ExceptionHandler]
-[EXTERN currently_executing_thread_regs]
-[EXTERN interrupt_stack_top]
+[EXTERN AcquireKernelLock]
 [EXTERN JumpIntoThread]
 exception_common_stub:
+    ; If we interrupted userland, swap in the kernel's GS so it points to
+    ; this CPU's struct Cpu. CS is after the interrupt number, error code,
+    ; and RIP.
+    test qword [rsp + 24], 3
+    jz .from_kernel
+    swapgs
+    jmp .acquire_lock
+.from_kernel:
+    ; The kernel might have caused the exception while holding the lock.
+    cmp byte [gs:CPU_HOLDS_KERNEL_LOCK], 0
+    jne .holding_lock
+.acquire_lock:
+    ; Only one CPU can be in the kernel at a time.
+    call AcquireKernelLock
+.holding_lock:
+
     ; Copy what's at the top of the thread's stack.
     push rbp
     push rdi ; Using to keep the interrupt number.
 
     ; Move these values out of the interrupt handler
-    mov rbp, [currently_executing_thread_regs]
+    mov rbp, [gs:CPU_REGS]
     pop qword [rbp + 13 * 8] ; rdi
     pop qword [rbp + 14 * 8] ; rbp
     pop rdi ; interrupt number
-    add rsp, 8
+    pop qword [gs:CPU_EXCEPTION_ERROR_CODE] ; error code
     pop qword [rbp + 15 * 8] ; rip
     pop qword [rbp + 16 * 8] ; cs
     pop qword [rbp + 17 * 8] ; eflags
@@ -286,7 +307,7 @@ exception_common_stub:
     pop qword [rbp + 19 * 8] ; ss
 
     ; Point our stack to the top of isr_regs, minus the registers already saved.
-    mov rsp, [currently_executing_thread_regs]
+    mov rsp, [gs:CPU_REGS]
     add rsp, 13 * 8
 
     ; Push the rest of the registers.
@@ -305,18 +326,18 @@ exception_common_stub:
     push r15
 
     ; Move back to the interrupt's stack.
-    mov rsp, interrupt_stack_top
+    mov rsp, [gs:CPU_INTERRUPT_STACK_TOP]
 
     ; Move to kernel land data segment
     mov ax, 0x10
     mov ds, ax
     mov es, ax
-    mov fs, ax
-    mov gs, ax
 
     ; Call the handler
     ; mov rdi, [rbp - 46] ; pass interrupt number as argument
     ; Interrupt number is in rdi and will get passed as an argument.
+    ; The error code gets passed as the second argument.
+    mov rsi, [gs:CPU_EXCEPTION_ERROR_CODE]
     mov rax, ExceptionHandler
     call rax
     jmp JumpIntoThread
\ No newline at end of file
@@ -14,6 +14,7 @@
 
 #include "exceptions.h"
 
+#include "fpu.h"
 #include "idt.h"
 #include "interrupts.h"
 #include "physical_allocator.h"
@@ -27,6 +28,10 @@
 // The maximum number of levels to print up the call stack for a stack trace.
 #define STACK_TRACE_DEPTH 20
 
+// The bits set in a page fault's error code when userland writes to a page
+// that is present: present (bit 0), write (bit 1), and user (bit 2).
+#define PAGE_FAULT_FROM_WRITE_TO_USER_PAGE 0x7
+
 // The first 32 interrupts are used for processor exceptions.
 extern void isr0();
 extern void isr1();
@@ -183,8 +188,39 @@ void PrintStackTrace() {
 	}
 }
 
+// Handles a page fault. Returns true if the fault was resolved and the thread
+// can continue.
+static bool HandlePageFault(size_t error_code) {
+	size_t address;
+	asm volatile("mov %%cr2, %0" : "=r"(address));
+
+	if (running_thread == NULL ||
+		(error_code & PAGE_FAULT_FROM_WRITE_TO_USER_PAGE) !=
+			PAGE_FAULT_FROM_WRITE_TO_USER_PAGE)
+		return false;
+
+	// Userland wrote to a read-only page, which might be copy-on-write. This
+	// includes memory that hasn't been written to since it was allocated,
+	// which is mapped to the zero page.
+	return ResolveCopyOnWritePage(running_thread->process->pml4, address);
+}
+
 // The exception handler.
-void ExceptionHandler(int interrupt_no) {
+void ExceptionHandler(int interrupt_no, size_t error_code) {
+	if (GetCurrentCpu()->running_thread_was_evicted) {
+		// Another CPU destroyed the thread that caused this exception while we
+		// were waiting for the kernel lock.
+		ScheduleNextThread();
+		JumpIntoThread(); // Doesn't return.
+	}
+
+	if (interrupt_no == 14 && HandlePageFault(error_code))
+		return;
+
+	// Threads use the FPU for the first time in a time slice.
+	if (interrupt_no == 7 && HandleDeviceNotAvailableException())
+		return;
+
 	// Output the exception that occured.
 	if(interrupt_no < 32) {
 		PrintString("\nException occured: ");
@@ -0,0 +1,203 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "fpu.h"
+
+#include "cpu.h"
+#include "io.h"
+#include "thread.h"
+
+// CPUID feature bits in leaf 1's ECX.
+#define CPUID_XSAVE_BIT (1 << 26)
+#define CPUID_AVX_BIT (1 << 28)
+
+// The CPUID leaf that describes the XSAVE state components. Subleaf 1's EAX
+// has the XSAVEOPT bit, and subleaf 2 describes the AVX state.
+#define CPUID_XSAVE_LEAF 0xD
+#define CPUID_XSAVEOPT_BIT (1 << 0)
+#define CPUID_AVX_STATE_SUBLEAF 2
+
+// The CR0 bit that makes using the FPU raise a device not available
+// exception.
+#define CR0_TS (1 << 3)
+
+// The CR4 bit that enables XSAVE and XSETBV.
+#define CR4_OSXSAVE (1 << 18)
+
+// The XCR0 bits for the state components that XSAVE saves and restores.
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+// Where the x87 control word and MXCSR are in the FXSAVE and XSAVE formats,
+// and their initial values (every exception masked.)
+#define FPU_CONTROL_WORD_OFFSET 0
+#define FPU_CONTROL_WORD_INITIAL_VALUE 0x037F
+#define MXCSR_OFFSET 24
+#define MXCSR_INITIAL_VALUE 0x1F80
+
+// Whether we save the FPU registers with XSAVE rather than FXSAVE.
+bool xsave_supported;
+
+// Whether we can save the FPU registers with XSAVEOPT, which skips the state
+// components that haven't changed since they were restored.
+bool xsaveopt_supported;
+
+// The state components that are enabled, when xsave_supported is true.
+size_t xcr0;
+
+// Calls CPUID.
+static void Cpuid(uint32 leaf, uint32 subleaf, uint32* eax, uint32* ebx,
+	uint32* ecx, uint32* edx) {
+	asm volatile("cpuid"
+		: "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+		: "a"(leaf), "c"(subleaf));
+}
+
+// Disables the FPU, so the next time it's used we get a device not available
+// exception.
+static void DisableFpu() {
+	size_t cr0;
+	asm volatile("mov %%cr0, %0" : "=r"(cr0));
+	asm volatile("mov %0, %%cr0" :: "r"(cr0 | CR0_TS));
+}
+
+// Saves the FPU registers into a thread.
+static void SaveFpuRegisters(struct Thread* thread) {
+	if (xsaveopt_supported) {
+		asm volatile("xsaveopt %0" : "=m"(thread->fpu_registers)
+			: "a"(0xFFFFFFFF), "d"(0xFFFFFFFF));
+	} else if (xsave_supported) {
+		asm volatile("xsave %0" : "=m"(thread->fpu_registers)
+			: "a"(0xFFFFFFFF), "d"(0xFFFFFFFF));
+	} else {
+		asm volatile("fxsave %0" : "=m"(thread->fpu_registers));
+	}
+}
+
+// Restores the FPU registers from a thread.
+static void RestoreFpuRegisters(struct Thread* thread) {
+	if (xsave_supported) {
+		asm volatile("xrstor %0" :: "m"(thread->fpu_registers),
+			"a"(0xFFFFFFFF), "d"(0xFFFFFFFF));
+	} else {
+		asm volatile("fxrstor %0" :: "m"(thread->fpu_registers));
+	}
+}
+
+// Detects how to save the FPU registers and enables the FPU on the boot CPU.
+void InitializeFpu() {
+	uint32 eax, ebx, ecx, edx;
+	Cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+	size_t highest_leaf = eax;
+
+	Cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+	xsave_supported = (ecx & CPUID_XSAVE_BIT) != 0 &&
+		highest_leaf >= CPUID_XSAVE_LEAF;
+	bool avx_supported = (ecx & CPUID_AVX_BIT) != 0;
+
+	xsaveopt_supported = false;
+	xcr0 = XCR0_X87 | XCR0_SSE;
+	if (xsave_supported) {
+		Cpuid(CPUID_XSAVE_LEAF, 1, &eax, &ebx, &ecx, &edx);
+		xsaveopt_supported = (eax & CPUID_XSAVEOPT_BIT) != 0;
+
+		if (avx_supported) {
+			// EAX is the size of the AVX state and EBX is where it's saved.
+			Cpuid(CPUID_XSAVE_LEAF, CPUID_AVX_STATE_SUBLEAF,
+				&eax, &ebx, &ecx, &edx);
+			if (ebx + eax <= FPU_REGISTERS_SIZE)
+				xcr0 |= XCR0_AVX;
+		}
+	}
+
+	EnableFpuFeatures();
+}
+
+// Enables XSAVE and the AVX registers, if the CPU supports them, on the CPU
+// we're running on, and disables the FPU until a thread uses it.
+void EnableFpuFeatures() {
+	if (xsave_supported) {
+		size_t cr4;
+		asm volatile("mov %%cr4, %0" : "=r"(cr4));
+		asm volatile("mov %0, %%cr4" :: "r"(cr4 | CR4_OSXSAVE));
+		asm volatile("xsetbv" :: "c"(0), "a"((uint32)xcr0),
+			"d"((uint32)(xcr0 >> 32)));
+	}
+
+	struct Cpu* cpu = GetCurrentCpu();
+	cpu->fpu_owner = NULL;
+	cpu->fpu_enabled = false;
+	DisableFpu();
+}
+
+// Puts a new thread's FPU registers in their initial state.
+void InitializeFpuRegisters(struct Thread* thread) {
+	// A zeroed XSAVE header means every state component is in its initial
+	// state. The control word and MXCSR are loaded even so.
+	memset((unsigned char*)thread->fpu_registers, 0, FPU_REGISTERS_SIZE);
+	*(uint16*)&thread->fpu_registers[FPU_CONTROL_WORD_OFFSET] =
+		FPU_CONTROL_WORD_INITIAL_VALUE;
+	*(uint32*)&thread->fpu_registers[MXCSR_OFFSET] = MXCSR_INITIAL_VALUE;
+	thread->fpu_cpu = NULL;
+}
+
+// Called when a CPU switches away from its running thread. Saves the thread's
+// FPU registers if it used them during its time slice, and disables the FPU.
+void ReleaseFpu(struct Cpu* cpu) {
+	if (!cpu->fpu_enabled)
+		return;
+
+	// Threads can move between CPUs, so the registers are saved now rather
+	// than when another thread on this CPU wants the FPU. The registers stay
+	// loaded, so if the thread comes back to this CPU before another thread
+	// uses the FPU, they don't need to be restored. The thread might have been
+	// destroyed by another CPU, in which case there's nothing to save.
+	if (cpu->thread != NULL && cpu->thread == cpu->fpu_owner)
+		SaveFpuRegisters(cpu->thread);
+
+	cpu->fpu_enabled = false;
+	DisableFpu();
+}
+
+// Handles the device not available exception that is raised when a thread
+// uses the FPU while it's disabled. Returns true if the thread can continue.
+bool HandleDeviceNotAvailableException() {
+	struct Cpu* cpu = GetCurrentCpu();
+	struct Thread* thread = cpu->thread;
+	if (thread == NULL || cpu->fpu_enabled) {
+		// The kernel doesn't use the FPU.
+		return false;
+	}
+
+	asm volatile("clts");
+	cpu->fpu_enabled = true;
+
+	if (cpu->fpu_owner != thread || thread->fpu_cpu != cpu) {
+		RestoreFpuRegisters(thread);
+		cpu->fpu_owner = thread;
+		thread->fpu_cpu = cpu;
+	}
+	return true;
+}
+
+// Called when a thread is destroyed, so that a new thread at the same address
+// isn't mistaken for the owner of a CPU's FPU registers.
+void ForgetFpuRegisters(struct Thread* thread) {
+	for (size_t i = 0; i < number_of_cpus; i++) {
+		if (cpus[i].fpu_owner == thread)
+			cpus[i].fpu_owner = NULL;
+	}
+}
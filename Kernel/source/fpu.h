@@ -0,0 +1,50 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include "types.h"
+
+struct Cpu;
+struct Thread;
+
+// The FPU registers (x87, SSE, and AVX) are switched lazily. When a thread is
+// switched in, the FPU is disabled (CR0.TS is set) and the thread's registers
+// are only restored once it raises a device not available exception by
+// using the FPU. If the CPU's registers still belong to the thread, they
+// aren't restored at all. Threads that don't use the FPU during their time
+// slice don't have their registers saved when they're switched out.
+
+// Detects how to save the FPU registers and enables the FPU on the boot CPU.
+extern void InitializeFpu();
+
+// Enables XSAVE and the AVX registers, if the CPU supports them, on the CPU
+// we're running on, and disables the FPU until a thread uses it.
+extern void EnableFpuFeatures();
+
+// Puts a new thread's FPU registers in their initial state.
+extern void InitializeFpuRegisters(struct Thread* thread);
+
+// Called when a CPU switches away from its running thread. Saves the thread's
+// FPU registers if it used them during its time slice, and disables the FPU.
+extern void ReleaseFpu(struct Cpu* cpu);
+
+// Handles the device not available exception that is raised when a thread
+// uses the FPU while it's disabled. Returns true if the thread can continue.
+extern bool HandleDeviceNotAvailableException();
+
+// Called when a thread is destroyed, so that a new thread at the same address
+// isn't mistaken for the owner of a CPU's FPU registers.
+extern void ForgetFpuRegisters(struct Thread* thread);
@@ -49,6 +49,12 @@ void InitializeIdt() {
 	// Clear the IDT.
 	memset((unsigned char *)idt, 0, sizeof(struct idt_entry) * 256);
 
+	LoadIdt();
+}
+
+// Loads the interrupt descriptor table into the CPU we're running on. Every
+// CPU shares the same IDT.
+void LoadIdt() {
 	// Load the new IDT pointer, which is in virtual address space.
 	__asm__ __volatile__ ("lidt (%0)" : : "b"((size_t)&idt_p));
 }
@@ -7,6 +7,10 @@
 // Initalizes the interrupt descriptor table.
 extern void InitializeIdt();
 
+// Loads the interrupt descriptor table into the CPU we're running on. Every
+// CPU shares the same IDT.
+extern void LoadIdt();
+
 // Sets an IDT entry.
 extern void SetIdtEntry(
 	unsigned char num, size_t handler, unsigned short sel, unsigned char flags);
@@ -30,6 +30,14 @@
 [GLOBAL irq13]
 [GLOBAL irq14]
 [GLOBAL irq15]
+[GLOBAL local_apic_timer_irq]
+[GLOBAL reschedule_irq]
+[GLOBAL spurious_irq]
+
+; Offsets into struct Cpu (cpu.h).
+%define CPU_REGS 8
+%define CPU_INTERRUPT_STACK_TOP 16
+%define CPU_HOLDS_KERNEL_LOCK 41
 
 irq0:
 	cli
@@ -111,17 +119,41 @@ irq15:
 	push 15
 	jmp irq_common_stub
 
+; Interrupts from the local APIC get numbers after the 16 PIC IRQs.
+local_apic_timer_irq:
+	cli
+	push 16
+	jmp irq_common_stub
+
+reschedule_irq:
+	cli
+	push 17
+	jmp irq_common_stub
+
+; Spurious interrupts from the local APIC don't need an EOI or any handling.
+spurious_irq:
+	iretq
+
 [EXTERN CommonHardwareInterruptHandler]
-[EXTERN currently_executing_thread_regs]
-[EXTERN interrupt_stack_top]
+[EXTERN AcquireKernelLock]
+[EXTERN kernel_lock]
 [EXTERN JumpIntoThread]
 irq_common_stub:
+	; If we interrupted userland, swap in the kernel's GS so it points to
+	; this CPU's struct Cpu. CS is after the interrupt number and RIP.
+	test qword [rsp + 16], 3
+	jz .from_kernel
+	swapgs
+.from_kernel:
+	; Only one CPU can be in the kernel at a time.
+	call AcquireKernelLock
+
 	; Copy what's at the top of the thread's stack.
 	push rbp
 	push rdi ; Using to keep the interrupt number.
 
 	; Move these values out of the interrupt handler
-	mov rbp, [currently_executing_thread_regs]
+	mov rbp, [gs:CPU_REGS]
 	pop qword [rbp + 13 * 8] ; rdi
 	pop qword [rbp + 14 * 8] ; rbp
 	pop qword rdi ; interrupt number
@@ -132,7 +164,7 @@ irq_common_stub:
 	pop qword [rbp + 19 * 8] ; ss
 
  	; Point our stack to the top of isr_regs, minus the registers already saved.
-	mov rsp, [currently_executing_thread_regs]
+	mov rsp, [gs:CPU_REGS]
 	add rsp, 13 * 8
 
 	; Push the rest of the registers.
@@ -151,7 +183,7 @@ irq_common_stub:
 	push r15
 
 	; Move back to the interrupt's stack.
-	mov rsp, [interrupt_stack_top]
+	mov rsp, [gs:CPU_INTERRUPT_STACK_TOP]
 
 	; Move to kernel land data segment
 	mov ax, 0x10
@@ -171,7 +203,7 @@ JumpIntoThread:
 	mov es, ax
 
  	; Jump to the bottom of isr_regs, which contains 20 64-bit registers.
-	mov rsp, [currently_executing_thread_regs]
+	mov rsp, [gs:CPU_REGS]
 
 	; Pop the registers into memory.
 	pop r15
@@ -189,4 +221,15 @@ JumpIntoThread:
 	pop rax
 	pop rdi
 	pop rbp
+
+	; Release the kernel lock.
+	mov byte [gs:CPU_HOLDS_KERNEL_LOCK], 0
+	mov qword [kernel_lock], 0
+
+	; Swap back to the user's GS if we're returning to userland. CS is after
+	; RIP.
+	test qword [rsp + 8], 3
+	jz .to_kernel
+	swapgs
+.to_kernel:
 	iretq ; pops RIP, CS, EFLAGS, RSP, SS
\ No newline at end of file
@@ -14,10 +14,12 @@
 
 #include "interrupts.h"
 
+#include "cpu.h"
 #include "exceptions.h"
 #include "idt.h"
 #include "io.h"
 #include "liballoc.h"
+#include "local_apic.h"
 #include "messages.h"
 #include "physical_allocator.h"
 #include "process.h"
@@ -45,9 +47,9 @@ extern void irq12();
 extern void irq13();
 extern void irq14();
 extern void irq15();
-
-// The top of the interrupt's stack.
-size_t interrupt_stack_top;
+extern void local_apic_timer_irq();
+extern void reschedule_irq();
+extern void spurious_irq();
 
 // A message to fire on an interrupt.
 struct MessageToFireOnInterrupt {
@@ -108,10 +110,15 @@ void RegisterInterruptHandlers() {
 	SetIdtEntry(45, (size_t)irq13, 0x08, 0x8E);
 	SetIdtEntry(46, (size_t)irq14, 0x08, 0x8E);
 	SetIdtEntry(47, (size_t)irq15, 0x08, 0x8E);
+
+	// Interrupts that come from the local APIC.
+	SetIdtEntry(LOCAL_APIC_TIMER_IDT_ENTRY, (size_t)local_apic_timer_irq, 0x08, 0x8E);
+	SetIdtEntry(RESCHEDULE_IDT_ENTRY, (size_t)reschedule_irq, 0x08, 0x8E);
+	SetIdtEntry(SPURIOUS_INTERRUPT_IDT_ENTRY, (size_t)spurious_irq, 0x08, 0x8E);
 }
 
-// Allocates a stack to use for interrupts.
-void AllocateInterruptStack() {
+// Allocates a stack for a CPU to use for interrupts.
+void AllocateInterruptStack(struct Cpu* cpu) {
 	size_t physical_addr = GetPhysicalPage();
 	size_t virtual_addr = FindFreePageRange(kernel_pml4, 1);
 	if (physical_addr == OUT_OF_PHYSICAL_PAGES || virtual_addr == OUT_OF_MEMORY) {
@@ -123,20 +130,23 @@ void AllocateInterruptStack() {
 	MapPhysicalPageToVirtualPage(kernel_pml4, virtual_addr, physical_addr, true);
 
 #ifdef DEBUG
-	PrintString("Interrupt stack is at ");
+	PrintString("Interrupt stack for CPU ");
+	PrintNumber(cpu->id);
+	PrintString(" is at ");
 	PrintHex(virtual_addr);
 	PrintChar('\n');
 #endif
 
-	interrupt_stack_top = virtual_addr + PAGE_SIZE;
-
-	SetInterruptStack(virtual_addr);
+	cpu->interrupt_stack_top = virtual_addr + PAGE_SIZE;
 }
 
 // Initializes interrupts.
 void InitializeInterrupts() {
 	InitializeIdt();
-	AllocateInterruptStack();
+
+	struct Cpu* cpu = GetCurrentCpu();
+	AllocateInterruptStack(cpu);
+	SetInterruptStack(cpu->interrupt_stack_top - PAGE_SIZE);
 
 	// There are two sets of interrupts - CPU exceptions and hardware signals. We'll
 	// register handler for both.
@@ -250,9 +260,20 @@ void UnregisterAllMessagesToForOnInterruptForProcess(struct Process* process) {
 
 // The common handler that is called when a hardware interrupt occurs.
 void CommonHardwareInterruptHandler(int interrupt_number) {
-	if (interrupt_number == 0) {
-		// The only hardware interrupt the microkernel knows about - the timer.
-		TimerHandler();
+	if (interrupt_number >= 16) {
+		// Interrupts from the local APIC, which each CPU has.
+		if (interrupt_number == LOCAL_APIC_TIMER_INTERRUPT) {
+			// The only hardware interrupt the microkernel knows about - the
+			// timer.
+			TimerHandler();
+		} else {
+			// Reschedule interrupts wake us up to check if there is a thread
+			// to schedule, or if the next timer event has changed.
+			ProgramTimerForNextDeadline();
+		}
+		SignalEndOfLocalApicInterrupt();
+		ScheduleThreadIfWeAreHaltedOrPreempted();
+		return;
 	}
 
 	// Send messages to any processes listening for this interrupt.
@@ -271,7 +292,7 @@ void CommonHardwareInterruptHandler(int interrupt_number) {
 	// Send an EOI to the master interrupt controllerr.
 	outportb(0x20, 0x20);
 	
-	// Interrupt could have awoken a thread when the system was currently halted. If so, let's
-	// jump straight into it upon return.
-	ScheduleThreadIfWeAreHalted();
+	// Interrupt could have awoken a thread when the system was currently halted, or a thread
+	// more important than the one running. If so, let's jump straight into it upon return.
+	ScheduleThreadIfWeAreHaltedOrPreempted();
 }
@@ -16,11 +16,15 @@
 
 #include "types.h"
 
+struct Cpu;
 struct Process;
 
 // Initializes interrupts.
 extern void InitializeInterrupts();
 
+// Allocates a stack for a CPU to use for interrupts.
+extern void AllocateInterruptStack(struct Cpu* cpu);
+
 // Registers a message to send to a process upon receiving an interrupt.
 extern void RegisterMessageToSendOnInterrupt(size_t interrupt_number, struct Process* process, size_t message_id);
 
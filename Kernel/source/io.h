@@ -24,4 +24,15 @@ static inline void wrmsr(uint64 msr, uint64 value)
 		:
 		: "c"(msr), "a"(low), "d"(high)
 	);
+}
+
+static inline uint64 rdmsr(uint64 msr)
+{
+	uint32 low, high;
+	asm volatile (
+		"rdmsr"
+		: "=a"(low), "=d"(high)
+		: "c"(msr)
+	);
+	return ((uint64)high << 32) | low;
 }
\ No newline at end of file
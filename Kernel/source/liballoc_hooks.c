@@ -37,7 +37,7 @@ int liballoc_unlock() {
  * \return A pointer to the allocated memory.
  */
 void* liballoc_alloc(size_t pages) {
-	return (void*)AllocateVirtualMemoryInAddressSpace(kernel_pml4, pages);
+	return (void*)AllocateVirtualMemoryInAddressSpace(kernel_pml4, pages, /*large_pages=*/false);
 }
 
 /** This frees previously allocated memory. The void* parameter passed
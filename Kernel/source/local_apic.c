@@ -0,0 +1,199 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "local_apic.h"
+
+#include "acpi.h"
+#include "cpu.h"
+#include "io.h"
+#include "physical_allocator.h"
+#include "text_terminal.h"
+#include "timer.h"
+#include "virtual_allocator.h"
+
+// #define DEBUG
+
+// The model specific register that contains the local APIC's base address.
+#define APIC_BASE_MSR 0x1B
+
+// Offsets of the local APIC's registers.
+#define LOCAL_APIC_ID 0x20
+#define LOCAL_APIC_TASK_PRIORITY 0x80
+#define LOCAL_APIC_END_OF_INTERRUPT 0xB0
+#define LOCAL_APIC_SPURIOUS_INTERRUPT_VECTOR 0xF0
+#define LOCAL_APIC_INTERRUPT_COMMAND_LOW 0x300
+#define LOCAL_APIC_INTERRUPT_COMMAND_HIGH 0x310
+#define LOCAL_APIC_TIMER_VECTOR 0x320
+#define LOCAL_APIC_TIMER_INITIAL_COUNT 0x380
+#define LOCAL_APIC_TIMER_CURRENT_COUNT 0x390
+#define LOCAL_APIC_TIMER_DIVIDE_CONFIGURATION 0x3E0
+
+// Bits in the spurious interrupt vector register.
+#define LOCAL_APIC_SOFTWARE_ENABLE (1 << 8)
+
+// Bits in the interrupt command register.
+#define DELIVERY_MODE_FIXED (0 << 8)
+#define DELIVERY_MODE_INIT (5 << 8)
+#define DELIVERY_MODE_STARTUP (6 << 8)
+#define DELIVERY_STATUS_PENDING (1 << 12)
+#define LEVEL_ASSERT (1 << 14)
+
+// Bits in the timer vector register. The timer is in one-shot mode unless
+// the periodic bit is set.
+#define TIMER_MASKED (1 << 16)
+
+// Divide the timer's clock by 16.
+#define TIMER_DIVIDE_BY_16 0x3
+
+// How long to measure the local APIC timer for when calibrating it.
+#define TIMER_CALIBRATION_MICROSECONDS 10000
+
+// Virtual address the local APIC's registers are mapped to.
+volatile uint32* local_apic;
+
+// The number of times the local APIC timer ticks per second.
+size_t local_apic_timer_ticks_per_second;
+
+// Reads a local APIC register.
+static uint32 ReadLocalApic(size_t reg) {
+	return local_apic[reg / 4];
+}
+
+// Writes to a local APIC register.
+static void WriteLocalApic(size_t reg, uint32 value) {
+	local_apic[reg / 4] = value;
+}
+
+// Measures how fast the local APIC timer ticks.
+static void CalibrateLocalApicTimer() {
+	WriteLocalApic(LOCAL_APIC_TIMER_DIVIDE_CONFIGURATION, TIMER_DIVIDE_BY_16);
+	WriteLocalApic(LOCAL_APIC_TIMER_VECTOR, TIMER_MASKED);
+	WriteLocalApic(LOCAL_APIC_TIMER_INITIAL_COUNT, 0xFFFFFFFF);
+
+	BusyWaitMicroseconds(TIMER_CALIBRATION_MICROSECONDS);
+
+	size_t ticks = 0xFFFFFFFF - ReadLocalApic(LOCAL_APIC_TIMER_CURRENT_COUNT);
+	WriteLocalApic(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+
+	local_apic_timer_ticks_per_second =
+		ticks * (1000000 / TIMER_CALIBRATION_MICROSECONDS);
+
+#ifdef DEBUG
+	PrintString("Local APIC timer ticks per second: ");
+	PrintNumber(local_apic_timer_ticks_per_second);
+	PrintChar('\n');
+#endif
+}
+
+// Maps the local APIC into memory, enables it for the boot CPU, and
+// calibrates the local APIC timer.
+void InitializeLocalApic() {
+	size_t physical_address = local_apic_physical_address;
+	if (physical_address == 0) {
+		// We didn't find it in the ACPI tables, so ask the CPU.
+		physical_address = rdmsr(APIC_BASE_MSR) & 0xFFFFFFFFFF000;
+	}
+
+	size_t virtual_address = FindFreePageRange(kernel_pml4, 1);
+	if (virtual_address == OUT_OF_MEMORY ||
+		!MapPhysicalPageToVirtualPage(kernel_pml4, virtual_address,
+			physical_address, false)) {
+		PrintString("Out of memory to map the local APIC.");
+		__asm__ __volatile__("cli");
+		__asm__ __volatile__("hlt");
+	}
+	local_apic = (volatile uint32*)virtual_address;
+
+	EnableLocalApic();
+	GetCurrentCpu()->local_apic_id = GetLocalApicId();
+	CalibrateLocalApicTimer();
+}
+
+// Enables the local APIC of the CPU we're running on.
+void EnableLocalApic() {
+	// Accept all interrupts.
+	WriteLocalApic(LOCAL_APIC_TASK_PRIORITY, 0);
+	WriteLocalApic(LOCAL_APIC_SPURIOUS_INTERRUPT_VECTOR,
+		LOCAL_APIC_SOFTWARE_ENABLE | SPURIOUS_INTERRUPT_IDT_ENTRY);
+}
+
+// Returns the ID of the local APIC of the CPU we're running on.
+size_t GetLocalApicId() {
+	return ReadLocalApic(LOCAL_APIC_ID) >> 24;
+}
+
+// Signals to the local APIC that we're done handling its interrupt.
+void SignalEndOfLocalApicInterrupt() {
+	WriteLocalApic(LOCAL_APIC_END_OF_INTERRUPT, 0);
+}
+
+// Sets the local APIC timer of the CPU we're running on to fire once after
+// the number of microseconds.
+void SetLocalApicTimer(size_t microseconds) {
+	if (local_apic == NULL)
+		return;  // Not initialized yet.
+
+	// Deadlines far into the future get cut short, and the timer gets
+	// reprogrammed when it fires. This keeps the multiplication below from
+	// overflowing.
+	if (microseconds > 1000000)
+		microseconds = 1000000;
+
+	size_t ticks = microseconds * local_apic_timer_ticks_per_second / 1000000;
+	if (ticks == 0)
+		ticks = 1;  // 0 would stop the timer.
+	else if (ticks > 0xFFFFFFFF)
+		ticks = 0xFFFFFFFF;
+
+	WriteLocalApic(LOCAL_APIC_TIMER_DIVIDE_CONFIGURATION, TIMER_DIVIDE_BY_16);
+	WriteLocalApic(LOCAL_APIC_TIMER_VECTOR, LOCAL_APIC_TIMER_IDT_ENTRY);
+	WriteLocalApic(LOCAL_APIC_TIMER_INITIAL_COUNT, (uint32)ticks);
+}
+
+// Stops the local APIC timer of the CPU we're running on.
+void StopLocalApicTimer() {
+	if (local_apic == NULL)
+		return;  // Not initialized yet.
+
+	WriteLocalApic(LOCAL_APIC_TIMER_INITIAL_COUNT, 0);
+}
+
+// Sends an interprocessor interrupt.
+static void SendInterprocessorInterrupt(size_t local_apic_id, uint32 command) {
+	WriteLocalApic(LOCAL_APIC_INTERRUPT_COMMAND_HIGH, local_apic_id << 24);
+	WriteLocalApic(LOCAL_APIC_INTERRUPT_COMMAND_LOW, command);
+
+	// Wait for the interrupt to be sent.
+	while (ReadLocalApic(LOCAL_APIC_INTERRUPT_COMMAND_LOW) &
+		DELIVERY_STATUS_PENDING)
+		asm volatile("pause");
+}
+
+// Interrupts a CPU so that it checks if it should schedule another thread.
+void SendRescheduleInterrupt(struct Cpu* cpu) {
+	SendInterprocessorInterrupt(cpu->local_apic_id,
+		DELIVERY_MODE_FIXED | LEVEL_ASSERT | RESCHEDULE_IDT_ENTRY);
+}
+
+// Sends an INIT interrupt to a CPU, which resets it.
+void SendInitInterrupt(size_t local_apic_id) {
+	SendInterprocessorInterrupt(local_apic_id, DELIVERY_MODE_INIT | LEVEL_ASSERT);
+}
+
+// Sends a startup interrupt to a CPU, which starts it executing in real mode
+// at page * 4096.
+void SendStartupInterrupt(size_t local_apic_id, size_t page) {
+	SendInterprocessorInterrupt(local_apic_id,
+		DELIVERY_MODE_STARTUP | LEVEL_ASSERT | (page & 0xFF));
+}
@@ -0,0 +1,65 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#pragma once
+
+#include "types.h"
+
+// Each CPU has a local APIC (Advanced Programmable Interrupt Controller) that
+// we use to send interrupts between CPUs and to give each CPU its own one-shot
+// timer.
+// Legacy hardware interrupts still come in through the 8259 PIC and are
+// handled by the boot CPU.
+
+struct Cpu;
+
+// The IDT entries of interrupts that come from the local APIC.
+#define LOCAL_APIC_TIMER_IDT_ENTRY 48
+#define RESCHEDULE_IDT_ENTRY 49
+#define SPURIOUS_INTERRUPT_IDT_ENTRY 255
+
+// The interrupt numbers that get passed to CommonHardwareInterruptHandler for
+// interrupts that come from the local APIC. 0 to 15 are the PIC's IRQs.
+#define LOCAL_APIC_TIMER_INTERRUPT 16
+#define RESCHEDULE_INTERRUPT 17
+
+// Maps the local APIC into memory, enables it for the boot CPU, and
+// calibrates the local APIC timer against the PIT.
+extern void InitializeLocalApic();
+
+// Enables the local APIC of the CPU we're running on.
+extern void EnableLocalApic();
+
+// Returns the ID of the local APIC of the CPU we're running on.
+extern size_t GetLocalApicId();
+
+// Signals to the local APIC that we're done handling its interrupt.
+extern void SignalEndOfLocalApicInterrupt();
+
+// Sets the local APIC timer of the CPU we're running on to fire once after
+// the number of microseconds.
+extern void SetLocalApicTimer(size_t microseconds);
+
+// Stops the local APIC timer of the CPU we're running on.
+extern void StopLocalApicTimer();
+
+// Interrupts a CPU so that it checks if it should schedule another thread.
+extern void SendRescheduleInterrupt(struct Cpu* cpu);
+
+// Sends an INIT interrupt to a CPU, which resets it.
+extern void SendInitInterrupt(size_t local_apic_id);
+
+// Sends a startup interrupt to a CPU, which starts it executing in real mode
+// at page * 4096.
+extern void SendStartupInterrupt(size_t local_apic_id, size_t page);
@@ -1,6 +1,11 @@
+#include "acpi.h"
+#include "benchmarks.h"
+#include "cpu.h"
+#include "fpu.h"
 #include "framebuffer.h"
 #include "interrupts.h"
 #include "io.h"
+#include "local_apic.h"
 #include "../../third_party/multiboot2.h"
 #include "multiboot_modules.h"
 #include "object_pools.h"
@@ -8,6 +13,7 @@
 #include "process.h"
 #include "scheduler.h"
 #include "shared_memory.h"
+#include "smp.h"
 #include "syscall.h"
 #include "service.h"
 #include "text_terminal.h"
@@ -16,6 +22,9 @@
 #include "tss.h"
 #include "virtual_allocator.h"
 
+// Uncomment to run the kernel benchmarks while booting.
+// #define RUN_KERNEL_BENCHMARKS
+
 void kmain() {
 	// Make sure we were booted with a multiboot2 bootloader - we need this because we depend
 	// on GRUB for providing us with some initialization information.
@@ -24,6 +33,12 @@ void kmain() {
 		asm ("hlt");
 	}
 
+	// Everything else depends on knowing which CPU we're running on.
+	InitializeBootCpu();
+	// Other CPUs wait for us to finish initializing the kernel before they
+	// can enter it.
+	AcquireKernelLock();
+
 	InitializePhysicalAllocator();
 	InitializeVirtualAllocator();
 	InitializeObjectPools();
@@ -31,6 +46,7 @@ void kmain() {
 	InitializeTss();
 	InitializeInterrupts();
 	InitializeSystemCalls();
+	InitializeFpu();
 
 	InitializeProcesses();
 	InitializeThreads();
@@ -40,15 +56,30 @@ void kmain() {
 	InitializeScheduler();
 	InitializeTimer();
 
-	// Loads the multiboot modules, then frees the memory used by them.
+	// Find and start the other CPUs.
+	InitializeAcpi();
+	InitializeLocalApic();
+	StartApplicationProcessors();
+
+#ifdef RUN_KERNEL_BENCHMARKS
+	RunKernelBenchmarks();
+#endif
+
+	// Loads the multiboot modules, then unmaps them from the kernel.
 	LoadMultibootModules();
 	MaybeLoadFramebuffer();
 	DoneWithMultibootMemory();
 
+	// Interrupt ourselves so we schedule any threads that were started on
+	// this CPU. There's no regular timer tick to wake us up.
+	SendRescheduleInterrupt(GetCurrentCpu());
+
+	ReleaseKernelLock();
 	asm("sti");
 	for(;;) {
 		// This needs to be in a loop because the scheduler returns here when there are no awake threads
 		// scheduled.
+		ZeroFreePagesWhileIdle();
 		asm("hlt");
 	}
 }
@@ -12,6 +12,18 @@
 // The maximum number of messages that can be queued.
 #define MAX_EVENTS_QUEUED 1024
 
+// The maximum number of messages that can be queued from each bucket of
+// senders, so one sender can't fill up a process's queue.
+#define MAX_MESSAGES_QUEUED_PER_SENDER 256
+
+// The maximum number of high priority messages that can be queued.
+#define MAX_PRIORITY_MESSAGES_QUEUED 1024
+
+// The maximum number of high priority messages that can be queued from each
+// bucket of senders. Any process can flag a message as a reply, so this stops
+// one sender from filling up the high priority queue.
+#define MAX_PRIORITY_MESSAGES_QUEUED_PER_SENDER 256
+
 // Magic number for when there are no messages queued.
 #define ID_FOR_NO_EVENTS 0xFFFFFFFFFFFFFFFF
 
@@ -21,11 +33,45 @@
 #define MS_OUT_OF_MEMORY 2
 #define MS_RECEIVERS_QUEUE_IS_FULL 3
 #define MS_UNIMPLEMENTED 4
+#define MS_INVALID_MEMORY_RANGE 5
+
+// Copies a message into a buffer in a process's memory. Returns false if the
+// buffer isn't mapped.
+static bool CopyMessageIntoProcessMemory(struct Message* message,
+	struct Process* process, size_t address) {
+	struct MessageInProcessMemory message_in_process_memory;
+	message_in_process_memory.pid = message->sender_pid;
+	message_in_process_memory.message_id = message->message_id;
+	message_in_process_memory.metadata = message->metadata;
+	message_in_process_memory.param1 = message->param1;
+	message_in_process_memory.param2 = message->param2;
+	message_in_process_memory.param3 = message->param3;
+	message_in_process_memory.param4 = message->param4;
+	message_in_process_memory.param5 = message->param5;
+	return CopyToProcessMemory(process->pml4, address,
+		&message_in_process_memory, sizeof(message_in_process_memory));
+}
 
-// Loads an message in to the thread.
-void LoadMessageIntoThread(struct Message* message, struct Thread* thread) {
-	// Set the thread's registers to contain this message.
+// Loads an message in to the thread. Returns false if the thread is receiving
+// messages into a buffer that isn't mapped, in which case the message hasn't
+// been consumed.
+bool LoadMessageIntoThread(struct Message* message, struct Thread* thread) {
 	struct Registers* registers = thread->registers;
+	if (thread->message_buffer_address != 0) {
+		// The thread is sleeping in a batched receive, so copy the message
+		// into its buffer.
+		size_t address = thread->message_buffer_address;
+		thread->message_buffer_address = 0;
+		if (!CopyMessageIntoProcessMemory(message, thread->process, address)) {
+			registers->rax = 0;
+			return false;
+		}
+		registers->rax = 1;
+		ReleaseMessage(message);
+		return true;
+	}
+
+	// Set the thread's registers to contain this message.
 	registers->rax = message->message_id;
 	registers->rbx = message->sender_pid;
 	registers->rdx = message->metadata;
@@ -36,6 +82,7 @@ void LoadMessageIntoThread(struct Message* message, struct Thread* thread) {
 	registers->r12 = message->param5;
 
 	ReleaseMessage(message);
+	return true;
 }
 
 // Is this a message that involves transferring memory pages?
@@ -43,11 +90,59 @@ bool IsPagingMessage(size_t metadata) {
 	return (metadata & 1) == 1;
 }
 
-// Sends an message to a process.
-void SendMessageToProcess(struct Message* message, struct Process* receiver) {
+// Returns the bucket that a sender's queued messages are counted in.
+static size_t GetSenderBucket(size_t sender_pid) {
+	return sender_pid % MESSAGE_SENDER_BUCKETS;
+}
+
+// Is this message from the kernel rather than a process?
+static bool IsKernelMessage(size_t sender_pid) {
+	return sender_pid == 0;
+}
+
+// Does this process have any messages queued?
+static bool HasQueuedMessages(struct Process* process) {
+	return process->next_priority_message != NULL ||
+		process->next_message != NULL;
+}
+
+// Returns the next message that is queued for a process, without removing it
+// from the queue. Returns NULL if there are no messages queued.
+static struct Message* PeekNextQueuedMessage(struct Process* process) {
+	return process->next_priority_message != NULL ?
+		process->next_priority_message : process->next_message;
+}
+
+// Tries to replace the last message queued for a process with a newer version
+// of the message. Returns false if the last queued message isn't the same kind
+// of message from the same sender.
+static bool CoalesceMessage(struct Process* receiver, size_t sender_pid,
+	size_t message_id, size_t metadata, size_t param1, size_t param2,
+	size_t param3, size_t param4, size_t param5) {
+	struct Message* message = receiver->last_message;
+	if (message == NULL || message->sender_pid != sender_pid ||
+		message->message_id != message_id || message->metadata != metadata ||
+		IsPagingMessage(metadata))
+		return false;
+
+	message->param1 = param1;
+	message->param2 = param2;
+	message->param3 = param3;
+	message->param4 = param4;
+	message->param5 = param5;
+	receiver->messages_coalesced++;
+	return true;
+}
+
+// Sends an message to a process. High priority messages are consumed before
+// any other queued messages. If thread_woken isn't NULL and the message
+// wakes up a thread, the thread isn't scheduled but is returned in
+// thread_woken, so the caller can decide where it runs.
+void SendMessageToProcess(struct Message* message, struct Process* receiver,
+	bool is_priority, struct Thread** thread_woken) {
 	if (receiver->thread_sleeping_for_message != NULL) {
 		// There is a thread sleeping for messages.
-		if (receiver->messages_queued != 0) {
+		if (HasQueuedMessages(receiver)) {
 			// This should never happen.
 			PrintString("A thread is sleeping for messages even though there are messages queued.\n");
 		}
@@ -64,42 +159,78 @@ void SendMessageToProcess(struct Message* message, struct Process* receiver) {
 			PrintString("Thread waiting for message isn't even asleep.\n");
 		}
 
-		LoadMessageIntoThread(message, thread_to_wake);
+		bool message_was_loaded = LoadMessageIntoThread(message, thread_to_wake);
 
 		// Wake up the thread.
 		thread_to_wake->thread_is_waiting_for_message = false;
-		ScheduleThread(thread_to_wake);
+		if (thread_woken != NULL)
+			*thread_woken = thread_to_wake;
+		else
+			ScheduleThread(thread_to_wake);
+
+		if (message_was_loaded)
+			return;
 
+		// The thread couldn't take the message, so queue it.
+	}
+
+	// We're the last element on the list.
+	message->next_message = NULL;
+
+	if (is_priority) {
+		if (receiver->last_priority_message == NULL) {
+			// No priority messages are queued, this is the only one.
+			receiver->next_priority_message = message;
+		} else {
+			// Add it to the end of the list of queued priority messages.
+			receiver->last_priority_message->next_message = message;
+		}
+		receiver->last_priority_message = message;
+		receiver->priority_messages_queued++;
+		if (!IsKernelMessage(message->sender_pid)) {
+			receiver->priority_messages_queued_by_sender[
+				GetSenderBucket(message->sender_pid)]++;
+		}
 		return;
 	}
 
 	if (receiver->last_message == NULL) {
 		// No messages are queued, this is the only one.
 		receiver->next_message = message;
-		receiver->last_message = message;
-		receiver->messages_queued = 1;
 	} else {
 		// Add it to the end of the list of queued messages.
 		receiver->last_message->next_message = message;
-		receiver->last_message = message;
-		receiver->messages_queued++;
 	}
-
-	// We're the last element on the list.
-	message->next_message = NULL;
+	receiver->last_message = message;
+	receiver->messages_queued++;
+	receiver->messages_queued_by_sender[GetSenderBucket(message->sender_pid)]++;
 }
 
-// Can this process receive an message?
-bool CanProcessReceiveMessage(struct Process* receiver) {
-	return receiver->messages_queued < MAX_EVENTS_QUEUED;
+// Can this process receive an message? Messages from processes are limited by
+// how many messages from the same sender are already queued in the same queue.
+bool CanProcessReceiveMessage(struct Process* receiver, size_t sender_pid,
+	bool is_priority) {
+	if (is_priority) {
+		return receiver->priority_messages_queued <
+				MAX_PRIORITY_MESSAGES_QUEUED &&
+			(IsKernelMessage(sender_pid) ||
+				receiver->priority_messages_queued_by_sender[
+					GetSenderBucket(sender_pid)] <
+					MAX_PRIORITY_MESSAGES_QUEUED_PER_SENDER);
+	}
+
+	return receiver->messages_queued < MAX_EVENTS_QUEUED &&
+		receiver->messages_queued_by_sender[GetSenderBucket(sender_pid)] <
+			MAX_MESSAGES_QUEUED_PER_SENDER;
 }
 
 
 // Sends a message from the kernel to a process. The message will be ignored on an error.
 void SendKernelMessageToProcess(struct Process* receiver_process, size_t event_id,
 	size_t param1, size_t param2, size_t param3, size_t param4, size_t param5) {
-	if (!CanProcessReceiveMessage(receiver_process)) {
+	if (!CanProcessReceiveMessage(receiver_process, 0, /*is_priority=*/true)) {
 		// The receiver's queue is full.
+		receiver_process->messages_dropped++;
 		return;
 	}
 
@@ -120,46 +251,55 @@ void SendKernelMessageToProcess(struct Process* receiver_process, size_t event_i
 	message->param5 = param5;
 
 	// Send the message to the receiver.
-	SendMessageToProcess(message, receiver_process);
+	SendMessageToProcess(message, receiver_process, /*is_priority=*/true, NULL);
 }
 
 void PrintStackTrace();
 
-// Sends an message from a thread. This is intended to be called from within a syscall.
-void SendMessageFromThreadSyscall(struct Thread* sender_thread) {
-	struct Process* sender_process = sender_thread->process;
-	struct Registers* registers = sender_thread->registers;
-
+// Sends a message from a process. flags are the MESSAGE_FLAG_* values. Returns
+// the status to send back to the sender. If thread_woken isn't NULL, a thread
+// woken by the message is returned in it rather than scheduled. (See
+// SendMessageToProcess.)
+static size_t SendMessageFromProcess(struct Process* sender_process,
+	size_t receiver_pid, size_t message_id, size_t metadata, size_t param1,
+	size_t param2, size_t param3, size_t param4, size_t param5, size_t flags,
+	struct Thread** thread_woken) {
 	// Find the receiver process, which maybe ourselves.
-	struct Process* receiver_process = (registers->rbx == sender_process->pid) ?
-		sender_process : GetProcessFromPid(registers->rbx);
+	struct Process* receiver_process = (receiver_pid == sender_process->pid) ?
+		sender_process : GetProcessFromPid(receiver_pid);
 
 	if (receiver_process == NULL) {
 		// Error, process doesn't exist.
-		registers->rax = MS_PROCESS_DOESNT_EXIST;
-		return;
+		return MS_PROCESS_DOESNT_EXIST;
+	}
+
+	if ((flags & MESSAGE_FLAG_CAN_COALESCE) != 0 &&
+		CoalesceMessage(receiver_process, sender_process->pid, message_id,
+			metadata, param1, param2, param3, param4, param5)) {
+		// The message replaced one that was already queued.
+		return MS_SUCCESS;
 	}
 
-	if (!CanProcessReceiveMessage(receiver_process)) {
+	bool is_priority = (flags & MESSAGE_FLAG_IS_REPLY) != 0;
+	if (!CanProcessReceiveMessage(receiver_process, sender_process->pid,
+		is_priority)) {
 		// Error, the receiver's queue is full.
-		registers->rax = MS_RECEIVERS_QUEUE_IS_FULL;
-		return;
+		receiver_process->messages_dropped++;
+		return MS_RECEIVERS_QUEUE_IS_FULL;
 	}
 
 	struct Message* message = AllocateMessage();
 	if (message == NULL) {
 		// Error, out of memory.
-		registers->rax = MS_OUT_OF_MEMORY;
-		return;
+		return MS_OUT_OF_MEMORY;
 	}
 
-	// Reads the message from the registers.
-	message->message_id = registers->rax;
+	message->message_id = message_id;
 	message->sender_pid = sender_process->pid;
-	message->metadata = registers->rdx;
-	message->param1 = registers->rsi;
-	message->param2 = registers->r8;
-	message->param3 = registers->r9;
+	message->metadata = metadata;
+	message->param1 = param1;
+	message->param2 = param2;
+	message->param3 = param3;
 	if (IsPagingMessage(message->metadata) &&
 		receiver_process != sender_process) {
 		// Transfer memory pages.
@@ -167,10 +307,11 @@ void SendMessageFromThreadSyscall(struct Thread* sender_thread) {
 		// r12/param 5 = Size of the message in pages.
 
 		// Figure out where to move the memory from and to.
-		size_t size_in_pages = registers->r12;
-		size_t source_virtual_address = registers->r10;
+		size_t size_in_pages = param5;
+		size_t source_virtual_address = param4;
 		size_t destination_virtual_address =
 			FindFreePageRange(receiver_process->pml4, size_in_pages);
+		bool share = (flags & MESSAGE_FLAG_SHARE_PAGES) != 0;
 
 		#if DEBUG
 			PrintString("Moving ");
@@ -183,67 +324,117 @@ void SendMessageFromThreadSyscall(struct Thread* sender_thread) {
 		#endif
 
 		if (destination_virtual_address == OUT_OF_MEMORY) {
-			// Out of memory - release message and all source pages.
-			ReleaseVirtualMemoryInAddressSpace(
-				sender_process->pml4, source_virtual_address, size_in_pages);
-			registers->rax = MS_OUT_OF_MEMORY;
+			// Out of memory - release message and all source pages, unless
+			// they're still the sender's.
+			if (!share) {
+				ReleaseVirtualMemoryInAddressSpace(
+					sender_process->pml4, source_virtual_address, size_in_pages);
+			}
 			ReleaseMessage(message);
-			return;
+			return MS_OUT_OF_MEMORY;
 		}
 
-		// Move each page over.
-		for (size_t page = 0; page < size_in_pages; page++) {
-			// Get the physical address of this page.
-			size_t page_physical_address = GetPhysicalAddress(
-				sender_process->pml4, source_virtual_address + page * PAGE_SIZE,
-				/*ignore_unownwed_pages=*/true);
-			if (page_physical_address == OUT_OF_MEMORY) {
-				#if DEBUG
-					PrintString("Page ");
-					PrintNumber(page);
-					PrintString("/");
-					PrintNumber(size_in_pages);
-					PrintString(" at ");
-					PrintHex(source_virtual_address + page * PAGE_SIZE);
-					PrintString(" doesn't exist.");
-				#endif
-
-				// No memory was mapped to this area. Release message and all
-				// source and destination pages.
+		// Move or share the pages, a page table at a time.
+		bool transferred = share ?
+			SharePagesBetweenAddressSpaces(sender_process->pml4,
+				source_virtual_address, receiver_process->pml4,
+				destination_virtual_address, size_in_pages) :
+			MovePagesBetweenAddressSpaces(sender_process->pml4,
+				source_virtual_address, receiver_process->pml4,
+				destination_virtual_address, size_in_pages);
+		if (!transferred) {
+			#if DEBUG
+				PrintString("Pages at ");
+				PrintHex(source_virtual_address);
+				PrintString(" couldn't be transferred.\n");
+			#endif
+
+			// Release the message and the destination pages, and the source
+			// pages too unless they're still the sender's.
+			if (!share) {
 				ReleaseVirtualMemoryInAddressSpace(
 					sender_process->pml4, source_virtual_address, size_in_pages);
-				ReleaseVirtualMemoryInAddressSpace(
-					receiver_process->pml4, destination_virtual_address, size_in_pages);
-				registers->rax = MS_OUT_OF_MEMORY;
-				ReleaseMessage(message);
-				return;
 			}
-
-			// Unmap the physical page from the old process.
-			UnmapVirtualPage(sender_process->pml4,
-				source_virtual_address + page * PAGE_SIZE, false);
-
-			// Map the physical page to the new process.
-			MapPhysicalPageToVirtualPage(receiver_process->pml4,
-				destination_virtual_address + page * PAGE_SIZE,
-				page_physical_address, /*own=*/ true);
+			ReleaseVirtualMemoryInAddressSpace(
+				receiver_process->pml4, destination_virtual_address, size_in_pages);
+			ReleaseMessage(message);
+			return MS_OUT_OF_MEMORY;
 		}
 
 		// Point our message to the new virtual address.
 		message->param4 = destination_virtual_address;
 		message->param5 = size_in_pages;
 	} else {
-		message->param4 = registers->r10;
-		message->param5 = registers->r12;
+		message->param4 = param4;
+		message->param5 = param5;
 	}
 
 	// Send the message to the receiver.
-	registers->rax = MS_SUCCESS;
-	SendMessageToProcess(message, receiver_process);
+	SendMessageToProcess(message, receiver_process, is_priority, thread_woken);
+	return MS_SUCCESS;
+}
+
+// Sends an message from a thread. This is intended to be called from within a syscall.
+void SendMessageFromThreadSyscall(struct Thread* sender_thread) {
+	struct Registers* registers = sender_thread->registers;
+	registers->rax = SendMessageFromProcess(sender_thread->process,
+		registers->rbx, registers->rax, registers->rdx, registers->rsi,
+		registers->r8, registers->r9, registers->r10, registers->r12,
+		registers->r13, NULL);
+}
+
+// Sends a batch of messages from a thread. This is intended to be called from
+// within a syscall.
+void SendMessagesFromThreadSyscall(struct Thread* sender_thread) {
+	struct Process* sender_process = sender_thread->process;
+	struct Registers* registers = sender_thread->registers;
+	size_t messages_address = registers->rax;
+	size_t number_of_messages = registers->rbx;
+	size_t flags = registers->r13;
+	if (number_of_messages > MAX_MESSAGES_IN_BATCH)
+		number_of_messages = MAX_MESSAGES_IN_BATCH;
+
+	size_t status = MS_SUCCESS;
+	size_t messages_sent = 0;
+	for (; messages_sent < number_of_messages; messages_sent++) {
+		struct MessageInProcessMemory message;
+		if (!CopyFromProcessMemory(sender_process->pml4,
+			messages_address + messages_sent * sizeof(message),
+			&message, sizeof(message))) {
+			status = MS_INVALID_MEMORY_RANGE;
+			break;
+		}
+
+		status = SendMessageFromProcess(sender_process, message.pid,
+			message.message_id, message.metadata, message.param1,
+			message.param2, message.param3, message.param4, message.param5,
+			flags, NULL);
+		if (status != MS_SUCCESS)
+			break;
+	}
+
+	registers->rax = status;
+	registers->rbx = messages_sent;
 }
 
 // Gets the next message queued for a process. Returns NULL if there are no messages queued.
 struct Message* GetNextQueuedMessage(struct Process* receiver) {
+	if (receiver->next_priority_message != NULL) {
+		// Grab the message at the front of the priority list.
+		struct Message* message = receiver->next_priority_message;
+		receiver->next_priority_message = message->next_message;
+		if (receiver->next_priority_message == NULL) {
+			// We removed the last item from the list.
+			receiver->last_priority_message = NULL;
+		}
+		receiver->priority_messages_queued--;
+		if (!IsKernelMessage(message->sender_pid)) {
+			receiver->priority_messages_queued_by_sender[
+				GetSenderBucket(message->sender_pid)]--;
+		}
+		return message;
+	}
+
 	if (receiver->next_message == NULL) {
 		// No messages are queued.
 		return NULL;
@@ -259,6 +450,7 @@ struct Message* GetNextQueuedMessage(struct Process* receiver) {
 	}
 
 	receiver->messages_queued--;
+	receiver->messages_queued_by_sender[GetSenderBucket(message->sender_pid)]--;
 	return message;
 }
 
@@ -274,6 +466,66 @@ void LoadNextMessageIntoThread(struct Thread* thread) {
 	}
 }
 
+// Loads as many queued messages as will fit into the buffer in the thread's
+// memory, pointed to by rax and with room for rbx messages. Sets rax to the
+// number of messages loaded.
+void LoadNextMessagesIntoThread(struct Thread* thread) {
+	struct Process* process = thread->process;
+	struct Registers* registers = thread->registers;
+	size_t buffer_address = registers->rax;
+	size_t buffer_size = registers->rbx;
+
+	size_t messages_loaded = 0;
+	while (messages_loaded < buffer_size && HasQueuedMessages(process)) {
+		// Copy the message before we dequeue it, so it stays queued if the
+		// buffer isn't mapped.
+		if (!CopyMessageIntoProcessMemory(PeekNextQueuedMessage(process),
+			process, buffer_address + messages_loaded *
+				sizeof(struct MessageInProcessMemory)))
+			break;
+
+		ReleaseMessage(GetNextQueuedMessage(process));
+		messages_loaded++;
+	}
+
+	registers->rax = messages_loaded;
+}
+
+// Returns if SleepThreadUntilMessages would put the thread to sleep, rather
+// than return straight away because there are messages queued or the buffer
+// in rax and rbx can't receive messages.
+static bool CanThreadSleepUntilMessages(struct Thread* thread) {
+	struct Registers* registers = thread->registers;
+	if (!thread->awake || thread->thread_is_waiting_for_message ||
+		HasQueuedMessages(thread->process) || registers->rbx == 0)
+		return false;
+
+	// Make sure we can write to the buffer before we sleep on it.
+	return GetPhysicalAddress(thread->process->pml4,
+		registers->rax & ~(PAGE_SIZE - 1), /*ignore_unowned_pages=*/false) !=
+		OUT_OF_MEMORY;
+}
+
+// Sleeps a thread until a message, then loads as many queued messages as will
+// fit into the buffer in the thread's memory, pointed to by rax and with room
+// for rbx messages. Returns if the thread is now asleep, or false if messages
+// were loaded.
+bool SleepThreadUntilMessages(struct Thread* thread) {
+	struct Registers* registers = thread->registers;
+	if (!CanThreadSleepUntilMessages(thread)) {
+		LoadNextMessagesIntoThread(thread);
+		return false;
+	}
+
+	if (!SleepThreadUntilMessage(thread))
+		return false;
+
+	// SendMessageToProcess will copy the message that wakes us up into the
+	// buffer.
+	thread->message_buffer_address = registers->rax;
+	return true;
+}
+
 // Sleeps a thread until an message. Returns if the thread is now asleep, or false
 // if a message was loaded.
 bool SleepThreadUntilMessage(struct Thread* thread) {
@@ -283,7 +535,7 @@ bool SleepThreadUntilMessage(struct Thread* thread) {
 	}
 
 	// Check if there is an message queued.
-	if (thread->process->next_message != NULL) {
+	if (HasQueuedMessages(thread->process)) {
 		LoadNextMessageIntoThread(thread);
 		return false;
 	}
@@ -297,4 +549,61 @@ bool SleepThreadUntilMessage(struct Thread* thread) {
 	// Unschedule this thread.
 	UnscheduleThread(thread);
 	return true;
-}
\ No newline at end of file
+}
+
+// Sends a message from a thread, then sleeps the thread until a message. If
+// the message wakes up a thread, the CPU is handed straight to that thread.
+// This is intended to be called from within a syscall.
+bool SendMessageAndSleepThreadUntilMessages(struct Thread* thread) {
+	struct Registers* registers = thread->registers;
+	struct Thread* thread_woken = NULL;
+	size_t status = SendMessageFromProcess(thread->process,
+		registers->rbx, registers->rax, registers->rdx, registers->rsi,
+		registers->r8, registers->r9, registers->r10, registers->r12,
+		registers->r13, &thread_woken);
+	if (status != MS_SUCCESS) {
+		registers->rax = 0;
+		registers->rbx = status;
+		return false;
+	}
+
+	// Receive messages into the buffer in r14 and r15.
+	registers->rax = registers->r14;
+	registers->rbx = registers->r15;
+
+	bool is_asleep = false;
+	if (CanThreadSleepUntilMessages(thread)) {
+		if (thread_woken != NULL) {
+			// Hand the CPU to the thread that received our message, which is
+			// most likely what we're waiting on.
+			ScheduleThreadToRunNext(thread_woken);
+			thread_woken = NULL;
+		}
+		is_asleep = SleepThreadUntilMessages(thread);
+	} else {
+		LoadNextMessagesIntoThread(thread);
+	}
+
+	if (thread_woken != NULL)
+		ScheduleThread(thread_woken);
+
+	registers->rbx = MS_SUCCESS;
+	return is_asleep;
+}
+
+// Populates the thread's registers with the statistics of the message queues
+// of the process with the PID in rax.
+void GetMessageQueueStatisticsForThread(struct Thread* thread) {
+	struct Registers* registers = thread->registers;
+	struct Process* process = GetProcessFromPid(registers->rax);
+	if (process == NULL) {
+		registers->rax = 0;
+		return;
+	}
+
+	registers->rax = 1;
+	registers->rbx = process->messages_queued;
+	registers->rdx = process->priority_messages_queued;
+	registers->rsi = process->messages_dropped;
+	registers->r8 = process->messages_coalesced;
+}
@@ -19,9 +19,46 @@ struct Message {
 	struct Message* next_message; // The next queued message for a process.
 };
 
+// Flags for sending a message (passed in r13.)
+// The message is a reply to an RPC, so it's queued in the receiver's high
+// priority queue. The kernel can't check this, so each sender can only have a
+// limited number of messages in the high priority queue.
+#define MESSAGE_FLAG_IS_REPLY 1
+// Only the latest of these messages matters (such as the mouse's position),
+// so it replaces the last queued message if that message has the same sender,
+// ID, and metadata, instead of being queued.
+#define MESSAGE_FLAG_CAN_COALESCE 2
+// The pages sent with the message are shared copy-on-write with the receiver
+// rather than moved, so they stay mapped in the sender.
+#define MESSAGE_FLAG_SHARE_PAGES 4
+
+// The maximum number of messages that can be sent in one batch.
+#define MAX_MESSAGES_IN_BATCH 64
+
+// A message in a process's memory, for sending and receiving messages in
+// batches. Userland depends on this layout.
+struct MessageInProcessMemory {
+	// When sending, the PID of the process to send the message to. When
+	// receiving, the PID of the process that sent the message.
+	size_t pid;
+	// ID of the message.
+	size_t message_id;
+	// Message metadata.
+	size_t metadata;
+	// Parameters:
+	size_t param1;
+	size_t param2;
+	size_t param3;
+	size_t param4;
+	size_t param5;
+};
+
 struct Process;
 struct Thread;
 
+// Is this a message that involves transferring memory pages?
+extern bool IsPagingMessage(size_t metadata);
+
 // Sends a message from the kernel to a process. The message will be ignored on an error.
 extern void SendKernelMessageToProcess(struct Process* receiver_process, size_t event_id,
 	size_t param1, size_t param2, size_t param3, size_t param4, size_t param5);
@@ -29,9 +66,35 @@ extern void SendKernelMessageToProcess(struct Process* receiver_process, size_t
 // Sends an message from a thread. This is intended to be called from within a syscall.
 extern void SendMessageFromThreadSyscall(struct Thread* sender_thread);
 
+// Sends a batch of messages from a thread. This is intended to be called from
+// within a syscall.
+extern void SendMessagesFromThreadSyscall(struct Thread* sender_thread);
+
 // Loads the next queued message for the process into the thread.
 extern void LoadNextMessageIntoThread(struct Thread* thread);
 
+// Loads as many queued messages as will fit into the buffer in the thread's
+// memory, pointed to by rax and with room for rbx messages. Sets rax to the
+// number of messages loaded.
+extern void LoadNextMessagesIntoThread(struct Thread* thread);
+
 // Sleeps a thread until an message. Returns if the thread is now asleep, or false
 // if a message was loaded.
 extern bool SleepThreadUntilMessage(struct Thread* thread);
+
+// Sleeps a thread until a message, then loads as many queued messages as will
+// fit into the buffer in the thread's memory, pointed to by rax and with room
+// for rbx messages. Returns if the thread is now asleep, or false if messages
+// were loaded.
+extern bool SleepThreadUntilMessages(struct Thread* thread);
+
+// Sends a message from a thread, then sleeps the thread until a message and
+// loads as many queued messages as will fit into the buffer in the thread's
+// memory, pointed to by r14 and with room for r15 messages. If the message
+// wakes up a thread, the CPU is handed straight to it. Returns if the thread is
+// now asleep, in which case the CPU has already switched to the next thread.
+extern bool SendMessageAndSleepThreadUntilMessages(struct Thread* thread);
+
+// Populates the thread's registers with the statistics of the message queues
+// of the process with the PID in rax.
+extern void GetMessageQueueStatisticsForThread(struct Thread* thread);
@@ -37,6 +37,11 @@ MbHdr:
 
 	dd 0 ; align next tag to 8 byte boundry
 
+	; load modules at page boundaries, so the ELF loader can map their pages
+	; straight into processes (optional, the loader copies otherwise)
+	dw 6, 1 ; MULTIBOOT_HEADER_TAG_MODULE_ALIGN
+	dd 8
+
 	; end of tags
 	dw 0, 0 ; MULTIBOOT_TAG_TYPE_END
 	dd 8
@@ -1,81 +1,336 @@
 #include "object_pools.h"
 
-#include "liballoc.h"
+#include "io.h"
 #include "messages.h"
+#include "physical_allocator.h"
 #include "process.h"
+#include "registers.h"
 #include "service.h"
 #include "shared_memory.h"
+#include "thread.h"
 #include "timer_event.h"
+#include "virtual_allocator.h"
 
-struct ObjectPoolItem {
-	struct ObjectPoolItem* next;
+// The largest slab is 2^MAX_SLAB_ORDER pages.
+#define MAX_SLAB_ORDER 3
+
+// We pick the smallest slab that fits at least this many objects.
+#define MIN_OBJECTS_PER_SLAB 8
+
+// The number of entirely free slabs that each pool holds onto, so that an
+// object being allocated and released over and over doesn't keep creating and
+// destroying a slab.
+#define EMPTY_SLABS_TO_KEEP 1
+
+// The number of registers that hold the name of a pool in
+// PopulateRegistersWithObjectPoolStatistics.
+#define OBJECT_POOL_NAME_WORDS 5
+
+// Marks the end of a slab's list of free objects.
+#define NO_FREE_OBJECT 0xFFFF
+
+// The header at the start of each slab.
+struct ObjectSlab {
+	// The pool that this slab belongs to.
+	struct ObjectPool* pool;
+
+	// Linked list of slabs in the same list in the pool.
+	struct ObjectSlab* next;
+	struct ObjectSlab* previous;
+
+	// The number of objects in this slab that are in use.
+	size_t objects_in_use;
+
+	// The index of the first free object, or NO_FREE_OBJECT.
+	uint16 first_free_object;
+
+	// The index of the free object after each free object. The objects start
+	// after this array.
+	uint16 next_free_object[];
 };
 
-// Grabs an object from the pool, if it exists, or allocates a new object.
-void* GrabOrAllocateObject(struct ObjectPoolItem** object_pool, size_t size) {
-	if (*object_pool == NULL) {
-		return malloc(size);
-	} else {
-		void* obj_to_return = *object_pool;
-		*object_pool = (*object_pool)->next;
-		return obj_to_return;
+// The first object pool, in the order they were initialized.
+struct ObjectPool* first_object_pool;
+
+// The last object pool, so we can add to the end of the list.
+struct ObjectPool* last_object_pool;
+
+// The smallest alignment of objects in a pool.
+#define MIN_OBJECT_ALIGNMENT 16
+
+// Rounds a number up to a multiple of a power of two alignment.
+static size_t RoundUpToAlignment(size_t number, size_t alignment) {
+	return (number + alignment - 1) & ~(alignment - 1);
+}
+
+// Calculates the layout of the pool's slabs, and adds the pool to the list of
+// pools.
+static void InitializeObjectPool(struct ObjectPool* pool) {
+	if (pool->alignment < MIN_OBJECT_ALIGNMENT)
+		pool->alignment = MIN_OBJECT_ALIGNMENT;
+	pool->object_size = RoundUpToAlignment(pool->object_size, pool->alignment);
+
+	for (pool->slab_order = 0;; pool->slab_order++) {
+		size_t slab_size = PAGE_SIZE << pool->slab_order;
+
+		// Each object needs room for itself and its entry in
+		// next_free_object. Start with an estimate and take objects away until
+		// the header and the objects fit.
+		size_t objects = (slab_size - sizeof(struct ObjectSlab)) /
+			(pool->object_size + sizeof(uint16));
+		if (objects >= NO_FREE_OBJECT)
+			objects = NO_FREE_OBJECT - 1;
+		while (objects > 0 && RoundUpToAlignment(sizeof(struct ObjectSlab) +
+			objects * sizeof(uint16), pool->alignment) +
+				objects * pool->object_size > slab_size)
+			objects--;
+
+		if (objects >= MIN_OBJECTS_PER_SLAB ||
+			pool->slab_order == MAX_SLAB_ORDER) {
+			pool->objects_per_slab = objects;
+			pool->first_object_offset = RoundUpToAlignment(
+				sizeof(struct ObjectSlab) + objects * sizeof(uint16),
+				pool->alignment);
+			break;
+		}
+	}
+
+	pool->partial_slabs = NULL;
+	pool->full_slabs = NULL;
+	pool->empty_slabs = NULL;
+	pool->empty_slab_count = 0;
+	pool->objects_in_use = 0;
+	pool->slabs = 0;
+	pool->allocations = 0;
+	pool->slabs_reclaimed = 0;
+
+	pool->next = NULL;
+	if (last_object_pool == NULL)
+		first_object_pool = pool;
+	else
+		last_object_pool->next = pool;
+	last_object_pool = pool;
+}
+
+// Adds a slab to the front of one of a pool's lists.
+static void AddSlabToList(struct ObjectSlab** list, struct ObjectSlab* slab) {
+	slab->previous = NULL;
+	slab->next = *list;
+	if (*list != NULL)
+		(*list)->previous = slab;
+	*list = slab;
+}
+
+// Removes a slab from one of a pool's lists.
+static void RemoveSlabFromList(struct ObjectSlab** list,
+	struct ObjectSlab* slab) {
+	if (slab->previous == NULL)
+		*list = slab->next;
+	else
+		slab->previous->next = slab->next;
+	if (slab->next != NULL)
+		slab->next->previous = slab->previous;
+}
+
+// Returns the address of an object in a slab.
+static void* GetObjectInSlab(struct ObjectSlab* slab, size_t index) {
+	return (void*)((size_t)slab + slab->pool->first_object_offset +
+		index * slab->pool->object_size);
+}
+
+// Creates a slab of free objects, or returns NULL if we're out of memory.
+static struct ObjectSlab* CreateSlab(struct ObjectPool* pool) {
+	size_t physical_address = GetPhysicalPages(pool->slab_order);
+	if (physical_address == OUT_OF_PHYSICAL_PAGES)
+		return NULL;
+
+	struct ObjectSlab* slab =
+		(struct ObjectSlab*)(DIRECT_MAP_OFFSET + physical_address);
+	slab->pool = pool;
+	slab->objects_in_use = 0;
+	slab->first_free_object = 0;
+	for (size_t i = 0; i < pool->objects_per_slab; i++) {
+		slab->next_free_object[i] = i + 1 == pool->objects_per_slab ?
+			NO_FREE_OBJECT : i + 1;
+		if (pool->constructor != NULL)
+			pool->constructor(GetObjectInSlab(slab, i));
+	}
+
+	pool->slabs++;
+	return slab;
+}
+
+// Returns a slab's pages to the physical allocator.
+static void DestroySlab(struct ObjectSlab* slab) {
+	slab->pool->slabs--;
+	FreePhysicalPages((size_t)slab - DIRECT_MAP_OFFSET, slab->pool->slab_order);
+}
+
+// Grabs an object from the pool, creating a new slab if there are no free
+// objects.
+void* GrabOrAllocateObject(struct ObjectPool* pool) {
+	struct ObjectSlab* slab = pool->partial_slabs;
+	if (slab == NULL) {
+		slab = pool->empty_slabs;
+		if (slab != NULL) {
+			RemoveSlabFromList(&pool->empty_slabs, slab);
+			pool->empty_slab_count--;
+		} else {
+			slab = CreateSlab(pool);
+			if (slab == NULL)
+				return NULL;
+		}
+		AddSlabToList(&pool->partial_slabs, slab);
+	}
+
+	size_t index = slab->first_free_object;
+	slab->first_free_object = slab->next_free_object[index];
+	slab->objects_in_use++;
+	if (slab->first_free_object == NO_FREE_OBJECT) {
+		RemoveSlabFromList(&pool->partial_slabs, slab);
+		AddSlabToList(&pool->full_slabs, slab);
 	}
+
+	pool->objects_in_use++;
+	pool->allocations++;
+	return GetObjectInSlab(slab, index);
 }
 
 // Returns an object to the pool.
-void ReleaseObjectToPool(struct ObjectPoolItem** object_pool, void* item) {
-	((struct ObjectPoolItem*)item)->next = *object_pool;
-	*object_pool = ((struct ObjectPoolItem*)item);
+void ReleaseObjectToPool(struct ObjectPool* pool, void* item) {
+	if (item == NULL)
+		return;
+
+	// Slabs are aligned to their size, so we can find the slab from the
+	// object.
+	struct ObjectSlab* slab = (struct ObjectSlab*)((size_t)item &
+		~((PAGE_SIZE << pool->slab_order) - 1));
+	size_t index = ((size_t)item - (size_t)slab - pool->first_object_offset) /
+		pool->object_size;
+
+	if (slab->first_free_object == NO_FREE_OBJECT) {
+		// The slab was full.
+		RemoveSlabFromList(&pool->full_slabs, slab);
+		AddSlabToList(&pool->partial_slabs, slab);
+	}
+	slab->next_free_object[index] = slab->first_free_object;
+	slab->first_free_object = index;
+	slab->objects_in_use--;
+	pool->objects_in_use--;
+
+	if (slab->objects_in_use == 0) {
+		RemoveSlabFromList(&pool->partial_slabs, slab);
+		if (pool->empty_slab_count < EMPTY_SLABS_TO_KEEP) {
+			AddSlabToList(&pool->empty_slabs, slab);
+			pool->empty_slab_count++;
+		} else {
+			DestroySlab(slab);
+		}
+	}
 }
 
-// Frees all the objects in the pool
-void FreeObjectsInPool(struct ObjectPoolItem** object_pool) {
-	while (*object_pool != NULL) {
-		struct ObjectPoolItem* next = (*object_pool)->next;
-		free(*object_pool);
-		*object_pool = next;
+// Frees all the empty slabs in the pool.
+void FreeEmptySlabsInPool(struct ObjectPool* pool) {
+	while (pool->empty_slabs != NULL) {
+		struct ObjectSlab* slab = pool->empty_slabs;
+		RemoveSlabFromList(&pool->empty_slabs, slab);
+		DestroySlab(slab);
+		pool->slabs_reclaimed++;
 	}
+	pool->empty_slab_count = 0;
 }
 
-#define OBJECT_POOL(Struct, CamelCase) \
-	struct ObjectPoolItem* CamelCase##_pool = NULL; \
+#define OBJECT_POOL_WITH_CONSTRUCTOR(Struct, CamelCase, Constructor) \
+	struct ObjectPool CamelCase##_pool = { \
+		.name = #Struct, \
+		.object_size = sizeof (struct Struct), \
+		.alignment = __alignof__ (struct Struct), \
+		.constructor = Constructor \
+	}; \
 	struct Struct* Allocate##Struct() { \
-		return (struct Struct*) GrabOrAllocateObject(&CamelCase##_pool,\
-			sizeof (struct Struct)); \
+		return (struct Struct*) GrabOrAllocateObject(&CamelCase##_pool); \
 	} \
 	void Release##Struct(struct Struct* obj) { \
 		ReleaseObjectToPool(&CamelCase##_pool, obj); \
 	}
 
+#define OBJECT_POOL(Struct, CamelCase) \
+	OBJECT_POOL_WITH_CONSTRUCTOR(Struct, CamelCase, NULL)
+
+OBJECT_POOL(CopyOnWritePage, copy_on_write_page)
+OBJECT_POOL(FreeMemoryRange, free_memory_range)
 OBJECT_POOL(Message, message)
+OBJECT_POOL(Process, process)
 OBJECT_POOL(ProcessToNotifyOnExit, process_to_notify_on_exit)
 OBJECT_POOL(ProcessToNotifyWhenServiceAppears, process_to_notify_when_service_appears)
+OBJECT_POOL(Registers, registers)
 OBJECT_POOL(Service, service)
 OBJECT_POOL(SharedMemory, shared_memory)
 OBJECT_POOL(SharedMemoryInProcess, shared_memory_in_process)
-OBJECT_POOL(SharedMemoryPage, shared_memory_page)
+OBJECT_POOL(Thread, thread)
 OBJECT_POOL(TimerEvent, timer_event)
+OBJECT_POOL_WITH_CONSTRUCTOR(VirtualAddressSpace, virtual_address_space,
+	ConstructVirtualAddressSpace)
 
 // Initialize the object pools.
 void InitializeObjectPools() {
-	message_pool = NULL;
-	process_to_notify_on_exit_pool = NULL;
-	process_to_notify_when_service_appears_pool = NULL;
-	service_pool = NULL;
-	shared_memory_pool = NULL;
-	shared_memory_in_process_pool = NULL;
-	shared_memory_page_pool = NULL;
-	timer_event_pool = NULL;
+	first_object_pool = NULL;
+	last_object_pool = NULL;
+
+	InitializeObjectPool(&copy_on_write_page_pool);
+	InitializeObjectPool(&free_memory_range_pool);
+	InitializeObjectPool(&message_pool);
+	InitializeObjectPool(&process_pool);
+	InitializeObjectPool(&process_to_notify_on_exit_pool);
+	InitializeObjectPool(&process_to_notify_when_service_appears_pool);
+	InitializeObjectPool(&registers_pool);
+	InitializeObjectPool(&service_pool);
+	InitializeObjectPool(&shared_memory_pool);
+	InitializeObjectPool(&shared_memory_in_process_pool);
+	InitializeObjectPool(&thread_pool);
+	InitializeObjectPool(&timer_event_pool);
+	InitializeObjectPool(&virtual_address_space_pool);
 }
 
-// Clean up object pools to gain some memory back.
-void CleanUpObjectPools() {
-	FreeObjectsInPool(&message_pool);
-	FreeObjectsInPool(&process_to_notify_on_exit_pool);
-	FreeObjectsInPool(&process_to_notify_when_service_appears_pool);
-	FreeObjectsInPool(&service_pool);	
-	FreeObjectsInPool(&shared_memory_pool);
-	FreeObjectsInPool(&shared_memory_in_process_pool);
-	FreeObjectsInPool(&shared_memory_page_pool);
-	FreeObjectsInPool(&timer_event_pool);
+// Returns the pages of entirely free slabs to the physical allocator, when we
+// are running out of memory. Slabs with objects in use are left alone.
+void ShrinkObjectPools() {
+	for (struct ObjectPool* pool = first_object_pool; pool != NULL;
+		pool = pool->next)
+		FreeEmptySlabsInPool(pool);
+}
+
+// Populates the registers with the statistics of the object pool at an
+// index, in the order that they were initialized, for the
+// GET_OBJECT_POOL_STATISTICS syscall.
+void PopulateRegistersWithObjectPoolStatistics(size_t index,
+	struct Registers* regs) {
+	struct ObjectPool* pool = first_object_pool;
+	while (pool != NULL && index > 0) {
+		pool = pool->next;
+		index--;
+	}
+
+	if (pool == NULL) {
+		regs->rax = 0;
+		return;
+	}
+
+	regs->rax = 1;
+	regs->rbx = pool->object_size;
+	regs->rdx = pool->objects_in_use;
+	regs->rsi = pool->slabs << pool->slab_order;
+	regs->r8 = pool->allocations;
+	regs->r9 = pool->slabs_reclaimed << pool->slab_order;
+
+	// The name is packed into the remaining registers.
+	size_t name[OBJECT_POOL_NAME_WORDS];
+	memset((unsigned char*)name, 0, sizeof(name));
+	for (size_t i = 0; i < sizeof(name) && pool->name[i] != '\0'; i++)
+		((char*)name)[i] = pool->name[i];
+	regs->r10 = name[0];
+	regs->r12 = name[1];
+	regs->r13 = name[2];
+	regs->r14 = name[3];
+	regs->r15 = name[4];
 }
@@ -1,15 +1,85 @@
 #pragma once
 
+#include "types.h"
+
+struct CopyOnWritePage;
+struct FreeMemoryRange;
 struct Message;
 struct ProcessToNotifyOnExit;
 struct ProcessToNotifyWhenServiceAppears;
+struct Process;
+struct Registers;
 struct Service;
 struct SharedMemory;
 struct SharedMemoryInProcess;
-struct SharedMemoryPage;
+struct Thread;
 struct TimerEvent;
+struct VirtualAddressSpace;
+struct ObjectSlab;
 
 // Object pools, for fast grabbing and releasing objects that are created/destoyed a lot.
+//
+// Each type of object has its own pool, which carves objects out of slabs -
+// physically contiguous pages that we reach through the direct map. A slab
+// remembers which of its objects are free without writing into them, so a
+// pool with a constructor only constructs an object once, when its slab is
+// created, and objects must be released in their constructed state.
+
+// A pool of objects of one type.
+struct ObjectPool {
+	// The name of the type of object, for statistics.
+	const char* name;
+
+	// The size of each object, rounded up to keep objects aligned.
+	size_t object_size;
+
+	// The alignment of each object. Objects are always at least 16 byte
+	// aligned.
+	size_t alignment;
+
+	// Called on each object when its slab is created, or NULL.
+	void (*constructor)(void* object);
+
+	// Each slab is 2^slab_order pages, aligned to its size.
+	size_t slab_order;
+
+	// The number of objects that fit in a slab.
+	size_t objects_per_slab;
+
+	// The offset of the first object from the start of the slab.
+	size_t first_object_offset;
+
+	// Slabs with some free objects, slabs with no free objects, and slabs that
+	// are entirely free.
+	struct ObjectSlab* partial_slabs;
+	struct ObjectSlab* full_slabs;
+	struct ObjectSlab* empty_slabs;
+
+	// The number of slabs in empty_slabs.
+	size_t empty_slab_count;
+
+	// Statistics.
+	size_t objects_in_use;
+	size_t slabs;
+	size_t allocations;
+	size_t slabs_reclaimed;
+
+	// The next pool, in the order that they were initialized.
+	struct ObjectPool* next;
+};
+
+// Allocate a CopyOnWritePage.
+// Allocate a CopyOnWritePage.
+struct CopyOnWritePage* AllocateCopyOnWritePage();
+
+// Release a CopyOnWritePage.
+void ReleaseCopyOnWritePage(struct CopyOnWritePage* copy_on_write_page);
+
+// Allocate a FreeMemoryRange.
+struct FreeMemoryRange* AllocateFreeMemoryRange();
+
+// Release a FreeMemoryRange.
+void ReleaseFreeMemoryRange(struct FreeMemoryRange* free_memory_range);
 
 // Allocate a message.
 struct Message* AllocateMessage();
@@ -24,6 +94,18 @@ struct ProcessToNotifyOnExit* AllocateProcessToNotifyOnExit();
 void ReleaseProcessToNotifyOnExit(
 	struct ProcessToNotifyOnExit* process_to_notify_on_exit);
 
+// Allocate a Process.
+struct Process* AllocateProcess();
+
+// Release a Process.
+void ReleaseProcess(struct Process* process);
+
+// Allocate a Registers.
+struct Registers* AllocateRegisters();
+
+// Release a Registers.
+void ReleaseRegisters(struct Registers* registers);
+
 // Allocate a Service.
 struct Service* AllocateService();
 
@@ -50,11 +132,11 @@ struct SharedMemoryInProcess* AllocateSharedMemoryInProcess();
 // Release a SharedMemoryInProcess.
 void ReleaseSharedMemoryInProcess(struct SharedMemoryInProcess* shared_memory_in_process);
 
-// Allocate a SharedMemoryPage.
-struct SharedMemoryPage* AllocateSharedMemoryPage();
+// Allocate a Thread.
+struct Thread* AllocateThread();
 
-// Release a SharedMemoryPage.
-void ReleaseSharedMemoryPage(struct SharedMemoryPage* shared_memory_page);
+// Release a Thread.
+void ReleaseThread(struct Thread* thread);
 
 // Allocate a TimerEvent.
 struct TimerEvent* AllocateTimerEvent();
@@ -62,8 +144,21 @@ struct TimerEvent* AllocateTimerEvent();
 // Release a TimerEvent.
 void ReleaseTimerEvent(struct TimerEvent* timer_event);
 
+// Allocate a VirtualAddressSpace. It comes with empty free range trees.
+struct VirtualAddressSpace* AllocateVirtualAddressSpace();
+
+// Release a VirtualAddressSpace. Its free range trees must be empty.
+void ReleaseVirtualAddressSpace(struct VirtualAddressSpace* virtual_address_space);
+
 // Initialize the object pools.
 void InitializeObjectPools();
 
-// Clean up object pools to gain some memory back.
-void CleanUpObjectPools();
\ No newline at end of file
+// Returns the pages of entirely free slabs to the physical allocator, when we
+// are running out of memory. Slabs with objects in use are left alone.
+void ShrinkObjectPools();
+
+// Populates the registers with the statistics of the object pool at an
+// index, in the order that they were initialized, for the
+// GET_OBJECT_POOL_STATISTICS syscall.
+void PopulateRegistersWithObjectPoolStatistics(size_t index,
+	struct Registers* regs);
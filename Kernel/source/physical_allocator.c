@@ -1,5 +1,6 @@
 #include "physical_allocator.h"
 
+#include "cpu.h"
 #include "io.h"
 #include "../../third_party/multiboot2.h"
 #include "object_pools.h"
@@ -11,16 +12,61 @@
 // The total number of bytes of system memory.
 size_t total_system_memory;
 
+// The end of the highest range of physical memory that the bootloader told us
+// about.
+size_t end_of_physical_memory;
+
 // The total number of free pages.
 size_t free_pages;
 
 // Start of the free memory on boot.
 extern size_t bssEnd;
 
-// Physical memory is divided into 4kb pages. We keep a linked stack of them that we can pop a page off
-// of and push a page onto. This pointer points to the top of the stack (next free page), and the first
-// thing in that page will be a pointer to the next page.
-size_t next_free_page_address;
+// The largest number of ranges of available memory that we keep track of
+// at boot.
+#define MAX_BOOT_MEMORY_RANGES 32
+
+// The number of zeroed pages that we try to keep ready for GetPhysicalPage.
+#define ZEROED_PAGE_POOL_SIZE 1024 // 4 MB
+
+// A range of available physical memory that the bootloader told us about.
+struct BootMemoryRange {
+	size_t start;
+	size_t end;
+};
+
+// The ranges of available physical memory. Before the buddy allocator is
+// initialized, pages are handed out from the front of these ranges.
+struct BootMemoryRange boot_memory_ranges[MAX_BOOT_MEMORY_RANGES];
+size_t number_of_boot_memory_ranges;
+
+// The end of the highest range of available physical memory.
+size_t end_of_usable_memory;
+
+// A free block of physical pages. This lives at the start of the block and is
+// accessed through the direct map.
+struct FreePhysicalBlock {
+	struct FreePhysicalBlock* next;
+	struct FreePhysicalBlock* previous;
+};
+
+// Free blocks of physical memory, one list for each order. A block of order n
+// is 2^n pages and is aligned to its size.
+struct FreePhysicalBlock* free_blocks[LARGE_PAGE_ORDER + 1];
+
+// For each physical page, 1 + the order of the free block that starts at this
+// page, or 0 if no free block starts here.
+uint8* free_block_orders;
+
+// The number of physical pages covered by free_block_orders.
+size_t number_of_physical_pages;
+
+// A stack of pages that have been zeroed while we were idle, linked through
+// the first word of each page.
+struct FreePhysicalBlock* zeroed_pages;
+
+// The number of pages in zeroed_pages.
+size_t zeroed_pages_in_pool;
 
 // The end of multiboot memory. This is memory that is temporarily reserved to hold the multiboot
 // information put there by the bootloader, and will be released after calling DoneWithMultibootMemory.
@@ -90,12 +136,13 @@ void CalculateStartOfFreeMemoryAtBoot() {
 
 void InitializePhysicalAllocator() {
 	total_system_memory = 0;
+	end_of_physical_memory = 0;
+	end_of_usable_memory = 0;
 	free_pages = 0;
+	number_of_boot_memory_ranges = 0;
+	free_block_orders = NULL;
 	CalculateStartOfFreeMemoryAtBoot();
 
-	// Initialize the stack to OUT_OF_PHYSICAL_PAGES, then we will push pages onto the stack As
-	next_free_page_address = OUT_OF_PHYSICAL_PAGES;
-
 	// The multiboot bootloader (GRUB) already did the hard work of asking the BIOS what physical
 	// memory is available. The bootloader puts this information into the multiboot header.
 
@@ -146,6 +193,8 @@ void InitializePhysicalAllocator() {
 
 				uint64 len = SafeReadUint64(&mmap->len);
 				total_system_memory += len;
+				if(SafeReadUint64(&mmap->addr) + len > end_of_physical_memory)
+					end_of_physical_memory = SafeReadUint64(&mmap->addr) + len;
 
 				if(SafeReadUint32(&mmap->type) == MULTIBOOT_MEMORY_AVAILABLE) {
 					// This memory is avaliable for usage (in contrast to memory that is reserved, dead, etc.)
@@ -170,20 +219,19 @@ void InitializePhysicalAllocator() {
 						}
 					#endif
 
-					// Now we will divide this memory up into pages and iterate through them.
-					size_t page_addr;
-					for(page_addr = start; page_addr < end; page_addr += PAGE_SIZE) {
-						// Push this page onto the linked stack.
+					// Memory past the direct map can't be reached by the buddy
+					// allocator.
+					if(end > MAX_DIRECT_MAP_SIZE)
+						end = MAX_DIRECT_MAP_SIZE;
 
-						// Map this physical memory, so can write the previous stack page to it.
-						size_t *bp = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(page_addr);
-						
-						// Write the previous stack head to the start of this page.
-						*bp = next_free_page_address;
-						// Sets the stack head to this page.
-						next_free_page_address = page_addr;
+					if(end > start && number_of_boot_memory_ranges < MAX_BOOT_MEMORY_RANGES) {
+						boot_memory_ranges[number_of_boot_memory_ranges].start = start;
+						boot_memory_ranges[number_of_boot_memory_ranges].end = end;
+						number_of_boot_memory_ranges++;
 
-						free_pages++;
+						if(end > end_of_usable_memory)
+							end_of_usable_memory = end;
+						free_pages += (end - start) / PAGE_SIZE;
 					}
 				}
 
@@ -194,7 +242,9 @@ void InitializePhysicalAllocator() {
 
 // Indicates that we are done with the multiboot memory and that it can be released.
 void DoneWithMultibootMemory() {
-	// Frees the memory pages between the end of kernel memory
+	// Unmaps the memory pages between the end of kernel memory and the end of the
+	// multiboot modules. The physical pages are kept, because the processes
+	// loaded from the modules map the modules' pages rather than copies of them.
 	size_t end_of_kernel_memory = (size_t)&bssEnd;
 	size_t start = (end_of_kernel_memory + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); // Round up.
 	size_t end = start_of_free_memory_at_boot;// (start_of_free_memory_at_boot + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1); // Round up.
@@ -205,70 +255,252 @@ void DoneWithMultibootMemory() {
 			PrintHex(page + VIRTUAL_MEMORY_OFFSET);
 			PrintChar('\n');
 		#endif
-		UnmapVirtualPage(kernel_pml4, page + VIRTUAL_MEMORY_OFFSET, true);
+		UnmapVirtualPage(kernel_pml4, page + VIRTUAL_MEMORY_OFFSET, false);
 	}
 }
 
 // Grabs the next physical page (at boot time before the virtual memory allocator is initialized),
 // returns OUT_OF_PHYSICAL_PAGES if there are no more physical pages.
 size_t GetPhysicalPagePreVirtualMemory() {
-	if(next_free_page_address == OUT_OF_PHYSICAL_PAGES) {
-		// No more free pages.
-		return OUT_OF_PHYSICAL_PAGES;
+	for(size_t i = 0; i < number_of_boot_memory_ranges; i++) {
+		struct BootMemoryRange* range = &boot_memory_ranges[i];
+		if(range->start < range->end) {
+			size_t addr = range->start;
+			range->start += PAGE_SIZE;
+			free_pages--;
+			return addr;
+		}
 	}
 
-	// Take the top page from the stack.
-	size_t addr = next_free_page_address;
+	// No more free pages.
+	return OUT_OF_PHYSICAL_PAGES;
+}
+
+// Returns a pointer to a free block through the direct map.
+static struct FreePhysicalBlock* GetFreePhysicalBlock(size_t addr) {
+	return (struct FreePhysicalBlock*)(addr + DIRECT_MAP_OFFSET);
+}
+
+// Adds a block to the free list for its order.
+static void AddFreePhysicalBlock(size_t addr, size_t order) {
+	struct FreePhysicalBlock* block = GetFreePhysicalBlock(addr);
+	block->previous = NULL;
+	block->next = free_blocks[order];
+	if(block->next != NULL)
+		block->next->previous = block;
+	free_blocks[order] = block;
+	free_block_orders[addr / PAGE_SIZE] = (uint8)(order + 1);
+}
+
+// Removes a block from the free list for its order.
+static void RemoveFreePhysicalBlock(size_t addr, size_t order) {
+	struct FreePhysicalBlock* block = GetFreePhysicalBlock(addr);
+	if(block->previous == NULL)
+		free_blocks[order] = block->next;
+	else
+		block->previous->next = block->next;
+	if(block->next != NULL)
+		block->next->previous = block->previous;
+	free_block_orders[addr / PAGE_SIZE] = 0;
+}
 
-	// Pop it from the stack by mapping the page to physical memory so we can grab the pointer to the
-	// next free page.
-	size_t *bp = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(addr);
-	next_free_page_address = *bp;
+// Takes a block of 2^order pages off of the free lists, splitting a larger
+// block if we have to. The block isn't zeroed. Returns OUT_OF_PHYSICAL_PAGES
+// if there's no block big enough.
+static size_t TakeFreePhysicalBlock(size_t order) {
+	size_t block_order = order;
+	while(block_order <= LARGE_PAGE_ORDER && free_blocks[block_order] == NULL)
+		block_order++;
+	if(block_order > LARGE_PAGE_ORDER)
+		return OUT_OF_PHYSICAL_PAGES;
 
-	free_pages--;
+	size_t addr = (size_t)free_blocks[block_order] - DIRECT_MAP_OFFSET;
+	RemoveFreePhysicalBlock(addr, block_order);
 
+	// Give the upper halves back until the block is the size that we want.
+	while(block_order > order) {
+		block_order--;
+		AddFreePhysicalBlock(addr + (PAGE_SIZE << block_order), block_order);
+	}
+
+	free_pages -= (size_t)1 << order;
 	return addr;
 }
 
+// Puts a block of 2^order pages back on the free lists, merging it with its
+// buddy for as long as the buddy is also free.
+static void ReturnFreePhysicalBlock(size_t addr, size_t order) {
+	free_pages += (size_t)1 << order;
+
+	while(order < LARGE_PAGE_ORDER) {
+		size_t buddy = addr ^ (PAGE_SIZE << order);
+		if(buddy / PAGE_SIZE >= number_of_physical_pages ||
+			free_block_orders[buddy / PAGE_SIZE] != order + 1)
+			break;
+
+		RemoveFreePhysicalBlock(buddy, order);
+		addr &= ~(PAGE_SIZE << order);
+		order++;
+	}
+
+	AddFreePhysicalBlock(addr, order);
+}
+
+// Gives the zeroed pages back to the free lists, so they can be merged into
+// larger blocks.
+static void ReturnZeroedPagesToFreeLists() {
+	while(zeroed_pages != NULL) {
+		struct FreePhysicalBlock* page = zeroed_pages;
+		zeroed_pages = page->next;
+		zeroed_pages_in_pool--;
+		free_pages--;
+		ReturnFreePhysicalBlock((size_t)page - DIRECT_MAP_OFFSET, 0);
+	}
+}
+
+// Hands the free memory over to the buddy allocator.
+void InitializeBuddyAllocator() {
+	number_of_physical_pages = end_of_usable_memory / PAGE_SIZE;
+
+	// Find somewhere to put free_block_orders.
+	size_t bytes_for_orders = (number_of_physical_pages + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	for(size_t i = 0; i < number_of_boot_memory_ranges; i++) {
+		struct BootMemoryRange* range = &boot_memory_ranges[i];
+		if(range->end - range->start >= bytes_for_orders) {
+			free_block_orders = (uint8*)(range->start + DIRECT_MAP_OFFSET);
+			range->start += bytes_for_orders;
+			free_pages -= bytes_for_orders / PAGE_SIZE;
+			break;
+		}
+	}
+	if(free_block_orders == NULL) {
+		PrintString("Out of memory to initialize the physical allocator.");
+		asm("cli");
+		asm("hlt");
+	}
+	memset(free_block_orders, 0, number_of_physical_pages);
+
+	for(size_t order = 0; order <= LARGE_PAGE_ORDER; order++)
+		free_blocks[order] = NULL;
+	zeroed_pages = NULL;
+	zeroed_pages_in_pool = 0;
+
+	// Add what's left of each range as the largest aligned blocks that fit.
+	free_pages = 0;
+	for(size_t i = 0; i < number_of_boot_memory_ranges; i++) {
+		size_t start = boot_memory_ranges[i].start;
+		size_t end = boot_memory_ranges[i].end;
+		while(start < end) {
+			size_t order = LARGE_PAGE_ORDER;
+			while(order > 0 && ((start & ((PAGE_SIZE << order) - 1)) != 0 ||
+				start + (PAGE_SIZE << order) > end))
+				order--;
+
+			AddFreePhysicalBlock(start, order);
+			free_pages += (size_t)1 << order;
+			start += PAGE_SIZE << order;
+		}
+	}
+
+	// Everything is now owned by the buddy allocator.
+	number_of_boot_memory_ranges = 0;
+}
+
 // Grabs the next physical page, returns OUT_OF_PHYSICAL_PAGES if there are no more physical pages.
 size_t GetPhysicalPage() {
-	if(next_free_page_address == OUT_OF_PHYSICAL_PAGES) {
+	if(zeroed_pages != NULL) {
+		// Grab a page that was zeroed while we were idle.
+		struct FreePhysicalBlock* page = zeroed_pages;
+		zeroed_pages = page->next;
+		zeroed_pages_in_pool--;
+		free_pages--;
+
+		// Only the link to the next page is dirty.
+		page->next = NULL;
+		return (size_t)page - DIRECT_MAP_OFFSET;
+	}
+
+	size_t addr = TakeFreePhysicalBlock(0);
+	if(addr == OUT_OF_PHYSICAL_PAGES) {
 		// Ran out of memory. Try to clean up some memory.
-		CleanUpObjectPools();
+		ShrinkObjectPools();
 
-		if (next_free_page_address == OUT_OF_PHYSICAL_PAGES) {
+		addr = TakeFreePhysicalBlock(0);
+		if(addr == OUT_OF_PHYSICAL_PAGES) {
 			// No more free pages.
 			return OUT_OF_PHYSICAL_PAGES;
 		}
 	}
 
-	// Take the top page from the stack.
-	size_t addr = next_free_page_address;
+	// Clear out the page, so we don't leak anything from another process.
+	memset((unsigned char*)GetFreePhysicalBlock(addr), 0, PAGE_SIZE);
+	return addr;
+}
 
-	// Pop it from the stack by mapping the page to physical memory so we can grab the pointer to the
-	// next free page.
-	size_t *bp = (size_t *)TemporarilyMapPhysicalMemory(addr, 5);
-	next_free_page_address = *bp;
+// Grabs 2^order physically contiguous pages that are aligned to their size.
+size_t GetPhysicalPages(size_t order) {
+	if(order == 0)
+		return GetPhysicalPage();
+	if(order > LARGE_PAGE_ORDER)
+		return OUT_OF_PHYSICAL_PAGES;
 
-	// Clear out the page, so we don't leak anything from another process.
-	memset((unsigned char*)bp, 0, PAGE_SIZE);
+	size_t addr = TakeFreePhysicalBlock(order);
+	if(addr == OUT_OF_PHYSICAL_PAGES) {
+		// The zeroed pages might be the buddies we need.
+		ReturnZeroedPagesToFreeLists();
+		ShrinkObjectPools();
 
-	free_pages--;
+		addr = TakeFreePhysicalBlock(order);
+		if(addr == OUT_OF_PHYSICAL_PAGES)
+			return OUT_OF_PHYSICAL_PAGES;
+	}
 
+	memset((unsigned char*)GetFreePhysicalBlock(addr), 0, PAGE_SIZE << order);
 	return addr;
 }
 
 // Frees a physical page.
 void FreePhysicalPage(size_t addr) {
-	// Push this page onto the linked stack.
+	if(addr / PAGE_SIZE >= number_of_physical_pages) {
+		// Not memory that we manage.
+		return;
+	}
+	ReturnFreePhysicalBlock(addr, 0);
+}
 
-	// Map this physical memory, so can write the previous stack page to it.
-	size_t *bp = (size_t *)TemporarilyMapPhysicalMemory(addr, 5);
-	// Write the previous stack head to the start of this page.	
-	*bp = next_free_page_address;
+// Frees 2^order physically contiguous pages.
+void FreePhysicalPages(size_t addr, size_t order) {
+	if(addr / PAGE_SIZE >= number_of_physical_pages)
+		return;
+	ReturnFreePhysicalBlock(addr, order);
+}
 
-	// Sets the stack head to this page.
-	next_free_page_address = addr;
+// Zeroes free pages into the pool, until the pool is full or there are no
+// free pages left.
+void ZeroFreePagesWhileIdle() {
+	for(;;) {
+		asm volatile("cli");
+		AcquireKernelLock();
+		size_t addr = zeroed_pages_in_pool < ZEROED_PAGE_POOL_SIZE ?
+			TakeFreePhysicalBlock(0) : OUT_OF_PHYSICAL_PAGES;
+		ReleaseKernelLock();
+		asm volatile("sti");
+
+		if(addr == OUT_OF_PHYSICAL_PAGES)
+			return;
 
-	free_pages++;
-}
\ No newline at end of file
+		// Zero the page without holding the kernel lock so that other CPUs,
+		// and interrupts, aren't held up by us.
+		struct FreePhysicalBlock* page = GetFreePhysicalBlock(addr);
+		memset((unsigned char*)page, 0, PAGE_SIZE);
+
+		asm volatile("cli");
+		AcquireKernelLock();
+		page->next = zeroed_pages;
+		zeroed_pages = page;
+		zeroed_pages_in_pool++;
+		free_pages++;
+		ReleaseKernelLock();
+		asm volatile("sti");
+	}
+}
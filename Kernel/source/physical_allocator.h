@@ -1,13 +1,19 @@
 #pragma once
 
 // The physical allocator manages physical memory, and operates by grabbing and freeing pages
-// (4 KB chunks of memory).
+// (4 KB chunks of memory). Free memory is kept by a buddy allocator, so we can also hand out
+// aligned blocks of contiguous pages up to 2 MB. While idle, CPUs zero free pages into a pool so
+// GetPhysicalPage usually doesn't have to.
 
 #include "types.h"
 
 // The total number of bytes of system memory.
 extern size_t total_system_memory;
 
+// The end of the highest range of physical memory that the bootloader told us
+// about.
+extern size_t end_of_physical_memory;
+
 // The total number of free pages.
 extern size_t free_pages;
 
@@ -20,18 +26,44 @@ extern size_t start_of_free_memory_at_boot;
 // Magic value for when we are out of physical pages.
 #define OUT_OF_PHYSICAL_PAGES 1
 
+// The order of the largest block of contiguous pages we can allocate. 2^9 pages is 2 MB, the
+// size of a large page.
+#define LARGE_PAGE_ORDER 9
+
+// The size of a large page, in bytes.
+#define LARGE_PAGE_SIZE (PAGE_SIZE << LARGE_PAGE_ORDER)
+
 // Initializes the physical allocator.
 extern void InitializePhysicalAllocator();
 
-// Indicates that we are done with the multiboot memory and that it can be released.
+// Indicates that we are done with the multiboot memory and that its virtual addresses can be
+// released. The modules' physical pages are never freed, because processes share them.
 extern void DoneWithMultibootMemory();
 
 // Grabs the next physical page (at boot time before the virtual memory allocator is initialized),
 // returns OUT_OF_PHYSICAL_PAGES if there are no more physical pages.
 extern size_t GetPhysicalPagePreVirtualMemory();
 
+// Hands the free memory over to the buddy allocator. Called by the virtual allocator once all of
+// physical memory is directly mapped. GetPhysicalPagePreVirtualMemory can't be used after this.
+extern void InitializeBuddyAllocator();
+
 // Grabs the next physical page, returns OUT_OF_PHYSICAL_PAGES if there are no more physical pages.
+// The page is zeroed.
 extern size_t GetPhysicalPage();
 
+// Grabs 2^order physically contiguous pages (up to LARGE_PAGE_ORDER) that are aligned to their
+// size, such as for DMA buffers and large pages. Returns OUT_OF_PHYSICAL_PAGES if there's no free
+// block that big. The pages are zeroed.
+extern size_t GetPhysicalPages(size_t order);
+
 // Frees a physical page.
-extern void FreePhysicalPage(size_t addr);
\ No newline at end of file
+extern void FreePhysicalPage(size_t addr);
+
+// Frees 2^order physically contiguous pages from GetPhysicalPages. The pages may also be freed one
+// at a time with FreePhysicalPage.
+extern void FreePhysicalPages(size_t addr, size_t order);
+
+// Zeroes free pages into a pool for GetPhysicalPage, and returns once the pool is full. Called by
+// idle CPUs with interrupts enabled and without holding the kernel lock.
+extern void ZeroFreePagesWhileIdle();
\ No newline at end of file
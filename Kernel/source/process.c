@@ -2,32 +2,121 @@
 
 #include "interrupts.h"
 #include "io.h"
-#include "liballoc.h"
 #include "messages.h"
 #include "object_pools.h"
+#include "registers.h"
 #include "service.h"
+#include "shared_memory.h"
 #include "thread.h"
 #include "timer.h"
+#include "timer_event.h"
 #include "virtual_allocator.h"
 
-// The last assigned process ID.
+// The number of buckets in the hash table of processes by PID. PIDs are
+// handed out in order, so they spread evenly over the buckets.
+#define PROCESS_PID_BUCKETS 1024
+
+// The number of buckets in the hash table of processes by name.
+#define PROCESS_NAME_BUCKETS 256
+
+// The last assigned process ID. PIDs are never reused.
 size_t last_assigned_pid;
 
 //  Linked list of processes that are running.
 struct Process *first_process;
 struct Process *last_process;
 
+// Hash table of processes, keyed by PID.
+struct Process *processes_by_pid[PROCESS_PID_BUCKETS];
+
+// The running processes, sorted by PID.
+struct AATree process_tree_by_pid;
+
+// Hash table of processes, keyed by name. Each bucket is sorted by PID, and
+// has a pointer to its last process so new processes can be added to the end.
+struct Process *first_process_by_name[PROCESS_NAME_BUCKETS];
+struct Process *last_process_by_name[PROCESS_NAME_BUCKETS];
+
+// Sorts process_tree_by_pid.
+static size_t CalculateProcessPid(struct AATreeNode* node) {
+	return ((struct Process*)((size_t)node -
+		__builtin_offsetof(struct Process, node_by_pid)))->pid;
+}
+
+// Returns the bucket in processes_by_pid for a PID.
+static struct Process** GetProcessPidBucket(size_t pid) {
+	return &processes_by_pid[pid % PROCESS_PID_BUCKETS];
+}
+
+// Returns the index of the bucket in processes_by_name for a name (which must
+// be an array of length PROCESS_NAME_LENGTH).
+static size_t GetProcessNameBucket(const char* name) {
+	size_t hash = 0;
+	for (int word = 0; word < PROCESS_NAME_WORDS; word++)
+		hash = (hash ^ ((size_t*)name)[word]) * 0x9E3779B97F4A7C15;
+	return (hash >> 32) % PROCESS_NAME_BUCKETS;
+}
+
+// Adds a process to the hash table of processes by name, keeping the bucket
+// sorted by PID.
+static void AddProcessToNameIndex(struct Process* process) {
+	size_t bucket = GetProcessNameBucket(process->name);
+
+	// New processes have the highest PID, so this rarely has to walk.
+	struct Process* previous = last_process_by_name[bucket];
+	while (previous != NULL && previous->pid > process->pid)
+		previous = previous->previous_with_same_name_hash;
+
+	process->previous_with_same_name_hash = previous;
+	if (previous == NULL) {
+		process->next_with_same_name_hash = first_process_by_name[bucket];
+		first_process_by_name[bucket] = process;
+	} else {
+		process->next_with_same_name_hash = previous->next_with_same_name_hash;
+		previous->next_with_same_name_hash = process;
+	}
+
+	if (process->next_with_same_name_hash == NULL)
+		last_process_by_name[bucket] = process;
+	else
+		process->next_with_same_name_hash->previous_with_same_name_hash =
+			process;
+}
+
+// Removes a process from the hash table of processes by name.
+static void RemoveProcessFromNameIndex(struct Process* process) {
+	size_t bucket = GetProcessNameBucket(process->name);
+	if (process->previous_with_same_name_hash == NULL)
+		first_process_by_name[bucket] = process->next_with_same_name_hash;
+	else
+		process->previous_with_same_name_hash->next_with_same_name_hash =
+			process->next_with_same_name_hash;
+
+	if (process->next_with_same_name_hash == NULL)
+		last_process_by_name[bucket] = process->previous_with_same_name_hash;
+	else
+		process->next_with_same_name_hash->previous_with_same_name_hash =
+			process->previous_with_same_name_hash;
+}
+
 // Initializes the internal structures for tracking processes.
 void InitializeProcesses() {
 	last_assigned_pid = 0;
 	first_process = NULL;
 	last_process = NULL;
+	for (int i = 0; i < PROCESS_PID_BUCKETS; i++)
+		processes_by_pid[i] = NULL;
+	InitializeAATree(&process_tree_by_pid, CalculateProcessPid);
+	for (int i = 0; i < PROCESS_NAME_BUCKETS; i++) {
+		first_process_by_name[i] = NULL;
+		last_process_by_name[i] = NULL;
+	}
 }
 
 // Creates a process, returns ERROR if there was an error.
 struct Process *CreateProcess(bool is_driver) {
 	// Create a memory space for it.
-	struct Process *proc = malloc(sizeof(struct Process));
+	struct Process *proc = AllocateProcess();
 	if(proc == 0) {
 		// Out of memory.
 		return (struct Process *)ERROR;
@@ -42,16 +131,23 @@ struct Process *CreateProcess(bool is_driver) {
 	// Allocate an address space.
 	proc->pml4 = CreateAddressSpace();
 	if(proc->pml4 == OUT_OF_MEMORY) {
-		free(proc);
+		ReleaseProcess(proc);
 		return (struct Process *)ERROR;
 	}
-	proc->allocated_pages = 0;
-
 
 	// Various linked lists of that should be initialized to NULL.
 	proc->next_message = NULL;
 	proc->last_message = NULL;
 	proc->messages_queued = 0;
+	memset((unsigned char*)proc->messages_queued_by_sender, 0,
+		sizeof(proc->messages_queued_by_sender));
+	proc->next_priority_message = NULL;
+	proc->last_priority_message = NULL;
+	proc->priority_messages_queued = 0;
+	memset((unsigned char*)proc->priority_messages_queued_by_sender, 0,
+		sizeof(proc->priority_messages_queued_by_sender));
+	proc->messages_dropped = 0;
+	proc->messages_coalesced = 0;
 	proc->thread_sleeping_for_message = NULL;
 	proc->message_to_fire_on_interrupt = NULL;
 	proc->processes_to_notify_when_i_die = NULL;
@@ -81,6 +177,13 @@ struct Process *CreateProcess(bool is_driver) {
 
 	proc->next = NULL;
 
+	// Add to the indices for looking up processes.
+	struct Process** bucket = GetProcessPidBucket(proc->pid);
+	proc->next_with_same_pid_hash = *bucket;
+	*bucket = proc;
+	InsertNodeIntoAATree(&process_tree_by_pid, &proc->node_by_pid);
+	AddProcessToNameIndex(proc);
+
 	return proc;
 }
 
@@ -172,8 +275,16 @@ void DestroyProcess(struct Process *process) {
 		process->next->previous = process->previous;
 	}
 
+	// Remove from the indices.
+	struct Process** bucket = GetProcessPidBucket(process->pid);
+	while (*bucket != process)
+		bucket = &(*bucket)->next_with_same_pid_hash;
+	*bucket = process->next_with_same_pid_hash;
+	RemoveNodeFromAATree(&process_tree_by_pid, &process->node_by_pid);
+	RemoveProcessFromNameIndex(process);
+
 	// Free the process.
-	free(process);
+	ReleaseProcess(process);
 }
 
 // Registers that a process wants to be notified if another process dies.
@@ -201,26 +312,132 @@ extern void NotifyProcessOnDeath(struct Process* target,
 // Returns a process with the provided pid, returns NULL if it doesn't
 // exist.
 struct Process *GetProcessFromPid(size_t pid) {
-	// Walk through the linked list to find our process.
-	for (struct Process *proc = first_process; proc != NULL; proc = proc->next)
+	for (struct Process *proc = *GetProcessPidBucket(pid); proc != NULL;
+		proc = proc->next_with_same_pid_hash)
 		if(proc->pid == pid)
 			return proc;
 
 	return (struct Process *)NULL;
 }
 
+// Sets the name of a process. Process names must be set with this so the
+// process can be found by its name.
+void SetProcessName(struct Process* process, const char* name,
+	size_t name_length) {
+	RemoveProcessFromNameIndex(process);
+	memset((unsigned char*)process->name, 0, PROCESS_NAME_LENGTH);
+	CopyString((const unsigned char*)name, PROCESS_NAME_LENGTH, name_length,
+		(unsigned char*)process->name);
+	AddProcessToNameIndex(process);
+}
+
+// Returns the number of pages that a process owns in its address space.
+size_t GetPagesOwnedByProcess(struct Process* process) {
+	size_t owned_pages, page_table_pages;
+	CountPagesInAddressSpace(process->pml4, &owned_pages, &page_table_pages);
+	return owned_pages;
+}
+
+// Returns the number of pages sent to a process in messages that are queued.
+// The pages are already mapped into the process, but the process doesn't know
+// about them until it receives the message.
+static size_t CountPagesInQueuedMessages(struct Message* message) {
+	size_t pages = 0;
+	for (; message != NULL; message = message->next_message) {
+		if (IsPagingMessage(message->metadata))
+			pages += message->param5;
+	}
+	return pages;
+}
+
+// Returns the number of bytes of kernel objects that exist because of a
+// process.
+static size_t CountKernelObjectBytesForProcess(struct Process* process) {
+	size_t bytes = sizeof(struct Process) + sizeof(struct VirtualAddressSpace);
+
+	bytes += process->thread_count *
+		(sizeof(struct Thread) + sizeof(struct Registers));
+	bytes += (process->messages_queued + process->priority_messages_queued) *
+		sizeof(struct Message);
+
+	for (struct Service* service = process->first_service; service != NULL;
+		service = service->next_service_in_process)
+		bytes += sizeof(struct Service);
+
+	for (struct SharedMemoryInProcess* shared_memory = process->shared_memory;
+		shared_memory != NULL; shared_memory = shared_memory->next_in_process)
+		bytes += sizeof(struct SharedMemoryInProcess);
+
+	for (struct TimerEvent* timer_event = process->timer_event;
+		timer_event != NULL;
+		timer_event = timer_event->next_timer_event_in_process)
+		bytes += sizeof(struct TimerEvent);
+
+	for (struct ProcessToNotifyOnExit* notification =
+		process->processes_i_want_to_be_notified_of_when_they_die;
+		notification != NULL; notification = notification->next_in_notifyee)
+		bytes += sizeof(struct ProcessToNotifyOnExit);
+
+	for (struct ProcessToNotifyWhenServiceAppears* notification =
+		process->services_i_want_to_be_notified_of_when_they_appear;
+		notification != NULL;
+		notification = notification->next_notification_in_process)
+		bytes += sizeof(struct ProcessToNotifyWhenServiceAppears);
+
+	return bytes;
+}
+
+// Populates the registers with the memory statistics of a process, for the
+// GET_PROCESS_MEMORY_STATISTICS syscall.
+void PopulateRegistersWithProcessMemoryStatistics(struct Process* process,
+	struct Registers* regs) {
+	if (process == NULL) {
+		regs->rax = 0;
+		return;
+	}
+
+	size_t owned_pages, page_table_pages;
+	CountPagesInAddressSpace(process->pml4, &owned_pages, &page_table_pages);
+
+	// Shared memory is mapped without being owned, so it's counted separately
+	// depending on who created it.
+	size_t shared_pages_created = 0;
+	size_t shared_pages_joined = 0;
+	for (struct SharedMemoryInProcess* shared_memory_in_process =
+		process->shared_memory; shared_memory_in_process != NULL;
+		shared_memory_in_process = shared_memory_in_process->next_in_process) {
+		struct SharedMemory* shared_memory =
+			shared_memory_in_process->shared_memory;
+		if (shared_memory->creator_pid == process->pid)
+			shared_pages_created += shared_memory->size_in_pages;
+		else
+			shared_pages_joined += shared_memory->size_in_pages;
+	}
+
+	regs->rax = 1;
+	regs->rbx = owned_pages;
+	regs->rdx = shared_pages_created;
+	regs->rsi = shared_pages_joined;
+	regs->r8 = page_table_pages;
+	regs->r9 = CountPagesInQueuedMessages(process->next_message) +
+		CountPagesInQueuedMessages(process->next_priority_message);
+	regs->r10 = CountKernelObjectBytesForProcess(process);
+}
+
 // Returns a process with the provided pid, and if it doesn't exist, returns
 // the process with the next highest pid. Returns NULL if no process exists
 // with a pid >= pid.
 struct Process *GetProcessOrNextFromPid(size_t pid) {
-	// Walk through the linked list to find our process.
-	struct Process *proc = first_process;
-	for (struct Process *proc = first_process; proc != NULL; proc = proc->next) {
-		if(proc->pid >= pid)
-			return proc;
-	}
-
-	return (struct Process *)NULL;
+	struct Process *proc = GetProcessFromPid(pid);
+	if (proc != NULL)
+		return proc;
+
+	struct AATreeNode* node =
+		SearchForNodeGreaterThanOrEqualToValue(&process_tree_by_pid, pid);
+	if (node == NULL)
+		return (struct Process *)NULL;
+	return (struct Process*)((size_t)node -
+		__builtin_offsetof(struct Process, node_by_pid));
 }
 
 // Do two process names (of length PROCESS_NAME_LENGTH) match?
@@ -238,16 +455,33 @@ bool DoProcessNamesMatch(const char* a, const char* b) {
 // with the provided name.
 struct Process* FindNextProcessWithName(const char* name,
 	struct Process* start_from) {
-	struct Process* potential_process = start_from;
-	// Loop over every process.
+	if (start_from == NULL)
+		return NULL;
+
+	// Only the processes in the name's bucket can have the name.
+	struct Process* potential_process =
+		first_process_by_name[GetProcessNameBucket(name)];
 	while (potential_process != NULL) {
-		if (DoProcessNamesMatch(name, potential_process->name))
+		if (potential_process->pid >= start_from->pid &&
+			DoProcessNamesMatch(name, potential_process->name))
 			// We found a process with this name!
 			return potential_process;
 		// Try the next process.
-		potential_process = potential_process->next;
+		potential_process = potential_process->next_with_same_name_hash;
 	}
 
 	// No process was found with the name.
 	return NULL;
 }
+
+// Returns the next process after this one with the same name. Returns NULL if
+// there are no more processes with the name.
+struct Process* FindNextProcessWithSameName(struct Process* process) {
+	for (struct Process* potential_process = process->next_with_same_name_hash;
+		potential_process != NULL;
+		potential_process = potential_process->next_with_same_name_hash) {
+		if (DoProcessNamesMatch(process->name, potential_process->name))
+			return potential_process;
+	}
+	return NULL;
+}
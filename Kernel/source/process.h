@@ -1,4 +1,5 @@
 #pragma once
+#include "aa_tree.h"
 #include "types.h"
 /*
 struct reg128 {
@@ -10,10 +11,15 @@ typedef size_t reg64;*/
 #define PROCESS_NAME_WORDS 11
 #define PROCESS_NAME_LENGTH (PROCESS_NAME_WORDS * 8)
 
+// The number of buckets that senders are hashed into (by PID), to limit how
+// many messages each sender can have queued in a process.
+#define MESSAGE_SENDER_BUCKETS 64
+
 struct MessageToFireOnInterrupt;
 struct Message;
 struct Process;
 struct ProcessToNotifyWhenServiceAppears;
+struct Registers;
 struct Service;
 struct SharedMemoryInProcess;
 struct Thread;
@@ -51,14 +57,28 @@ struct Process {
 	// The physical address of this process's pml4. This represents the virtual
 	// address space that is unique to this process.
 	size_t pml4;
-	// The number of allocated pages.
-	size_t allocated_pages; // The number of allocated pages.
 
 	// Linked list of messages waiting send to this process, waiting to be consumed.
 	struct Message* next_message;
 	struct Message* last_message;
 	// Number of messages queued.
 	size_t messages_queued;
+	// Number of messages queued from each bucket of senders.
+	uint16 messages_queued_by_sender[MESSAGE_SENDER_BUCKETS];
+	// Linked list of high priority messages (RPC replies and messages from the
+	// kernel), which are consumed before any other queued messages.
+	struct Message* next_priority_message;
+	struct Message* last_priority_message;
+	// Number of high priority messages queued.
+	size_t priority_messages_queued;
+	// Number of high priority messages queued from each bucket of senders,
+	// not counting messages from the kernel.
+	uint16 priority_messages_queued_by_sender[MESSAGE_SENDER_BUCKETS];
+	// Number of messages that were dropped because a queue was full.
+	size_t messages_dropped;
+	// Number of messages that replaced a queued message instead of being
+	// queued.
+	size_t messages_coalesced;
 	// Linked queue of threads that are currently sleeping and waiting for a message.
 	struct Thread *thread_sleeping_for_message;
 
@@ -70,10 +90,22 @@ struct Process {
 	// Number of threads this process has..
 	unsigned short thread_count;
 
-	// Linked list of processes.
+	// Linked list of processes, sorted by PID.
 	struct Process *next;
 	struct Process *previous;
 
+	// The next process in the same bucket of processes_by_pid.
+	struct Process *next_with_same_pid_hash;
+
+	// Node in the tree of processes sorted by PID, for finding the process
+	// with the next highest PID.
+	struct AATreeNode node_by_pid;
+
+	// Linked list of processes in the same bucket of processes_by_name, sorted
+	// by PID.
+	struct Process *next_with_same_name_hash;
+	struct Process *previous_with_same_name_hash;
+
 	// Linked lists of processes to notify when I die.
 	struct ProcessToNotifyOnExit* processes_to_notify_when_i_die;
 	// Linked lists of processes I want to be notified of when they die.
@@ -111,6 +143,19 @@ extern void NotifyProcessOnDeath(struct Process* target,
 // Returns a process with the provided pid, returns NULL if it doesn't exist.
 extern struct Process *GetProcessFromPid(size_t pid);
 
+// Sets the name of a process. Process names must be set with this so the
+// process can be found by its name.
+extern void SetProcessName(struct Process* process, const char* name,
+	size_t name_length);
+
+// Returns the number of pages that a process owns in its address space.
+extern size_t GetPagesOwnedByProcess(struct Process* process);
+
+// Populates the registers with the memory statistics of a process, for the
+// GET_PROCESS_MEMORY_STATISTICS syscall.
+extern void PopulateRegistersWithProcessMemoryStatistics(
+	struct Process* process, struct Registers* regs);
+
 // Returns a process with the provided pid, and if it doesn't exist, returns
 // the process with the next highest pid. Returns NULL if no process exists
 // with a pid >= pid.
@@ -121,3 +166,7 @@ extern struct Process *GetProcessOrNextFromPid(size_t pid);
 // with the provided name. `start_from` is inclusive.
 extern struct Process* FindNextProcessWithName(const char* name,
 	struct Process* start_from);
+
+// Returns the next process after this one with the same name. Returns NULL if
+// there are no more processes with the name.
+extern struct Process* FindNextProcessWithSameName(struct Process* process);
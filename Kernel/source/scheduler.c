@@ -1,159 +1,376 @@
 #include "scheduler.h"
 
+#include "cpu.h"
+#include "fpu.h"
 #include "interrupts.h"
 #include "liballoc.h"
+#include "local_apic.h"
 #include "thread.h"
 #include "process.h"
 #include "registers.h"
 #include "text_terminal.h"
+#include "timer.h"
 #include "virtual_allocator.h"
 
 // Uncomment for debug printing.
 // #define DEBUG
 
-// Linked list of awake threads we can cycle through.
-struct Thread *first_awake_thread;
-struct Thread *last_awake_thread;
+// The number of time slices between boosting every awake thread back to the
+// highest priority, so threads that have been demoted can't be starved.
+#define TIME_SLICES_BETWEEN_PRIORITY_BOOSTS 100
 
-// The currently executing thread. This can be NULL if all threads are asleep.
-struct Thread *running_thread;
-
-// The idle registers to return to when no thread is awake. (This points us to
-// the while(true) {hlt} in kmain.)
-struct Registers *idle_regs;
+void InitializeScheduler() {
+	InitializeSchedulerForCpu(GetCurrentCpu());
+}
 
-// Currently executing registers.
-struct Registers *currently_executing_thread_regs;
+// Initializes the scheduler's state for a CPU.
+void InitializeSchedulerForCpu(struct Cpu* cpu) {
+	for (int priority = 0; priority < NUMBER_OF_PRIORITY_LEVELS; priority++) {
+		cpu->first_awake_thread[priority] = NULL;
+		cpu->last_awake_thread[priority] = NULL;
+	}
+	cpu->priority_levels_with_awake_threads = 0;
+	cpu->awake_threads = 0;
+	cpu->time_slices = 0;
+	cpu->time_slices_since_priority_boost = 0;
+	cpu->thread = NULL;
+	cpu->thread_receiving_time_slice = NULL;
+	cpu->running_thread_was_evicted = false;
 
-void InitializeScheduler() {
-	first_awake_thread = NULL;
-	last_awake_thread = NULL;
-	running_thread = NULL;
-	currently_executing_thread_regs = malloc(sizeof(struct Registers));
-	if (!currently_executing_thread_regs) {
+	// The idle registers to return to when no thread is awake. (This points us
+	// to the while(true) {hlt} loop the CPU idles in.)
+	cpu->idle_regs = malloc(sizeof(struct Registers));
+	if (!cpu->idle_regs) {
 		PrintString("Could not allocate object to store the kernel's registers.");
 		__asm__ __volatile__("cli");
 		__asm__ __volatile__("hlt");
 	}
-	idle_regs = currently_executing_thread_regs;
+	cpu->regs = cpu->idle_regs;
+}
+
+// Adds a thread to the back of a CPU's queue for its priority level.
+static void AddThreadToRunQueue(struct Cpu *cpu, struct Thread *thread) {
+	size_t priority = thread->priority;
+	thread->cpu = cpu;
+	thread->next_awake = NULL;
+	thread->previous_awake = cpu->last_awake_thread[priority];
+
+	if (cpu->last_awake_thread[priority]) {
+		cpu->last_awake_thread[priority]->next_awake = thread;
+	} else {
+		cpu->first_awake_thread[priority] = thread;
+		cpu->priority_levels_with_awake_threads |= (size_t)1 << priority;
+	}
+	cpu->last_awake_thread[priority] = thread;
+	cpu->awake_threads++;
+}
+
+// Adds a thread to the front of a CPU's queue for its priority level.
+static void AddThreadToFrontOfRunQueue(struct Cpu *cpu, struct Thread *thread) {
+	size_t priority = thread->priority;
+	thread->cpu = cpu;
+	thread->previous_awake = NULL;
+	thread->next_awake = cpu->first_awake_thread[priority];
+
+	if (cpu->first_awake_thread[priority]) {
+		cpu->first_awake_thread[priority]->previous_awake = thread;
+	} else {
+		cpu->last_awake_thread[priority] = thread;
+		cpu->priority_levels_with_awake_threads |= (size_t)1 << priority;
+	}
+	cpu->first_awake_thread[priority] = thread;
+	cpu->awake_threads++;
+}
+
+// Removes a thread from its CPU's queue for its priority level.
+static void RemoveThreadFromRunQueue(struct Thread *thread) {
+	struct Cpu *cpu = thread->cpu;
+	size_t priority = thread->priority;
+	if (thread->next_awake) {
+		thread->next_awake->previous_awake = thread->previous_awake;
+	} else {
+		cpu->last_awake_thread[priority] = thread->previous_awake;
+	}
+
+	if (thread->previous_awake) {
+		thread->previous_awake->next_awake = thread->next_awake;
+	} else {
+		cpu->first_awake_thread[priority] = thread->next_awake;
+	}
+
+	if (cpu->first_awake_thread[priority] == NULL) {
+		cpu->priority_levels_with_awake_threads &= ~((size_t)1 << priority);
+	}
+	cpu->awake_threads--;
+}
+
+// Returns the highest priority level that has an awake thread. Only valid if
+// the CPU's priority_levels_with_awake_threads is not 0.
+static size_t HighestPriorityLevelWithAwakeThreads(struct Cpu *cpu) {
+	return __builtin_ctzl(cpu->priority_levels_with_awake_threads);
+}
+
+// Moves every awake thread on a CPU up to the highest priority level.
+static void BoostPriorityOfAllAwakeThreads(struct Cpu *cpu) {
+	for (size_t priority = 1; priority < NUMBER_OF_PRIORITY_LEVELS; priority++) {
+		while (cpu->first_awake_thread[priority] != NULL) {
+			struct Thread *thread = cpu->first_awake_thread[priority];
+			RemoveThreadFromRunQueue(thread);
+			thread->priority = 0;
+			AddThreadToRunQueue(cpu, thread);
+		}
+	}
+}
 
+// Returns the number of threads on a CPU that are waiting to run.
+static size_t ThreadsWaitingToRun(struct Cpu *cpu) {
+	if (cpu->thread != NULL && cpu->thread->awake)
+		return cpu->awake_threads - 1;
+	else
+		return cpu->awake_threads;
 }
 
-// Initializes the scheduler.
+// Moves a thread from the busiest CPU into this CPU's queues. Returns false
+// if there were no threads to steal.
+static bool StealThread(struct Cpu *this_cpu) {
+	// Find the CPU with the most threads waiting to run.
+	struct Cpu *victim = NULL;
+	size_t most_threads_waiting_to_run = 0;
+	for (size_t i = 0; i < number_of_cpus; i++) {
+		struct Cpu *cpu = &cpus[i];
+		if (cpu == this_cpu || !cpu->is_online)
+			continue;
+		size_t threads_waiting_to_run = ThreadsWaitingToRun(cpu);
+		if (threads_waiting_to_run > most_threads_waiting_to_run) {
+			victim = cpu;
+			most_threads_waiting_to_run = threads_waiting_to_run;
+		}
+	}
+
+	if (victim == NULL)
+		return false;
+
+	// Take the thread at the back of the lowest priority queue, which has
+	// waited the longest until it would run on the other CPU.
+	for (int priority = NUMBER_OF_PRIORITY_LEVELS - 1; priority >= 0; priority--) {
+		struct Thread *thread = victim->last_awake_thread[priority];
+		if (thread == victim->thread) {
+			// Don't steal the thread the other CPU is running.
+			thread = thread->previous_awake;
+		}
+		if (thread != NULL) {
+			RemoveThreadFromRunQueue(thread);
+			AddThreadToRunQueue(this_cpu, thread);
+#ifdef DEBUG
+			PrintString("CPU "); PrintNumber(this_cpu->id);
+			PrintString(" stole tid "); PrintNumber(thread->id);
+			PrintString(" from CPU "); PrintNumber(victim->id);
+			PrintChar('\n');
+#endif
+			return true;
+		}
+	}
+	return false;
+}
+
+// Schedule the next thread.
 void ScheduleNextThread() {
+	struct Cpu *cpu = GetCurrentCpu();
 	// The next thread to switch to.
 	struct Thread *next;
 
-	if(running_thread) {
+	// If another CPU evicted our thread, it's already been taken out of our
+	// queue and there's nothing to save.
+	cpu->running_thread_was_evicted = false;
+
+	struct Thread *thread_receiving_time_slice =
+		cpu->thread_receiving_time_slice;
+	cpu->thread_receiving_time_slice = NULL;
+
+	// Save the FPU registers if the thread we're leaving used them, so the
+	// next thread to use them faults.
+	ReleaseFpu(cpu);
+
+	if(cpu->thread) {
 		// We were currently executing a thread.
 #ifdef DEBUG
-		PrintString("Leaving tid "); PrintNumber(running_thread->id);
-		PrintString(" pid "); PrintNumber(running_thread->process->pid);
+		PrintString("Leaving tid "); PrintNumber(cpu->thread->id);
+		PrintString(" pid "); PrintNumber(cpu->thread->process->pid);
 		PrintChar('\n');
-		PrintRegisters(currently_executing_thread_regs);
+		PrintRegisters(cpu->regs);
 #endif
-		if (running_thread->uses_fpu_registers) {
-			asm volatile("fxsave %0"::"m"(*running_thread->fpu_registers));
-		}
-
-		// Move to the next awake thread.
-		next = running_thread->next_awake;
-		if(!next) {
-			// We reached the end of the line. Switch back to the first awake thread.
-			next = first_awake_thread;
+		if (cpu->thread->awake) {
+			// Move to the back of the queue so we round robin between threads
+			// of the same priority.
+			RemoveThreadFromRunQueue(cpu->thread);
+			AddThreadToRunQueue(cpu, cpu->thread);
 		}
-
-	} else {
-		// We were in the kernel's idle thread. Attempt to switch to the first awake thread.
-		next = first_awake_thread;
 	}
 
-	if (!next) {
+	if (cpu->priority_levels_with_awake_threads == 0 && !StealThread(cpu)) {
 		// If there's no next thread, we'll return to the kernel's idle thread.
-		running_thread = 0;
-		currently_executing_thread_regs = idle_regs;
+		cpu->thread = 0;
+		cpu->regs = cpu->idle_regs;
 		SwitchToAddressSpace(kernel_pml4);
+		// Only wake up if there's a timer event.
+		ProgramTimerForNextDeadline();
 #ifdef DEBUG
 		PrintString("Kernel idle thread\n");
 #endif
 		return;
 	}
 
+	// Pick the thread at the front of the highest priority queue.
+	next = cpu->first_awake_thread[HighestPriorityLevelWithAwakeThreads(cpu)];
+
 	/* enter the next thread */
-	running_thread = next;
-	running_thread->time_slices++;
+	cpu->thread = next;
+	next->time_slices++;
 
-	SwitchToAddressSpace(running_thread->process->pml4);
+	SwitchToAddressSpace(next->process->pml4);
 
-	if (running_thread->uses_fpu_registers) {
-		asm volatile("fxrstor %0"::"m"(*running_thread->fpu_registers));
-	}
-	LoadThreadSegment(running_thread);
+	LoadThreadSegment(next);
+
+	cpu->regs = next->registers;
 
-	currently_executing_thread_regs = running_thread->registers;
+	size_t now = GetCurrentTimestampInMicroseconds();
+	if (next != thread_receiving_time_slice || cpu->time_slice_ends_at <= now) {
+		// Give the thread a full time slice. (Otherwise, it continues the time
+		// slice of the thread that handed the CPU to it.)
+		cpu->time_slice_ends_at = now + TIME_SLICE_MICROSECONDS;
+	}
+	ProgramTimerForNextDeadline();
 
 #ifdef DEBUG
-	PrintString("Entering tid "); PrintNumber(running_thread->id);
-	PrintString(" pid "); PrintNumber(running_thread->process->pid);
-	PrintString(" for time "); PrintNumber(running_thread->time_slices++);
+	PrintString("CPU "); PrintNumber(cpu->id);
+	PrintString(" entering tid "); PrintNumber(next->id);
+	PrintString(" pid "); PrintNumber(next->process->pid);
+	PrintString(" at priority "); PrintNumber(next->priority);
+	PrintString(" for time "); PrintNumber(next->time_slices);
 	PrintChar('\n');
-	PrintRegisters(currently_executing_thread_regs);
+	PrintRegisters(cpu->regs);
 	PrintChar('\n');
 #endif
 }
 
+// Called by the timer when the running thread has used up its time slice.
+void PreemptRunningThread() {
+	struct Cpu *cpu = GetCurrentCpu();
+	cpu->time_slices++;
+
+	if (cpu->thread != NULL && cpu->thread->awake &&
+		cpu->thread->priority < NUMBER_OF_PRIORITY_LEVELS - 1) {
+		// The thread used its whole time slice, so it's CPU bound. Demote it
+		// so that threads that sleep often get to run first.
+		RemoveThreadFromRunQueue(cpu->thread);
+		cpu->thread->priority++;
+		AddThreadToRunQueue(cpu, cpu->thread);
+	}
+
+	cpu->time_slices_since_priority_boost++;
+	if (cpu->time_slices_since_priority_boost >=
+		TIME_SLICES_BETWEEN_PRIORITY_BOOSTS) {
+		cpu->time_slices_since_priority_boost = 0;
+		BoostPriorityOfAllAwakeThreads(cpu);
+	}
+
+	ScheduleNextThread();
+}
+
+// Returns if a CPU has nothing to do.
+static bool IsCpuIdle(struct Cpu *cpu) {
+	return cpu->is_online && cpu->thread == NULL && cpu->awake_threads == 0;
+}
+
+// Picks the CPU to wake a thread up on.
+static struct Cpu *ChooseCpuForThread(struct Thread *thread) {
+	// Prefer the CPU the thread last ran on, if it's not doing anything, since
+	// its caches might still be warm.
+	if (thread->cpu != NULL && IsCpuIdle(thread->cpu))
+		return thread->cpu;
+
+	// Otherwise, wake up an idle CPU.
+	for (size_t i = 0; i < number_of_cpus; i++) {
+		if (IsCpuIdle(&cpus[i]))
+			return &cpus[i];
+	}
+
+	if (thread->cpu != NULL && thread->cpu->is_online)
+		return thread->cpu;
+	else
+		return GetCurrentCpu();
+}
+
 void ScheduleThread(struct Thread *thread) {
-	//lock_interrupts();
 	if(thread->awake) {
-	//	unlock_interrupts();
 		return;
 	}
 
 	thread->awake = true;
 
-	thread->next_awake = 0;
-	thread->previous_awake = last_awake_thread;
+	// Threads that have been sleeping (such as waiting for a message) get
+	// boosted to the highest priority so that they respond quickly.
+	thread->priority = 0;
 
-	if(last_awake_thread) {
-		last_awake_thread->next_awake = thread;
-		last_awake_thread = thread;
-	} else {
-		first_awake_thread = thread;
-		last_awake_thread = thread;
+	struct Cpu *cpu = ChooseCpuForThread(thread);
+	AddThreadToRunQueue(cpu, thread);
+
+	if (cpu != GetCurrentCpu() &&
+		(cpu->thread == NULL || cpu->thread->priority > thread->priority)) {
+		// Let the other CPU know it should switch to this thread. (The CPU
+		// we're running on checks when it leaves the kernel.)
+		SendRescheduleInterrupt(cpu);
 	}
-	//unlock_interrupts();
 }
 
-void UnscheduleThread(struct Thread *thread) {
-	if(!thread->awake) {
+// Wakes up a thread and puts it at the front of this CPU's queues, so it's the
+// thread that runs next when the running thread goes to sleep or yields.
+void ScheduleThreadToRunNext(struct Thread *thread) {
+	if(thread->awake) {
 		return;
 	}
 
-	thread->awake = false;
+	thread->awake = true;
+	thread->priority = 0;
 
-	if(thread->next_awake) {
-		thread->next_awake->previous_awake = thread->previous_awake;
-	} else {
-		last_awake_thread = thread->previous_awake;
-	}
+	struct Cpu *cpu = GetCurrentCpu();
+	AddThreadToFrontOfRunQueue(cpu, thread);
+	cpu->thread_receiving_time_slice = thread;
+}
 
-	if(thread->previous_awake) {
-		thread->previous_awake->next_awake = thread->next_awake;
-	} else {
-		first_awake_thread = thread->next_awake;
+void UnscheduleThread(struct Thread *thread) {
+	if(!thread->awake) {
+		return;
 	}
 
-	if (thread == running_thread) {
-		ScheduleNextThread();
+	thread->awake = false;
+	struct Cpu *cpu = thread->cpu;
+	RemoveThreadFromRunQueue(thread);
+
+	if (thread == cpu->thread) {
+		if (cpu == GetCurrentCpu()) {
+			ScheduleNextThread();
+		} else {
+			EvictRunningThreadFromCpu(cpu);
+		}
 	}
 }
 
-
-// Schedules a thread if we are currently halted - such as an interrupt
-// woke up a thread.
-void ScheduleThreadIfWeAreHalted() {
-	if (running_thread == NULL && first_awake_thread != NULL) {
-		// No thread was running, but there is a thread waiting to run.
+// Schedules a thread if we are currently halted, or if a thread with a higher
+// priority than the running thread has woken up - such as an interrupt woke
+// up a thread.
+void ScheduleThreadIfWeAreHaltedOrPreempted() {
+	struct Cpu *cpu = GetCurrentCpu();
+	if (cpu->thread == NULL) {
+		// No thread was running (or it was evicted by another CPU), but there
+		// might be a thread waiting to run here or on another CPU.
+		if (cpu->running_thread_was_evicted ||
+			cpu->priority_levels_with_awake_threads != 0 ||
+			number_of_cpus > 1)
+			ScheduleNextThread();
+	} else if (cpu->priority_levels_with_awake_threads != 0 &&
+		HighestPriorityLevelWithAwakeThreads(cpu) < cpu->thread->priority) {
+		// A more important thread is waiting to run.
 		ScheduleNextThread();
 	}
-}
\ No newline at end of file
+}
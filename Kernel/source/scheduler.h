@@ -1,24 +1,47 @@
 #pragma once
+#include "cpu.h"
 #include "types.h" 
 
 struct Thread;
 struct Registers;
 
-// The currently running thread.
-extern struct Thread *running_thread;
+// Each CPU has its own queues of awake threads, and CPUs that run out of
+// threads steal threads from the busiest CPU.
 
-// Currently executing registers.
-extern struct Registers *currently_executing_thread_regs;
+// The thread running on the CPU we're executing on.
+#define running_thread (GetCurrentCpu()->thread)
+
+// The registers of the thread running on the CPU we're executing on.
+#define currently_executing_thread_regs (GetCurrentCpu()->regs)
 
 // Initializes the scheduler.
 extern void InitializeScheduler();
 
-// Schedule the next thread, called from the timer inerrupt.
+// Initializes the scheduler's state for a CPU.
+extern void InitializeSchedulerForCpu(struct Cpu* cpu);
+
+// Schedule the next thread.
 extern void ScheduleNextThread();
 
+// Called by the timer when the running thread has used up its time slice.
+// Lowers the thread's priority and schedules the next thread.
+extern void PreemptRunningThread();
+
+// Wakes up a thread and boosts it to the highest priority.
 extern void ScheduleThread(struct Thread *thread);
+
+// Wakes up a thread and puts it at the front of this CPU's queues, so it's the
+// thread that runs next when the running thread goes to sleep or yields. The
+// thread gets the rest of the running thread's time slice, rather than waiting
+// for its turn.
+extern void ScheduleThreadToRunNext(struct Thread *thread);
+
+// Puts a thread to sleep. If the thread is running on another CPU, it is
+// evicted from that CPU without its registers being saved, so this should
+// only be done to a thread running on another CPU when destroying it.
 extern void UnscheduleThread(struct Thread *thread);
 
-// Schedules a thread if we are currently halted - such as an interrupt
-// woke up a thread.
-extern void ScheduleThreadIfWeAreHalted();
\ No newline at end of file
+// Schedules a thread if we are currently halted, or if a thread with a higher
+// priority than the running thread has woken up - such as an interrupt woke
+// up a thread.
+extern void ScheduleThreadIfWeAreHaltedOrPreempted();
@@ -20,12 +20,22 @@
 
 // #define DEBUG
 
+// The number of buckets in the hash table of services by name.
+#define SERVICE_NAME_BUCKETS 256
+
 struct ProcessToNotifyWhenServiceAppears*
 	first_process_to_be_notified_when_a_service_appears = NULL;
 
+// Hash table of services, keyed by name. Each bucket is a linked list of the
+// first service of each name that hashes to it, and each of those is the start
+// of the list of services with that name.
+struct Service* services_by_name[SERVICE_NAME_BUCKETS];
+
 // Initializes the internal structures for tracking services.
 void InitializeServices() {
 	first_process_to_be_notified_when_a_service_appears = NULL;
+	for (int i = 0; i < SERVICE_NAME_BUCKETS; i++)
+		services_by_name[i] = NULL;
 }
 
 // Do two service names (of length SERVICE_NAME_LENGTH) match?
@@ -38,6 +48,113 @@ bool DoServiceNamesMatch(const char* a, const char* b) {
 	return true;
 }
 
+// Returns the index of the bucket in services_by_name for a name (which must
+// be an array of length SERVICE_NAME_LENGTH).
+static size_t GetServiceNameBucket(const char* name) {
+	size_t hash = 0;
+	for (int word = 0; word < SERVICE_NAME_WORDS; word++)
+		hash = (hash ^ ((size_t*)name)[word]) * 0x9E3779B97F4A7C15;
+	return (hash >> 32) % SERVICE_NAME_BUCKETS;
+}
+
+// Returns the link in services_by_name that points to the first service with
+// the name. If there are no services with the name, the link is NULL.
+static struct Service** FindLinkToFirstServiceWithName(const char* name) {
+	struct Service** link = &services_by_name[GetServiceNameBucket(name)];
+	while (*link != NULL && !DoServiceNamesMatch(name, (*link)->service_name))
+		link = &(*link)->next_name_in_bucket;
+	return link;
+}
+
+// Is service 'a' ordered before service 'b' in the list of services with the
+// same name?
+static bool IsServiceBefore(struct Service* a, struct Service* b) {
+	if (a->process->pid != b->process->pid)
+		return a->process->pid < b->process->pid;
+	return a->message_id < b->message_id;
+}
+
+// Adds a service to the hash table of services by name, keeping the services
+// with the same name sorted so callers can page through them.
+static void AddServiceToNameIndex(struct Service* service) {
+	struct Service** link =
+		FindLinkToFirstServiceWithName(service->service_name);
+	struct Service* first_service = *link;
+	if (first_service == NULL) {
+		// This is the first service with this name.
+		service->previous_service_with_same_name = NULL;
+		service->next_service_with_same_name = NULL;
+		service->last_service_with_same_name = service;
+		service->next_name_in_bucket = NULL;
+		*link = service;
+		return;
+	}
+
+	// Services are usually registered with a higher PID or message ID than
+	// the ones before them, so walk backwards from the end.
+	struct Service* previous = first_service->last_service_with_same_name;
+	while (previous != NULL && IsServiceBefore(service, previous))
+		previous = previous->previous_service_with_same_name;
+
+	if (previous == NULL) {
+		// We're the new first service with this name, so take over the
+		// bucket's link.
+		service->previous_service_with_same_name = NULL;
+		service->next_service_with_same_name = first_service;
+		service->last_service_with_same_name =
+			first_service->last_service_with_same_name;
+		service->next_name_in_bucket = first_service->next_name_in_bucket;
+		first_service->previous_service_with_same_name = service;
+		*link = service;
+		return;
+	}
+
+	service->previous_service_with_same_name = previous;
+	service->next_service_with_same_name =
+		previous->next_service_with_same_name;
+	previous->next_service_with_same_name = service;
+	if (service->next_service_with_same_name == NULL) {
+		first_service->last_service_with_same_name = service;
+	} else {
+		service->next_service_with_same_name->
+			previous_service_with_same_name = service;
+	}
+}
+
+// Removes a service from the hash table of services by name.
+static void RemoveServiceFromNameIndex(struct Service* service) {
+	struct Service** link =
+		FindLinkToFirstServiceWithName(service->service_name);
+	struct Service* first_service = *link;
+	struct Service* next = service->next_service_with_same_name;
+
+	if (service == first_service) {
+		if (next == NULL) {
+			// This was the last service with this name.
+			*link = service->next_name_in_bucket;
+			return;
+		}
+
+		// The next service becomes the first service with this name.
+		next->previous_service_with_same_name = NULL;
+		next->last_service_with_same_name =
+			service->last_service_with_same_name;
+		next->next_name_in_bucket = service->next_name_in_bucket;
+		*link = next;
+		return;
+	}
+
+	service->previous_service_with_same_name->next_service_with_same_name =
+		next;
+	if (next == NULL) {
+		first_service->last_service_with_same_name =
+			service->previous_service_with_same_name;
+	} else {
+		next->previous_service_with_same_name =
+			service->previous_service_with_same_name;
+	}
+}
+
 // Registers a service, and notifies anybody listening for new instances
 // of services with this name.
 void RegisterService(char* service_name, struct Process* process,
@@ -64,7 +181,7 @@ void RegisterService(char* service_name, struct Process* process,
 		process->first_service = service;
 		process->last_service = service;
 	} else {
-		// FindNextServiceByPidAndMidWithName depends on the services being
+		// UnregisterServiceByMessageId depends on the services being
 		// sorted in order of their message id. There could exist a scenario
 		// (such as a race condition) where services get registered out of
 		// order. We'll walk backwards from the end to find where to insert
@@ -75,7 +192,8 @@ void RegisterService(char* service_name, struct Process* process,
 			previous_service = previous_service->previous_service_in_process;
 		}
 
-		if (service->message_id == previous_service->message_id) {
+		if (previous_service != NULL &&
+			service->message_id == previous_service->message_id) {
 			// Trying to register multiple services with the same message ID.
 			ReleaseService(service);
 			return;
@@ -96,14 +214,16 @@ void RegisterService(char* service_name, struct Process* process,
 		} else {
 			// Slot us between two processes.
 			service->previous_service_in_process = previous_service;
-			previous_service->next_service_in_process = service;
 			service->next_service_in_process =
 				previous_service->next_service_in_process;
+			previous_service->next_service_in_process = service;
 			service->next_service_in_process->previous_service_in_process =
 				service;
 		}
 	}
 
+	AddServiceToNameIndex(service);
+
 	// Notify everyone listening for this new service.
 	struct ProcessToNotifyWhenServiceAppears* notification =
 		first_process_to_be_notified_when_a_service_appears;
@@ -121,7 +241,7 @@ void RegisterService(char* service_name, struct Process* process,
 // Unregisters a service, and notifies anybody listening.
 void UnregisterServiceByMessageId(struct Process* process, size_t message_id) {
 	struct Service* service = process->first_service;
-	while (service != NULL && message_id <= service->message_id) {
+	while (service != NULL && service->message_id <= message_id) {
 		if (message_id == service->message_id) {
 			return UnregisterService(service);
 		}
@@ -133,6 +253,8 @@ void UnregisterServiceByMessageId(struct Process* process, size_t message_id) {
 void UnregisterService(struct Service* service) {
 	// TODO: Notify everyone listening for this service to die.
 
+	RemoveServiceFromNameIndex(service);
+
 	// Remove from the linked list of services in the process.
 	if (service->previous_service_in_process == NULL)
 		// We are the first service.
@@ -159,42 +281,20 @@ struct Service* FindNextServiceByPidAndMidWithName(
 	char* service_name,
 	size_t min_pid,
 	size_t min_message_id) {
+	struct Service* service = *FindLinkToFirstServiceWithName(service_name);
 
-	struct Process* process = GetProcessOrNextFromPid(min_pid);
-
-	// We only care about starting from this mid if we are continuing
-	// from the same process.
-	if (process->pid != min_pid) min_message_id = 0;
-
-	// We'll return if we find the next process, otherwise keep
-	// looping and scanning the next processes for services.
-	while (process != NULL) {
-		struct Service* service = process->first_service;
-		// Keep looping through services in this process.
-		while (service != NULL) {
-			// Does this message meet our min message id threshold
-			// and also have the same service name that we're looking
-			// for?
-			if (service->message_id >= min_message_id &&
-				DoServiceNamesMatch(service_name,
-					service->service_name)) {
-				// We found a service we're looking for!
-				return service;
-			}
-			service = service->next_service_in_process;
-		}
-
-		// Jump to the next process, and reset the min mid we care
-		// about.
-		process = process->next;
-		min_message_id = 0;
-	}
+	// The services with this name are sorted, so skip over the ones before
+	// the provided process ID and message ID.
+	while (service != NULL && (service->process->pid < min_pid ||
+		(service->process->pid == min_pid &&
+			service->message_id < min_message_id)))
+		service = service->next_service_with_same_name;
 
-	// Couldn't find any more services with this name.
-	return NULL;
+	return service;
 }
 
-// Returns the next service, or NULL if there are no more services.
+// Returns the next service with the same name, or NULL if there are no more
+// services.
 struct Service* FindNextServiceWithName(
 	char* service_name,
 	struct Service* previous_service) {
@@ -202,34 +302,7 @@ struct Service* FindNextServiceWithName(
 	if (previous_service == NULL)
 		return NULL;
 
-	// Remember the process we're starting from.
-	struct Process* process = previous_service->process;
-
-	// Start scanning from the next service, so we don't return
-	// the service passed as input.
-	struct Service* service = previous_service->next_service_in_process;
-
-	// While we still have processes.
-	while (process != NULL) {
-		// While we still have in this process.
-		while (service != NULL) {
-			// Does this service have the same name that we're
-			// looking for?
-			if (DoServiceNamesMatch(service_name,
-					service->service_name)) {
-				// We found a service we're looking for!
-				return service;
-			}
-			// Jump to the next service.
-			service = service->next_service_in_process;
-		}
-
-		// Jump to the next process.
-		process = process->next;
-		if (process != NULL)
-			service = process->first_service;
-	}
-	return NULL;
+	return previous_service->next_service_with_same_name;
 }
 
 // Registers that we want this process to be notified when a service of the
@@ -274,22 +347,15 @@ void NotifyProcessWhenServiceAppears(
 	}
 	process->services_i_want_to_be_notified_of_when_they_appear = notification;
 
-	// Loop through all services and send the process a message for any that
-	// match the name we are listening for.
-	struct Process* process_to_scan = GetProcessOrNextFromPid(0);
-	while (process_to_scan != NULL) {
-		struct Service* service = process_to_scan->first_service;
-		while (service != NULL) {
-			if (DoServiceNamesMatch(service_name,
-					service->service_name)) {
-			SendKernelMessageToProcess(process,
-				message_id,
-				service->process->pid, service->message_id, 0, 0, 0);
-			}
-
-			service = service->next_service_in_process;
-		}
-		process_to_scan = process_to_scan->next;
+	// Send the process a message for each service that has the name we are
+	// listening for.
+	for (struct Service* service =
+			*FindLinkToFirstServiceWithName(service_name);
+		service != NULL;
+		service = service->next_service_with_same_name) {
+		SendKernelMessageToProcess(process,
+			message_id,
+			service->process->pid, service->message_id, 0, 0, 0);
 	}
 }
 
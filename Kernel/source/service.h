@@ -36,6 +36,17 @@ struct Service {
 	// Linked list of registered services in this process.
 	struct Service* previous_service_in_process;
 	struct Service* next_service_in_process;
+
+	// Linked list of registered services with the same name, sorted by
+	// process ID and then message ID.
+	struct Service* previous_service_with_same_name;
+	struct Service* next_service_with_same_name;
+
+	// Only set on the first service with each name: the last service with
+	// this name, and the first service of the next name in the same hash
+	// table bucket.
+	struct Service* last_service_with_same_name;
+	struct Service* next_name_in_bucket;
 };
 
 // Represents a process to notify when a service appears.
@@ -77,7 +88,8 @@ void UnregisterService(struct Service* service);
 struct Service* FindNextServiceByPidAndMidWithName(
 	char* service_name, size_t min_pid, size_t min_message_id);
 
-// Returns the next service, or NULL if there are no more services.
+// Returns the next service with the same name, or NULL if there are no more
+// services.
 struct Service* FindNextServiceWithName(
 	char* service_name,
 	struct Service* previous_service);
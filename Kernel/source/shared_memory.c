@@ -12,6 +12,7 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "liballoc.h"
 #include "object_pools.h"
 #include "physical_allocator.h"
 #include "process.h"
@@ -19,71 +20,89 @@
 #include "text_terminal.h"
 #include "virtual_allocator.h"
 
+// The number of buckets in the hash table of shared memory blocks.
+#define SHARED_MEMORY_BUCKETS 256
+
 // The last assigned shared memory ID.
 size_t last_assigned_shared_memory_id;
 
-// Linked list of all shared memory blocks.
-struct SharedMemory* first_shared_memory;
+// Hash table of all shared memory blocks, keyed by ID.
+struct SharedMemory* shared_memory_by_id[SHARED_MEMORY_BUCKETS];
 
 // Initializes the internal structures for shared memory.
 void InitializeSharedMemory() {
 	last_assigned_shared_memory_id = 0;
-	first_shared_memory = NULL;
+	for (int i = 0; i < SHARED_MEMORY_BUCKETS; i++)
+		shared_memory_by_id[i] = NULL;
+}
+
+// Returns the hash table bucket for a shared memory ID. IDs are assigned
+// sequentially, so they spread evenly over the buckets.
+static struct SharedMemory** GetSharedMemoryBucket(size_t shared_memory_id) {
+	return &shared_memory_by_id[shared_memory_id % SHARED_MEMORY_BUCKETS];
 }
 
 // Creates a shared memory block.
-struct SharedMemory* CreateSharedMemoryBlock(size_t pages) {
+struct SharedMemory* CreateSharedMemoryBlock(size_t pages, bool large_pages) {
+	// The number of pages comes from userland. We couldn't allocate more pages
+	// than are free anyway, and this keeps the size of physical_pages from
+	// overflowing.
+	if (pages == 0 || pages > free_pages) {
+		return NULL;
+	}
+
 	struct SharedMemory* shared_memory = AllocateSharedMemory();
 	if (shared_memory == NULL) {
 		return NULL;
 	}
 
+	shared_memory->physical_pages = malloc(sizeof(size_t) * pages);
+	if (shared_memory->physical_pages == NULL) {
+		ReleaseSharedMemory(shared_memory);
+		return NULL;
+	}
+
 	last_assigned_shared_memory_id++;
 	shared_memory->id = last_assigned_shared_memory_id;
-	shared_memory->size_in_pages = pages;
+	shared_memory->size_in_pages = 0;
 	shared_memory->processes_referencing_this_block = 0;
-	shared_memory->first_page = NULL;
-	shared_memory->next = NULL;
-	shared_memory->previous = NULL;
+	shared_memory->large_pages = large_pages;
+
+	// Add it to the hash table, so ReleaseSharedMemoryBlock can remove it if
+	// we run out of memory.
+	struct SharedMemory** bucket = GetSharedMemoryBucket(shared_memory->id);
+	shared_memory->next = *bucket;
+	*bucket = shared_memory;
+
+	// Allocate each page. size_in_pages counts the pages allocated so far.
+	while (shared_memory->size_in_pages < pages) {
+		if (large_pages &&
+			pages - shared_memory->size_in_pages >= LARGE_PAGE_SIZE / PAGE_SIZE) {
+			// Try to allocate the next 2 MB in one physically contiguous run.
+			size_t physical_pages = GetPhysicalPages(LARGE_PAGE_ORDER);
+			if (physical_pages != OUT_OF_PHYSICAL_PAGES) {
+				for (size_t offset = 0; offset < LARGE_PAGE_SIZE;
+					offset += PAGE_SIZE) {
+					shared_memory->physical_pages[
+						shared_memory->size_in_pages++] =
+							physical_pages + offset;
+				}
+				continue;
+			}
 
-	// Allocate each page.
-	struct SharedMemoryPage* last_shared_memory_page = NULL;
+			// Memory is too fragmented, so use 4 KB pages for the rest.
+			large_pages = false;
+		}
 
-	while (pages > 0) {
 		size_t physical_page = GetPhysicalPage();
 		if (physical_page == OUT_OF_PHYSICAL_PAGES) {
 			// Out of memory.
 			ReleaseSharedMemoryBlock(shared_memory);
 			return NULL;
 		}
-
-		struct SharedMemoryPage* shared_memory_page =
-			AllocateSharedMemoryPage();
-		if (shared_memory_page == NULL) {
-			// Out of memory.
-			FreePhysicalPage(physical_page);
-			ReleaseSharedMemoryBlock(shared_memory);
-			return NULL;
-		}
-
-		shared_memory_page->physical_address = physical_page;
-		shared_memory_page->next = NULL;
-
-		// Add to the linked list of pages.
-		if (last_shared_memory_page == NULL) {
-			shared_memory->first_page = shared_memory_page;
-		} else {
-			last_shared_memory_page->next = shared_memory_page;
-		}
-		last_shared_memory_page = shared_memory_page;
-
-		pages--;
-	}
-
-	if (first_shared_memory != NULL) {
-		shared_memory->next = first_shared_memory;
+		shared_memory->physical_pages[shared_memory->size_in_pages++] =
+			physical_page;
 	}
-	first_shared_memory = shared_memory;
 
 	return shared_memory;
 }
@@ -91,14 +110,17 @@ struct SharedMemory* CreateSharedMemoryBlock(size_t pages) {
 
 // Creates a shared memory block and map it into a procses.
 struct SharedMemoryInProcess* CreateAndMapSharedMemoryBlockIntoProcess(
-	struct Process* process, size_t pages) {
+	struct Process* process, size_t pages, bool large_pages) {
 	// Create the shared memory block.
-	struct SharedMemory* shared_memory = CreateSharedMemoryBlock(pages);
+	struct SharedMemory* shared_memory = CreateSharedMemoryBlock(pages,
+		large_pages);
 	if (shared_memory == NULL) {
 		// Could not create shared memory.
 		return NULL;
 	}
 
+	shared_memory->creator_pid = process->pid;
+
 	// Map it into this process.
 	struct SharedMemoryInProcess* shared_memory_in_process =
 		MapSharedMemoryIntoProcess(process, shared_memory);
@@ -118,37 +140,25 @@ void ReleaseSharedMemoryBlock(struct SharedMemory* shared_memory) {
 	}
 
 	// Release each physical page associated with this shared memory block.
-	struct SharedMemoryPage* next_shared_memory_page =
-		shared_memory->first_page;
-	while (next_shared_memory_page != NULL) {
-		// Save our pointer and iterate to the next shared memory page.
-		struct SharedMemoryPage* page = next_shared_memory_page;
-		next_shared_memory_page = next_shared_memory_page->next;
-
-		// Release this physical page.
-		FreePhysicalPage(page->physical_address);
-
-		// Release this SharedMemoryPage object.
-		ReleaseSharedMemoryPage(page);
-	}
-
-	// Remove us from the linked list of shared memory.
-	if (shared_memory->next != NULL) {
-		shared_memory->next->previous = shared_memory->previous;
-	}
-
-	if (shared_memory->previous == NULL) {
-		first_shared_memory = shared_memory->next;
-	} else {
-		shared_memory->previous->next = shared_memory->next;
-	}
+	// Pages that were allocated as a 2 MB run are freed one at a time, and the
+	// buddy allocator merges them back together.
+	for (size_t i = 0; i < shared_memory->size_in_pages; i++)
+		FreePhysicalPage(shared_memory->physical_pages[i]);
+	free(shared_memory->physical_pages);
+
+	// Remove us from the hash table.
+	struct SharedMemory** previous = GetSharedMemoryBucket(shared_memory->id);
+	while (*previous != shared_memory)
+		previous = &(*previous)->next;
+	*previous = shared_memory->next;
 
 	// Release the SharedMemory object.
 	ReleaseSharedMemory(shared_memory);
 }
 
 struct SharedMemory* GetSharedMemoryFromId(size_t shared_memory_id) {
-	struct SharedMemory* shared_memory = first_shared_memory;
+	struct SharedMemory* shared_memory =
+		*GetSharedMemoryBucket(shared_memory_id);
 	while (shared_memory != NULL) {
 		if (shared_memory->id == shared_memory_id) {
 			// Found a shared memory block that matches the ID.
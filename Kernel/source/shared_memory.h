@@ -16,17 +16,6 @@
 
 struct Process;
 
-// Represents a linked list of physical pages that makes up a shared
-// memory block.
-struct SharedMemoryPage {
-	// The physical address of this page.
-	size_t physical_address;
-
-	// Pointer to the next SharedMemoryPage block, otherwise 0 if there
-	// are no more pages.
-	struct SharedMemoryPage* next;
-};
-
 // Represents a block of shared memory.
 struct SharedMemory {
 	// The ID of this shared memory.
@@ -35,14 +24,21 @@ struct SharedMemory {
 	// The size of this shared memory block, in pages.
 	size_t size_in_pages;
 
-	// Linked list of physical pages.
-	struct SharedMemoryPage* first_page;
+	// The physical address of each page in the block, in order.
+	size_t* physical_pages;
 
 	// Number of processes that are referencing this block.
 	size_t processes_referencing_this_block;
 
-	// Linked list of shared memory.
-	struct SharedMemory* previous;
+	// The PID of the process that created this block, so memory statistics
+	// can tell the blocks a process created from the blocks it joined.
+	size_t creator_pid;
+
+	// Whether the block was allocated in physically contiguous 2 MB runs, and
+	// so should be mapped into processes with 2 MB pages.
+	bool large_pages;
+
+	// The next SharedMemory in the same hash table bucket.
 	struct SharedMemory* next;
 };
 
@@ -64,9 +60,11 @@ struct SharedMemoryInProcess {
 // Initializes the internal structures for shared memory.
 extern void InitializeSharedMemory();
 
-// Creates a shared memory block and map it into a procses.
+// Creates a shared memory block and map it into a procses. If large_pages is
+// true, the memory is allocated in 2 MB runs where possible so it can be mapped
+// with 2 MB pages.
 extern struct SharedMemoryInProcess* CreateAndMapSharedMemoryBlockIntoProcess(
-	struct Process* process, size_t pages);
+	struct Process* process, size_t pages, bool large_pages);
 
 // Releases a shared memory block. Please make sure that there are no
 // processes referencing the shared memory block before calling this.
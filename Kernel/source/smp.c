@@ -0,0 +1,198 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "smp.h"
+
+#include "cpu.h"
+#include "fpu.h"
+#include "idt.h"
+#include "interrupts.h"
+#include "io.h"
+#include "local_apic.h"
+#include "physical_allocator.h"
+#include "scheduler.h"
+#include "syscall.h"
+#include "text_terminal.h"
+#include "timer.h"
+#include "tss.h"
+#include "virtual_allocator.h"
+
+// #define DEBUG
+
+// Where the trampoline gets copied to. Must match ap_trampoline.asm.
+#define AP_TRAMPOLINE_ADDRESS 0x8000
+
+// Paging structures that identity map the first 2 MB of memory, so the
+// trampoline can turn on paging. These are in low memory, below the kernel,
+// so they are never given out by the physical allocator and the trampoline
+// can load them while still in 32-bit mode.
+#define AP_TRAMPOLINE_PML4 0x9000
+#define AP_TRAMPOLINE_PDPT 0xA000
+#define AP_TRAMPOLINE_PD 0xB000
+
+// The number of pages in an application processor's stack.
+#define AP_STACK_PAGES 2
+
+// Symbols in ap_trampoline.asm.
+extern char ApTrampolineStart[];
+extern char ApTrampolineEnd[];
+extern char ApTrampolinePml4[];
+extern char ApTrampolineKernelPml4[];
+extern char ApTrampolineStack[];
+extern char ApTrampolineCpu[];
+extern char ApTrampolineEntryPoint[];
+
+// Returns a pointer to where a field in the trampoline was copied to.
+static size_t* TrampolineField(char* field) {
+	return (size_t*)(AP_TRAMPOLINE_ADDRESS + VIRTUAL_MEMORY_OFFSET +
+		(field - ApTrampolineStart));
+}
+
+// Copies the trampoline into low memory and builds the page tables it uses.
+static void PrepareTrampoline() {
+	memcpy((unsigned char*)(AP_TRAMPOLINE_ADDRESS + VIRTUAL_MEMORY_OFFSET),
+		(unsigned char*)ApTrampolineStart, ApTrampolineEnd - ApTrampolineStart);
+
+	size_t* pml4 = (size_t*)(AP_TRAMPOLINE_PML4 + VIRTUAL_MEMORY_OFFSET);
+	size_t* pdpt = (size_t*)(AP_TRAMPOLINE_PDPT + VIRTUAL_MEMORY_OFFSET);
+	size_t* pd = (size_t*)(AP_TRAMPOLINE_PD + VIRTUAL_MEMORY_OFFSET);
+	memset((unsigned char*)pml4, 0, PAGE_SIZE);
+	memset((unsigned char*)pdpt, 0, PAGE_SIZE);
+	memset((unsigned char*)pd, 0, PAGE_SIZE);
+
+	// Identity map the first 2 MB.
+	pml4[0] = AP_TRAMPOLINE_PDPT | 0x3;
+	pdpt[0] = AP_TRAMPOLINE_PD | 0x3;
+	pd[0] = 0x83; // Present, RW, 2 MB page.
+
+	// Share the kernel's higher half memory.
+	size_t* kernel_pml4_ptr = (size_t*)TemporarilyMapPhysicalMemory(kernel_pml4, 0);
+	pml4[511] = kernel_pml4_ptr[511];
+
+	*TrampolineField(ApTrampolinePml4) = AP_TRAMPOLINE_PML4;
+	*TrampolineField(ApTrampolineKernelPml4) = kernel_pml4;
+	*TrampolineField(ApTrampolineEntryPoint) =
+		(size_t)ApplicationProcessorEntryPoint;
+}
+
+// Allocates a kernel stack for a CPU to idle on, returning the top of it, or
+// OUT_OF_MEMORY.
+static size_t AllocateApplicationProcessorStack() {
+	size_t stack = AllocateVirtualMemoryInAddressSpace(kernel_pml4,
+		AP_STACK_PAGES, /*large_pages=*/false);
+	if (stack == 0)
+		return OUT_OF_MEMORY;
+	return stack + AP_STACK_PAGES * PAGE_SIZE;
+}
+
+// Waits for a CPU to come online, up to a timeout. Returns if it is online.
+static bool WaitForCpuToComeOnline(struct Cpu* cpu, size_t microseconds) {
+	for (size_t waited = 0; waited < microseconds; waited += 1000) {
+		if (cpu->is_online)
+			return true;
+		BusyWaitMicroseconds(1000);
+	}
+	return cpu->is_online;
+}
+
+// Starts an application processor. Returns if it came online.
+static bool StartApplicationProcessor(struct Cpu* cpu) {
+	size_t stack_top = AllocateApplicationProcessorStack();
+	if (stack_top == OUT_OF_MEMORY)
+		return false;
+
+	// The CPU can't allocate anything while it starts because we're holding
+	// the kernel lock, so allocate everything it needs for it.
+	InitializeSchedulerForCpu(cpu);
+	AllocateInterruptStack(cpu);
+
+	*TrampolineField(ApTrampolineStack) = stack_top;
+	*TrampolineField(ApTrampolineCpu) = (size_t)cpu;
+
+	// The INIT-SIPI-SIPI sequence from the Intel MultiProcessor Specification.
+	SendInitInterrupt(cpu->local_apic_id);
+	BusyWaitMicroseconds(10000);
+	SendStartupInterrupt(cpu->local_apic_id, AP_TRAMPOLINE_ADDRESS / PAGE_SIZE);
+	BusyWaitMicroseconds(200);
+	if (!cpu->is_online)
+		SendStartupInterrupt(cpu->local_apic_id, AP_TRAMPOLINE_ADDRESS / PAGE_SIZE);
+
+	return WaitForCpuToComeOnline(cpu, 100000);
+}
+
+// Starts the application processors (every CPU other than the boot CPU) that
+// were found by InitializeAcpi().
+void StartApplicationProcessors() {
+	if (number_of_cpus == 1)
+		return;
+
+	PrepareTrampoline();
+
+	// The CPUs share the trampoline, so start them one at a time.
+	size_t cpus_found = number_of_cpus;
+	for (size_t i = 1; i < cpus_found; i++) {
+		struct Cpu* cpu = &cpus[i];
+		if (!StartApplicationProcessor(cpu)) {
+			PrintString("CPU ");
+			PrintNumber(cpu->id);
+			PrintString(" with local APIC ");
+			PrintNumber(cpu->local_apic_id);
+			PrintString(" didn't start.\n");
+			// Don't try to start the rest, because the CPU might still be
+			// starting and using the trampoline. Only the CPUs that started
+			// are used.
+			number_of_cpus = i;
+			break;
+		}
+	}
+
+#ifdef DEBUG
+	PrintString("Running on ");
+	PrintNumber(number_of_cpus);
+	PrintString(" CPU(s).\n");
+#endif
+}
+
+// Where application processors enter the kernel. Doesn't return.
+void ApplicationProcessorEntryPoint(struct Cpu* cpu) {
+	// The boot CPU is holding the kernel lock while we start, so this must only
+	// touch state that is local to this CPU.
+	if (cpu->id >= number_of_cpus) {
+		// The boot CPU gave up waiting for us to start.
+		for(;;) {
+			asm("cli");
+			asm("hlt");
+		}
+	}
+
+	LoadCpuSegment(cpu);
+	cpu->pml4 = kernel_pml4;
+	cpu->cr3 = kernel_pml4;
+	EnableTlbFeatures();
+	EnableFpuFeatures();
+	LoadIdt();
+	InitializeTss();
+	SetInterruptStack(cpu->interrupt_stack_top - PAGE_SIZE);
+	InitializeSystemCalls();
+	EnableLocalApic();
+
+	cpu->is_online = true;
+
+	for(;;) {
+		// This needs to be in a loop because the scheduler returns here when
+		// there are no awake threads scheduled on this CPU.
+		ZeroFreePagesWhileIdle();
+		asm volatile("sti; hlt");
+	}
+}
@@ -3,23 +3,32 @@
 [GLOBAL syscall_entry]
 [EXTERN SyscallHandler]
 
-; temp location to put the stack pointer while we manipulate the code
-sys_call_stack_pointer:
-    DQ 0x0000000000000000 
+; Offsets into struct Cpu (cpu.h).
+%define CPU_REGS 8
+%define CPU_INTERRUPT_STACK_TOP 16
+%define CPU_SYSCALL_USER_STACK_POINTER 24
+%define CPU_HOLDS_KERNEL_LOCK 41
 
-[EXTERN currently_executing_thread_regs]
-[EXTERN interrupt_stack_top]
+[EXTERN AcquireKernelLock]
+[EXTERN kernel_lock]
 
 syscall_entry:
+    ; Swap in the kernel's GS so it points to this CPU's struct Cpu.
+    swapgs
+
     ; Temporarily save userland rsp
-    mov [sys_call_stack_pointer], rsp
+    mov [gs:CPU_SYSCALL_USER_STACK_POINTER], rsp
+
+    ; Only one CPU can be in the kernel at a time.
+    mov rsp, [gs:CPU_INTERRUPT_STACK_TOP]
+    call AcquireKernelLock
 
     ; Store the current registers
-    mov rsp, [currently_executing_thread_regs]
+    mov rsp, [gs:CPU_REGS]
     add rsp, 19 * 8 ; point to usersp, skipping ss
 
     ; Push the registers
-    push qword [sys_call_stack_pointer] ; usersp
+    push qword [gs:CPU_SYSCALL_USER_STACK_POINTER] ; usersp
     push r11 ; syscall puts rflags are in r11
     sub rsp, 8 ; skip cs
     push rcx ; syscall puts rip in rcx
@@ -47,7 +56,7 @@ syscall_entry:
     ;mov gs, ax
 
     ; Move to the interrupt's stack.
-    mov rsp, [interrupt_stack_top]
+    mov rsp, [gs:CPU_INTERRUPT_STACK_TOP]
 
     ; Call the handler
     mov rax, SyscallHandler
@@ -60,7 +69,7 @@ syscall_entry:
     ;mov fs, ax
     ;mov gs, ax
 
-    mov rsp, [currently_executing_thread_regs]
+    mov rsp, [gs:CPU_REGS]
     pop r15
     pop r14
     pop r13
@@ -81,4 +90,10 @@ syscall_entry:
     pop r11 ; pop rflags into r11
     pop rsp
 
+    ; Release the kernel lock.
+    mov byte [gs:CPU_HOLDS_KERNEL_LOCK], 0
+    mov qword [kernel_lock], 0
+
+    ; Swap back to the user's GS.
+    swapgs
     o64 sysret
\ No newline at end of file
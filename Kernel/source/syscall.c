@@ -4,6 +4,7 @@
 #include "io.h"
 #include "framebuffer.h"
 #include "messages.h"
+#include "object_pools.h"
 #include "process.h"
 #include "registers.h"
 #include "scheduler.h"
@@ -43,8 +44,7 @@ void InitializeSystemCalls() {
 }
 
 // Syscalls.
-// Next id is 45.
-// Free: 26
+// Next id is 53.
 #define PRINT_DEBUG_CHARACTER 0
 #define CREATE_THREAD 1
 #define GET_THIS_THREAD_ID 2
@@ -60,10 +60,13 @@ void InitializeSystemCalls() {
 // Memory management
 #define ALLOCATE_MEMORY_PAGES 12
 #define RELEASE_MEMORY_PAGES 13
+#define RESIZE_MEMORY_PAGES 26
 #define MAP_PHYSICAL_MEMORY 41
 #define GET_FREE_SYSTEM_MEMORY 14
 #define GET_MEMORY_USED_BY_PROCESS 15
 #define GET_TOTAL_SYSTEM_MEMORY 16
+#define GET_OBJECT_POOL_STATISTICS 51
+#define GET_PROCESS_MEMORY_STATISTICS 52
 #define CREATE_SHARED_MEMORY 42
 #define JOIN_SHARED_MEMORY 43
 #define LEAVE_SHARED_MEMORY 44
@@ -87,6 +90,12 @@ void InitializeSystemCalls() {
 #define SEND_MESSAGE 17
 #define POLL_FOR_MESSAGE 18
 #define SLEEP_FOR_MESSAGE 19
+#define SEND_MESSAGES 45
+#define POLL_FOR_MESSAGES 46
+#define SLEEP_FOR_MESSAGES 47
+#define CALL 48
+#define REPLY_AND_WAIT 49
+#define GET_MESSAGE_QUEUE_STATISTICS 50
 // Interrupts
 #define REGISTER_MESSAGE_TO_SEND_ON_INTERRUPT 20
 #define UNREGISTER_MESSAGE_TO_SEND_ON_INTERRUPT 21
@@ -100,6 +109,13 @@ void InitializeSystemCalls() {
 extern void JumpIntoThread();
 
 void SyscallHandler(int syscall_number) {
+	if (GetCurrentCpu()->running_thread_was_evicted) {
+		// Another CPU destroyed the thread that made this syscall while we
+		// were waiting for the kernel lock.
+		ScheduleNextThread();
+		JumpIntoThread(); // Doesn't return.
+	}
+
 #ifdef DEBUG
 	PrintString("Entering syscall: ");
 	PrintNumber(syscall_number);
@@ -167,20 +183,30 @@ void SyscallHandler(int syscall_number) {
 		case ALLOCATE_MEMORY_PAGES:
 			currently_executing_thread_regs->rax =
 				AllocateVirtualMemoryInAddressSpace(running_thread->process->pml4,
-					currently_executing_thread_regs->rax);
+					currently_executing_thread_regs->rax,
+					currently_executing_thread_regs->rbx != 0);
 			break;
 		case RELEASE_MEMORY_PAGES:
 			ReleaseVirtualMemoryInAddressSpace(running_thread->process->pml4,
 					currently_executing_thread_regs->rax,
 					currently_executing_thread_regs->rbx);
 			break;
+		case RESIZE_MEMORY_PAGES:
+			currently_executing_thread_regs->rax =
+				ResizeVirtualMemoryInAddressSpace(running_thread->process->pml4,
+					currently_executing_thread_regs->rax,
+					currently_executing_thread_regs->rbx,
+					currently_executing_thread_regs->rdx,
+					currently_executing_thread_regs->rsi != 0);
+			break;
 		case MAP_PHYSICAL_MEMORY:
 			// Only drivers can map physical memory.
 			if (running_thread->process->is_driver) {
 				currently_executing_thread_regs->rax =
 					MapPhysicalMemoryInAddressSpace(running_thread->process->pml4,
 						currently_executing_thread_regs->rax,
-						currently_executing_thread_regs->rbx);
+						currently_executing_thread_regs->rbx,
+						currently_executing_thread_regs->rdx != 0);
 			} else {
 				currently_executing_thread_regs->rax =
 					OUT_OF_MEMORY;
@@ -190,16 +216,28 @@ void SyscallHandler(int syscall_number) {
 			currently_executing_thread_regs->rax = free_pages * PAGE_SIZE;
 			break;
 		case GET_MEMORY_USED_BY_PROCESS:
-			currently_executing_thread_regs->rax = running_thread->process->allocated_pages * PAGE_SIZE;
+			currently_executing_thread_regs->rax =
+				GetPagesOwnedByProcess(running_thread->process) * PAGE_SIZE;
 			break;
 		case GET_TOTAL_SYSTEM_MEMORY:
 			currently_executing_thread_regs->rax = total_system_memory;
 			break;
+		case GET_OBJECT_POOL_STATISTICS:
+			PopulateRegistersWithObjectPoolStatistics(
+				currently_executing_thread_regs->rax,
+				currently_executing_thread_regs);
+			break;
+		case GET_PROCESS_MEMORY_STATISTICS:
+			PopulateRegistersWithProcessMemoryStatistics(
+				GetProcessFromPid(currently_executing_thread_regs->rax),
+				currently_executing_thread_regs);
+			break;
 		case CREATE_SHARED_MEMORY: {
 			struct SharedMemoryInProcess* shared_memory =
 				CreateAndMapSharedMemoryBlockIntoProcess(
 					running_thread->process,
-					currently_executing_thread_regs->rax);
+					currently_executing_thread_regs->rax,
+					currently_executing_thread_regs->rbx != 0);
 			if (shared_memory == NULL) {
 				// Could not create the shared memory block.
 				currently_executing_thread_regs->rax = 0;
@@ -277,17 +315,15 @@ void SyscallHandler(int syscall_number) {
 			// the pids of the first 12 that we find.
 			size_t pids[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0};
 			size_t processes_found = 0;
-			struct Process* process =
-				GetProcessOrNextFromPid(currently_executing_thread_regs->rbp);
+			struct Process* process = FindNextProcessWithName(
+				(char *)process_name,
+				GetProcessOrNextFromPid(currently_executing_thread_regs->rbp));
 			while (process != NULL) {
-				process = FindNextProcessWithName((char *)process_name, process);
-				if (process != NULL) {
-					if (processes_found < 12)
-						pids[processes_found] = process->pid;
+				if (processes_found < 12)
+					pids[processes_found] = process->pid;
 
-					processes_found++;
-					process = process->next;
-				}
+				processes_found++;
+				process = FindNextProcessWithSameName(process);
 			}
 
 			// Write out the list of found PIDs.
@@ -489,6 +525,30 @@ void SyscallHandler(int syscall_number) {
 				JumpIntoThread(); // Doesn't return.
 			}
 			break;
+		case SEND_MESSAGES:
+			SendMessagesFromThreadSyscall(running_thread);
+			break;
+		case POLL_FOR_MESSAGES:
+			LoadNextMessagesIntoThread(running_thread);
+			break;
+		case SLEEP_FOR_MESSAGES:
+			if (SleepThreadUntilMessages(running_thread)) {
+				// The thread is now asleep. We need to schedule a new thread.
+				ScheduleNextThread();
+				JumpIntoThread(); // Doesn't return.
+			}
+			break;
+		case CALL:
+		case REPLY_AND_WAIT:
+			if (SendMessageAndSleepThreadUntilMessages(running_thread)) {
+				// The thread is now asleep, and the CPU has already switched
+				// to the thread it handed the CPU to.
+				JumpIntoThread(); // Doesn't return.
+			}
+			break;
+		case GET_MESSAGE_QUEUE_STATISTICS:
+			GetMessageQueueStatisticsForThread(running_thread);
+			break;
 		case REGISTER_MESSAGE_TO_SEND_ON_INTERRUPT:
 			RegisterMessageToSendOnInterrupt(
 				(int)currently_executing_thread_regs->rax,
@@ -1,6 +1,7 @@
 #include "thread.h"
 
-#include "liballoc.h"
+#include "fpu.h"
+#include "object_pools.h"
 #include "process.h"
 #include "physical_allocator.h"
 #include "io.h"
@@ -17,8 +18,6 @@
 
 size_t next_thread_id;
 
-extern void save_fpu_registers(size_t regs_addr);
-
 // Initialize threads.
 void InitializeThreads() {
 	// Clears our linked list.
@@ -27,7 +26,7 @@ void InitializeThreads() {
 
 // Createss a thread.
 struct Thread *CreateThread(struct Process *process, size_t entry_point, size_t param) {
-	struct Thread *thread = malloc(sizeof(struct Thread));
+	struct Thread *thread = AllocateThread();
 	if(thread == NULL) {
 		return NULL;
 	}
@@ -38,36 +37,23 @@ struct Thread *CreateThread(struct Process *process, size_t entry_point, size_t
 	thread->id = next_thread_id;
 	next_thread_id++;
 
-	// Sets up the stack by:
-	// 1) Finds a free page in the process's virtual address space.
-	thread->stack = FindFreePageRange(thread->process->pml4, STACK_PAGES);
-	if(thread->stack == OUT_OF_MEMORY) {
-		free(thread);
+	// Allocate the stack. Its pages are only backed by physical memory once
+	// the thread touches them.
+	thread->stack = AllocateVirtualMemoryInAddressSpace(thread->process->pml4,
+		STACK_PAGES, /*large_pages=*/false);
+	if(thread->stack == 0) {
+		ReleaseThread(thread);
 		return NULL;
 	}
 
-	for (int stack_page = 0; stack_page < STACK_PAGES; stack_page++) {
-		// 2) Grabs a physical page.
-		size_t stack_physical_addr = GetPhysicalPage();
-		if(stack_physical_addr == OUT_OF_PHYSICAL_PAGES) {
-			// Free any stack pages allocated.
-			for (int allocated_stack_page = 0;
-				allocated_stack_page < stack_page;
-				allocated_stack_page++) {
-				UnmapVirtualPage(thread->process->pml4,
-					thread->stack + allocated_stack_page * PAGE_SIZE, true);
-			}
-			free(thread);
-			return NULL;
-		}
-
-		// 3) Maps the process's virtual address to the physical page.
-		MapPhysicalPageToVirtualPage(thread->process->pml4,
-			thread->stack + stack_page * PAGE_SIZE, stack_physical_addr, true);
-	}
-
 	// Sets up the registers that our process will start with.
-	struct Registers *regs = malloc(sizeof(struct Registers));
+	struct Registers *regs = AllocateRegisters();
+	if(regs == NULL) {
+		ReleaseVirtualMemoryInAddressSpace(thread->process->pml4,
+			thread->stack, STACK_PAGES);
+		ReleaseThread(thread);
+		return NULL;
+	}
 	thread->registers = regs;
 
 	// Initialize our general purpose registers to 0.
@@ -100,6 +86,8 @@ struct Thread *CreateThread(struct Process *process, size_t entry_point, size_t
 	thread->awake = false;
 	thread->next_awake = NULL;
 	thread->previous_awake = NULL;
+	thread->priority = 0;
+	thread->cpu = NULL;
 
 	// The thread hasn't ran for any time slices yet.
 	thread->time_slices = 0;
@@ -107,6 +95,7 @@ struct Thread *CreateThread(struct Process *process, size_t entry_point, size_t
 	// The thread isn't sleeping waiting for messages.
 	thread->thread_is_waiting_for_message = false;
 	thread->next_thread_sleeping_for_messages = NULL;
+	thread->message_buffer_address = 0;
 
 	// Add this to the linked list of threads in the process.
 	thread->previous = 0;
@@ -119,8 +108,8 @@ struct Thread *CreateThread(struct Process *process, size_t entry_point, size_t
 	// Increment the process's thread cont.
 	process->thread_count++;
 
-	// Populate the FPU registers with something.
-	memset(thread->fpu_registers, 0, 512);
+	// The thread starts with the FPU registers in their initial state.
+	InitializeFpuRegisters(thread);
 
 	thread->address_to_clear_on_termination = 0;
 
@@ -135,7 +124,8 @@ void DestroyThread(struct Thread *thread, bool process_being_destroyed) {
 	}
 
 	// Free the thread's stack.
-	UnmapVirtualPage(thread->process->pml4, thread->stack, true);
+	ReleaseVirtualMemoryInAddressSpace(thread->process->pml4, thread->stack,
+		STACK_PAGES);
 
 	struct Process *process = thread->process;
 
@@ -173,21 +163,20 @@ void DestroyThread(struct Thread *thread, bool process_being_destroyed) {
 
 	// The thread has a virtual address that should be cleared.
 	if (thread->address_to_clear_on_termination) {
-		// Find the virtual page and offset of the address.
-		size_t offset_in_page = thread->address_to_clear_on_termination & (PAGE_SIZE - 1);
-		size_t page = thread->address_to_clear_on_termination - offset_in_page;
-
-		// Get the physical page.
-		size_t physical_page = GetPhysicalAddress(thread->process->pml4, offset_in_page,
-			/*ignore_unowned_pages=*/ false);
-		if (physical_page != OUT_OF_MEMORY) {
-			// If this virtual page was actually assigned to a physical address, set our memory location to 0.
-			*(uint64*)((size_t)TemporarilyMapPhysicalMemory(physical_page, 1) + offset_in_page) = 0;
-		}
+		// Set the memory location to 0, if it's mapped. This goes through
+		// CopyToProcessMemory because the page might be copy-on-write.
+		uint64 zero = 0;
+		CopyToProcessMemory(thread->process->pml4,
+			thread->address_to_clear_on_termination, &zero, sizeof(zero));
 	}
 
+	// Make sure no CPU thinks a thread created at the same address owns its
+	// FPU registers.
+	ForgetFpuRegisters(thread);
+
 	// Free the thread object.
-	free(thread);
+	ReleaseRegisters(thread->registers);
+	ReleaseThread(thread);
 
 	// Decrease the thread count.
 	process->thread_count--;
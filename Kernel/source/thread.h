@@ -1,9 +1,18 @@
 #pragma once
 #include "types.h" 
 
+struct Cpu;
 struct Process;
 struct Registers;
 
+// The number of priority levels threads can be scheduled at. 0 is the highest
+// priority.
+#define NUMBER_OF_PRIORITY_LEVELS 8
+
+// The size of a thread's FPU register area. This has room for the x87, SSE,
+// and AVX state in XSAVE's standard format.
+#define FPU_REGISTERS_SIZE 1024
+
 // Represents a thread. A sequence of execution (that's part of a user process) that may run in parallel with other threads.
 struct Thread {
 	// The ID of the tread. Used it identify this thread inside the process.
@@ -16,12 +25,13 @@ struct Thread {
 	// are actually in the CPU registers until the next interrupt or syscall.
 	struct Registers *registers;
 
-	// Storage for the FPU registers. Must be 16 byte aligned (our malloc implementation will give us a 16 byte aligned Thread struct.)
-	// For performance reasons, we only save this if uses_fpu_registers is set.
-	char fpu_registers[512] __attribute__((aligned(16)));
+	// Storage for the FPU registers, in the format of XSAVE (or FXSAVE if the CPU doesn't support XSAVE.) This is only
+	// saved when the thread has used the FPU during its time slice. XSAVE needs this to be 64 byte aligned.
+	char fpu_registers[FPU_REGISTERS_SIZE] __attribute__((aligned(64)));
 
-	// Does this thread use FPU registers that we need to save them on context switching?
-	bool uses_fpu_registers : 1;
+	// The CPU that last loaded this thread's FPU registers. If the CPU's fpu_owner is still this thread, the registers
+	// are still loaded and don't need restoring.
+	struct Cpu* fpu_cpu;
 
 	// Offset of the thread's segment (FS).
 	size_t thread_segment_offset;
@@ -40,6 +50,15 @@ struct Thread {
 	struct Thread *next_awake;
 	struct Thread *previous_awake;
 
+	// The priority level the thread is scheduled at, 0 being the highest. Threads
+	// that use up their time slice get demoted, and threads that wake up get
+	// boosted.
+	uint8 priority;
+
+	// The CPU whose queue this thread is in while it is awake. Sleeping threads
+	// are woken up on the same CPU, to keep their caches warm.
+	struct Cpu* cpu;
+
 	// The number of time slices this thread has ran for. This might not be so accurate as to how much processing time a thread has
 	// had because partial slices (such as the previous thread 'yielding') is considered a full slice here.
 	size_t time_slices;
@@ -48,6 +67,11 @@ struct Thread {
 	struct Thread* next_thread_sleeping_for_messages;
 	bool thread_is_waiting_for_message : 1;
 
+	// If not 0, the address of the buffer in the process's memory to copy the
+	// message that wakes this thread up into. Set when the thread is sleeping
+	// for a batch of messages.
+	size_t message_buffer_address;
+
 	// If not 0, the virtual address in the process's space to clear on termination of the thread. Must be 8-byte aligned.
 	size_t address_to_clear_on_termination;
 };
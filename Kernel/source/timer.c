@@ -1,7 +1,9 @@
 #include "timer.h"
 
+#include "cpu.h"
 #include "interrupts.h"
 #include "io.h"
+#include "local_apic.h"
 #include "messages.h"
 #include "object_pools.h"
 #include "process.h"
@@ -9,49 +11,184 @@
 #include "text_terminal.h"
 #include "timer_event.h"
 
-// The number of time slices (or how many times the timer triggers) per second.
-#define TIME_SLICES_PER_SECOND 100
-volatile size_t microseconds_since_kernel_started;
+// #define DEBUG
+
+// The frequency that the PIT counts at.
+#define PIT_FREQUENCY 1193180
+
+// How long to measure the TSC for when calibrating it.
+#define TSC_CALIBRATION_MICROSECONDS 10000
+
+// The CPU that wakes up for timer events. Other CPUs only wake up for the end
+// of their running thread's time slice.
+#define TIMER_EVENT_CPU 0
+
+// Used when a CPU doesn't have a deadline to wake up for.
+#define NO_DEADLINE 0xFFFFFFFFFFFFFFFF
+
+// The value of the TSC when the kernel started.
+size_t tsc_at_boot;
+
+// How many times the TSC ticks per second.
+size_t tsc_ticks_per_second;
+
+// The root of the pairing heap of scheduled timer events, which is the next
+// timer event to trigger.
 struct TimerEvent* next_scheduled_timer_event;
 
-// Sets the timer to fire 'hz' times per second.
-void SetTimerPhase(size_t hz) {
-	size_t divisor = 1193180 / hz;
-	outportb(0x43, 0x36);
-	outportb(0x40, divisor & 0xFF);
-	outportb(0x40, divisor >> 8);
+// Reads the CPU's timestamp counter.
+static size_t ReadTimestampCounter() {
+	uint32 low, high;
+	asm volatile("rdtsc" : "=a"(low), "=d"(high));
+	return ((size_t)high << 32) | low;
+}
+
+// Measures how fast the TSC ticks.
+static void CalibrateTimestampCounter() {
+	size_t start = ReadTimestampCounter();
+	BusyWaitMicroseconds(TSC_CALIBRATION_MICROSECONDS);
+	size_t ticks = ReadTimestampCounter() - start;
+
+	tsc_ticks_per_second = ticks * (1000000 / TSC_CALIBRATION_MICROSECONDS);
+	tsc_at_boot = start;
+
+#ifdef DEBUG
+	PrintString("TSC ticks per second: ");
+	PrintNumber(tsc_ticks_per_second);
+	PrintChar('\n');
+#endif
 }
 
-// The function that gets called each time to timer fires.
+// Merges two timer event heaps, returning the new root. Both roots must have
+// been detached from any siblings.
+static struct TimerEvent* MergeTimerEventHeaps(struct TimerEvent* a,
+	struct TimerEvent* b) {
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (b->timestamp_to_trigger_at < a->timestamp_to_trigger_at) {
+		struct TimerEvent* temp = a;
+		a = b;
+		b = temp;
+	}
+
+	// Make 'b' the first child of 'a'.
+	b->previous_timer_event_in_heap = a;
+	b->next_sibling_timer_event = a->first_child_timer_event;
+	if (a->first_child_timer_event != NULL)
+		a->first_child_timer_event->previous_timer_event_in_heap = b;
+	a->first_child_timer_event = b;
+	return a;
+}
+
+// Merges a list of sibling timer events into a single heap, returning the new
+// root. This is the two-pass merge that gives the pairing heap its amortized
+// O(log n) removal.
+static struct TimerEvent* MergeTimerEventSiblings(
+	struct TimerEvent* first_sibling) {
+	// First pass: merge pairs from left to right, pushing each merged pair onto
+	// a list (linked through next_sibling_timer_event) so the last pair is at
+	// the front.
+	struct TimerEvent* merged_pairs = NULL;
+	while (first_sibling != NULL) {
+		struct TimerEvent* a = first_sibling;
+		struct TimerEvent* b = a->next_sibling_timer_event;
+		first_sibling = b == NULL ? NULL : b->next_sibling_timer_event;
+
+		a->next_sibling_timer_event = NULL;
+		a->previous_timer_event_in_heap = NULL;
+		if (b != NULL) {
+			b->next_sibling_timer_event = NULL;
+			b->previous_timer_event_in_heap = NULL;
+		}
+
+		struct TimerEvent* pair = MergeTimerEventHeaps(a, b);
+		pair->next_sibling_timer_event = merged_pairs;
+		merged_pairs = pair;
+	}
+
+	// Second pass: merge the pairs from right to left.
+	struct TimerEvent* root = NULL;
+	while (merged_pairs != NULL) {
+		struct TimerEvent* pair = merged_pairs;
+		merged_pairs = pair->next_sibling_timer_event;
+		pair->next_sibling_timer_event = NULL;
+		root = MergeTimerEventHeaps(root, pair);
+	}
+	return root;
+}
+
+// Adds a timer event to the heap of scheduled timer events.
+static void AddTimerEventToHeap(struct TimerEvent* timer_event) {
+	timer_event->first_child_timer_event = NULL;
+	timer_event->next_sibling_timer_event = NULL;
+	timer_event->previous_timer_event_in_heap = NULL;
+	next_scheduled_timer_event = MergeTimerEventHeaps(
+		next_scheduled_timer_event, timer_event);
+}
+
+// Removes a timer event from anywhere in the heap of scheduled timer events.
+static void RemoveTimerEventFromHeap(struct TimerEvent* timer_event) {
+	if (timer_event == next_scheduled_timer_event) {
+		// We're the root, so our children become the new heap.
+		next_scheduled_timer_event =
+			MergeTimerEventSiblings(timer_event->first_child_timer_event);
+		return;
+	}
+
+	// Detach ourselves (and our children) from our parent or left sibling.
+	struct TimerEvent* previous = timer_event->previous_timer_event_in_heap;
+	if (previous->first_child_timer_event == timer_event) {
+		previous->first_child_timer_event =
+			timer_event->next_sibling_timer_event;
+	} else {
+		previous->next_sibling_timer_event =
+			timer_event->next_sibling_timer_event;
+	}
+	if (timer_event->next_sibling_timer_event != NULL) {
+		timer_event->next_sibling_timer_event->previous_timer_event_in_heap =
+			previous;
+	}
+
+	// Merge our children back into the heap.
+	next_scheduled_timer_event = MergeTimerEventHeaps(
+		next_scheduled_timer_event,
+		MergeTimerEventSiblings(timer_event->first_child_timer_event));
+}
+
+// Removes a timer event from the linked list in its process.
+static void RemoveTimerEventFromProcess(struct TimerEvent* timer_event) {
+	if (timer_event->previous_timer_event_in_process == NULL) {
+		timer_event->process_to_send_message_to->timer_event =
+			timer_event->next_timer_event_in_process;
+	} else {
+		timer_event->previous_timer_event_in_process->
+			next_timer_event_in_process =
+				timer_event->next_timer_event_in_process;
+	}
+
+	if (timer_event->next_timer_event_in_process != NULL) {
+		timer_event->next_timer_event_in_process->
+			previous_timer_event_in_process =
+				timer_event->previous_timer_event_in_process;
+	}
+}
+
+// The function that gets called each time the local APIC timer fires.
 void TimerHandler() {
-	microseconds_since_kernel_started += (1000000 / TIME_SLICES_PER_SECOND);
+	size_t now = GetCurrentTimestampInMicroseconds();
 
 	// Call any timer events that are scheduled to run.
 	while (next_scheduled_timer_event != NULL &&
-		next_scheduled_timer_event->timestamp_to_trigger_at <=
-			microseconds_since_kernel_started) {
+		next_scheduled_timer_event->timestamp_to_trigger_at <= now) {
 		struct TimerEvent* timer_event = next_scheduled_timer_event;
 
-		// Remove this timer event from the front of the queue.
-		next_scheduled_timer_event = timer_event->next_scheduled_timer_event;
-		if(next_scheduled_timer_event != NULL)
-			next_scheduled_timer_event->previous_scheduled_timer_event = NULL;
-
-		// Remove this timer event from the process.
-		if (timer_event->previous_timer_event_in_process == NULL) {
-			timer_event->process_to_send_message_to->timer_event =
-				timer_event->next_timer_event_in_process;
-		} else {
-			timer_event->previous_timer_event_in_process->
-				next_timer_event_in_process =
-					timer_event->next_timer_event_in_process;
-		}
-
-		if (timer_event->next_timer_event_in_process != NULL) {
-			timer_event->next_timer_event_in_process->
-				previous_timer_event_in_process =
-					timer_event->previous_timer_event_in_process;
-		}
+		// Remove this timer event from the top of the heap and from the
+		// process.
+		RemoveTimerEventFromHeap(timer_event);
+		RemoveTimerEventFromProcess(timer_event);
 
 		// Send the message to the process.
 		SendKernelMessageToProcess(timer_event->process_to_send_message_to,
@@ -61,20 +198,90 @@ void TimerHandler() {
 		ReleaseTimerEvent(timer_event);
 	}
 
-	ScheduleNextThread();
+	struct Cpu* cpu = GetCurrentCpu();
+	if (cpu->thread != NULL && now >= cpu->time_slice_ends_at) {
+		// The running thread has used up its time slice. This programs the
+		// timer for the next time slice.
+		PreemptRunningThread();
+	} else {
+		// We woke up for a timer event (or early.)
+		ProgramTimerForNextDeadline();
+	}
 }
 
 // Initializes the timer.
 void InitializeTimer() {
-	microseconds_since_kernel_started = 0;
 	next_scheduled_timer_event = NULL;
-	SetTimerPhase(TIME_SLICES_PER_SECOND);
+
+	// Mask IRQ 0 so the PIT stops interrupting us. The local APIC timers are
+	// programmed for each deadline instead.
+	outportb(0x21, inportb(0x21) | 0x01);
+
+	CalibrateTimestampCounter();
 }
 
+// Programs the local APIC timer of the CPU we're running on to fire at the
+// next deadline - the end of the running thread's time slice, or the next
+// timer event. If there's nothing to wake up for, the timer is stopped so an
+// idle CPU stays halted.
+void ProgramTimerForNextDeadline() {
+	struct Cpu* cpu = GetCurrentCpu();
+
+	size_t deadline = NO_DEADLINE;
+	if (cpu->thread != NULL)
+		deadline = cpu->time_slice_ends_at;
+
+	if (cpu->id == TIMER_EVENT_CPU && next_scheduled_timer_event != NULL &&
+		next_scheduled_timer_event->timestamp_to_trigger_at < deadline)
+		deadline = next_scheduled_timer_event->timestamp_to_trigger_at;
+
+	if (deadline == NO_DEADLINE) {
+		StopLocalApicTimer();
+		return;
+	}
+
+	size_t now = GetCurrentTimestampInMicroseconds();
+	SetLocalApicTimer(deadline > now ? deadline - now : 0);
+}
+
+// Spins for at least the number of microseconds. Used for short delays while
+// initializing hardware.
+void BusyWaitMicroseconds(size_t microseconds) {
+	// Use channel 2 of the PIT, which is gated through port 0x61, so we don't
+	// disturb channel 0 which drives the timer interrupt.
+	uint8 original_port_61 = inportb(0x61);
+
+	while (microseconds > 0) {
+		// The counter is 16-bit, so wait for at most 50ms at a time.
+		size_t microseconds_to_wait = microseconds > 50000 ? 50000 : microseconds;
+		microseconds -= microseconds_to_wait;
+		size_t ticks = PIT_FREQUENCY * microseconds_to_wait / 1000000;
+		if (ticks == 0)
+			ticks = 1;
+
+		// Enable channel 2's gate with the speaker turned off.
+		outportb(0x61, (original_port_61 & ~0x02) | 0x01);
+
+		// Channel 2, low then high byte, mode 0 (interrupt on terminal count.)
+		outportb(0x43, 0xB0);
+		outportb(0x42, ticks & 0xFF);
+		outportb(0x42, (ticks >> 8) & 0xFF);
+
+		// Wait for the output of channel 2 to go high.
+		while ((inportb(0x61) & 0x20) == 0) {}
+	}
+
+	outportb(0x61, original_port_61);
+}
 
 // Returns the current time, in microseconds, since the kernel has started.
 size_t GetCurrentTimestampInMicroseconds() {
-	return microseconds_since_kernel_started;
+	size_t ticks = ReadTimestampCounter() - tsc_at_boot;
+
+	// Split this up to avoid overflowing when we multiply.
+	size_t seconds = ticks / tsc_ticks_per_second;
+	size_t remaining_ticks = ticks % tsc_ticks_per_second;
+	return seconds * 1000000 + remaining_ticks * 1000000 / tsc_ticks_per_second;
 }
 
 // Sends a message to the process at or after a specified number of microseconds
@@ -91,46 +298,15 @@ void SendMessageToProcessAtMicroseconds(
 	timer_event->timestamp_to_trigger_at = timestamp;
 	timer_event->message_id_to_send = message_id;
 
-	// Add to global queue, in assending order based on timestamp.
-
-	// Find the timer event we should insert ourselves after.
-	struct TimerEvent* previous_timer_event = NULL;
-	if (next_scheduled_timer_event != NULL &&
-		next_scheduled_timer_event->timestamp_to_trigger_at < timestamp) {
-		// We have events to trigger before us.
-		previous_timer_event = next_scheduled_timer_event;
-
-		// Keep iterating if there are still events to trigger before us.
-		while (previous_timer_event->next_scheduled_timer_event != NULL &&
-			previous_timer_event->next_scheduled_timer_event
-				->timestamp_to_trigger_at < timestamp) {
-
-			previous_timer_event = previous_timer_event->next_scheduled_timer_event;
-	}
-	}
-
-	if (previous_timer_event == NULL) {
-		// We're at the front of the queue!
-		timer_event->previous_scheduled_timer_event = NULL;
-		if (next_scheduled_timer_event != NULL) {
-			next_scheduled_timer_event->previous_scheduled_timer_event = timer_event;
-		}
-		timer_event->next_scheduled_timer_event = next_scheduled_timer_event;
-		next_scheduled_timer_event = timer_event;
-	} else {
-		// Insert ourselves after this timestamp.
-		timer_event->previous_scheduled_timer_event =
-			previous_timer_event;
-		timer_event->next_scheduled_timer_event =
-			previous_timer_event->next_scheduled_timer_event;
-
-		previous_timer_event->next_scheduled_timer_event =
-			timer_event;
+	// Add to the heap of scheduled timer events.
+	AddTimerEventToHeap(timer_event);
 
-		if (timer_event->next_scheduled_timer_event) {
-			timer_event->next_scheduled_timer_event->
-				previous_scheduled_timer_event = timer_event;
-		}
+	if (next_scheduled_timer_event == timer_event) {
+		// This is the next timer event, so the timer needs to fire sooner.
+		if (GetCurrentCpu()->id == TIMER_EVENT_CPU)
+			ProgramTimerForNextDeadline();
+		else
+			SendRescheduleInterrupt(&cpus[TIMER_EVENT_CPU]);
 	}
 
 	// Add to process.
@@ -153,21 +329,8 @@ void CancelAllTimerEventsForProcess(struct Process* process) {
 		// Remove this TimerEvent from the linked list in the process.
 		process->timer_event = timer_event->next_timer_event_in_process;
 
-		// Remove from sceduled timer events.
-		if (timer_event->previous_scheduled_timer_event == NULL) {
-			next_scheduled_timer_event =
-				timer_event->next_scheduled_timer_event;
-		} else {
-			timer_event->previous_scheduled_timer_event->
-				next_scheduled_timer_event = 
-					timer_event->next_scheduled_timer_event;
-		}
-
-		if (timer_event->next_scheduled_timer_event != NULL) {
-			timer_event->next_scheduled_timer_event->
-				previous_scheduled_timer_event =
-					timer_event->previous_scheduled_timer_event;
-		}
+		// Remove from the scheduled timer events.
+		RemoveTimerEventFromHeap(timer_event);
 
 		// Release the memory for the TimerEvent.
 		ReleaseTimerEvent(timer_event);
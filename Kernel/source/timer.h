@@ -1,17 +1,33 @@
 #pragma once
 #include "types.h"
 
-// The programmable interrupt timer (PIT) triggers many times a second and is the basis of
-// preemptive multitasking.
+// Each CPU's local APIC timer is programmed in one-shot mode to fire at the
+// next deadline - the end of the running thread's time slice, or the next
+// timer event - and is the basis of preemptive multitasking. Time is read from
+// the TSC, which is calibrated against the programmable interrupt timer (PIT).
 
 struct Process;
 
+// The number of time slices per second.
+#define TIME_SLICES_PER_SECOND 100
+
+// The length of a time slice.
+#define TIME_SLICE_MICROSECONDS (1000000 / TIME_SLICES_PER_SECOND)
+
 // The function that gets called each time to timer fires.
 extern void TimerHandler();
 
 // Initializes the timer.
 extern void InitializeTimer();
 
+// Programs the local APIC timer of the CPU we're running on to fire at the
+// next deadline. Called whenever the deadline might have changed.
+extern void ProgramTimerForNextDeadline();
+
+// Spins for at least the number of microseconds. Used for short delays while
+// initializing hardware.
+extern void BusyWaitMicroseconds(size_t microseconds);
+
 // Returns the current time, in microseconds, since the kernel has started.
 extern size_t GetCurrentTimestampInMicroseconds();
 
@@ -30,10 +30,13 @@ struct TimerEvent {
 	// The message ID of the timer to send.
 	size_t message_id_to_send;
 
-	// Linked list, ordered by timerstamp_to_trigger, of all
-	// scheduled TimerEvents.
-	struct TimerEvent* previous_scheduled_timer_event;
-	struct TimerEvent* next_scheduled_timer_event;
+	// Pairing heap, ordered by timestamp_to_trigger_at, of all scheduled
+	// TimerEvents. The first child is the head of a list of children that are
+	// linked by their siblings. The previous pointer points to the left
+	// sibling, or to the parent if this is the first child.
+	struct TimerEvent* first_child_timer_event;
+	struct TimerEvent* next_sibling_timer_event;
+	struct TimerEvent* previous_timer_event_in_heap;
 
 	// Linked list in the process.
 	struct TimerEvent* previous_timer_event_in_process;
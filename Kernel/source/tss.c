@@ -14,31 +14,44 @@
 
 #include "tss.h"
 
+#include "cpu.h"
 #include "io.h"
-#include "liballoc.h"
 #include "physical_allocator.h"
 #include "text_terminal.h"
 #include "virtual_allocator.h"
 
-// Pointers for the TSS entry in the GDT. WARNING: These refer to symbols in
-// lower memory, so we'll have to add VIRTUAL_MEMORY_OFFSET when deferencing them.
-extern uint64 TSSEntry;
+// The GDT set up in boot.asm. WARNING: This refers to a symbol in lower
+// memory, so we'll have to add VIRTUAL_MEMORY_OFFSET when deferencing it.
+extern uint64 Gdt64;
 
 // Size of the TSS 
 #define TSS_SIZE 104
 // Index of RSP0 in the TSS (stack pointer for ring 0).
 #define RSP0_LOW 1
 #define RSP0_HIGH 2
-// Pointer to the TSS.
-uint32* tss;
 
 // TSS offset in the GDT. The GDT is hardcoded in boot.asm.
 #define TSS_GDT_OFFSET 0x28
 
-// Initializes the task segment structure.
+// Reference to a global descriptor table.
+struct gdt_ptr {
+	unsigned short limit;
+	size_t base;
+} __attribute__ ((packed));
+
+// Initializes the task segment structure of the CPU we're running on. Each
+// CPU gets its own copy of the GDT so that it can point to its own TSS.
 void InitializeTss() {
-	// Allocate and clear the TSS.
-	tss = malloc(TSS_SIZE);
+	struct Cpu* cpu = GetCurrentCpu();
+	uint32* tss = cpu->tss;
+	_Static_assert(sizeof(cpu->tss) == TSS_SIZE, "The TSS is the wrong size.");
+
+	// Copy the GDT from boot.asm.
+	memcpy((unsigned char*)cpu->gdt,
+		(unsigned char*)((size_t)&Gdt64 + VIRTUAL_MEMORY_OFFSET),
+		sizeof(cpu->gdt));
+
+	// Clear the TSS.
 	memset((char *)tss, 0, TSS_SIZE);
 
 	// Set the TSS entry in the GDT.
@@ -64,15 +77,24 @@ void InitializeTss() {
 
 	tss_entry_dwords[0] = (base >> 32) & 0xFFFFFFFF;
 
-	*(uint64*)(((size_t)&TSSEntry) + VIRTUAL_MEMORY_OFFSET) = tss_entry_low;
-	*(uint64*)(((size_t)&TSSEntry) + VIRTUAL_MEMORY_OFFSET + 8) = tss_entry_high;
+	cpu->gdt[TSS_GDT_OFFSET / 8] = tss_entry_low;
+	cpu->gdt[TSS_GDT_OFFSET / 8 + 1] = tss_entry_high;
 
 	// Point the IOPB bitmap offset to the end of TSS structure, because it's unused.
 	((uint16*)tss)[51] = TSS_SIZE;
+
+	// Load this CPU's GDT. The segment selectors stay the same.
+	struct gdt_ptr gdt_p;
+	gdt_p.limit = sizeof(cpu->gdt) - 1;
+	gdt_p.base = (size_t)cpu->gdt;
+	__asm__ __volatile__("lgdt (%0)":: "r"(&gdt_p) : "memory");
+
+	// Load the TSS.
+	__asm__ __volatile__("ltr %0":: "r"((uint16)TSS_GDT_OFFSET));
 }
 
 
-// Sets the stack to use for interrupts.
+// Sets the stack to use for interrupts on the CPU we're running on.
 void SetInterruptStack(size_t interrupt_stack_start_virtual_addr) {
 	// Stacks grow downwards.
 	size_t top_of_stack = interrupt_stack_start_virtual_addr + PAGE_SIZE;
@@ -80,9 +102,7 @@ void SetInterruptStack(size_t interrupt_stack_start_virtual_addr) {
 	uint32 low = top_of_stack & 0xFFFFFFFF;
 	uint32 high = top_of_stack >> 32;
 
+	uint32* tss = GetCurrentCpu()->tss;
 	tss[RSP0_LOW] = low;
 	tss[RSP0_HIGH] = high;
-
-	// Load the TSS.
-	__asm__ __volatile__("ltr %0":: "r"((uint16)TSS_GDT_OFFSET));
 }
\ No newline at end of file
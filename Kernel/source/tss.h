@@ -16,8 +16,8 @@
 
 #include "types.h"
 
-// Initializes the task segment structure.
+// Initializes the task segment structure of the CPU we're running on.
 extern void InitializeTss();
 
-// Sets the stack to use for interrupts.
+// Sets the stack to use for interrupts on the CPU we're running on.
 extern void SetInterruptStack(size_t interrupt_stack_start_virtual_addr);
\ No newline at end of file
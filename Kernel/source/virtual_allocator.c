@@ -1,5 +1,6 @@
 #include "virtual_allocator.h"
 
+#include "io.h"
 #include "object_pools.h"
 #include "physical_allocator.h"
 #include "process.h"
@@ -17,9 +18,14 @@ size_t kernel_pml4;
 size_t *temp_memory_page_table;
 // Start address of what the temporary page table refers to.
 size_t temp_memory_start;
-
-// The address of the currently loaded PML4.
-size_t current_pml4;
+// The end of the physical memory that is mapped at DIRECT_MAP_OFFSET.
+size_t direct_map_end;
+// The number of times that we've reloaded CR3, for benchmarking.
+size_t cr3_reloads;
+// Whether address spaces are tagged with PCIDs, so switching between them doesn't flush the TLB.
+bool pcids_enabled;
+// Whether the CPU supports INVPCID, for flushing entries of a PCID that isn't loaded.
+bool invpcid_supported;
 
 // Start of the free memory on boot.
 extern size_t bssEnd;
@@ -33,6 +39,101 @@ extern size_t bssEnd;
 // The number of entries in a page table. Each entry is 8 bytes long.
 #define PAGE_TABLE_ENTRIES (PAGE_TABLE_SIZE / PAGE_TABLE_ENTRY_SIZE)
 
+_Static_assert(MAX_CPUS * TEMPORARY_MAPPINGS_PER_CPU <= PAGE_TABLE_ENTRIES,
+	"Every CPU's temporary mappings must fit in the temporary page table.");
+
+// The number of bytes that a PML1 (and the pages it maps) covers.
+#define PAGE_TABLE_RANGE (PAGE_SIZE * PAGE_TABLE_ENTRIES) // 2 MB
+
+// The page table entry bit for a PML2 entry that maps a 2 MB page rather than
+// pointing to a PML1.
+#define LARGE_PAGE_BIT (1 << 7)
+
+// The physical address bits in a PML2 entry that maps a 2 MB page. Bit 12 is
+// the PAT bit rather than part of the address.
+#define LARGE_PAGE_ADDRESS_MASK 0x000FFFFFFFE00000
+
+// A custom page table entry bit for pages that are shared copy-on-write. These
+// pages are mapped read-only, and each page has a CopyOnWritePage counting the
+// number of places that it's mapped into.
+#define COPY_ON_WRITE_PAGE_BIT (1 << 10)
+
+// The number of buckets in the hash table of copy-on-write pages.
+#define COPY_ON_WRITE_PAGE_BUCKETS 256
+
+// Beyond this many pages, it's cheaper to flush the whole TLB than to flush
+// each page.
+#define MAX_PAGES_TO_FLUSH_INDIVIDUALLY 32
+
+// The page table entry bit for pages that stay in the TLB when CR3 is reloaded. All kernel pages are global, because
+// every address space shares them.
+#define GLOBAL_PAGE_BIT (1 << 8)
+
+// CR4 bits to enable global pages and PCIDs.
+#define CR4_PGE (1 << 7)
+#define CR4_PCIDE (1 << 17)
+
+// Setting this bit when loading CR3 keeps the TLB entries of the PCID being loaded.
+#define CR3_NO_FLUSH ((size_t)1 << 63)
+
+// CPUID feature bits: PCID in leaf 1's ECX, and INVPCID in leaf 7's EBX.
+#define CPUID_PCID_BIT (1 << 17)
+#define CPUID_INVPCID_BIT (1 << 10)
+
+// INVPCID types.
+#define INVPCID_ADDRESS 0
+#define INVPCID_EVERYTHING 2
+
+// The number of PCIDs, which are 12 bits wide.
+#define PCIDS 4096
+
+// The kernel's PCID. Kernel pages are global so this never needs flushing.
+#define KERNEL_PCID 0
+
+// The PCID that address spaces share once every other PCID has been handed out. It's flushed every time it's loaded.
+#define SHARED_PCID (PCIDS - 1)
+
+// Bitmap of the PCIDs that are in use.
+size_t pcids_in_use[PCIDS / 64];
+
+// Where to start looking for a free PCID, in pcids_in_use.
+size_t next_pcid_word;
+
+// Hash table of the physical pages that are shared copy-on-write, keyed by
+// physical address.
+struct CopyOnWritePage* copy_on_write_pages[COPY_ON_WRITE_PAGE_BUCKETS];
+
+// A page of zeros that newly allocated user memory is mapped to, copy-on-write,
+// so physical pages are only allocated once the memory is written to.
+size_t zero_page;
+
+// The copy-on-write record for the zero page. It holds on to an extra
+// reference so that the zero page is never freed.
+struct CopyOnWritePage zero_copy_on_write_page;
+
+// The parts of a user address space that we hand out. The null page is never
+// handed out, the non-canonical hole splits the rest in two, and the top PML4
+// entry belongs to the kernel.
+#define USER_LOWER_HALF_START PAGE_SIZE
+#define USER_LOWER_HALF_END 0x0000800000000000
+#define USER_HIGHER_HALF_START 0xFFFF800000000000
+#define USER_HIGHER_HALF_END DIRECT_MAP_OFFSET
+
+// The number of buckets in the hash table of user address spaces.
+#define VIRTUAL_ADDRESS_SPACE_BUCKETS 64
+
+// Hash table of the free address ranges of each user address space, keyed by
+// PML4.
+struct VirtualAddressSpace* virtual_address_spaces[VIRTUAL_ADDRESS_SPACE_BUCKETS];
+
+static void UnmapPage(size_t pml4, size_t virtualaddr, bool free);
+static void UnmapPages(size_t pml4, size_t start, size_t pages, bool free);
+static bool MapLargePage(size_t pml4, size_t virtualaddr, size_t physicaladdr, bool own);
+static void FlushVirtualPagesInAddressSpace(size_t pml4, size_t addr, size_t pages);
+static void FlushVirtualPagesOnInactiveCpus(size_t pml4, size_t addr, size_t pages);
+static bool MapZeroPagesAt(size_t pml4, size_t start, size_t pages);
+static struct CopyOnWritePage** GetCopyOnWritePageBucket(size_t physicaladdr);
+
 
 // Maps a physical address to a virtual address in the kernel - at boot time while paging is initializing.
 // assign_page_table - true if we're assigning a page table (for our temp memory) rather than a page.
@@ -129,14 +230,115 @@ void MapKernelMemoryPreVirtualMemory(size_t virtualaddr, size_t physicaladdr, bo
 
 	// Write us in PML1.
 	ptr = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(pml1);
-	size_t entry = physicaladdr | 0x3;
+	size_t entry = physicaladdr | 0x3 | GLOBAL_PAGE_BIT;
 	ptr[pml1_entry] = entry;
 }
 
+// Maps all of physical memory into the kernel at DIRECT_MAP_OFFSET with 2 MB pages - at boot time while paging is
+// initializing. The kernel's code must already be mapped, so the kernel's PML3 exists.
+static void MapDirectMemoryPreVirtualMemory() {
+	size_t end = (end_of_physical_memory + PAGE_TABLE_RANGE - 1) & ~(PAGE_TABLE_RANGE - 1); // Round up.
+	if(end > MAX_DIRECT_MAP_SIZE)
+		end = MAX_DIRECT_MAP_SIZE;
+
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(kernel_pml4);
+	size_t pml3 = ptr[PAGE_TABLE_ENTRIES - 1] & ~(PAGE_SIZE - 1);
+
+	// Each PML2 maps 1 GB.
+	size_t addr;
+	for(addr = 0; addr < end; addr += PAGE_TABLE_RANGE * PAGE_TABLE_ENTRIES) {
+		size_t pml2 = GetPhysicalPagePreVirtualMemory();
+		ptr = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(pml2);
+		size_t i;
+		for(i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+			size_t physicaladdr = addr + i * PAGE_TABLE_RANGE;
+			ptr[i] = physicaladdr < end ? (physicaladdr | LARGE_PAGE_BIT | GLOBAL_PAGE_BIT | 0x3) : 0;
+		}
+
+		ptr = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(pml3);
+		ptr[((DIRECT_MAP_OFFSET + addr) >> 30) & 511] = pml2 | 0x3;
+	}
+}
+
+// Detects which TLB features the CPU supports.
+static void DetectTlbFeatures() {
+	uint32 eax, ebx, ecx, edx;
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0), "c"(0));
+	size_t highest_leaf = eax;
+
+	asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(1), "c"(0));
+	pcids_enabled = (ecx & CPUID_PCID_BIT) != 0;
+
+	invpcid_supported = false;
+	if(pcids_enabled && highest_leaf >= 7) {
+		asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(7), "c"(0));
+		invpcid_supported = (ebx & CPUID_INVPCID_BIT) != 0;
+	}
+}
+
+// Enables global pages, and PCIDs if the CPU supports them, on the CPU we're running on. The kernel's PML4 must be
+// loaded.
+void EnableTlbFeatures() {
+	size_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	cr4 |= CR4_PGE;
+	if(pcids_enabled)
+		cr4 |= CR4_PCIDE;
+	asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// Invalidates TLB entries with INVPCID.
+static void Invpcid(size_t type, size_t pcid, size_t addr) {
+	struct {
+		size_t pcid;
+		size_t addr;
+	} descriptor = {pcid, addr};
+	asm volatile("invpcid %0, %1" :: "m"(descriptor), "r"(type) : "memory");
+}
+
+// Flushes every entry from this CPU's TLB, including global pages and the entries of every PCID.
+static void FlushEntireTlb() {
+	if(invpcid_supported) {
+		Invpcid(INVPCID_EVERYTHING, 0, 0);
+		return;
+	}
+
+	// Toggling global pages flushes everything.
+	size_t cr4;
+	asm volatile("mov %%cr4, %0" : "=r"(cr4));
+	asm volatile("mov %0, %%cr4" :: "r"(cr4 ^ CR4_PGE) : "memory");
+	asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// Hands out a PCID for a user address space. Returns SHARED_PCID if they're all in use.
+static size_t AllocatePcid() {
+	for(size_t i = 0; i < PCIDS / 64; i++) {
+		size_t word = (next_pcid_word + i) % (PCIDS / 64);
+		if(pcids_in_use[word] != ~(size_t)0) {
+			size_t bit = __builtin_ctzll(~pcids_in_use[word]);
+			pcids_in_use[word] |= (size_t)1 << bit;
+			next_pcid_word = word;
+			return word * 64 + bit;
+		}
+	}
+	return SHARED_PCID;
+}
+
+// Returns a PCID so it can be handed out again.
+static void ReleasePcid(size_t pcid) {
+	if(pcid != SHARED_PCID)
+		pcids_in_use[pcid / 64] &= ~((size_t)1 << (pcid % 64));
+}
+
 // Initializes the virtual allocator.
 void InitializeVirtualAllocator() {
 	// We entered long mode with a temporary setup, now it's time to build a real paging system for us.
 
+	// Nothing is directly mapped until we load our PML4.
+	direct_map_end = 0;
+	cr3_reloads = 0;
+	pcids_enabled = false;
+
 	// Allocate a physical page to use as the kernel's PML4 and clear it.
 	kernel_pml4 = GetPhysicalPagePreVirtualMemory();
 	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemoryPreVirtualMemory(kernel_pml4);
@@ -154,6 +356,9 @@ void InitializeVirtualAllocator() {
 		MapKernelMemoryPreVirtualMemory(i + VIRTUAL_MEMORY_OFFSET, i, false);
 	i += VIRTUAL_MEMORY_OFFSET;
 
+	// Map all of physical memory, so we rarely need temporary mappings.
+	MapDirectMemoryPreVirtualMemory();
+
 	// Allocate a virtual and physical page for our temporary page table.
 	temp_memory_page_table = (size_t *)i;
 	i += PAGE_SIZE;
@@ -171,10 +376,44 @@ void InitializeVirtualAllocator() {
 	for(i = 0; i < PAGE_TABLE_ENTRIES; i++)
 		ptr[i] = 1; // Assigned.
 
+	// Nothing is shared copy-on-write yet.
+	for(i = 0; i < COPY_ON_WRITE_PAGE_BUCKETS; i++)
+		copy_on_write_pages[i] = NULL;
+
+	// There are no user address spaces yet.
+	for(i = 0; i < VIRTUAL_ADDRESS_SPACE_BUCKETS; i++)
+		virtual_address_spaces[i] = NULL;
+
+	// The kernel's PCID and the shared PCID are never handed out.
+	for(i = 0; i < PCIDS / 64; i++)
+		pcids_in_use[i] = 0;
+	pcids_in_use[KERNEL_PCID / 64] |= (size_t)1 << (KERNEL_PCID % 64);
+	pcids_in_use[SHARED_PCID / 64] |= (size_t)1 << (SHARED_PCID % 64);
+	next_pcid_word = 0;
+
 	// Flush and load the kernel's new and final PML4.
 	current_pml4 = 1; // A dud entry so SwitchToAddressSpace works.
 	SwitchToAddressSpace(kernel_pml4);
 
+	// PCIDs can only be enabled once the loaded CR3 has PCID 0.
+	DetectTlbFeatures();
+	EnableTlbFeatures();
+	direct_map_end = (end_of_physical_memory + PAGE_TABLE_RANGE - 1) & ~(PAGE_TABLE_RANGE - 1);
+	if(direct_map_end > MAX_DIRECT_MAP_SIZE)
+		direct_map_end = MAX_DIRECT_MAP_SIZE;
+
+	// Now that all of physical memory is reachable, the rest of the free
+	// memory can be handed over to the buddy allocator.
+	InitializeBuddyAllocator();
+
+	// Set up the zero page, which is always shared copy-on-write.
+	zero_page = GetPhysicalPage();
+	zero_copy_on_write_page.physical_address = zero_page;
+	zero_copy_on_write_page.references = 1;
+	struct CopyOnWritePage** bucket = GetCopyOnWritePageBucket(zero_page);
+	zero_copy_on_write_page.next = *bucket;
+	*bucket = &zero_copy_on_write_page;
+
 	// Reclaim the PML4, PDPT, PD set up at boot time.
 	UnmapVirtualPage(kernel_pml4, (size_t)Pml4 + VIRTUAL_MEMORY_OFFSET, true);
 	UnmapVirtualPage(kernel_pml4, (size_t)Pdpt + VIRTUAL_MEMORY_OFFSET, true);
@@ -224,25 +463,204 @@ void *TemporarilyMapPhysicalMemoryPreVirtualMemory(size_t addr) {
 }
 
 
-// Temporarily maps physical memory (page aligned) into virtual memory so we can fiddle with it.
-// index is from 0 to 511 - mapping a different address to the same index unmaps the previous page mapped there.
+// Returns a pointer to physical memory (page aligned) so we can fiddle with it. Memory in the direct map is always
+// reachable, anything past it is temporarily mapped. index is from 0 to TEMPORARY_MAPPINGS_PER_CPU - 1, and each CPU
+// has its own set of temporary mappings - mapping a different address to the same index unmaps the previous page
+// mapped there.
 void *TemporarilyMapPhysicalMemory(size_t addr, size_t index) {
-	size_t entry = addr | 0x3;
+	if(addr < direct_map_end)
+		return (void *)(DIRECT_MAP_OFFSET + addr);
+
+	size_t entry = addr | 0x3 | GLOBAL_PAGE_BIT;
+
+	// Each CPU has its own range of the temporary page table, so CPUs don't
+	// have to flush each other's TLBs when they change a mapping.
+	index += GetCurrentCpu()->id * TEMPORARY_MAPPINGS_PER_CPU;
 	
 	// Check if it's not already mapped.
 	if(temp_memory_page_table[index] != entry) {
 		// Map this page into our temporary page table.
 		temp_memory_page_table[index] = entry;
-		// Flush our page table cache.
-		__asm__ __volatile__("mov %0, %%cr3":: "a"(current_pml4));
+		// Flush the old mapping from our page table cache.
+		FlushVirtualPage(temp_memory_start + PAGE_SIZE * index);
 	}
 
 	// Return a pointer to the virtual address of the requested physical memory.
 	return (void *)(temp_memory_start + PAGE_SIZE * index);
 }
 
-// Finds a range of free physical pages in memory - returns the first address or OUT_OF_MEMORY if it can't find a fit.
-size_t FindFreePageRange(size_t pml4, size_t pages) {
+// Returns the FreeMemoryRange that a node in free_ranges_by_address belongs to.
+static struct FreeMemoryRange* GetFreeMemoryRangeFromAddressNode(struct AATreeNode* node) {
+	return (struct FreeMemoryRange*)((size_t)node -
+		__builtin_offsetof(struct FreeMemoryRange, node_by_address));
+}
+
+// Returns the FreeMemoryRange that a node in free_ranges_by_size belongs to.
+static struct FreeMemoryRange* GetFreeMemoryRangeFromSizeNode(struct AATreeNode* node) {
+	return (struct FreeMemoryRange*)((size_t)node -
+		__builtin_offsetof(struct FreeMemoryRange, node_by_size));
+}
+
+// Sorts free_ranges_by_address.
+static size_t CalculateFreeMemoryRangeAddress(struct AATreeNode* node) {
+	return GetFreeMemoryRangeFromAddressNode(node)->start_address;
+}
+
+// Sorts free_ranges_by_size.
+static size_t CalculateFreeMemoryRangeSize(struct AATreeNode* node) {
+	return GetFreeMemoryRangeFromSizeNode(node)->pages;
+}
+
+// Returns the hash table bucket for an address space.
+static struct VirtualAddressSpace** GetVirtualAddressSpaceBucket(size_t pml4) {
+	return &virtual_address_spaces[(pml4 / PAGE_SIZE) % VIRTUAL_ADDRESS_SPACE_BUCKETS];
+}
+
+// Returns the free address ranges of a user address space, or NULL if it's
+// not a user address space.
+static struct VirtualAddressSpace* FindVirtualAddressSpace(size_t pml4) {
+	struct VirtualAddressSpace* space = *GetVirtualAddressSpaceBucket(pml4);
+	while(space != NULL && space->pml4 != pml4)
+		space = space->next;
+	return space;
+}
+
+// Adds a free range to both of the address space's trees.
+static void AddFreeMemoryRange(struct VirtualAddressSpace* space,
+	struct FreeMemoryRange* range) {
+	InsertNodeIntoAATree(&space->free_ranges_by_address, &range->node_by_address);
+	InsertNodeIntoAATree(&space->free_ranges_by_size, &range->node_by_size);
+}
+
+// Removes a free range from both of the address space's trees.
+static void RemoveFreeMemoryRange(struct VirtualAddressSpace* space,
+	struct FreeMemoryRange* range) {
+	RemoveNodeFromAATree(&space->free_ranges_by_address, &range->node_by_address);
+	RemoveNodeFromAATree(&space->free_ranges_by_size, &range->node_by_size);
+}
+
+// Marks the addresses from start up until end as in use.
+static void ReserveAddressRange(struct VirtualAddressSpace* space, size_t start,
+	size_t end) {
+	for(;;) {
+		// Find the first free range that ends after start.
+		struct AATreeNode* node = SearchForNodeLessThanOrEqualToValue(
+			&space->free_ranges_by_address, start);
+		struct FreeMemoryRange* range = node == NULL ? NULL :
+			GetFreeMemoryRangeFromAddressNode(node);
+		if(range == NULL || range->start_address + range->pages * PAGE_SIZE <= start) {
+			node = SearchForNodeGreaterThanOrEqualToValue(
+				&space->free_ranges_by_address, start);
+			if(node == NULL)
+				return;
+			range = GetFreeMemoryRangeFromAddressNode(node);
+		}
+
+		if(range->start_address >= end) {
+			// Nothing else overlaps.
+			return;
+		}
+
+		// Cut the overlapping part out of the free range.
+		size_t range_end = range->start_address + range->pages * PAGE_SIZE;
+		RemoveFreeMemoryRange(space, range);
+		if(range->start_address < start) {
+			if(range_end > end) {
+				// The range continues after the reserved addresses.
+				struct FreeMemoryRange* after = AllocateFreeMemoryRange();
+				if(after != NULL) {
+					after->start_address = end;
+					after->pages = (range_end - end) / PAGE_SIZE;
+					AddFreeMemoryRange(space, after);
+				}
+				// If we're out of memory, the addresses after are lost to
+				// this address space, which is safer than handing them out
+				// twice.
+			}
+			range->pages = (start - range->start_address) / PAGE_SIZE;
+			AddFreeMemoryRange(space, range);
+		} else if(range_end > end) {
+			range->start_address = end;
+			range->pages = (range_end - end) / PAGE_SIZE;
+			AddFreeMemoryRange(space, range);
+		} else {
+			ReleaseFreeMemoryRange(range);
+		}
+	}
+}
+
+// Marks the addresses from start up until end as free, merging them with the
+// free ranges on either side. The addresses must be inside one half of the
+// user address space.
+static void ReleaseAddressRangeInHalf(struct VirtualAddressSpace* space,
+	size_t start, size_t end) {
+	// Make sure none of the addresses are already free, so the free ranges
+	// never overlap.
+	ReserveAddressRange(space, start, end);
+
+	struct FreeMemoryRange* range = NULL;
+	struct AATreeNode* node = SearchForNodeLessThanOrEqualToValue(
+		&space->free_ranges_by_address, start);
+	if(node != NULL) {
+		struct FreeMemoryRange* before = GetFreeMemoryRangeFromAddressNode(node);
+		if(before->start_address + before->pages * PAGE_SIZE == start) {
+			RemoveFreeMemoryRange(space, before);
+			start = before->start_address;
+			range = before;
+		}
+	}
+
+	node = SearchForNodeGreaterThanOrEqualToValue(
+		&space->free_ranges_by_address, end);
+	if(node != NULL) {
+		struct FreeMemoryRange* after = GetFreeMemoryRangeFromAddressNode(node);
+		if(after->start_address == end) {
+			RemoveFreeMemoryRange(space, after);
+			end = after->start_address + after->pages * PAGE_SIZE;
+			if(range == NULL)
+				range = after;
+			else
+				ReleaseFreeMemoryRange(after);
+		}
+	}
+
+	if(range == NULL) {
+		range = AllocateFreeMemoryRange();
+		if(range == NULL) {
+			// Out of memory, so the addresses stay reserved.
+			return;
+		}
+	}
+
+	range->start_address = start;
+	range->pages = (end - start) / PAGE_SIZE;
+	AddFreeMemoryRange(space, range);
+}
+
+// Marks the addresses from start up until end as free, ignoring any that
+// aren't in the user address space.
+static void ReleaseAddressRange(struct VirtualAddressSpace* space, size_t start,
+	size_t end) {
+	start &= ~(PAGE_SIZE - 1);
+	if(end < start) {
+		// The range wrapped around.
+		end = USER_HIGHER_HALF_END;
+	}
+
+	size_t half_start = start > USER_LOWER_HALF_START ? start : USER_LOWER_HALF_START;
+	size_t half_end = end < USER_LOWER_HALF_END ? end : USER_LOWER_HALF_END;
+	if(half_start < half_end)
+		ReleaseAddressRangeInHalf(space, half_start, half_end);
+
+	half_start = start > USER_HIGHER_HALF_START ? start : USER_HIGHER_HALF_START;
+	half_end = end < USER_HIGHER_HALF_END ? end : USER_HIGHER_HALF_END;
+	if(half_start < half_end)
+		ReleaseAddressRangeInHalf(space, half_start, half_end);
+}
+
+// Finds a range of free virtual pages in memory by scanning the page tables - returns the first address or OUT_OF_MEMORY
+// if it can't find a fit.
+static size_t FindFreePageRangeInPageTables(size_t pml4, size_t pages) {
 	if(pages == 0 || pages > 34359738368 /* 128 GB */) {
 		// Too many or not enough entries.
 		return 0; 
@@ -315,7 +733,11 @@ size_t FindFreePageRange(size_t pml4, size_t pages) {
 					ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
 					size_t k;
 					for(k = 0; k < PAGE_TABLE_ENTRIES && pages_counted < pages; k++) {
-						if(ptr[k] == 0) {
+						if(ptr[k] & LARGE_PAGE_BIT) {
+							// A 2 MB page, such as in the direct map.
+							counting = false;
+							pages_counted = 0;
+						} else if(ptr[k] == 0) {
 							if(!counting) {
 								counting = true;
 								start_pml1_entry = 0;
@@ -398,8 +820,61 @@ size_t FindFreePageRange(size_t pml4, size_t pages) {
 	return addr;
 }
 
-// Maps a physical page to a virtual page. Returns if it was successful.
-bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physicaladdr, bool own) {
+// Finds a range of free virtual pages - returns the first address or OUT_OF_MEMORY if it can't find a fit. In user address
+// spaces the range is reserved until it's released with ReleaseVirtualMemoryInAddressSpace or UnmapVirtualPage.
+size_t FindFreePageRange(size_t pml4, size_t pages) {
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL) {
+		// The kernel's address space is small enough to scan.
+		return FindFreePageRangeInPageTables(pml4, pages);
+	}
+
+	if(pages == 0)
+		return OUT_OF_MEMORY;
+
+	// Take the start of the smallest free range that fits.
+	struct AATreeNode* node = SearchForNodeGreaterThanOrEqualToValue(
+		&space->free_ranges_by_size, pages);
+	if(node == NULL)
+		return OUT_OF_MEMORY;
+
+	size_t addr = GetFreeMemoryRangeFromSizeNode(node)->start_address;
+	ReserveAddressRange(space, addr, addr + pages * PAGE_SIZE);
+
+#ifdef DEBUG
+	PrintString("Allocating ");
+	PrintNumber(pages);
+	PrintString(" at ");
+	PrintHex(addr);
+	PrintString("\n");
+#endif
+
+	return addr;
+}
+
+// Finds and reserves a range of free virtual pages, like FindFreePageRange, but places it offset bytes past a 2 MB
+// boundary so that memory that is physically laid out the same way can be mapped with 2 MB pages. Falls back to
+// FindFreePageRange for ranges too small to hold a 2 MB page, or if there's no room for the padding.
+static size_t FindFreePageRangeForLargePages(size_t pml4, size_t pages, size_t offset) {
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL || pages < PAGE_TABLE_ENTRIES)
+		return FindFreePageRange(pml4, pages);
+
+	// Any free range with an extra 2 MB (less a page) has an aligned start in it.
+	struct AATreeNode* node = SearchForNodeGreaterThanOrEqualToValue(
+		&space->free_ranges_by_size, pages + PAGE_TABLE_ENTRIES - 1);
+	if(node == NULL)
+		return FindFreePageRange(pml4, pages);
+
+	size_t range_start = GetFreeMemoryRangeFromSizeNode(node)->start_address;
+	size_t addr = range_start + ((offset - range_start) & (PAGE_TABLE_RANGE - 1));
+	ReserveAddressRange(space, addr, addr + pages * PAGE_SIZE);
+	return addr;
+}
+
+// Maps a physical page to a virtual page without reserving the address, because the caller already has. Returns if it
+// was successful.
+static bool MapPage(size_t pml4, size_t virtualaddr, size_t physicaladdr, bool own) {
 	// Find the index into each PML table.
 	// 6666 5555 5555 5544 4444 4444 4333 3333 3332 2222 2222 2111 1111 111
 	// 4321 0987 6543 2109 8765 4321 0987 6543 2109 8765 4321 0978 6543 2109 8765 4321
@@ -528,6 +1003,9 @@ bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physic
 		ptr[pml2_entry] = new_pml1 | 0x3 |
 			// Set the user bit.
 			(user_page ? (1 << 2) : 0);
+	} else if((ptr[pml2_entry] & LARGE_PAGE_BIT) != 0) {
+		// This address is already mapped by a 2 MB page.
+		return false;
 	}
 
 	size_t pml1 = ptr[pml2_entry] & ~(PAGE_SIZE - 1);
@@ -541,8 +1019,8 @@ bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physic
 
 	// Write us in PML1.
 	size_t entry = physicaladdr | 0x3 |
-		// Set the user bit.
-		(user_page ? (1 << 2) : 0) |
+		// Set the user bit, or the global bit for kernel pages.
+		(user_page ? (1 << 2) : GLOBAL_PAGE_BIT) |
 		// Set the ownership bit (a custom bit.)
 		(own ? (1 << 9) : 0);
 	ptr[pml1_entry] = entry;
@@ -562,6 +1040,19 @@ bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physic
 	return true;
 }
 
+// Maps a physical page to a virtual page. Returns if it was successful.
+bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physicaladdr, bool own) {
+	if(!MapPage(pml4, virtualaddr, physicaladdr, own))
+		return false;
+
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space != NULL) {
+		virtualaddr &= ~(PAGE_SIZE - 1);
+		ReserveAddressRange(space, virtualaddr, virtualaddr + PAGE_SIZE);
+	}
+	return true;
+}
+
 // Return the physical address mapped at a virtual address, returning OUT_OF_MEMORY if is not mapped.
 size_t GetPhysicalAddress(size_t pml4, size_t virtualaddr, bool ignore_unowned_pages) {
 	size_t pml4_entry = (virtualaddr >> 39) & 511;
@@ -603,6 +1094,12 @@ size_t GetPhysicalAddress(size_t pml4, size_t virtualaddr, bool ignore_unowned_p
 	if(ptr[pml2_entry] == 0) {
 		// Entry blank.
 		return OUT_OF_MEMORY;
+	} else if((ptr[pml2_entry] & LARGE_PAGE_BIT) != 0) {
+		// A 2 MB page.
+		if (ignore_unowned_pages && (ptr[pml2_entry] & (1 << 9)) == 0)
+			return OUT_OF_MEMORY;
+		return (ptr[pml2_entry] & LARGE_PAGE_ADDRESS_MASK) +
+			(virtualaddr & (PAGE_TABLE_RANGE - 1) & ~(PAGE_SIZE - 1));
 	}
 
 	size_t pml1 = ptr[pml2_entry] & ~(PAGE_SIZE - 1);
@@ -625,7 +1122,12 @@ size_t GetOrCreateVirtualPage(size_t pml4, size_t virtualaddr) {
 	size_t physical_address = GetPhysicalAddress(pml4, virtualaddr,
 		/*ignore_unowned_pages=*/ false);
 	if (physical_address != OUT_OF_MEMORY) {
-		return physical_address;
+		// The caller is going to write to the page, so it can't stay shared
+		// copy-on-write (such as with the zero page.)
+		if (!ResolveCopyOnWritePage(pml4, virtualaddr))
+			return OUT_OF_MEMORY;
+		return GetPhysicalAddress(pml4, virtualaddr,
+			/*ignore_unowned_pages=*/ false);
 	}
 
 	physical_address = GetPhysicalPage();
@@ -642,53 +1144,181 @@ size_t GetOrCreateVirtualPage(size_t pml4, size_t virtualaddr) {
 }
 
 
-size_t AllocateVirtualMemoryInAddressSpace(size_t pml4, size_t pages) {
-	size_t start = FindFreePageRange(pml4, pages);
-	if(start == OUT_OF_MEMORY) {
-		return 0;
+// Copies memory between the kernel and a process's address space, one page at
+// a time through temporary mapping 7. Returns false if any of the process's
+// memory isn't mapped, or if we're writing and the memory isn't writable.
+static bool CopyProcessMemory(size_t pml4, size_t process_address,
+	unsigned char* kernel_buffer, size_t length, bool to_process) {
+	while (length > 0) {
+		size_t offset_in_page = process_address & (PAGE_SIZE - 1);
+		size_t length_in_page = PAGE_SIZE - offset_in_page;
+		if (length_in_page > length)
+			length_in_page = length;
+
+		// Copy-on-write pages need to be copied before we can write to them.
+		if (to_process && !ResolveCopyOnWritePage(pml4,
+				process_address & ~(PAGE_SIZE - 1)))
+			return false;
+
+		size_t physical_address = GetPhysicalAddress(pml4,
+			process_address & ~(PAGE_SIZE - 1),
+			/*ignore_unowned_pages=*/false);
+		if (physical_address == OUT_OF_MEMORY)
+			return false;
+
+		unsigned char* page = (unsigned char*)TemporarilyMapPhysicalMemory(
+			physical_address, 7);
+		if (to_process)
+			memcpy(page + offset_in_page, kernel_buffer, length_in_page);
+		else
+			memcpy(kernel_buffer, page + offset_in_page, length_in_page);
+
+		process_address += length_in_page;
+		kernel_buffer += length_in_page;
+		length -= length_in_page;
 	}
+	return true;
+}
+
+// Copies memory from a process's address space into the kernel. Returns false
+// if any of the memory isn't mapped.
+bool CopyFromProcessMemory(size_t pml4, size_t source_address,
+	void* destination, size_t length) {
+	return CopyProcessMemory(pml4, source_address,
+		(unsigned char*)destination, length, /*to_process=*/false);
+}
+
+// Copies memory from the kernel into a process's address space. Returns false
+// if any of the memory isn't mapped.
+bool CopyToProcessMemory(size_t pml4, size_t destination_address,
+	const void* source, size_t length) {
+	return CopyProcessMemory(pml4, destination_address,
+		(unsigned char*)source, length, /*to_process=*/true);
+}
+
 
-	// Allocate each page we've found.
+// Allocates and maps pages at addresses that have already been reserved. Returns false if we ran out of memory, in
+// which case none of the pages are mapped. If large_pages is true, aligned 2 MB runs are mapped with 2 MB pages while
+// there are physically contiguous blocks to back them. In user address spaces, the 4 KB pages are mapped to the zero
+// page and only get their own physical page when they're first written to.
+static bool AllocatePagesAt(size_t pml4, size_t start, size_t pages, bool large_pages) {
 	size_t addr = start;
-	size_t i;
-	for(i = 0; i < pages; i++, addr += PAGE_SIZE) {
-		// Get a physical page.
-		size_t phys = GetPhysicalPage();
+	size_t end = start + pages * PAGE_SIZE;
+	while(addr < end) {
+		if(large_pages && (addr & (PAGE_TABLE_RANGE - 1)) == 0 && end - addr >= PAGE_TABLE_RANGE) {
+			size_t phys = GetPhysicalPages(LARGE_PAGE_ORDER);
+			if(phys != OUT_OF_PHYSICAL_PAGES && MapLargePage(pml4, addr, phys, true)) {
+				addr += PAGE_TABLE_RANGE;
+				continue;
+			}
+
+			// Memory is too fragmented, so use 4 KB pages for the rest rather than draining the allocator trying.
+			if(phys != OUT_OF_PHYSICAL_PAGES)
+				FreePhysicalPages(phys, LARGE_PAGE_ORDER);
+			large_pages = false;
+		}
 
-		if(phys == OUT_OF_PHYSICAL_PAGES) {
-			// No physical pages. Unmap all memory up until this point.
-			for(;start < addr; start += PAGE_SIZE) {
-				UnmapVirtualPage(pml4, start, true);
+		if(pml4 != kernel_pml4) {
+			// Map the zero page up until the next 2 MB page, or the end.
+			size_t next = end;
+			if(large_pages) {
+				next = (addr + PAGE_TABLE_RANGE) & ~(PAGE_TABLE_RANGE - 1);
+				if(next > end)
+					next = end;
 			}
-			return 0;
+			if(!MapZeroPagesAt(pml4, addr, (next - addr) / PAGE_SIZE)) {
+				UnmapPages(pml4, start, (next - start) / PAGE_SIZE, true);
+				return false;
+			}
+			addr = next;
+			continue;
 		}
 
+		// Get a physical page.
+		size_t phys = GetPhysicalPage();
+
 		// Map the physical page.
-		MapPhysicalPageToVirtualPage(pml4, addr, phys, true);
+		if(phys == OUT_OF_PHYSICAL_PAGES || !MapPage(pml4, addr, phys, true)) {
+			if(phys != OUT_OF_PHYSICAL_PAGES)
+				FreePhysicalPage(phys);
+
+			// Unmap all memory up until this point.
+			UnmapPages(pml4, start, (addr - start) / PAGE_SIZE, true);
+			return false;
+		}
 
 		if (current_pml4 == pml4) {
 			FlushVirtualPage(addr);
 		}
+		addr += PAGE_SIZE;
+	}
+	return true;
+}
+
+size_t AllocateVirtualMemoryInAddressSpace(size_t pml4, size_t pages, bool large_pages) {
+	size_t start = large_pages ? FindFreePageRangeForLargePages(pml4, pages, 0) :
+		FindFreePageRange(pml4, pages);
+	if(start == OUT_OF_MEMORY) {
+		return 0;
+	}
+
+	if(!AllocatePagesAt(pml4, start, pages, large_pages)) {
+		// No physical pages, so give back the addresses.
+		ReleaseVirtualMemoryInAddressSpace(pml4, start, pages);
+		return 0;
 	}
 
 	return start;
 }
 
-size_t ReleaseVirtualMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages) {
-	size_t i = 0;
-	for(;i < pages; i++, addr += PAGE_SIZE) {
-		UnmapVirtualPage(pml4, addr, true);
+bool AllocateVirtualMemoryAt(size_t pml4, size_t addr, size_t pages) {
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL || (addr & (PAGE_SIZE - 1)) != 0 || pages == 0)
+		return false;
+
+	// The addresses must all be free.
+	struct AATreeNode* node = SearchForNodeLessThanOrEqualToValue(&space->free_ranges_by_address, addr);
+	if(node == NULL)
+		return false;
+	struct FreeMemoryRange* range = GetFreeMemoryRangeFromAddressNode(node);
+	if(range->start_address + range->pages * PAGE_SIZE < addr + pages * PAGE_SIZE)
+		return false;
+
+	ReserveAddressRange(space, addr, addr + pages * PAGE_SIZE);
+	if(!AllocatePagesAt(pml4, addr, pages, /*large_pages=*/false)) {
+		ReleaseAddressRange(space, addr, addr + pages * PAGE_SIZE);
+		return false;
 	}
+	return true;
+}
+
+size_t ReleaseVirtualMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages) {
+	UnmapPages(pml4, addr, pages, true);
+
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space != NULL)
+		ReleaseAddressRange(space, addr, addr + pages * PAGE_SIZE);
 }
 
 
-size_t MapPhysicalMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages) {
-	size_t start_virtual_address = FindFreePageRange(pml4, pages);
+size_t MapPhysicalMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages, bool large_pages) {
+	// Line the virtual address up with the physical address within a 2 MB page, so the aligned 2 MB runs in the
+	// middle can use 2 MB pages.
+	size_t start_virtual_address = large_pages ?
+		FindFreePageRangeForLargePages(pml4, pages, addr) : FindFreePageRange(pml4, pages);
 	if (start_virtual_address == OUT_OF_MEMORY)
 		return OUT_OF_MEMORY;
 
 	for (size_t virtual_address = start_virtual_address;
 		pages > 0; pages--, virtual_address += PAGE_SIZE, addr += PAGE_SIZE) {
+		if(large_pages && pages >= PAGE_TABLE_ENTRIES && (virtual_address & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			(addr & (PAGE_TABLE_RANGE - 1)) == 0 && MapLargePage(pml4, virtual_address, addr, false)) {
+			// The loop steps over the last page.
+			pages -= PAGE_TABLE_ENTRIES - 1;
+			virtual_address += PAGE_TABLE_RANGE - PAGE_SIZE;
+			addr += PAGE_TABLE_RANGE - PAGE_SIZE;
+			continue;
+		}
 #ifdef DEBUG
 		PrintString("Mapping ");
 		PrintHex(addr);
@@ -696,151 +1326,863 @@ size_t MapPhysicalMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages) {
 		PrintHex(virtual_address);
 		PrintString("\n");
 #endif
-		MapPhysicalPageToVirtualPage(pml4, virtual_address, addr, false);
+		MapPage(pml4, virtual_address, addr, false);
 	}
 	return start_virtual_address;
 
 }
 
-// Unmaps a virtual page - free specifies if that page should be returned to the physical memory manager.
-void UnmapVirtualPage(size_t pml4, size_t virtualaddr, bool free) {
-	// Find the index into each PML table.
-	// 6666 5555 5555 5544 4444 4444 4333 3333 3332 2222 2222 2111 1111 111
-	// 4321 0987 6543 2109 8765 4321 0987 6543 2109 8765 4321 0978 6543 2109 8765 4321
-    //                     #### #### #@@@ @@@@ @@!! !!!! !!!+ ++++ ++++ ^^^^ ^^^^ ^^^^
-    //                     pml4       pml3       pml2       pml1        flags
-
+// Returns the physical address of the PML2 that maps a virtual address. If
+// create is true, any missing PML3 or PML2 is created. Returns OUT_OF_MEMORY
+// if the PML2 doesn't exist and can't be created. The tables are walked
+// through the temporary mappings at index and index + 1.
+static size_t GetPageDirectory(size_t pml4, size_t virtualaddr, size_t index,
+	bool create) {
 	size_t pml4_entry = (virtualaddr >> 39) & 511;
 	size_t pml3_entry = (virtualaddr >> 30) & 511;
-	size_t pml2_entry = (virtualaddr >> 21) & 511;
-	size_t pml1_entry = (virtualaddr >> 12) & 511;
+	bool user_page = pml4_entry != PAGE_TABLE_ENTRIES - 1;
+	if(user_page == (pml4 == kernel_pml4)) {
+		// Kernel virtual addresses must be in the highest PML4 entry, and user
+		// space virtual addresses must be below kernel memory.
+		return OUT_OF_MEMORY;
+	}
 
-	if(pml4 == kernel_pml4) {
-		// Kernel virtual addresses must in the last PML4 entry.
-		if(pml4_entry < PAGE_TABLE_ENTRIES - 1) {
-			return;
-		}
-	} else {
-		// User space virtual addresses must below kernel memory.
-		if(pml4_entry == PAGE_TABLE_ENTRIES - 1) {
-			return;
+	size_t table = pml4;
+	size_t entry = pml4_entry;
+	for(int level = 0; level < 2; level++) {
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(table, index);
+		if(ptr[entry] == 0) {
+			if(!create)
+				return OUT_OF_MEMORY;
+
+			// Entry blank, create the next table.
+			size_t new_table = GetPhysicalPage();
+			if(new_table == OUT_OF_PHYSICAL_PAGES)
+				return OUT_OF_MEMORY;
+
+			// Clear it.
+			ptr = (size_t *)TemporarilyMapPhysicalMemory(new_table, index + 1);
+			for(size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+				ptr[i] = 0;
+
+			// Write it in.
+			ptr = (size_t *)TemporarilyMapPhysicalMemory(table, index);
+			ptr[entry] = new_table | 0x3 |
+				// Set the user bit.
+				(user_page ? (1 << 2) : 0);
 		}
+		table = ptr[entry] & ~(PAGE_SIZE - 1);
+		entry = pml3_entry;
 	}
+	return table;
+}
 
-	// Look in PML4.
-	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
-	if(ptr[pml4_entry] == 0) {
-		// This address isn't mapped.
-		return;
-	}
+// Returns the physical address of the PML1 that maps a virtual address, or
+// OUT_OF_MEMORY if there isn't one (including if the address is mapped by a
+// 2 MB page.)
+static size_t GetPageTable(size_t pml4, size_t virtualaddr) {
+	size_t pml2 = GetPageDirectory(pml4, virtualaddr, 0, /*create=*/false);
+	if(pml2 == OUT_OF_MEMORY)
+		return OUT_OF_MEMORY;
 
-	size_t pml3 = ptr[pml4_entry] & ~(PAGE_SIZE - 1);
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+	size_t pml2_entry = (virtualaddr >> 21) & 511;
+	if(ptr[pml2_entry] == 0 || (ptr[pml2_entry] & LARGE_PAGE_BIT) != 0)
+		return OUT_OF_MEMORY;
+	return ptr[pml2_entry] & ~(PAGE_SIZE - 1);
+}
 
-	// Look in PML3.
-	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml3, 1);
-	if(ptr[pml3_entry] == 0) {
-		// This address isn't mapped.
-		return;
-	}
+// Returns the PML2 entry that maps a virtual address if it's a 2 MB page,
+// otherwise 0.
+static size_t GetLargePageEntry(size_t pml4, size_t virtualaddr) {
+	size_t pml2 = GetPageDirectory(pml4, virtualaddr, 0, /*create=*/false);
+	if(pml2 == OUT_OF_MEMORY)
+		return 0;
 
-	size_t pml2 = ptr[pml3_entry] & ~(PAGE_SIZE - 1);
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+	size_t entry = ptr[(virtualaddr >> 21) & 511];
+	return (entry & LARGE_PAGE_BIT) != 0 ? entry : 0;
+}
 
-	// Look in PML2.
-	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
-	if(ptr[pml2_entry] == 0) {
-		// This address isn't mapped.
-		return;
-	}
+// Maps a 2 MB page without reserving the address. Both addresses must be 2 MB
+// aligned, and nothing else can be mapped in the 2 MB. Returns if it was
+// successful.
+static bool MapLargePage(size_t pml4, size_t virtualaddr, size_t physicaladdr,
+	bool own) {
+	if(pml4 == kernel_pml4)
+		return false;
 
-	size_t pml1 = ptr[pml2_entry] & ~(PAGE_SIZE - 1);
+	size_t pml2 = GetPageDirectory(pml4, virtualaddr, 0, /*create=*/true);
+	if(pml2 == OUT_OF_MEMORY)
+		return false;
 
-	// Look in PML1.
-	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
-	if(ptr[pml1_entry] == 0) {
-		// This address isn't mapped.
-		return;
-	}
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+	size_t pml2_entry = (virtualaddr >> 21) & 511;
+	if(ptr[pml2_entry] != 0)
+		return false;
+
+	ptr[pml2_entry] = physicaladdr | 0x7 | LARGE_PAGE_BIT |
+		// Set the ownership bit (a custom bit.)
+		(own ? (1 << 9) : 0);
+
+	if(pml4 == current_pml4)
+		FlushVirtualPage(virtualaddr);
+	return true;
+}
+
+// Breaks the 2 MB page that maps a virtual address into 4 KB pages, so part of
+// it can be unmapped, moved, or shared. Returns true if the address is now
+// mapped by a PML1 (or was never mapped by a 2 MB page), or false if we ran
+// out of memory.
+static bool SplitLargePage(size_t pml4, size_t virtualaddr) {
+	size_t entry = GetLargePageEntry(pml4, virtualaddr);
+	if(entry == 0)
+		return true;
+
+	size_t pml1 = GetPhysicalPage();
+	if(pml1 == OUT_OF_PHYSICAL_PAGES)
+		return false;
+
+	// The 4 KB pages keep the 2 MB page's flags, including ownership.
+	size_t physicaladdr = entry & LARGE_PAGE_ADDRESS_MASK;
+	size_t flags = entry & (PAGE_SIZE - 1) & ~LARGE_PAGE_BIT;
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+	for(size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+		ptr[i] = (physicaladdr + i * PAGE_SIZE) | flags;
+
+	// GetLargePageEntry found the PML2, so this can't fail.
+	size_t pml2 = GetPageDirectory(pml4, virtualaddr, 0, /*create=*/false);
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+	ptr[(virtualaddr >> 21) & 511] = pml1 | 0x7;
+
+	// The translations haven't changed, but the CPUs might have cached the
+	// 2 MB page.
+	FlushVirtualPagesInAddressSpace(pml4, virtualaddr & ~(PAGE_TABLE_RANGE - 1), 1);
+	return true;
+}
+
+// Returns the copy-on-write hash table bucket for a physical page.
+static struct CopyOnWritePage** GetCopyOnWritePageBucket(size_t physicaladdr) {
+	return &copy_on_write_pages[(physicaladdr / PAGE_SIZE) %
+		COPY_ON_WRITE_PAGE_BUCKETS];
+}
+
+// Finds the CopyOnWritePage for a physical page, or NULL if the page isn't
+// shared copy-on-write.
+static struct CopyOnWritePage* FindCopyOnWritePage(size_t physicaladdr) {
+	struct CopyOnWritePage* copy_on_write_page =
+		*GetCopyOnWritePageBucket(physicaladdr);
+	while (copy_on_write_page != NULL &&
+		copy_on_write_page->physical_address != physicaladdr)
+		copy_on_write_page = copy_on_write_page->next;
+	return copy_on_write_page;
+}
+
+// Removes a CopyOnWritePage from the hash table and releases it.
+static void RemoveCopyOnWritePage(struct CopyOnWritePage* copy_on_write_page) {
+	struct CopyOnWritePage** previous = GetCopyOnWritePageBucket(
+		copy_on_write_page->physical_address);
+	while (*previous != copy_on_write_page)
+		previous = &(*previous)->next;
+	*previous = copy_on_write_page->next;
+	ReleaseCopyOnWritePage(copy_on_write_page);
+}
+
+// Returns the physical page in a page table entry to the physical allocator,
+// unless it's a copy-on-write page that is still mapped somewhere else.
+static void FreePageInPageTableEntry(size_t entry) {
+	size_t physicaladdr = entry & ~(PAGE_SIZE - 1);
+	if ((entry & COPY_ON_WRITE_PAGE_BIT) != 0) {
+		struct CopyOnWritePage* copy_on_write_page =
+			FindCopyOnWritePage(physicaladdr);
+		if (copy_on_write_page != NULL) {
+			copy_on_write_page->references--;
+			if (copy_on_write_page->references > 0)
+				return;
+			RemoveCopyOnWritePage(copy_on_write_page);
+		}
+	}
+	FreePhysicalPage(physicaladdr);
+}
+
+// Returns true if every entry in a page table is empty. The page table is
+// mapped through the temporary mapping at index.
+static bool IsPageTableEmpty(size_t table, size_t index) {
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(table, index);
+	for(size_t i = 0; i < PAGE_TABLE_ENTRIES; i++) {
+		if(ptr[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+// Frees the PML1, PML2, and PML3 along the path to a virtual address, if they
+// no longer map anything.
+static void FreePageTablesIfEmpty(size_t pml4, size_t virtualaddr) {
+	size_t pml4_entry = (virtualaddr >> 39) & 511;
+	size_t pml3_entry = (virtualaddr >> 30) & 511;
+	size_t pml2_entry = (virtualaddr >> 21) & 511;
+
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
+	if(ptr[pml4_entry] == 0)
+		return;
+	size_t pml3 = ptr[pml4_entry] & ~(PAGE_SIZE - 1);
+
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml3, 1);
+	if(ptr[pml3_entry] == 0)
+		return;
+	size_t pml2 = ptr[pml3_entry] & ~(PAGE_SIZE - 1);
+
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+	if((ptr[pml2_entry] & LARGE_PAGE_BIT) != 0) {
+		// A 2 MB page is still mapped here.
+		return;
+	} else if(ptr[pml2_entry] != 0) {
+		size_t pml1 = ptr[pml2_entry] & ~(PAGE_SIZE - 1);
+		if(!IsPageTableEmpty(pml1, 3))
+			return;
+
+		// There was nothing in the PML1. We can free it.
+		FreePhysicalPage(pml1);
+		ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+		ptr[pml2_entry] = 0;
+	}
+
+	if(!IsPageTableEmpty(pml2, 2))
+		return;
+
+	// There was nothing in the PML2. We can free it.
+	FreePhysicalPage(pml2);
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml3, 1);
+	ptr[pml3_entry] = 0;
+
+	if(pml4_entry == PAGE_TABLE_ENTRIES - 1 || !IsPageTableEmpty(pml3, 1)) {
+		// The kernel's PML3 is shared by every address space, so we never
+		// free it.
+		return;
+	}
+
+	// There was nothing in the PML3. We can free it.
+	FreePhysicalPage(pml3);
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
+	ptr[pml4_entry] = 0;
+}
+
+// Unmaps a virtual page without releasing the address - free specifies if that page should be returned to the physical
+// memory manager.
+static void UnmapPage(size_t pml4, size_t virtualaddr, bool free) {
+	// Find the index into each PML table.
+	// 6666 5555 5555 5544 4444 4444 4333 3333 3332 2222 2222 2111 1111 111
+	// 4321 0987 6543 2109 8765 4321 0987 6543 2109 8765 4321 0978 6543 2109 8765 4321
+    //                     #### #### #@@@ @@@@ @@!! !!!! !!!+ ++++ ++++ ^^^^ ^^^^ ^^^^
+    //                     pml4       pml3       pml2       pml1        flags
+
+	size_t pml4_entry = (virtualaddr >> 39) & 511;
+	size_t pml1_entry = (virtualaddr >> 12) & 511;
+
+	if(!SplitLargePage(pml4, virtualaddr)) {
+		// We can't unmap part of a 2 MB page without a PML1 to put the rest in.
+		return;
+	}
+
+	size_t pml1 = GetPageTable(pml4, virtualaddr);
+	if(pml1 == OUT_OF_MEMORY) {
+		// This address isn't mapped.
+		return;
+	}
+
+	// Look in PML1.
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+	if(ptr[pml1_entry] == 0) {
+		// This address isn't mapped.
+		return;
+	}
 
 	// This adddress was mapped somwhere.
+	size_t entry = ptr[pml1_entry];
+
+	// Remove this entry from the PML1.
+	ptr[pml1_entry] = 0;
 
 	// Should we free it, and it owned by this process?
-	if(free && (ptr[pml1_entry] & (1 << 9)) != 0) {
+	if(free && (entry & (1 << 9)) != 0) {
 		// Return the memory to the physical allocator. This is optional because we don't want to do this if it's shared or
 		// memory mapped IO.
+		FreePageInPageTableEntry(entry);
+	}
 
-		// Figure out the physical address that this entry points to and free it.
-		size_t physicaladdr = ptr[pml1_entry] & ~(PAGE_SIZE - 1);
-		FreePhysicalPage(physicaladdr);
+	// If we don't find anything in the PML tables, we can free them.
+	FreePageTablesIfEmpty(pml4, virtualaddr);
 
-		// Load the PML1 again incase FreePhysicalPage maps something else.
-		ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+	if(pml4 == current_pml4 || pml4_entry >= PAGE_TABLE_ENTRIES - 1) {
+		// Flush the TLB if we are in this address space or if it's a kernel page.
+		FlushVirtualPage(virtualaddr);
 	}
 
-	// Remove this entry from the PML1.
-	ptr[pml1_entry] = 0;
+	// Other CPUs might have this page cached in their TLB too.
+	FlushVirtualPagesOnInactiveCpus(pml4, virtualaddr, 1);
+	FlushTlbOnOtherCpus(pml4_entry >= PAGE_TABLE_ENTRIES - 1 ? kernel_pml4 : pml4);
+}
 
-	// Scan to see if we find anything in the PML tables. If not, we can free them.
-	bool found = 0;
-	size_t i;
-	// Scan PML1.
-	for(i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-		if(ptr[i] != 0) {
-			found = 1;
+// Unmaps a virtual page - free specifies if that page should be returned to the physical memory manager.
+void UnmapVirtualPage(size_t pml4, size_t virtualaddr, bool free) {
+	UnmapPage(pml4, virtualaddr, free);
+
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space != NULL)
+		ReleaseAddressRange(space, virtualaddr, virtualaddr + PAGE_SIZE);
+}
+
+// Flushes the range of virtual pages in an address space from the TLB of
+// every CPU.
+static void FlushVirtualPagesInAddressSpace(size_t pml4, size_t addr,
+	size_t pages) {
+	if(pml4 == current_pml4)
+		FlushVirtualPages(addr, pages);
+	FlushVirtualPagesOnInactiveCpus(pml4, addr, pages);
+	FlushTlbOnOtherCpus(pml4);
+}
+
+// Flushes a range of virtual pages in a user address space from the TLBs of the CPUs that aren't running it. With
+// PCIDs, CPUs keep an address space's entries in their TLB after they switch away from it. We flush our own entries
+// with INVPCID if we can, and the other CPUs flush the address space's PCID the next time they switch to it.
+static void FlushVirtualPagesOnInactiveCpus(size_t pml4, size_t addr, size_t pages) {
+	if(!pcids_enabled)
+		return;
+
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL)
+		return;
+
+	struct Cpu* this_cpu = GetCurrentCpu();
+	for(size_t i = 0; i < number_of_cpus; i++) {
+		struct Cpu* cpu = &cpus[i];
+		size_t cpu_bit = (size_t)1 << i;
+		if(cpu->pml4 == pml4 || (space->cpus_with_tlb_entries & cpu_bit) == 0) {
+			// The CPU is flushed right away because it's running the address space, or it has nothing to flush.
+			continue;
+		}
+
+		if(cpu == this_cpu && invpcid_supported && pages <= MAX_PAGES_TO_FLUSH_INDIVIDUALLY) {
+			for(size_t page = 0; page < pages; page++)
+				Invpcid(INVPCID_ADDRESS, space->pcid, addr + page * PAGE_SIZE);
+		} else {
+			space->cpus_with_stale_tlb_entries |= cpu_bit;
+		}
+	}
+}
+
+// Unmaps a range of virtual pages without releasing the addresses - free
+// specifies if owned pages should be returned to the physical memory manager.
+// 2 MB pages that are entirely inside of the range are unmapped whole, and
+// ones that straddle the ends of the range are split.
+static void UnmapPages(size_t pml4, size_t start, size_t pages, bool free) {
+	size_t end = start + pages * PAGE_SIZE;
+	for(size_t addr = start; addr < end;) {
+		if((addr & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			end - addr >= PAGE_TABLE_RANGE) {
+			size_t entry = GetLargePageEntry(pml4, addr);
+			if(entry != 0) {
+				size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(
+					GetPageDirectory(pml4, addr, 0, /*create=*/false), 2);
+				ptr[(addr >> 21) & 511] = 0;
+				if(free && (entry & (1 << 9)) != 0)
+					FreePhysicalPages(entry & LARGE_PAGE_ADDRESS_MASK,
+						LARGE_PAGE_ORDER);
+				FreePageTablesIfEmpty(pml4, addr);
+				FlushVirtualPagesInAddressSpace(pml4, addr, 1);
+				addr += PAGE_TABLE_RANGE;
+				continue;
+			}
+		}
+
+		UnmapPage(pml4, addr, free);
+		addr += PAGE_SIZE;
+	}
+}
+
+// Moves or shares pages between two user address spaces. The page tables are
+// walked once per PML1 rather than once per page, and PML1s that are entirely
+// covered by an aligned move are handed over whole.
+static bool TransferPages(size_t source_pml4, size_t source_address,
+	size_t destination_pml4, size_t destination_address, size_t pages,
+	bool share) {
+	if(source_pml4 == kernel_pml4 || destination_pml4 == kernel_pml4 ||
+		(source_address & (PAGE_SIZE - 1)) != 0 ||
+		(destination_address & (PAGE_SIZE - 1)) != 0)
+		return false;
+
+	// Make sure every source page exists and is owned by the source, and
+	// count how many pages will become copy-on-write.
+	size_t pages_becoming_copy_on_write = 0;
+	for(size_t page = 0; page < pages;) {
+		size_t virtualaddr = source_address + page * PAGE_SIZE;
+		if(!SplitLargePage(source_pml4, virtualaddr))
+			return false;
+		size_t pml1 = GetPageTable(source_pml4, virtualaddr);
+		if(pml1 == OUT_OF_MEMORY)
+			return false;
+
+		size_t pml1_entry = (virtualaddr >> 12) & 511;
+		size_t pages_in_table = PAGE_TABLE_ENTRIES - pml1_entry;
+		if(pages_in_table > pages - page)
+			pages_in_table = pages - page;
+
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+		for(size_t i = 0; i < pages_in_table; i++) {
+			size_t entry = ptr[pml1_entry + i];
+			if(entry == 0 || (entry & (1 << 9)) == 0)
+				return false;
+			if((entry & COPY_ON_WRITE_PAGE_BIT) == 0)
+				pages_becoming_copy_on_write++;
+		}
+		page += pages_in_table;
+	}
+
+	// Allocate the CopyOnWritePages up front, because the allocator can
+	// remap the page tables we're walking.
+	struct CopyOnWritePage* spare_copy_on_write_pages = NULL;
+	bool success = true;
+	for(size_t i = 0; share && i < pages_becoming_copy_on_write; i++) {
+		struct CopyOnWritePage* copy_on_write_page = AllocateCopyOnWritePage();
+		if(copy_on_write_page == NULL) {
+			success = false;
 			break;
 		}
+		copy_on_write_page->next = spare_copy_on_write_pages;
+		spare_copy_on_write_pages = copy_on_write_page;
 	}
 
-	if(!found) {
-		// There was nothing in the PML1. We can free it.
-		FreePhysicalPage(pml1);
+	for(size_t page = 0; success && page < pages;) {
+		size_t from = source_address + page * PAGE_SIZE;
+		size_t to = destination_address + page * PAGE_SIZE;
+		size_t pages_left = pages - page;
+
+		size_t source_pml2 = GetPageDirectory(source_pml4, from, 0,
+			/*create=*/false);
+		size_t destination_pml2 = GetPageDirectory(destination_pml4, to, 8,
+			/*create=*/true);
+		if(destination_pml2 == OUT_OF_MEMORY) {
+			success = false;
+			break;
+		}
+		size_t source_pml2_entry = (from >> 21) & 511;
+		size_t destination_pml2_entry = (to >> 21) & 511;
+
+		size_t *source_ptr = (size_t *)TemporarilyMapPhysicalMemory(
+			source_pml2, 2);
+		size_t *destination_ptr = (size_t *)TemporarilyMapPhysicalMemory(
+			destination_pml2, 10);
+		if(!share && pages_left >= PAGE_TABLE_ENTRIES &&
+			(from & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			(to & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			destination_ptr[destination_pml2_entry] == 0) {
+			// The source's PML1 only maps pages that we're moving, so move the
+			// whole PML1 over.
+			destination_ptr[destination_pml2_entry] =
+				source_ptr[source_pml2_entry];
+			source_ptr[source_pml2_entry] = 0;
+			FreePageTablesIfEmpty(source_pml4, from);
+			page += PAGE_TABLE_ENTRIES;
+			continue;
+		}
 
-		// Remove from the entry from the PML2.
-		ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
-		ptr[pml2_entry] = 0;
+		size_t source_pml1 = source_ptr[source_pml2_entry] & ~(PAGE_SIZE - 1);
+		if(destination_ptr[destination_pml2_entry] == 0) {
+			// Entry blank, create a PML1 table.
+			size_t new_pml1 = GetPhysicalPage();
+			if(new_pml1 == OUT_OF_PHYSICAL_PAGES) {
+				success = false;
+				break;
+			}
 
-		// Scan the PML2.
-		for(i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-			if(ptr[i] != 0) {
-				found = 1;
+			// Clear it.
+			destination_ptr = (size_t *)TemporarilyMapPhysicalMemory(
+				new_pml1, 11);
+			for(size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+				destination_ptr[i] = 0;
+
+			// Write it in.
+			destination_ptr = (size_t *)TemporarilyMapPhysicalMemory(
+				destination_pml2, 10);
+			destination_ptr[destination_pml2_entry] = new_pml1 | 0x7;
+		}
+		size_t destination_pml1 =
+			destination_ptr[destination_pml2_entry] & ~(PAGE_SIZE - 1);
+
+		// Move or share the entries up until the end of either PML1.
+		size_t source_pml1_entry = (from >> 12) & 511;
+		size_t destination_pml1_entry = (to >> 12) & 511;
+		size_t pages_in_table = PAGE_TABLE_ENTRIES -
+			(source_pml1_entry > destination_pml1_entry ?
+				source_pml1_entry : destination_pml1_entry);
+		if(pages_in_table > pages_left)
+			pages_in_table = pages_left;
+
+		source_ptr = (size_t *)TemporarilyMapPhysicalMemory(source_pml1, 3);
+		destination_ptr = (size_t *)TemporarilyMapPhysicalMemory(
+			destination_pml1, 11);
+		for(size_t i = 0; i < pages_in_table; i++) {
+			size_t entry = source_ptr[source_pml1_entry + i];
+			if(destination_ptr[destination_pml1_entry + i] != 0) {
+				// Something is already mapped here.
+				success = false;
 				break;
 			}
+
+			if(share) {
+				struct CopyOnWritePage* copy_on_write_page;
+				if((entry & COPY_ON_WRITE_PAGE_BIT) == 0) {
+					// Make both copies of the page read-only.
+					copy_on_write_page = spare_copy_on_write_pages;
+					spare_copy_on_write_pages = copy_on_write_page->next;
+
+					copy_on_write_page->physical_address =
+						entry & ~(PAGE_SIZE - 1);
+					copy_on_write_page->references = 1;
+					struct CopyOnWritePage** bucket = GetCopyOnWritePageBucket(
+						copy_on_write_page->physical_address);
+					copy_on_write_page->next = *bucket;
+					*bucket = copy_on_write_page;
+
+					entry = (entry & ~(size_t)0x2) | COPY_ON_WRITE_PAGE_BIT;
+					source_ptr[source_pml1_entry + i] = entry;
+				} else {
+					copy_on_write_page = FindCopyOnWritePage(
+						entry & ~(PAGE_SIZE - 1));
+				}
+				copy_on_write_page->references++;
+			} else {
+				source_ptr[source_pml1_entry + i] = 0;
+			}
+			destination_ptr[destination_pml1_entry + i] = entry;
 		}
 
-		if(!found) {
-			// There was nothing in the PML2. We can free it.
-			FreePhysicalPage(pml2);
+		if(!share)
+			FreePageTablesIfEmpty(source_pml4, from);
+		page += pages_in_table;
+	}
 
-			// Remove the entry from the PML3.
-			ptr = (size_t *)TemporarilyMapPhysicalMemory(pml3, 1);
-			ptr[pml3_entry] = 0;
+	while(spare_copy_on_write_pages != NULL) {
+		struct CopyOnWritePage* next = spare_copy_on_write_pages->next;
+		ReleaseCopyOnWritePage(spare_copy_on_write_pages);
+		spare_copy_on_write_pages = next;
+	}
 
-			// Scan the PML3.
-			for(i = 0; i < PAGE_TABLE_ENTRIES; i++) {
-				if(ptr[i] != 0) {
-					found = 1;
-					break;
-				}
+	// The destination's entries were all empty, and empty entries are never
+	// cached, so only the source needs flushing.
+	FlushVirtualPagesInAddressSpace(source_pml4, source_address, pages);
+
+	// The destination's addresses are now in use, and the source's are free
+	// once the pages have all moved out.
+	struct VirtualAddressSpace* destination_space =
+		FindVirtualAddressSpace(destination_pml4);
+	if(destination_space != NULL) {
+		ReserveAddressRange(destination_space, destination_address,
+			destination_address + pages * PAGE_SIZE);
+	}
+	struct VirtualAddressSpace* source_space =
+		FindVirtualAddressSpace(source_pml4);
+	if(!share && success && source_space != NULL) {
+		ReleaseAddressRange(source_space, source_address,
+			source_address + pages * PAGE_SIZE);
+	}
+	return success;
+}
+
+// Moves pages from one user address space to another. The pages must all be
+// mapped and owned by the source. Returns false if the pages couldn't all be
+// moved, in which case some pages may have moved and the caller should
+// release both ranges.
+bool MovePagesBetweenAddressSpaces(size_t source_pml4, size_t source_address,
+	size_t destination_pml4, size_t destination_address, size_t pages) {
+	return TransferPages(source_pml4, source_address, destination_pml4,
+		destination_address, pages, /*share=*/false);
+}
+
+// Shares pages from one user address space with another, copy-on-write. The
+// pages must all be mapped and owned by the source, and stay mapped in the
+// source. Returns false if the pages couldn't all be shared, in which case the
+// caller should release the destination range.
+bool SharePagesBetweenAddressSpaces(size_t source_pml4, size_t source_address,
+	size_t destination_pml4, size_t destination_address, size_t pages) {
+	return TransferPages(source_pml4, source_address, destination_pml4,
+		destination_address, pages, /*share=*/true);
+}
+
+// Makes sure there are PML1s for a range of user pages. Returns false if we
+// ran out of memory.
+static bool CreatePageTables(size_t pml4, size_t addr, size_t pages) {
+	size_t end = addr + pages * PAGE_SIZE;
+	addr &= ~(PAGE_TABLE_RANGE - 1);
+	for(; addr < end; addr += PAGE_TABLE_RANGE) {
+		size_t pml2 = GetPageDirectory(pml4, addr, 0, /*create=*/true);
+		if(pml2 == OUT_OF_MEMORY)
+			return false;
+
+		size_t pml2_entry = (addr >> 21) & 511;
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+		if(ptr[pml2_entry] != 0)
+			continue;
+
+		size_t new_pml1 = GetPhysicalPage();
+		if(new_pml1 == OUT_OF_PHYSICAL_PAGES)
+			return false;
+
+		// Clear it.
+		ptr = (size_t *)TemporarilyMapPhysicalMemory(new_pml1, 3);
+		for(size_t i = 0; i < PAGE_TABLE_ENTRIES; i++)
+			ptr[i] = 0;
+
+		// Write it in.
+		ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+		ptr[pml2_entry] = new_pml1 | 0x7;
+	}
+	return true;
+}
+
+// Maps user pages that have already been reserved to the zero page,
+// copy-on-write. The page tables are walked once per PML1 rather than once per
+// page. Returns false if we ran out of memory, in which case the caller should
+// unmap the range.
+static bool MapZeroPagesAt(size_t pml4, size_t start, size_t pages) {
+	for(size_t page = 0; page < pages;) {
+		size_t addr = start + page * PAGE_SIZE;
+		if(!CreatePageTables(pml4, addr, 1))
+			return false;
+		size_t pml1 = GetPageTable(pml4, addr);
+		if(pml1 == OUT_OF_MEMORY)
+			return false;
+
+		// Fill in the PML1 up until its end. The entries are read-only and
+		// owned, so the first write makes a private copy.
+		size_t pml1_entry = (addr >> 12) & 511;
+		size_t pages_in_table = PAGE_TABLE_ENTRIES - pml1_entry;
+		if(pages_in_table > pages - page)
+			pages_in_table = pages - page;
+
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+		for(size_t i = 0; i < pages_in_table; i++) {
+			ptr[pml1_entry + i] = zero_page | 0x5 | (1 << 9) |
+				COPY_ON_WRITE_PAGE_BIT;
+		}
+		zero_copy_on_write_page.references += pages_in_table;
+		page += pages_in_table;
+	}
+
+	if(pml4 == current_pml4)
+		FlushVirtualPages(start, pages);
+	return true;
+}
+
+// Maps physical pages that are never freed, such as a multiboot module's, into a user address space at a particular
+// address. Returns false if any of the addresses are in use or we ran out of memory.
+bool MapSharedPhysicalPagesAt(size_t pml4, size_t addr, size_t physicaladdr, size_t pages, bool copy_on_write) {
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL || (addr & (PAGE_SIZE - 1)) != 0 || (physicaladdr & (PAGE_SIZE - 1)) != 0 || pages == 0)
+		return false;
+
+	// The addresses must all be free.
+	struct AATreeNode* node = SearchForNodeLessThanOrEqualToValue(&space->free_ranges_by_address, addr);
+	if(node == NULL)
+		return false;
+	struct FreeMemoryRange* range = GetFreeMemoryRangeFromAddressNode(node);
+	if(range->start_address + range->pages * PAGE_SIZE < addr + pages * PAGE_SIZE)
+		return false;
+	ReserveAddressRange(space, addr, addr + pages * PAGE_SIZE);
+
+	// Allocate the page tables and the CopyOnWritePages up front, because the allocator can remap the page tables
+	// we're walking.
+	bool success = CreatePageTables(pml4, addr, pages);
+	struct CopyOnWritePage* spare_copy_on_write_pages = NULL;
+	for(size_t page = 0; success && copy_on_write && page < pages; page++) {
+		if(FindCopyOnWritePage(physicaladdr + page * PAGE_SIZE) != NULL)
+			continue;
+		struct CopyOnWritePage* copy_on_write_page = AllocateCopyOnWritePage();
+		if(copy_on_write_page == NULL) {
+			success = false;
+			break;
+		}
+		copy_on_write_page->next = spare_copy_on_write_pages;
+		spare_copy_on_write_pages = copy_on_write_page;
+	}
+
+	for(size_t page = 0; success && page < pages;) {
+		size_t virtualaddr = addr + page * PAGE_SIZE;
+		size_t pml1 = GetPageTable(pml4, virtualaddr);
+		if(pml1 == OUT_OF_MEMORY) {
+			success = false;
+			break;
+		}
+
+		size_t pml1_entry = (virtualaddr >> 12) & 511;
+		size_t pages_in_table = PAGE_TABLE_ENTRIES - pml1_entry;
+		if(pages_in_table > pages - page)
+			pages_in_table = pages - page;
+
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+		for(size_t i = 0; i < pages_in_table; i++) {
+			size_t page_physicaladdr = physicaladdr + (page + i) * PAGE_SIZE;
+			if(!copy_on_write) {
+				// Read-only pages aren't owned, so they're never freed.
+				ptr[pml1_entry + i] = page_physicaladdr | 0x5;
+				continue;
 			}
 
-			if(!found) {
-				// There was nothing in the PML3. We can free it.
-				FreePhysicalPage(pml3);
+			struct CopyOnWritePage* copy_on_write_page = FindCopyOnWritePage(page_physicaladdr);
+			if(copy_on_write_page == NULL) {
+				// The first reference belongs to whoever keeps the page, so writing to it always makes a copy and
+				// the page never goes back to the physical allocator.
+				copy_on_write_page = spare_copy_on_write_pages;
+				spare_copy_on_write_pages = copy_on_write_page->next;
+				copy_on_write_page->physical_address = page_physicaladdr;
+				copy_on_write_page->references = 1;
+				struct CopyOnWritePage** bucket = GetCopyOnWritePageBucket(page_physicaladdr);
+				copy_on_write_page->next = *bucket;
+				*bucket = copy_on_write_page;
+			}
+			copy_on_write_page->references++;
+			ptr[pml1_entry + i] = page_physicaladdr | 0x5 | (1 << 9) | COPY_ON_WRITE_PAGE_BIT;
+		}
+		page += pages_in_table;
+	}
 
-				// Remove the entry from the PML4.
-				ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
-				ptr[pml4_entry] = 0;
+	while(spare_copy_on_write_pages != NULL) {
+		struct CopyOnWritePage* next = spare_copy_on_write_pages->next;
+		ReleaseCopyOnWritePage(spare_copy_on_write_pages);
+		spare_copy_on_write_pages = next;
+	}
+
+	if(!success) {
+		ReleaseVirtualMemoryInAddressSpace(pml4, addr, pages);
+		return false;
+	}
+
+	// The entries were all empty, and empty entries are never cached, so there's nothing to flush.
+	return true;
+}
+
+// Grows or shrinks memory that was allocated with AllocateVirtualMemoryInAddressSpace. Memory grows in place if the
+// addresses after it are free, otherwise the pages are moved (without copying them) to somewhere with room. Returns the
+// new address, or OUT_OF_MEMORY if the memory couldn't be resized, in which case it's left as it was. If may_move is
+// false, the memory only grows in place.
+size_t ResizeVirtualMemoryInAddressSpace(size_t pml4, size_t addr, size_t current_pages, size_t new_pages,
+	bool may_move) {
+	struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+	if(space == NULL || (addr & (PAGE_SIZE - 1)) != 0 || current_pages == 0 || new_pages == 0 ||
+		new_pages > (USER_LOWER_HALF_END / PAGE_SIZE))
+		return OUT_OF_MEMORY;
+
+	if(new_pages <= current_pages) {
+		// Shrink by releasing the pages at the end.
+		ReleaseVirtualMemoryInAddressSpace(pml4, addr + new_pages * PAGE_SIZE, current_pages - new_pages);
+		return addr;
+	}
+
+	size_t extra_pages = new_pages - current_pages;
+	size_t end = addr + current_pages * PAGE_SIZE;
+
+	// Try to grow in place.
+	struct AATreeNode* node = SearchForNodeLessThanOrEqualToValue(&space->free_ranges_by_address, end);
+	if(node != NULL) {
+		struct FreeMemoryRange* range = GetFreeMemoryRangeFromAddressNode(node);
+		if(range->start_address + range->pages * PAGE_SIZE >= end + extra_pages * PAGE_SIZE) {
+			ReserveAddressRange(space, end, end + extra_pages * PAGE_SIZE);
+			if(!AllocatePagesAt(pml4, end, extra_pages, /*large_pages=*/false)) {
+				ReleaseVirtualMemoryInAddressSpace(pml4, end, extra_pages);
+				return OUT_OF_MEMORY;
 			}
+			return addr;
 		}
+	}
 
+	if(!may_move)
+		return OUT_OF_MEMORY;
+
+	// Move somewhere with room.
+	size_t new_addr = FindFreePageRange(pml4, new_pages);
+	if(new_addr == OUT_OF_MEMORY)
+		return OUT_OF_MEMORY;
+
+	// Allocate the new pages and the page tables to move into first, so we
+	// can't run out of memory part way through the move.
+	if(!AllocatePagesAt(pml4, new_addr + current_pages * PAGE_SIZE, extra_pages, /*large_pages=*/false) ||
+		!CreatePageTables(pml4, new_addr, current_pages) ||
+		!MovePagesBetweenAddressSpaces(pml4, addr, pml4, new_addr, current_pages)) {
+		// The move only fails before touching anything, such as if the
+		// memory isn't all mapped and owned by the process.
+		ReleaseVirtualMemoryInAddressSpace(pml4, new_addr, new_pages);
+		return OUT_OF_MEMORY;
 	}
+	return new_addr;
+}
 
-	if(pml4 == current_pml4 || pml4_entry >= PAGE_TABLE_ENTRIES - 1) {
-		// Flush the TLB if we are in this address space or if it's a kernel page.
-		FlushVirtualPage(virtualaddr);
+// Gives a process its own writable copy of a copy-on-write page. Returns true
+// if the page is now writable, or false if the page isn't mapped, isn't
+// copy-on-write, or we're out of memory.
+bool ResolveCopyOnWritePage(size_t pml4, size_t virtualaddr) {
+	virtualaddr &= ~(PAGE_SIZE - 1);
+
+	// 2 MB pages are never copy-on-write.
+	size_t large_page_entry = GetLargePageEntry(pml4, virtualaddr);
+	if(large_page_entry != 0)
+		return (large_page_entry & 0x2) != 0;
+
+	size_t pml1 = GetPageTable(pml4, virtualaddr);
+	if(pml1 == OUT_OF_MEMORY)
+		return false;
+
+	size_t pml1_entry = (virtualaddr >> 12) & 511;
+	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+	size_t entry = ptr[pml1_entry];
+	if(entry == 0)
+		return false;
+	if((entry & 0x2) != 0) {
+		// The page is already writable. Another CPU may have copied it while
+		// our TLB held the read-only entry.
+		if(pml4 == current_pml4)
+			FlushVirtualPage(virtualaddr);
+		return true;
 	}
+	if((entry & COPY_ON_WRITE_PAGE_BIT) == 0)
+		return false;
+
+	size_t physicaladdr = entry & ~(PAGE_SIZE - 1);
+	struct CopyOnWritePage* copy_on_write_page =
+		FindCopyOnWritePage(physicaladdr);
+	if(copy_on_write_page != NULL && copy_on_write_page->references > 1) {
+		// Someone else still has this page, so make our own copy of it.
+		size_t copy = GetPhysicalPage();
+		if(copy == OUT_OF_PHYSICAL_PAGES)
+			return false;
+		// Pages from GetPhysicalPage are already zeroed.
+		if(physicaladdr != zero_page) {
+			memcpy(TemporarilyMapPhysicalMemory(copy, 6),
+				TemporarilyMapPhysicalMemory(physicaladdr, 7), PAGE_SIZE);
+		}
+		copy_on_write_page->references--;
+		physicaladdr = copy;
+	} else if(copy_on_write_page != NULL) {
+		// We're the last one with this page, so it's ours now.
+		RemoveCopyOnWritePage(copy_on_write_page);
+	}
+
+	ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+	ptr[pml1_entry] = physicaladdr | (entry & (PAGE_SIZE - 1) &
+		~COPY_ON_WRITE_PAGE_BIT) | 0x2;
+	FlushVirtualPagesInAddressSpace(pml4, virtualaddr, 1);
+	return true;
 }
 
 
+// Constructs a VirtualAddressSpace for its object pool. The trees are empty again by the time the VirtualAddressSpace
+// is released, so this only happens once per object.
+void ConstructVirtualAddressSpace(void* object) {
+	struct VirtualAddressSpace* space = (struct VirtualAddressSpace*)object;
+	InitializeAATree(&space->free_ranges_by_address, CalculateFreeMemoryRangeAddress);
+	InitializeAATree(&space->free_ranges_by_size, CalculateFreeMemoryRangeSize);
+}
+
 // Creates a process's virtual address space, returns the PML4. Returns OUT_OF_MEMORY if it fails.
 size_t CreateAddressSpace() {
 	size_t pml4 = GetPhysicalPage();
@@ -848,6 +2190,40 @@ size_t CreateAddressSpace() {
 		return OUT_OF_MEMORY;
 	}
 
+	// Everything in the user address space starts off free.
+	struct VirtualAddressSpace* space = AllocateVirtualAddressSpace();
+	struct FreeMemoryRange* lower_half = AllocateFreeMemoryRange();
+	struct FreeMemoryRange* higher_half = AllocateFreeMemoryRange();
+	if(space == NULL || lower_half == NULL || higher_half == NULL) {
+		if(space != NULL)
+			ReleaseVirtualAddressSpace(space);
+		if(lower_half != NULL)
+			ReleaseFreeMemoryRange(lower_half);
+		if(higher_half != NULL)
+			ReleaseFreeMemoryRange(higher_half);
+		FreePhysicalPage(pml4);
+		return OUT_OF_MEMORY;
+	}
+
+	space->pml4 = pml4;
+
+	// The PCID might have belonged to an address space that has been freed, so each CPU flushes it the first time it
+	// switches to us.
+	space->pcid = AllocatePcid();
+	space->cpus_with_tlb_entries = 0;
+	space->cpus_with_stale_tlb_entries = ~(size_t)0;
+
+	lower_half->start_address = USER_LOWER_HALF_START;
+	lower_half->pages = (USER_LOWER_HALF_END - USER_LOWER_HALF_START) / PAGE_SIZE;
+	AddFreeMemoryRange(space, lower_half);
+	higher_half->start_address = USER_HIGHER_HALF_START;
+	higher_half->pages = (USER_HIGHER_HALF_END - USER_HIGHER_HALF_START) / PAGE_SIZE;
+	AddFreeMemoryRange(space, higher_half);
+
+	struct VirtualAddressSpace** bucket = GetVirtualAddressSpaceBucket(pml4);
+	space->next = *bucket;
+	*bucket = space;
+
 	// Clear out this virtual address space.
 	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
 	size_t i;
@@ -870,6 +2246,23 @@ void FreeAddressSpace(size_t pml4) {
 		SwitchToAddressSpace(kernel_pml4);
 	}
 
+	// Release the free address ranges.
+	struct VirtualAddressSpace** bucket = GetVirtualAddressSpaceBucket(pml4);
+	while(*bucket != NULL && (*bucket)->pml4 != pml4)
+		bucket = &(*bucket)->next;
+	if(*bucket != NULL) {
+		struct VirtualAddressSpace* space = *bucket;
+		*bucket = space->next;
+		while(space->free_ranges_by_address.root != NULL) {
+			struct FreeMemoryRange* range = GetFreeMemoryRangeFromAddressNode(
+				space->free_ranges_by_address.root);
+			RemoveFreeMemoryRange(space, range);
+			ReleaseFreeMemoryRange(range);
+		}
+		ReleasePcid(space->pcid);
+		ReleaseVirtualAddressSpace(space);
+	}
+
 	// Scan the lower half of PML4.
 	size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
 	size_t i;
@@ -890,7 +2283,16 @@ void FreeAddressSpace(size_t pml4) {
 					ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
 					size_t k;
 					for(k = 0; k < PAGE_TABLE_ENTRIES; k++) {
-						if(ptr[k] != 0) {
+						if((ptr[k] & LARGE_PAGE_BIT) != 0) {
+							// Found a 2 MB page. Only free it if we own it, because 2 MB pages also map physical
+							// memory such as framebuffers.
+							if((ptr[k] & (1 << 9)) != 0) {
+								FreePhysicalPages(ptr[k] & LARGE_PAGE_ADDRESS_MASK, LARGE_PAGE_ORDER);
+
+								// Make sure the PML2 is mapped in memory after calling FreePhysicalPages.
+								ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2, 2);
+							}
+						} else if(ptr[k] != 0) {
 							// Found a PML1.
 							size_t pml1 = ptr[k] & ~(PAGE_SIZE - 1);
 
@@ -900,8 +2302,7 @@ void FreeAddressSpace(size_t pml4) {
 							for(l = 0; l < PAGE_TABLE_ENTRIES; l++) {
 								if(ptr[l] != 0) {
 									// We found a page, find it's physical address and free it.
-									size_t physicaladdr = ptr[l] & ~(PAGE_SIZE - 1);
-									FreePhysicalPage(physicaladdr);
+									FreePageInPageTableEntry(ptr[l]);
 
 									// Make sure the PML1 is mapped in memory after calling FreePhysicalPage.
 									ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
@@ -938,12 +2339,93 @@ void FreeAddressSpace(size_t pml4) {
 	FreePhysicalPage(pml4);
 }
 
-// Switch to a virtual address space.
+// Counts the pages in a user address space. Pages are only walked, not
+// changed, so this is safe to call on any process.
+void CountPagesInAddressSpace(size_t pml4, size_t* owned_pages, size_t* page_table_pages) {
+	*owned_pages = 0;
+	*page_table_pages = 1; // The PML4.
+
+	// Scan the lower half of PML4.
+	size_t *pml4_ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4, 0);
+	for(size_t i = 0; i < PAGE_TABLE_ENTRIES - 1; i++) {
+		if(pml4_ptr[i] == 0)
+			continue;
+
+		// Found a PML3.
+		(*page_table_pages)++;
+		size_t *pml3_ptr = (size_t *)TemporarilyMapPhysicalMemory(pml4_ptr[i] & ~(PAGE_SIZE - 1), 1);
+		for(size_t j = 0; j < PAGE_TABLE_ENTRIES; j++) {
+			if(pml3_ptr[j] == 0)
+				continue;
+
+			// Found a PML2.
+			(*page_table_pages)++;
+			size_t *pml2_ptr = (size_t *)TemporarilyMapPhysicalMemory(pml3_ptr[j] & ~(PAGE_SIZE - 1), 2);
+			for(size_t k = 0; k < PAGE_TABLE_ENTRIES; k++) {
+				if((pml2_ptr[k] & LARGE_PAGE_BIT) != 0) {
+					// Found a 2 MB page. Unowned ones map physical memory such as framebuffers.
+					if((pml2_ptr[k] & (1 << 9)) != 0)
+						*owned_pages += PAGE_TABLE_ENTRIES;
+				} else if(pml2_ptr[k] != 0) {
+					// Found a PML1.
+					(*page_table_pages)++;
+					size_t *pml1_ptr = (size_t *)TemporarilyMapPhysicalMemory(pml2_ptr[k] & ~(PAGE_SIZE - 1), 3);
+					for(size_t l = 0; l < PAGE_TABLE_ENTRIES; l++) {
+						// Pages still mapped to the zero page don't use any memory.
+						if((pml1_ptr[l] & (1 << 9)) != 0 && (pml1_ptr[l] & ~(PAGE_SIZE - 1)) != zero_page)
+							(*owned_pages)++;
+					}
+				}
+			}
+		}
+	}
+}
+
+// Switch to a virtual address space. With PCIDs, the TLB entries of the address space we're switching away from are
+// kept, and the address space we're switching to keeps whatever entries it had, unless its page tables changed since
+// this CPU last ran it.
 void SwitchToAddressSpace(size_t pml4) {
-	if(pml4 != current_pml4) {
-		current_pml4 = pml4;
-		__asm__ __volatile__("mov %0, %%cr3":: "b"(pml4));
+	if(pml4 == current_pml4)
+		return;
+
+	struct Cpu* cpu = GetCurrentCpu();
+	current_pml4 = pml4;
+	cpu->cr3 = pml4;
+	cr3_reloads++;
+
+	size_t cr3 = pml4;
+	if(pcids_enabled) {
+		bool flush = false;
+		struct VirtualAddressSpace* space = FindVirtualAddressSpace(pml4);
+		if(space != NULL) {
+			size_t cpu_bit = (size_t)1 << cpu->id;
+			cpu->cr3 |= space->pcid;
+			flush = space->pcid == SHARED_PCID || (space->cpus_with_stale_tlb_entries & cpu_bit) != 0;
+			space->cpus_with_stale_tlb_entries &= ~cpu_bit;
+			space->cpus_with_tlb_entries |= cpu_bit;
+		}
+		cr3 = flush ? cpu->cr3 : (cpu->cr3 | CR3_NO_FLUSH);
+	}
+	__asm__ __volatile__("mov %0, %%cr3":: "r"(cr3) : "memory");
+}
+
+// Flush the CPU lookup for a range of virtual pages.
+void FlushVirtualPages(size_t addr, size_t pages) {
+	if(pages > MAX_PAGES_TO_FLUSH_INDIVIDUALLY) {
+		if(addr >= USER_HIGHER_HALF_END) {
+			// Kernel pages are global, so reloading CR3 doesn't flush them.
+			FlushEntireTlb();
+			return;
+		}
+
+		// Reloading CR3 flushes everything in the address space.
+		cr3_reloads++;
+		__asm__ __volatile__("mov %0, %%cr3":: "r"(GetCurrentCpu()->cr3) : "memory");
+		return;
 	}
+
+	for(; pages > 0; pages--, addr += PAGE_SIZE)
+		FlushVirtualPage(addr);
 }
 
 // Flush the CPU lookup for a particular virtual address.
@@ -957,14 +2439,68 @@ void FlushVirtualPage(size_t addr) {
 }
 
 
+// Returns true if the physical pages in an array follow on from each other.
+static bool ArePhysicalPagesContiguous(size_t* physical_pages, size_t pages) {
+	for(size_t i = 1; i < pages; i++) {
+		if(physical_pages[i] != physical_pages[0] + i * PAGE_SIZE)
+			return false;
+	}
+	return true;
+}
+
+// Maps an array of physical pages, which we don't own, to consecutive virtual
+// pages that have already been reserved. The page tables are walked once per
+// PML1 rather than once per page, and if large_pages is true, aligned 2 MB
+// runs of contiguous pages are mapped with 2 MB pages. Returns false if we ran
+// out of memory, in which case the caller should release the range.
+static bool MapPhysicalPagesFromArray(size_t pml4, size_t virtual_address,
+	size_t* physical_pages, size_t pages, bool large_pages) {
+	for(size_t page = 0; page < pages;) {
+		size_t addr = virtual_address + page * PAGE_SIZE;
+		size_t pages_left = pages - page;
+		if(large_pages && pages_left >= PAGE_TABLE_ENTRIES &&
+			(addr & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			(physical_pages[page] & (PAGE_TABLE_RANGE - 1)) == 0 &&
+			ArePhysicalPagesContiguous(&physical_pages[page],
+				PAGE_TABLE_ENTRIES) &&
+			MapLargePage(pml4, addr, physical_pages[page], false)) {
+			page += PAGE_TABLE_ENTRIES;
+			continue;
+		}
+
+		if(!CreatePageTables(pml4, addr, 1))
+			return false;
+		size_t pml1 = GetPageTable(pml4, addr);
+		if(pml1 == OUT_OF_MEMORY)
+			return false;
+
+		// Fill in the PML1 up until its end.
+		size_t pml1_entry = (addr >> 12) & 511;
+		size_t pages_in_table = PAGE_TABLE_ENTRIES - pml1_entry;
+		if(pages_in_table > pages_left)
+			pages_in_table = pages_left;
+
+		size_t *ptr = (size_t *)TemporarilyMapPhysicalMemory(pml1, 3);
+		for(size_t i = 0; i < pages_in_table; i++)
+			ptr[pml1_entry + i] = physical_pages[page + i] | 0x7;
+		page += pages_in_table;
+	}
+
+	if(pml4 == current_pml4)
+		FlushVirtualPages(virtual_address, pages);
+	return true;
+}
+
 // Maps shared memory into a process's virtual address space. Returns NULL if
 // there was an issue.
 struct SharedMemoryInProcess* MapSharedMemoryIntoProcess(
 	struct Process* process, struct SharedMemory* shared_memory) {
 
 	// Find a free page range to map this shared memory into.
-	size_t virtual_address = FindFreePageRange(
-		process->pml4, shared_memory->size_in_pages);
+	size_t virtual_address = shared_memory->large_pages ?
+		FindFreePageRangeForLargePages(process->pml4,
+			shared_memory->size_in_pages, 0) :
+		FindFreePageRange(process->pml4, shared_memory->size_in_pages);
 	if (virtual_address == OUT_OF_MEMORY) {
 		// No space to allocate these pages to!
 		return NULL;
@@ -972,8 +2508,15 @@ struct SharedMemoryInProcess* MapSharedMemoryIntoProcess(
 
 	struct SharedMemoryInProcess* shared_memory_in_process =
 		AllocateSharedMemoryInProcess();
-	if (shared_memory_in_process == NULL) {
+	if (shared_memory_in_process == NULL ||
+		!MapPhysicalPagesFromArray(process->pml4, virtual_address,
+			shared_memory->physical_pages, shared_memory->size_in_pages,
+			shared_memory->large_pages)) {
 		// Out of memory.
+		if (shared_memory_in_process != NULL)
+			ReleaseSharedMemoryInProcess(shared_memory_in_process);
+		ReleaseVirtualMemoryInAddressSpace(process->pml4, virtual_address,
+			shared_memory->size_in_pages);
 		return NULL;
 	}
 
@@ -992,25 +2535,10 @@ struct SharedMemoryInProcess* MapSharedMemoryIntoProcess(
 	shared_memory_in_process->virtual_address = virtual_address;
 	shared_memory_in_process->references = 1;
 
-	// The next shared memory block in the process.
-	struct SharedMemoryInProcess* next_in_process;
-
 	// Add it to our linked list.
 	shared_memory_in_process->next_in_process = process->shared_memory;
 	process->shared_memory = shared_memory_in_process;
 
-	// Map the physical pages into memory.
-	struct SharedMemoryPage* shared_memory_page = shared_memory->first_page;
-	while (shared_memory_page != NULL) {
-		// Map the physical page to the virtual address.
-		MapPhysicalPageToVirtualPage(process->pml4,
-			virtual_address, shared_memory_page->physical_address, false);
-
-		// Iterate to the next page.
-		virtual_address += PAGE_SIZE;
-		shared_memory_page = shared_memory_page->next;
-	}
-
 	return shared_memory_in_process;
 }
 
@@ -6,54 +6,202 @@
 
 // Some information on different PML levels: http://wiki.osdev.org/Page_Tables 
 
+#include "aa_tree.h"
+#include "cpu.h"
 #include "types.h"
 
 struct Process;
 struct SharedMemoryInProcess;
 struct SharedMemory;
 
+// A physical page that is shared copy-on-write between one or more places.
+struct CopyOnWritePage {
+	// The physical address of the page.
+	size_t physical_address;
+
+	// The number of page table entries that point to this page.
+	size_t references;
+
+	// The next CopyOnWritePage in the same hash table bucket.
+	struct CopyOnWritePage* next;
+};
+
+// A range of free virtual addresses in a user address space.
+struct FreeMemoryRange {
+	// The first address in the range.
+	size_t start_address;
+
+	// The number of pages in the range.
+	size_t pages;
+
+	// Node in VirtualAddressSpace's free_ranges_by_address.
+	struct AATreeNode node_by_address;
+
+	// Node in VirtualAddressSpace's free_ranges_by_size.
+	struct AATreeNode node_by_size;
+};
+
+// Tracks which virtual addresses are free in a user address space, so we can
+// find room for new memory without scanning the page tables.
+struct VirtualAddressSpace {
+	// The address space's PML4.
+	size_t pml4;
+
+	// The free ranges, sorted by address so we can merge neighbors.
+	struct AATree free_ranges_by_address;
+
+	// The free ranges, sorted by size so we can find the best fit.
+	struct AATree free_ranges_by_size;
+
+	// The process-context identifier that tags this address space's entries
+	// in the TLB, so they survive switching to other address spaces.
+	size_t pcid;
+
+	// Bitmask of the CPUs that have loaded this address space's PCID, and so
+	// might have its entries in their TLB.
+	size_t cpus_with_tlb_entries;
+
+	// Bitmask of the CPUs that need to flush this address space's PCID the
+	// next time they switch to it, because the page tables changed while they
+	// weren't running it.
+	size_t cpus_with_stale_tlb_entries;
+
+	// The next VirtualAddressSpace in the same hash table bucket.
+	struct VirtualAddressSpace* next;
+};
+
 // The offset from physical to virtual memory.
 #define VIRTUAL_MEMORY_OFFSET 0xFFFFFFFF80000000 // 0x8000000000 = 256gb
 
+// Where all of physical memory is mapped into the kernel, using 2 MB pages.
+// This is the start of the kernel's PML4 entry, below the kernel's code.
+#define DIRECT_MAP_OFFSET 0xFFFFFF8000000000
+
+// The most physical memory we can map at DIRECT_MAP_OFFSET before we run into
+// VIRTUAL_MEMORY_OFFSET.
+#define MAX_DIRECT_MAP_SIZE (VIRTUAL_MEMORY_OFFSET - DIRECT_MAP_OFFSET)
+
 // The address of the kernel's PML4.
 extern size_t kernel_pml4;
 
-// The address of the currently loaded PML4.
-extern size_t current_pml4;
+// The end of the physical memory that is mapped at DIRECT_MAP_OFFSET.
+extern size_t direct_map_end;
+
+// The number of times that we've reloaded CR3, for benchmarking.
+extern size_t cr3_reloads;
+
+// Whether address spaces are tagged with PCIDs, so switching between them
+// doesn't flush the TLB.
+extern bool pcids_enabled;
+
+// The address of the PML4 loaded in the CPU we're running on.
+#define current_pml4 (GetCurrentCpu()->pml4)
+
+// The number of temporary mappings (see TemporarilyMapPhysicalMemory) that
+// each CPU has.
+#define TEMPORARY_MAPPINGS_PER_CPU 16
 
 // Initializes the virtual allocator.
 extern void InitializeVirtualAllocator();
 
+// Enables global pages, and PCIDs if the CPU supports them, on the CPU we're
+// running on. The kernel's PML4 must be loaded.
+extern void EnableTlbFeatures();
+
 // Maps a physical page so that we can access it with before the virtual allocator has been initialized. Returns a pointer to the
 // page in virtual memory space. Only one page at a time can be allocated this way.
 extern void *TemporarilyMapPhysicalMemoryPreVirtualMemory(size_t addr);
 
-// Temporarily maps physical memory (page aligned) into virtual memory so we can fiddle with it.
-// index is from 0 to 511 - mapping a different address to the same index unmaps the previous page mapped there.
+// Returns a pointer to physical memory (page aligned) so we can fiddle with it. Memory in the direct map is always
+// reachable, anything past it is temporarily mapped. index is from 0 to TEMPORARY_MAPPINGS_PER_CPU - 1, and each CPU
+// has its own set of temporary mappings - mapping a different address to the same index unmaps the previous page
+// mapped there.
 extern void *TemporarilyMapPhysicalMemory(size_t addr, size_t index);
 
-// Finds a range of free physical pages in memory - returns the first address or OUT_OF_MEMORY if it can't find a fit.
+// Finds a range of free virtual pages - returns the first address or OUT_OF_MEMORY if it can't find a fit. In user address
+// spaces the range is reserved until it's released with ReleaseVirtualMemoryInAddressSpace or UnmapVirtualPage.
 extern size_t FindFreePageRange(size_t pml4, size_t pages);
 
 // Maps a physical page to a virtual page. Returns if it was successful.
 extern bool MapPhysicalPageToVirtualPage(size_t pml4, size_t virtualaddr, size_t physicaladdr, bool own);
 
-extern size_t AllocateVirtualMemoryInAddressSpace(size_t pml4, size_t pages);
+// Allocates pages of memory in an address space, returning the address or 0 if it fails. If large_pages is true, the
+// memory is placed and backed so that aligned 2 MB runs are mapped with 2 MB pages where there's physically contiguous
+// memory for them, which saves TLB entries for large allocations. Only user address spaces have 2 MB pages. In user
+// address spaces, the 4 KB pages start off mapped to a shared zero page, copy-on-write, so they only use physical
+// memory once they're written to.
+extern size_t AllocateVirtualMemoryInAddressSpace(size_t pml4, size_t pages, bool large_pages);
+
+// Allocates pages of memory at a particular address in a user address space. Returns false if any of the addresses
+// are in use or we ran out of memory. Like AllocateVirtualMemoryInAddressSpace, the pages start off mapped to the zero
+// page and get their own physical page when they're first written to.
+extern bool AllocateVirtualMemoryAt(size_t pml4, size_t addr, size_t pages);
+
+// Maps physical pages that are never freed, such as a multiboot module's, into a user address space at a particular
+// address, so they're shared rather than copied. If copy_on_write is true, the pages get a private copy the first
+// time they're written to, otherwise they're read-only. Returns false if any of the addresses are in use or we ran
+// out of memory, in which case nothing is mapped.
+extern bool MapSharedPhysicalPagesAt(size_t pml4, size_t addr, size_t physicaladdr, size_t pages,
+	bool copy_on_write);
 
 extern size_t ReleaseVirtualMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages);
 
-extern size_t MapPhysicalMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages);
+// Grows or shrinks memory that was allocated with AllocateVirtualMemoryInAddressSpace. Memory grows in place if the
+// addresses after it are free, otherwise the pages are moved (without copying them) to somewhere with room. Returns the
+// new address, or OUT_OF_MEMORY if the memory couldn't be resized, in which case it's left as it was. If may_move is
+// false, the memory only grows in place.
+extern size_t ResizeVirtualMemoryInAddressSpace(size_t pml4, size_t addr, size_t current_pages, size_t new_pages,
+	bool may_move);
 
-// Unmaps a virtual page - free specifies if that page should be returned to the physical memory manager.
+// Maps physical memory (such as memory mapped IO) into an address space, returning the virtual address or
+// OUT_OF_MEMORY. If large_pages is true, the aligned 2 MB runs of physical memory are mapped with 2 MB pages.
+extern size_t MapPhysicalMemoryInAddressSpace(size_t pml4, size_t addr, size_t pages, bool large_pages);
+
+// Unmaps a virtual page - free specifies if that page should be returned to the physical memory manager. The address is
+// free to be reused.
 extern void UnmapVirtualPage(size_t pml4, size_t virtualaddr, bool free);
 
 // Return the physical address mapped at a virtual address, returning OUT_OF_MEMORY if is not mapped.
 extern size_t GetPhysicalAddress(size_t pml4, size_t virtualaddr, bool ignore_unowned_pages);
 
+// Moves pages from one user address space to another. The pages must all be
+// mapped and owned by the source. Returns false if the pages couldn't all be
+// moved, in which case some pages may have moved and the caller should
+// release both ranges.
+extern bool MovePagesBetweenAddressSpaces(size_t source_pml4,
+	size_t source_address, size_t destination_pml4,
+	size_t destination_address, size_t pages);
+
+// Shares pages from one user address space with another, copy-on-write. The
+// pages must all be mapped and owned by the source, and stay mapped in the
+// source. Returns false if the pages couldn't all be shared, in which case the
+// caller should release the destination range.
+extern bool SharePagesBetweenAddressSpaces(size_t source_pml4,
+	size_t source_address, size_t destination_pml4,
+	size_t destination_address, size_t pages);
+
+// Gives a process its own writable copy of a copy-on-write page. Returns true
+// if the page is now writable, or false if the page isn't mapped, isn't
+// copy-on-write, or we're out of memory.
+extern bool ResolveCopyOnWritePage(size_t pml4, size_t virtualaddr);
+
 // Gets or creates a virtual page in an address space, returning the physical
 // address or OUT_OF_MEMORY if it fails.
 extern size_t GetOrCreateVirtualPage(size_t pml4, size_t virtualaddr);
 
+// Copies memory from a process's address space into the kernel. Returns false
+// if any of the memory isn't mapped.
+extern bool CopyFromProcessMemory(size_t pml4, size_t source_address,
+	void* destination, size_t length);
+
+// Copies memory from the kernel into a process's address space. Returns false
+// if any of the memory isn't mapped.
+extern bool CopyToProcessMemory(size_t pml4, size_t destination_address,
+	const void* source, size_t length);
+
+// Constructs a VirtualAddressSpace for its object pool.
+extern void ConstructVirtualAddressSpace(void* object);
+
 // Creates a virtual address space, returns the PML4. Returns OUT_OF_MEMORY if
 // it fails.
 extern size_t CreateAddressSpace();
@@ -63,10 +211,20 @@ extern size_t CreateAddressSpace();
 // kernel's PML4.
 extern void FreeAddressSpace(size_t pml4);
 
+// Counts the pages in a user address space. owned_pages is set to the number
+// of pages that the address space owns, with each 2 MB page counting as 512
+// pages, and page_table_pages is set to the number of pages used by its page
+// tables.
+extern void CountPagesInAddressSpace(size_t pml4, size_t* owned_pages,
+	size_t* page_table_pages);
+
 // Switch to a virtual address space. Remember to call this if allocating or
 // freeing pages to flush the changes! 
 extern void SwitchToAddressSpace(size_t pml4);
 
+// Flush the CPU lookup for a range of virtual pages.
+extern void FlushVirtualPages(size_t addr, size_t pages);
+
 // Flush the CPU lookup for a particular virtual address.
 extern void FlushVirtualPage(size_t addr);
 
@@ -14,14 +14,40 @@
 
 #include "perception/linux_syscalls/mremap.h"
 
+#include "errno.h"
 #include "perception/debug.h"
+#include "perception/memory.h"
+#include "sys/mman.h"
 
 namespace perception {
 namespace linux_syscalls {
 
-long mremap() {
-	perception::DebugPrinterSingleton << "System call mremap is unimplemented.\n";
-	return 0;
+long mremap(long old_address, long old_size, long new_size, long flags,
+	long new_address) {
+	if (flags & MREMAP_FIXED) {
+		perception::DebugPrinterSingleton << "mremap wants to move to a specific addr (" << (size_t)new_address << ") but this isn't yet implemented.\n";
+		return -EINVAL;
+	}
+
+	size_t old_pages = ((size_t)old_size + kPageSize - 1) / kPageSize;
+	size_t new_pages = ((size_t)new_size + kPageSize - 1) / kPageSize;
+	if ((old_address & (kPageSize - 1)) != 0 || old_pages == 0 ||
+		new_pages == 0)
+		return -EINVAL;
+
+	if (old_pages == new_pages)
+		return old_address;
+
+	if ((flags & MREMAP_MAYMOVE) == 0) {
+		if (!MaybeResizePagesInPlace((void*)old_address, old_pages, new_pages))
+			return -ENOMEM;
+		return old_address;
+	}
+
+	void* address = (void*)old_address;
+	if (!MaybeResizePages(&address, old_pages, new_pages))
+		return -ENOMEM;
+	return (long)address;
 }
 
 }
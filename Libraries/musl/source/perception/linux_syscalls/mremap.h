@@ -15,7 +15,8 @@
 namespace perception {
 namespace linux_syscalls {
 
-long mremap();
+long mremap(long old_address, long old_size, long new_size, long flags,
+	long new_address);
 
 }
 }
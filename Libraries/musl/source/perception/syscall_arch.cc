@@ -736,7 +736,7 @@ extern "C" long __syscall6(long n, long a1, long a2, long a3, long a4, long a5,
 		case SYS_mq_unlink:
 			return ::perception::linux_syscalls::mq_unlink();
 		case SYS_mremap:
-			return ::perception::linux_syscalls::mremap();
+			return ::perception::linux_syscalls::mremap(a1, a2, a3, a4, a5);
 		case SYS_msgctl:
 			return ::perception::linux_syscalls::msgctl();
 		case SYS_msgget:
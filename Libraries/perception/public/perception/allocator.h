@@ -0,0 +1,42 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include "types.h"
+
+namespace perception {
+
+// The largest allocation that is served from a size class. Anything larger
+// gets its own run of pages.
+constexpr size_t kLargestSizeClass = 4096;
+
+// Allocates memory from the calling thread's cache. Small allocations are
+// rounded up to a size class and carved out of 64 KB spans that the thread
+// owns, so the common case doesn't make a syscall. Until Perception has
+// thread local storage, every thread in a process shares one cache behind a
+// lock. Returns nullptr if we're out of memory.
+void* AllocateMemory(size_t size);
+
+// Releases memory that was allocated with AllocateMemory. Memory may be
+// released by any thread - memory released by a thread other than the one
+// that owns its span is handed back to the owner without taking a lock.
+void ReleaseMemory(void* ptr);
+
+// Returns how many bytes can be used in memory that was allocated with
+// AllocateMemory, which is at least the size that was asked for.
+size_t GetAllocatedMemorySize(void* ptr);
+
+}
@@ -0,0 +1,165 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#pragma once
+
+#include <functional>
+#include <memory>
+
+#include "perception/shared_memory.h"
+#include "types.h"
+
+namespace perception {
+
+struct ChannelHeader;
+
+// A message sent through a channel. These are the same parameters that are
+// sent with a kernel message.
+struct ChannelMessage {
+	size_t metadata, param1, param2, param3, param4, param5;
+};
+
+// Channels are single-producer, single-consumer ring buffers of messages in
+// shared memory. Messages are sent and received without calling the kernel,
+// except to wake up the receiver when it is sleeping because the channel was
+// empty, or to wake up the sender when it is waiting for the receiver.
+//
+// The sender creates the channel and sends the shared memory ID to the
+// receiver through a normal message.
+
+// The sending end of a channel. Only one fiber may send at a time.
+class ChannelSender {
+public:
+	~ChannelSender();
+
+	// Creates a channel to the given process with room for at least the given
+	// number of messages. Returns nullptr if the shared memory couldn't be
+	// created.
+	static std::unique_ptr<ChannelSender> Create(ProcessId receiver,
+		size_t capacity);
+
+	// Returns the ID of the shared memory, which should be sent to the
+	// receiver so it can join the channel.
+	size_t GetSharedMemoryId() const;
+
+	// Sends a message. If the channel is full, the fiber sleeps until there's
+	// room. Returns false if the receiver has closed the channel or gone away.
+	bool Send(const ChannelMessage& message);
+
+	// Sleeps the fiber until the receiver has handled every message that was
+	// sent, so that a message sent some other way (such as through the kernel)
+	// arrives after them. Returns false if the receiver has closed the channel
+	// or gone away.
+	bool WaitUntilReceived();
+
+private:
+	ChannelSender(std::unique_ptr<SharedMemory> shared_memory,
+		size_t capacity, ProcessId receiver, MessageId wake_message_id);
+
+	// Has the receiver handled every message that was sent?
+	bool HasReceiverHandledEverything() const;
+
+	// The shared memory the channel lives in.
+	std::unique_ptr<SharedMemory> shared_memory_;
+
+	// The number of messages the ring can hold. The receiver can write to the
+	// header, so we keep our own copy rather than reading it from there.
+	size_t capacity_;
+
+	// The process that receives from this channel. We know this before the
+	// receiver has joined, and don't trust the header to tell us who to wake
+	// up.
+	ProcessId receiver_;
+
+	// The message the receiver sends us to wake us up.
+	MessageId wake_message_id_;
+
+	// Notifies us if the receiver goes away while we're waiting for it, or 0
+	// if we haven't waited yet.
+	MessageId receiver_termination_message_id_;
+
+	// Set if the receiver went away.
+	bool receiver_has_gone_;
+
+	// The header at the start of the shared memory.
+	ChannelHeader* header_;
+
+	// The ring of messages after the header.
+	ChannelMessage* messages_;
+};
+
+// The receiving end of a channel. A fiber that is handling messages keeps
+// the receiver alive until the handler returns, so it's safe to let go of the
+// receiver from anywhere, including from inside the handler.
+class ChannelReceiver {
+public:
+	// Closes the channel, so the sender stops sending to it.
+	~ChannelReceiver();
+
+	// Joins a channel created by a ChannelSender in the sender's process. The
+	// handler is called, on a fiber, for each message that is received.
+	// Returns nullptr if the shared memory isn't a channel.
+	static std::shared_ptr<ChannelReceiver> Join(size_t shared_memory_id,
+		ProcessId sender, std::function<void(const ChannelMessage&)> handler);
+
+	// Closes the channel, so the sender stops sending to it. Messages that
+	// haven't been handled yet are dropped, and the handler isn't called again.
+	void Close();
+
+private:
+	ChannelReceiver(std::unique_ptr<SharedMemory> shared_memory,
+		size_t capacity, ProcessId sender,
+		std::function<void(const ChannelMessage&)> handler);
+
+	// Handles every message in the channel, then tells the sender we're
+	// sleeping until it wakes us up.
+	void ReceiveMessages();
+
+	// Wakes up the sender if it's waiting for us to handle its messages.
+	void WakeSenderIfWaiting();
+
+	// The shared memory the channel lives in.
+	std::unique_ptr<SharedMemory> shared_memory_;
+
+	// The number of messages the ring can hold, checked when we joined. The
+	// sender can write to the header after that, so this is the only copy we
+	// trust.
+	size_t capacity_;
+
+	// The process that sends to this channel. We don't trust the header to
+	// tell us who to wake up.
+	ProcessId sender_;
+
+	// The header at the start of the shared memory.
+	ChannelHeader* header_;
+
+	// The ring of messages after the header.
+	ChannelMessage* messages_;
+
+	// The handler to call for each message.
+	std::function<void(const ChannelMessage&)> handler_;
+
+	// Set while we're handling messages, in case a handler sleeps and we're
+	// woken up again.
+	bool is_receiving_;
+
+	// Set once we've closed the channel.
+	bool is_closed_;
+
+	// The message the sender sends us to wake us up.
+	MessageId wake_message_id_;
+};
+
+}
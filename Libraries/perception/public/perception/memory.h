@@ -20,22 +20,84 @@ namespace perception {
 
 constexpr size_t kPageSize = 4096;
 
-void* AllocateMemoryPages(size_t number);
+// Allocates memory pages. If prefer_large_pages is true, the kernel backs
+// aligned 2 MB runs of the memory with 2 MB pages where it can, which saves
+// TLB misses when large allocations are accessed at random.
+void* AllocateMemoryPages(size_t number, bool prefer_large_pages = false);
 
 void ReleaseMemoryPages(void* ptr, size_t number);
 
 // Maps physical memory into this process's address space. Only drivers
-// may call this.
-void* MapPhysicalMemory(size_t physical_address, size_t pages);
+// may call this. If prefer_large_pages is true, aligned 2 MB runs of the
+// physical memory are mapped with 2 MB pages.
+void* MapPhysicalMemory(size_t physical_address, size_t pages,
+	bool prefer_large_pages = false);
 
+// Grows or shrinks memory pages allocated with AllocateMemoryPages. The
+// memory grows in place if there's room, otherwise the pages are moved to a
+// new address without copying them, and *ptr is updated. Returns false if the
+// memory couldn't be resized, in which case it's left as it was.
 bool MaybeResizePages(void** ptr, size_t current_number, size_t new_number);
 
+// Like MaybeResizePages, but the memory is never moved to a new address.
+bool MaybeResizePagesInPlace(void* ptr, size_t current_number,
+	size_t new_number);
+
 size_t GetFreeSystemMemory();
 
 size_t GetTotalSystemMemory();
 
 size_t GetMemoryUsedByProcess();
 
+// Statistics about one of the kernel's object pools.
+struct KernelObjectPoolStatistics {
+	// The type of object in the pool.
+	char name[41];
+	// The size of each object, in bytes.
+	size_t object_size;
+	// The number of objects that are allocated.
+	size_t objects_in_use;
+	// The number of pages held by the pool.
+	size_t pages;
+	// The number of objects that have ever been allocated.
+	size_t allocations;
+	// The number of pages the pool has given back because the kernel was
+	// running out of memory.
+	size_t pages_reclaimed;
+};
+
+// Gets the statistics of the kernel's object pool at an index. Returns false
+// if the index is past the last pool.
+bool GetKernelObjectPoolStatistics(size_t index,
+	KernelObjectPoolStatistics& statistics);
+
+// A breakdown of the memory used by a process.
+struct MemoryStatistics {
+	// The number of pages the process owns. Pages shared copy-on-write are
+	// counted in every process they're shared with.
+	size_t owned_pages;
+	// The number of pages in shared memory that the process created.
+	size_t shared_pages_created;
+	// The number of pages in shared memory that the process joined.
+	size_t shared_pages_joined;
+	// The number of pages used by the process's page tables.
+	size_t page_table_pages;
+	// The number of pages sent to the process in messages that it hasn't
+	// received yet. These are included in owned_pages.
+	size_t pages_in_queued_messages;
+	// The number of bytes of kernel objects that exist because of the
+	// process.
+	size_t kernel_object_bytes;
+};
+
+// Gets the memory statistics of a process. Returns false if the process
+// doesn't exist. The kernel walks the process's page tables, so this is too
+// slow to call often.
+bool GetMemoryStatistics(ProcessId process, MemoryStatistics& statistics);
+
+// Gets the memory statistics of this process.
+bool GetMemoryStatistics(MemoryStatistics& statistics);
+
 }
 
 // Functions handled by liballoc but redefined here to expose it in this library.
@@ -39,6 +39,43 @@ enum class MessageStatus {
 	INVALID_MEMORY_RANGE = 5
 };
 
+// A message that is sent or received in a batch. The layout is shared with
+// the kernel.
+struct MessageInBatch {
+	// When sending, the process to send the message to. When receiving, the
+	// process that sent the message.
+	ProcessId pid;
+	MessageId message_id;
+	size_t metadata, param1, param2, param3, param4, param5;
+};
+
+// The maximum number of messages the kernel will send in one batch.
+constexpr size_t kMaxMessagesInBatch = 64;
+
+// Flags for sending a message.
+// The message is a reply to an RPC, so it jumps ahead of other messages queued
+// in the receiver.
+constexpr size_t kMessageIsReply = 1;
+// Only the latest of these messages matters (such as the position of the
+// mouse), so if the last message queued in the receiver is the same kind of
+// message from us, it's replaced rather than queuing another message.
+constexpr size_t kMessageCanCoalesce = 2;
+// The memory pages sent with the message are shared copy-on-write with the
+// receiver instead of being moved, so they stay mapped in the sender.
+constexpr size_t kMessageSharePages = 4;
+
+// Statistics about a process's message queues.
+struct MessageQueueStatistics {
+	// The number of messages in the normal queue.
+	size_t messages_queued;
+	// The number of RPC replies and messages from the kernel queued.
+	size_t priority_messages_queued;
+	// The number of messages that were dropped because a queue was full.
+	size_t messages_dropped;
+	// The number of messages that replaced a queued message.
+	size_t messages_coalesced;
+};
+
 // Represents what to do when a message is received.
 struct MessageHandler {
 	// The fiber to wake up. This is set when a fiber is paused
@@ -73,9 +110,22 @@ Status ToStatus(MessageStatus status);
 
 // Sends a raw message to a process. Do not use unless you are familiar with
 // the Permebuf message protocol, as misuse could lead to memory corruption.
+// flags are the kMessage* flags.
 MessageStatus SendRawMessage(ProcessId pid, MessageId message_id,
 	size_t metadata, size_t param1, size_t param2, size_t param3,
-	size_t param4, size_t param5);
+	size_t param4, size_t param5, size_t flags = 0);
+
+// Sends a batch of messages, possibly to different processes, with one system
+// call. The messages are sent in order, and this stops at the first message
+// that fails to send. The number of messages that were sent is written to
+// messages_sent. The flags apply to every message.
+MessageStatus SendMessages(const MessageInBatch* messages,
+	size_t number_of_messages, size_t& messages_sent, size_t flags = 0);
+
+// Gets the statistics of a process's message queues. Returns false if the
+// process doesn't exist.
+bool GetMessageQueueStatistics(ProcessId pid,
+	MessageQueueStatistics& statistics);
 
 // Sends a message to a process.
 MessageStatus SendMessage(ProcessId pid, MessageId message_id, size_t param1, size_t param2, size_t param3,
@@ -121,4 +171,40 @@ void SleepUntilRawMessage(MessageId message_id, ProcessId& sender,
 // Maybe returns a message handler for the given ID, or nullptr.
 MessageHandler* GetMessageHandler(MessageId message_id);
 
+// Reserves a slot to receive the reply to an RPC in, and returns the message
+// ID the reply should be sent to. Slots are reused, so this doesn't allocate
+// memory once the process has warmed up.
+MessageId ReserveReplySlot();
+
+// Sleeps the current fiber until a message is sent to a reserved reply slot.
+// The slot stays reserved, so this can be called again if the message wasn't
+// the reply we were waiting for.
+void SleepUntilReply(MessageId reply_id, ProcessId& sender,
+	size_t& metadata, size_t& param1, size_t& param2, size_t& param3,
+	size_t& param4, size_t& param5);
+
+// Sends a message, then sleeps the current fiber until a message is sent to a
+// reserved reply slot. If there's nothing else to do, the kernel switches
+// straight to the receiver, which is faster than sending the message and then
+// sleeping. The out parameters are only set if the message was sent.
+MessageStatus SendMessageAndSleepUntilReply(ProcessId pid,
+	MessageId message_id, size_t metadata, size_t param1, size_t param2,
+	size_t param3, size_t param4, size_t param5, MessageId reply_id,
+	ProcessId& sender, size_t& reply_metadata, size_t& reply_param1,
+	size_t& reply_param2, size_t& reply_param3, size_t& reply_param4,
+	size_t& reply_param5);
+
+// Releases a reply slot once we are done with it. Any message sent to the
+// slot after this is treated as unhandled.
+void ReleaseReplySlot(MessageId reply_id);
+
+// Is this the message ID of a reply slot?
+bool IsReplySlotMessageId(MessageId message_id);
+
+// Returns the fiber that is waiting for a reply sent to a reply slot, or
+// nullptr if no fiber is waiting on it.
+Fiber* GetFiberToHandleReply(MessageId message_id, ProcessId senders_pid,
+	size_t metadata, size_t param1, size_t param2, size_t param3,
+	size_t param4, size_t param5);
+
 }
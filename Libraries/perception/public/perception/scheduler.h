@@ -16,6 +16,7 @@
 
 #include <functional>
 
+#include "perception/messages.h"
 #include "types.h"
 
 namespace perception {
@@ -45,7 +46,40 @@ public:
 	// Schedules a fiber to run.
 	static void ScheduleFiber(Fiber* fiber);
 
+	// Sends a message, then sleeps the current fiber until it's woken up. If
+	// this thread has nothing else to do, the message is sent in the same
+	// system call that sleeps the thread, and the kernel switches straight to
+	// the thread that receives the message.
+	static MessageStatus SendMessageAndSleep(ProcessId pid,
+		MessageId message_id, size_t metadata, size_t param1, size_t param2,
+		size_t param3, size_t param4, size_t param5);
+
+	// Sends a message, without memory pages, in reply to an RPC.
+	static void SendReply(ProcessId pid, MessageId message_id, size_t param1,
+		size_t param2, size_t param3, size_t param4, size_t param5);
+
+	// Like SendReply, but for the last thing a fiber does before it finishes
+	// handling a message and returns to the scheduler. If this thread is about
+	// to run out of work, the reply is held on to and sent in the same system
+	// call that sleeps the thread, so the kernel can switch straight back to
+	// the caller. Anything the fiber does after this holds up the reply.
+	static void SendReplyBeforeReturning(ProcessId pid, MessageId message_id,
+		size_t param1, size_t param2, size_t param3, size_t param4,
+		size_t param5);
+
 private:
+	// Returns if this thread would sleep until the next message, rather than
+	// run another fiber or handle a message it has already received.
+	static bool IsOutOfWork();
+
+	// Sends the reply that SendReplyBeforeReturning is holding on to, if there
+	// is one.
+	static void SendPendingReply();
+
+	// Returns a fiber to handle the next message we have received from the
+	// kernel but haven't dispatched, or nullptr if there's nothing to do for
+	// any of them.
+	static Fiber* DispatchReceivedMessages();
 
 	// Returns a fiber to handle the message, or nullptr if there's
 	// nothing to do.
@@ -46,8 +46,10 @@ public:
 	~SharedMemory();
 
 	// Creates a shared memory block of a specific size. The size is rounded up
-	// to the nearest page size.
-	static std::unique_ptr<SharedMemory> FromSize(size_t size_in_bytes);
+	// to the nearest page size. If prefer_large_pages is true, the kernel backs
+	// aligned 2 MB runs of the memory with 2 MB pages where it can.
+	static std::unique_ptr<SharedMemory> FromSize(size_t size_in_bytes,
+		bool prefer_large_pages = false);
 
 	// Creates another instance of the SharedMemory object that points to the
 	// same shared memory.
@@ -14,12 +14,19 @@
 
 #pragma once
 
+#include <map>
+#include <memory>
 #include <stddef.h>
 #include <stdint.h>
 #include <string_view>
 #include "types.h"
 #include "status.h"
 
+namespace perception {
+class ChannelReceiver;
+class ChannelSender;
+}
+
 // Determines the address size. Larger addresses allow the overall Permebuf to grow larger,
 // however, data structures take up more memory.
 enum class PermebufAddressSize {
@@ -480,6 +487,15 @@ protected:
 
 class PermebufServer;
 
+// The metadata of the message that asks a server to open a channel. This isn't
+// a valid function number. It has the bits set that say the message expects a
+// response, so a server that doesn't know about channels replies to it through
+// DealWithUnhandledMessage rather than leaving the client waiting.
+constexpr size_t kPermebufOpenChannelMetadata = ~(size_t)0b101;
+
+// The default number of messages a channel to a service can hold.
+constexpr size_t kPermebufDefaultChannelCapacity = 256;
+
 class PermebufService {
 public:
 	PermebufService();
@@ -509,13 +525,31 @@ public:
 		return process_id_ != 0;
 	}
 
+	// Opens a channel to the server, if the server accepts channels. Mini
+	// messages that don't expect a response and aren't sent with flags (such
+	// as kMessageCanCoalesce) are then sent through shared memory rather than
+	// through the kernel, which is much faster for high rate streams. Copies
+	// of this service share the channel. Messages still arrive in the order
+	// they were sent: if the channel is full, the sender waits for room, and
+	// anything sent through the kernel waits until the server has handled
+	// what's in the channel.
+	::perception::Status OpenChannel(
+		size_t capacity = kPermebufDefaultChannelCapacity);
+
 protected:
 	::perception::ProcessId process_id_;
 	::perception::MessageId message_id_;
 
+	// The channel to the server, if one was opened.
+	std::shared_ptr<::perception::ChannelSender> channel_;
+
+	// Waits until the server has handled everything we sent through the
+	// channel. Call this before sending anything through the kernel.
+	void WaitForChannel() const;
+
 	template <class O>
 	::perception::Status SendMiniMessage(size_t message_id,
-		const O& request) const;
+		const O& request, size_t flags = 0) const;
 
 	template <class O>
 	::perception::Status SendMessage(size_t message_id, Permebuf<O> request)
@@ -579,6 +613,10 @@ public:
 	bool operator==(const PermebufService& other) const;
 	bool operator==(const PermebufServer& other) const;
 
+	// Sets if clients may open channels to this server. See
+	// PermebufService::OpenChannel.
+	void SetAcceptsChannels(bool accepts_channels);
+
 	template <class I>
 	bool ProcessMiniMessage(::perception::ProcessId sender,
 		size_t metadata, size_t param1, size_t param2, size_t param3,
@@ -649,8 +687,28 @@ protected:
 		::perception::MessageId response_channel,
 		::perception::Status status);
 
+	// Opens a channel that a client has asked for.
+	::perception::Status OpenChannel(::perception::ProcessId sender,
+		size_t shared_memory_id);
+
+	// Closes the channel from a client.
+	void CloseChannel(::perception::ProcessId sender);
+
 	::perception::MessageId message_id_;
 
+	// Can clients open channels to this server?
+	bool accepts_channels_;
+
+	// A channel that a client opened to this server.
+	struct ChannelFromClient {
+		std::shared_ptr<::perception::ChannelReceiver> receiver;
+		// Notifies us when the client goes away.
+		::perception::MessageId process_termination_message_id;
+	};
+
+	// The channels that clients have opened, by the client's process ID.
+	std::map<::perception::ProcessId, ChannelFromClient> channels_;
+
 };
 
 #include "permebuf_implementation.inl"
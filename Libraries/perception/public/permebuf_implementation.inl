@@ -18,6 +18,7 @@
 // implementations and must be part of the header. But, they are in separate files
 // for better organization.
 
+#include "perception/channel.h"
 #include "perception/messages.h"
 #include "perception/memory.h"
 #include "perception/scheduler.h"
@@ -514,13 +515,25 @@ PermebufListOfNumbers<T> PermebufListOfNumbers<T>::Allocate(PermebufBase* buffer
 
 template <class O>
 ::perception::Status PermebufService::SendMiniMessage(size_t function_id,
-	const O& request) const {
+	const O& request, size_t flags) const {
 	size_t a, b, c, d;
 	request.Serialize(a, b, c, d);
+
+	// Skip the kernel if we have a channel. This only fails if the server
+	// closed the channel, in which case nothing in it will be handled. The
+	// channel doesn't know about flags (such as coalescing), so messages with
+	// flags always go through the kernel.
+	if (channel_ && flags == 0 && channel_->Send(::perception::ChannelMessage{
+		function_id << 3, 0, a, b, c, d}))
+		return ::perception::Status::OK;
+
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
 	return ::perception::ToStatus(::perception::SendRawMessage(
 		 process_id_, message_id_,
 		 function_id << 3,
-		 0, a, b, c, d));
+		 0, a, b, c, d, flags));
 }
 
 template <class O>
@@ -532,6 +545,9 @@ template <class O>
 	size_t size_in_bytes;
 	request.ReleaseMemory(&memory_address, &number_of_pages, &size_in_bytes);
 
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
 	auto status = ::perception::SendRawMessage(process_id_, message_id_,
 		(function_id << 3) | 1,
 		0, 0, size_in_bytes, (size_t)memory_address, number_of_pages);
@@ -551,24 +567,34 @@ StatusOr<I> PermebufService::SendMiniMessageAndWaitForMiniMessage(
 	request.Serialize(a, b, c, d);
 
 	::perception::MessageId message_id_of_response =
-		::perception::GenerateUniqueMessageId();
+		::perception::ReserveReplySlot();
 
-	auto send_status = ::perception::SendRawMessage(
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
+	// Send the message and sleep until we get a response.
+	::perception::ProcessId pid;
+	size_t metadata, response_status;
+	auto send_status = ::perception::SendMessageAndSleepUntilReply(
 		 process_id_, message_id_,
 		 function_id << 3,
-		 message_id_of_response, a, b, c, d);
+		 message_id_of_response, a, b, c, d, message_id_of_response,
+		 pid, metadata, response_status, a, b, c, d);
 
-	if (send_status != ::perception::MessageStatus::SUCCESS)
+	if (send_status != ::perception::MessageStatus::SUCCESS) {
 		// Something went wrong while sending it out.
+		::perception::ReleaseReplySlot(message_id_of_response);
 		return ::perception::ToStatus(send_status);
+	}
 
-	// Sleep until we get a response.
-	::perception::ProcessId pid;
-	size_t metadata, response_status;
-	do {
-		::perception::SleepUntilMessage(message_id_of_response,
-		pid, metadata, response_status, a, b, c, d);
-	} while (pid != process_id_);
+	while (pid != process_id_ || metadata != 0) {
+		// Not the response we are waiting for.
+		::perception::DealWithUnhandledMessage(pid, metadata,
+			response_status, c, d);
+		::perception::SleepUntilReply(message_id_of_response,
+			pid, metadata, response_status, a, b, c, d);
+	}
+	::perception::ReleaseReplySlot(message_id_of_response);
 
 	if (response_status != 0) {
 		// Bad response from the server.
@@ -591,32 +617,37 @@ PermebufService::SendMiniMessageAndWaitForMessage(size_t function_id,
 	request.Serialize(a, b, c, d);
 
 	::perception::MessageId message_id_of_response =
-		::perception::GenerateUniqueMessageId();
+		::perception::ReserveReplySlot();
 
-	auto send_status = ::perception::SendRawMessage(
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
+	// Send the message and sleep until we get a response.
+	::perception::ProcessId pid;
+	size_t metadata, response_status, param2, param3, param4, param5;
+	auto send_status = ::perception::SendMessageAndSleepUntilReply(
 		 process_id_, message_id_,
 		 function_id << 3,
-		 message_id_of_response, a, b, c, d);
+		 message_id_of_response, a, b, c, d, message_id_of_response,
+		 pid, metadata, response_status, param2, param3, param4, param5);
 
 	if (send_status != ::perception::MessageStatus::SUCCESS) {
 		// Something went wrong while sending it out.
+		::perception::ReleaseReplySlot(message_id_of_response);
 		return ::perception::ToStatus(send_status);
 	}
 
-	::perception::ProcessId pid;
-	size_t metadata, response_status, param2, param3, param4, param5;
-	do {
-		::perception::SleepUntilRawMessage(message_id_of_response,
+	while (pid != process_id_) {
+		// Not the process we care about.
+		if ((metadata & 1) == 1) {
+			// This other process sent us memory we don't care about.
+			::perception::ReleaseMemoryPages((void*)param4, param5);
+		}
+		::perception::SleepUntilReply(message_id_of_response,
 			pid, metadata, response_status, param2, param3, param4,
 			param5);
-		if (pid != process_id_) {
-			// Not the process we care about.
-			if ((metadata & 1) == 1) {
-				// This other process sent us memory we don't care about.
-				::perception::ReleaseMemoryPages((void*)param4, param5);
-			}
-		}
-	} while (pid != process_id_);
+	}
+	::perception::ReleaseReplySlot(message_id_of_response);
 
 	if (response_status != 0) {
 		// Bad response from the server.
@@ -647,6 +678,9 @@ void PermebufService::SendMiniMessageAndNotifyOnMiniMessage(
 	::perception::MessageId message_id_of_response =
 		::perception::GenerateUniqueMessageId();
 
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
 	auto send_status = ::perception::SendRawMessage(
 		 process_id_, message_id_,
 		 function_id << 3,
@@ -704,28 +738,37 @@ StatusOr<I> PermebufService::SendMessageAndWaitForMiniMessage(
 	request.ReleaseMemory(&memory_address, &number_of_pages, &size_in_bytes);
 
 	::perception::MessageId message_id_of_response =
-		::perception::GenerateUniqueMessageId();
+		::perception::ReserveReplySlot();
 
-	auto status = ::perception::SendRawMessage(process_id_, message_id_,
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
+	// Send the message and sleep until we get a response.
+	::perception::ProcessId pid;
+	size_t metadata, response_status, a, b, c, d;
+	auto status = ::perception::SendMessageAndSleepUntilReply(
+		process_id_, message_id_,
 		(function_id << 3) | 1,
 		message_id_of_response, 0, size_in_bytes,
-		(size_t)memory_address, number_of_pages);
+		(size_t)memory_address, number_of_pages, message_id_of_response,
+		pid, metadata, response_status, a, b, c, d);
 	if (status !=
 		::perception::MessageStatus::SUCCESS) {
 		// Something went wrong while sending the message.
 		::perception::ReleaseMemoryPages(memory_address,
 			number_of_pages);
+		::perception::ReleaseReplySlot(message_id_of_response);
 		return ::perception::ToStatus(status);
 	}
 
-
-	// Sleep until we get a response.
-	::perception::ProcessId pid;
-	size_t metadata, response_status, a, b, c, d;
-	do {
-		::perception::SleepUntilMessage(message_id_of_response,
+	while (pid != process_id_ || metadata != 0) {
+		// Not the response we are waiting for.
+		::perception::DealWithUnhandledMessage(pid, metadata,
+			response_status, c, d);
+		::perception::SleepUntilReply(message_id_of_response,
 			pid, metadata, response_status, a, b, c, d);
-	} while (pid != process_id_);
+	}
+	::perception::ReleaseReplySlot(message_id_of_response);
 
 	if (response_status != 0) {
 		// Bad response from the server.
@@ -750,34 +793,40 @@ StatusOr<Permebuf<I>>
 	request.ReleaseMemory(&memory_address, &number_of_pages, &size_in_bytes);
 
 	::perception::MessageId message_id_of_response =
-		::perception::GenerateUniqueMessageId();
+		::perception::ReserveReplySlot();
 
-	auto status = ::perception::SendRawMessage(process_id_, message_id_,
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
+	// Send the message and sleep until we get a response.
+	::perception::ProcessId pid;
+	size_t metadata, response_status, param2, param3, param4, param5;
+	auto status = ::perception::SendMessageAndSleepUntilReply(
+		process_id_, message_id_,
 		(function_id << 3) | 1,
 		message_id_of_response, 0, size_in_bytes,
-		(size_t)memory_address, number_of_pages);
+		(size_t)memory_address, number_of_pages, message_id_of_response,
+		pid, metadata, response_status, param2, param3, param4, param5);
 	if (status !=
 		::perception::MessageStatus::SUCCESS) {
 		// Something went wrong while sending the message.
 		::perception::ReleaseMemoryPages(memory_address,
 			number_of_pages);
+		::perception::ReleaseReplySlot(message_id_of_response);
 		return ::perception::ToStatus(status);
 	}
 
-	::perception::ProcessId pid;
-	size_t metadata, response_status, param2, param3, param4, param5;
-	do {
-		::perception::SleepUntilRawMessage(message_id_of_response,
+	while (pid != process_id_) {
+		// Not the process we care about.
+		if ((metadata & 1) == 1) {
+			// This other process sent us memory we don't care about.
+			::perception::ReleaseMemoryPages((void*)param4, param5);
+		}
+		::perception::SleepUntilReply(message_id_of_response,
 			pid, metadata, response_status, param2, param3, param4,
 			param5);
-		if (pid != process_id_) {
-			// Not the process we care about.
-			if ((metadata & 1) == 1) {
-				// This other process sent us memory we don't care about.
-				::perception::ReleaseMemoryPages((void*)param4, param5);
-			}
-		}
-	} while (pid != process_id_);
+	}
+	::perception::ReleaseReplySlot(message_id_of_response);
 
 	if (response_status != 0) {
 		// Bad response from the server.
@@ -810,6 +859,9 @@ void PermebufService::SendMessageAndNotifyOnMiniMessage(
 	::perception::MessageId message_id_of_response =
 		::perception::GenerateUniqueMessageId();
 
+	// Don't overtake anything we sent through the channel.
+	WaitForChannel();
+
 	auto send_status = ::perception::SendRawMessage(process_id_, message_id_,
 		(function_id << 3) | 1,
 		message_id_of_response, 0, size_in_bytes,
@@ -952,7 +1004,8 @@ void PermebufServer::ReplyWithStatusOrMessage(
 			&memory_address, &number_of_pages, &size_in_bytes);
 		if (::perception::SendRawMessage(process, response_channel, /*metadata=*/1,
 			(size_t)::perception::Status::OK,
-			0, size_in_bytes, (size_t)memory_address, number_of_pages) !=
+			0, size_in_bytes, (size_t)memory_address, number_of_pages,
+			::perception::kMessageIsReply) !=
 			::perception::MessageStatus::SUCCESS) {
 			::perception::ReleaseMemoryPages(memory_address,
 				number_of_pages);
@@ -974,8 +1027,8 @@ void PermebufServer::ReplyWithStatusOrMiniMessage(
 	if (status_or_mini_message) {
 		size_t a, b, c, d;
 		status_or_mini_message->Serialize(a, b, c, d);
-		::perception::SendMessage(process, response_channel,
-			(size_t)::perception::Status::OK, a, b, c, d);
+		::perception::Scheduler::SendReplyBeforeReturning(process,
+			response_channel, (size_t)::perception::Status::OK, a, b, c, d);
 	} else {
 		ReplyWithStatus(process, response_channel,
 			status_or_mini_message.Status());
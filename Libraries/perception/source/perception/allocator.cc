@@ -0,0 +1,494 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "perception/allocator.h"
+
+#include <atomic>
+#include <new>
+
+#include "perception/memory.h"
+#include "perception/threads.h"
+
+#ifndef PERCEPTION
+#include <stdlib.h>
+#endif
+
+#if PERCEPTION
+// Perception doesn't have thread local storage yet, so like the scheduler's
+// state, every thread in a process shares the same cache until it does. The
+// shared cache is protected by a lock.
+#define ALLOCATOR_THREAD_LOCAL /*thread_local*/
+#define ALLOCATOR_SHARED_THREAD_CACHE 1
+#else
+#define ALLOCATOR_THREAD_LOCAL thread_local
+#define ALLOCATOR_SHARED_THREAD_CACHE 0
+#endif
+
+namespace perception {
+namespace {
+
+// The size of each span. Spans are aligned to their size, so we can find the
+// span that an object belongs to from its address.
+constexpr size_t kSpanSize = 64 * 1024;
+
+// The number of pages in a span of small objects.
+constexpr size_t kPagesPerSpan = kSpanSize / kPageSize;
+
+// Every allocation is aligned to this many bytes.
+constexpr size_t kAlignment = 16;
+
+// The sizes that small allocations are rounded up to. Each size class is at
+// most 25% bigger than the one before it, so little memory is wasted.
+constexpr size_t kSizeClasses[] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	160, 192, 224, 256, 320, 384, 448, 512,
+	640, 768, 896, 1024, 1280, 1536, 1792, 2048,
+	2560, 3072, 3584, 4096
+};
+
+constexpr size_t kNumberOfSizeClasses =
+	sizeof(kSizeClasses) / sizeof(kSizeClasses[0]);
+
+static_assert(kSizeClasses[kNumberOfSizeClasses - 1] == kLargestSizeClass,
+	"The last size class must be the largest size class.");
+
+// The size class of a span that holds a single large allocation.
+constexpr size_t kLargeAllocation = kNumberOfSizeClasses;
+
+// Maps the size of an allocation, in units of kAlignment, to its size class.
+struct SizeClassTable {
+	uint8 size_class_by_granule[kLargestSizeClass / kAlignment + 1];
+
+	constexpr SizeClassTable() : size_class_by_granule() {
+		size_t size_class = 0;
+		for (size_t granule = 0; granule <= kLargestSizeClass / kAlignment;
+			granule++) {
+			if (granule * kAlignment > kSizeClasses[size_class])
+				size_class++;
+			size_class_by_granule[granule] = size_class;
+		}
+	}
+};
+
+constexpr SizeClassTable kSizeClassTable;
+
+// A free object, which points to the next free object.
+struct FreeObject {
+	FreeObject* next;
+};
+
+struct ThreadCache;
+
+// The header at the start of each span.
+struct Span {
+	// The size class of the objects in this span, or kLargeAllocation.
+	size_t size_class;
+
+	// The number of pages in this span.
+	size_t pages;
+
+	// The thread cache that owns this span, or nullptr if the span has been
+	// abandoned because its thread has exited.
+	std::atomic<ThreadCache*> owner;
+
+	// Linked list of the owner's spans in the same size class.
+	Span* next;
+	Span* previous;
+
+	// Free objects that can be allocated. Only touched by the owner.
+	FreeObject* free_objects;
+
+	// The number of objects that aren't in free_objects, which includes
+	// objects in remotely_released_objects.
+	size_t objects_in_use;
+
+	// Objects that were released by threads other than the owner. The owner
+	// collects them when it runs out of free objects. This is
+	// kSpanIsAbandoned while the span is abandoned.
+	std::atomic<FreeObject*> remotely_released_objects;
+};
+
+// Marks the remotely released objects of an abandoned span. Objects released
+// into an abandoned span go straight into its free objects, under the
+// abandoned spans lock, so the span can be released once they're all free.
+FreeObject* const kSpanIsAbandoned = (FreeObject*)1;
+
+// Objects start after the span's header.
+constexpr size_t kSpanHeaderSize =
+	(sizeof(Span) + kAlignment - 1) & ~(kAlignment - 1);
+
+// A thread's cache of spans to allocate small objects from.
+struct ThreadCache {
+	// The spans that the thread owns, for each size class. The first span is
+	// the one we're allocating from.
+	Span* spans[kNumberOfSizeClasses];
+
+	~ThreadCache();
+};
+
+ALLOCATOR_THREAD_LOCAL ThreadCache thread_cache;
+
+#if ALLOCATOR_SHARED_THREAD_CACHE
+// Protects thread_cache, which every thread shares.
+std::atomic_flag thread_cache_lock = ATOMIC_FLAG_INIT;
+#endif
+
+void LockThreadCache() {
+#if ALLOCATOR_SHARED_THREAD_CACHE
+	while (thread_cache_lock.test_and_set(std::memory_order_acquire))
+		Yield();
+#endif
+}
+
+void UnlockThreadCache() {
+#if ALLOCATOR_SHARED_THREAD_CACHE
+	thread_cache_lock.clear(std::memory_order_release);
+#endif
+}
+
+// Spans that were abandoned when their thread exited, for each size class,
+// waiting for another thread to adopt them.
+Span* abandoned_spans[kNumberOfSizeClasses];
+
+// Protects abandoned_spans and the free objects of the spans in it. This is
+// only taken when threads exit, when a thread runs out of spans, or when an
+// object in an abandoned span is released.
+std::atomic_flag abandoned_spans_lock = ATOMIC_FLAG_INIT;
+
+void LockAbandonedSpans() {
+	while (abandoned_spans_lock.test_and_set(std::memory_order_acquire)) {}
+}
+
+void UnlockAbandonedSpans() {
+	abandoned_spans_lock.clear(std::memory_order_release);
+}
+
+// Allocates pages for a span, aligned to kSpanSize. Returns nullptr if we're
+// out of memory.
+Span* AllocateSpanMemory(size_t pages) {
+#if PERCEPTION
+	// Allocate enough pages that an aligned span fits in them, then give back
+	// the pages either side of it.
+	size_t pages_to_allocate = pages + kPagesPerSpan - 1;
+	size_t address = (size_t)AllocateMemoryPages(pages_to_allocate);
+	if (address == 0)
+		return nullptr;
+
+	size_t aligned_address = (address + kSpanSize - 1) & ~(kSpanSize - 1);
+	size_t pages_before = (aligned_address - address) / kPageSize;
+	size_t pages_after = pages_to_allocate - pages_before - pages;
+	if (pages_before > 0)
+		ReleaseMemoryPages((void*)address, pages_before);
+	if (pages_after > 0) {
+		ReleaseMemoryPages((void*)(aligned_address + pages * kPageSize),
+			pages_after);
+	}
+	return new ((void*)aligned_address) Span();
+#else
+	void* address = aligned_alloc(kSpanSize, pages * kPageSize);
+	if (address == nullptr)
+		return nullptr;
+	return new (address) Span();
+#endif
+}
+
+// Returns a span's pages.
+void ReleaseSpanMemory(Span* span) {
+#if PERCEPTION
+	ReleaseMemoryPages(span, span->pages);
+#else
+	free(span);
+#endif
+}
+
+// Creates a span of free objects, or returns nullptr if we're out of memory.
+Span* CreateSpan(size_t size_class) {
+	Span* span = AllocateSpanMemory(kPagesPerSpan);
+	if (span == nullptr)
+		return nullptr;
+
+	span->size_class = size_class;
+	span->pages = kPagesPerSpan;
+	span->objects_in_use = 0;
+
+	// Link the objects backwards so they're handed out in address order.
+	size_t object_size = kSizeClasses[size_class];
+	size_t objects = (kSpanSize - kSpanHeaderSize) / object_size;
+	FreeObject* free_objects = nullptr;
+	for (size_t i = objects; i > 0; i--) {
+		FreeObject* object = (FreeObject*)((size_t)span + kSpanHeaderSize +
+			(i - 1) * object_size);
+		object->next = free_objects;
+		free_objects = object;
+	}
+	span->free_objects = free_objects;
+	return span;
+}
+
+// Adds a span to the front of a list of spans.
+void AddSpanToList(Span*& first_span, Span* span) {
+	span->previous = nullptr;
+	span->next = first_span;
+	if (first_span != nullptr)
+		first_span->previous = span;
+	first_span = span;
+}
+
+// Removes a span from a list of spans.
+void RemoveSpanFromList(Span*& first_span, Span* span) {
+	if (span->previous == nullptr)
+		first_span = span->next;
+	else
+		span->previous->next = span->next;
+	if (span->next != nullptr)
+		span->next->previous = span->previous;
+}
+
+// Adds a span to the front of the cache's spans for its size class.
+void AddSpanToCache(ThreadCache& cache, Span* span) {
+	AddSpanToList(cache.spans[span->size_class], span);
+}
+
+// Removes a span from the cache's spans for its size class.
+void RemoveSpanFromCache(ThreadCache& cache, Span* span) {
+	RemoveSpanFromList(cache.spans[span->size_class], span);
+}
+
+// Moves a list of objects that other threads have released into the span's
+// free objects.
+void AddRemotelyReleasedObjects(Span* span, FreeObject* object) {
+	while (object != nullptr) {
+		FreeObject* next = object->next;
+		object->next = span->free_objects;
+		span->free_objects = object;
+		span->objects_in_use--;
+		object = next;
+	}
+}
+
+// Moves objects that other threads have released into the span's free
+// objects. Only called by the span's owner.
+void CollectRemotelyReleasedObjects(Span* span) {
+	AddRemotelyReleasedObjects(span, span->remotely_released_objects.exchange(
+		nullptr, std::memory_order_acquire));
+}
+
+// Takes ownership of a span that was abandoned when its thread exited, or
+// returns nullptr if there are none in the size class.
+Span* AdoptAbandonedSpan(ThreadCache& cache, size_t size_class) {
+	LockAbandonedSpans();
+	Span* span = abandoned_spans[size_class];
+	if (span != nullptr) {
+		RemoveSpanFromList(abandoned_spans[size_class], span);
+		span->owner.store(&cache, std::memory_order_relaxed);
+		// Other threads can go back to releasing objects remotely.
+		span->remotely_released_objects.store(nullptr,
+			std::memory_order_release);
+	}
+	UnlockAbandonedSpans();
+	return span;
+}
+
+// Abandons a span that still has objects in use, or releases it if it doesn't.
+void AbandonSpan(Span* span) {
+	LockAbandonedSpans();
+	span->owner.store(nullptr, std::memory_order_relaxed);
+	AddRemotelyReleasedObjects(span, span->remotely_released_objects.exchange(
+		kSpanIsAbandoned, std::memory_order_acq_rel));
+	bool is_empty = span->objects_in_use == 0;
+	if (!is_empty)
+		AddSpanToList(abandoned_spans[span->size_class], span);
+	UnlockAbandonedSpans();
+
+	if (is_empty)
+		ReleaseSpanMemory(span);
+}
+
+// Releases an object into an abandoned span, and releases the span if this
+// was the last object in use. Returns false if the span has since been
+// adopted, in which case the object hasn't been released.
+bool ReleaseObjectIntoAbandonedSpan(Span* span, FreeObject* object) {
+	LockAbandonedSpans();
+	if (span->remotely_released_objects.load(std::memory_order_relaxed) !=
+		kSpanIsAbandoned) {
+		UnlockAbandonedSpans();
+		return false;
+	}
+
+	object->next = span->free_objects;
+	span->free_objects = object;
+	span->objects_in_use--;
+	bool is_empty = span->objects_in_use == 0;
+	if (is_empty)
+		RemoveSpanFromList(abandoned_spans[span->size_class], span);
+	UnlockAbandonedSpans();
+
+	if (is_empty)
+		ReleaseSpanMemory(span);
+	return true;
+}
+
+// Finds a span in the size class with a free object, and makes it the first
+// span in the cache. Returns nullptr if we're out of memory.
+Span* FindSpanWithFreeObject(ThreadCache& cache, size_t size_class) {
+	for (Span* span = cache.spans[size_class]; span != nullptr;
+		span = span->next) {
+		if (span->free_objects == nullptr)
+			CollectRemotelyReleasedObjects(span);
+		if (span->free_objects != nullptr) {
+			RemoveSpanFromCache(cache, span);
+			AddSpanToCache(cache, span);
+			return span;
+		}
+	}
+
+	// All of our spans are full, so adopt a span or create a new one.
+	while (Span* span = AdoptAbandonedSpan(cache, size_class)) {
+		AddSpanToCache(cache, span);
+		if (span->free_objects != nullptr)
+			return span;
+	}
+
+	Span* span = CreateSpan(size_class);
+	if (span == nullptr)
+		return nullptr;
+	span->owner.store(&cache, std::memory_order_relaxed);
+	AddSpanToCache(cache, span);
+	return span;
+}
+
+// Gives a large allocation its own span.
+void* AllocateLargeMemory(size_t size) {
+	if (size > (size_t)-1 - kSpanSize)
+		return nullptr;
+
+	size_t pages = (kSpanHeaderSize + size + kPageSize - 1) / kPageSize;
+	Span* span = AllocateSpanMemory(pages);
+	if (span == nullptr)
+		return nullptr;
+
+	span->size_class = kLargeAllocation;
+	span->pages = pages;
+	return (void*)((size_t)span + kSpanHeaderSize);
+}
+
+// Returns the span that an allocation belongs to.
+Span* GetSpan(void* ptr) {
+	return (Span*)((size_t)ptr & ~(kSpanSize - 1));
+}
+
+ThreadCache::~ThreadCache() {
+	LockThreadCache();
+	// Release the spans that are empty, and abandon the spans that still have
+	// objects in use so another thread can adopt them.
+	for (size_t size_class = 0; size_class < kNumberOfSizeClasses;
+		size_class++) {
+		Span* span = spans[size_class];
+		while (span != nullptr) {
+			Span* next = span->next;
+			AbandonSpan(span);
+			span = next;
+		}
+		spans[size_class] = nullptr;
+	}
+	UnlockThreadCache();
+}
+
+}
+
+void* AllocateMemory(size_t size) {
+	if (size > kLargestSizeClass)
+		return AllocateLargeMemory(size);
+
+	size_t size_class = kSizeClassTable.size_class_by_granule[
+		(size + kAlignment - 1) / kAlignment];
+	ThreadCache& cache = thread_cache;
+	LockThreadCache();
+	Span* span = cache.spans[size_class];
+	if (span == nullptr || span->free_objects == nullptr) {
+		span = FindSpanWithFreeObject(cache, size_class);
+		if (span == nullptr) {
+			UnlockThreadCache();
+			return nullptr;
+		}
+	}
+
+	FreeObject* object = span->free_objects;
+	span->free_objects = object->next;
+	span->objects_in_use++;
+	UnlockThreadCache();
+	return object;
+}
+
+void ReleaseMemory(void* ptr) {
+	if (ptr == nullptr)
+		return;
+
+	Span* span = GetSpan(ptr);
+	if (span->size_class == kLargeAllocation) {
+		ReleaseSpanMemory(span);
+		return;
+	}
+
+	FreeObject* object = (FreeObject*)ptr;
+	ThreadCache& cache = thread_cache;
+	LockThreadCache();
+	if (span->owner.load(std::memory_order_relaxed) != &cache) {
+		UnlockThreadCache();
+
+		// Another thread owns this span, or it has been abandoned, so push the
+		// object onto its list of remotely released objects.
+		FreeObject* next = span->remotely_released_objects.load(
+			std::memory_order_relaxed);
+		while (true) {
+			if (next == kSpanIsAbandoned) {
+				if (ReleaseObjectIntoAbandonedSpan(span, object))
+					return;
+				next = span->remotely_released_objects.load(
+					std::memory_order_relaxed);
+				continue;
+			}
+
+			object->next = next;
+			if (span->remotely_released_objects.compare_exchange_weak(
+				next, object, std::memory_order_release,
+				std::memory_order_relaxed))
+				return;
+		}
+	}
+
+	object->next = span->free_objects;
+	span->free_objects = object;
+	span->objects_in_use--;
+
+	// Release the span if it's empty, unless it's the span we're allocating
+	// from, so allocating and releasing an object over and over doesn't keep
+	// creating and destroying a span.
+	if (span->objects_in_use == 0 && span != cache.spans[span->size_class]) {
+		RemoveSpanFromCache(cache, span);
+		ReleaseSpanMemory(span);
+	}
+	UnlockThreadCache();
+}
+
+size_t GetAllocatedMemorySize(void* ptr) {
+	Span* span = GetSpan(ptr);
+	if (span->size_class == kLargeAllocation)
+		return span->pages * kPageSize - kSpanHeaderSize;
+	else
+		return kSizeClasses[span->size_class];
+}
+
+}
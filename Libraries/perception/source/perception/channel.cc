@@ -0,0 +1,310 @@
+// Copyright 2021 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+
+#include "perception/channel.h"
+
+#include <atomic>
+
+#include "perception/messages.h"
+#include "perception/processes.h"
+
+namespace perception {
+
+// The header at the start of a channel's shared memory. The indices are on
+// their own cache lines so the sender and receiver don't fight over them.
+struct ChannelHeader {
+	// The number of messages the ring can hold. This is a power of two.
+	size_t capacity;
+
+	// The message to wake the receiver up with. This is written by the
+	// receiver when it joins.
+	MessageId wake_message_id;
+
+	// Set by the receiver when it closes the channel.
+	std::atomic<bool> is_closed;
+
+	// Set by the receiver before it sleeps because the channel is empty. The
+	// sender clears this when it wakes up the receiver.
+	std::atomic<bool> receiver_is_sleeping;
+
+	// Set by the receiver while it's handling messages.
+	std::atomic<bool> receiver_is_receiving;
+
+	// The message to wake the sender up with. This is written by the sender
+	// when it creates the channel.
+	MessageId sender_wake_message_id;
+
+	// Set by the sender before it sleeps until the receiver has handled every
+	// message. The receiver clears this when it wakes up the sender.
+	std::atomic<bool> sender_is_waiting;
+
+	// The number of messages that have been sent. Only written by the sender.
+	alignas(64) std::atomic<size_t> write_index;
+
+	// The number of messages that have been received. Only written by the
+	// receiver.
+	alignas(64) std::atomic<size_t> read_index;
+};
+
+namespace {
+
+// Returns the ring of messages that follows the header.
+ChannelMessage* GetMessagesInChannel(ChannelHeader* header) {
+	return (ChannelMessage*)((size_t)header + sizeof(ChannelHeader));
+}
+
+}
+
+ChannelSender::ChannelSender(std::unique_ptr<SharedMemory> shared_memory,
+	size_t capacity, ProcessId receiver, MessageId wake_message_id) :
+	shared_memory_(std::move(shared_memory)), capacity_(capacity),
+	receiver_(receiver), wake_message_id_(wake_message_id), receiver_termination_message_id_(0),
+	receiver_has_gone_(false) {
+	header_ = (ChannelHeader*)**shared_memory_;
+	messages_ = GetMessagesInChannel(header_);
+}
+
+ChannelSender::~ChannelSender() {
+	if (receiver_termination_message_id_ != 0)
+		StopNotifyingUponProcessTermination(receiver_termination_message_id_);
+}
+
+// Creates a channel with room for at least the given number of messages.
+std::unique_ptr<ChannelSender> ChannelSender::Create(ProcessId receiver,
+	size_t capacity) {
+	// Round up to a power of two so we can mask the indices.
+	size_t rounded_capacity = 1;
+	while (rounded_capacity < capacity)
+		rounded_capacity <<= 1;
+
+	auto shared_memory = SharedMemory::FromSize(sizeof(ChannelHeader) +
+		rounded_capacity * sizeof(ChannelMessage));
+	if (!shared_memory || **shared_memory == nullptr)
+		return nullptr;
+
+	// Use up any extra space that was rounded up to the page size.
+	while (sizeof(ChannelHeader) + rounded_capacity * 2 * sizeof(ChannelMessage)
+		<= shared_memory->GetSize())
+		rounded_capacity <<= 1;
+
+	ChannelHeader* header = (ChannelHeader*)**shared_memory;
+	header->capacity = rounded_capacity;
+	header->wake_message_id = 0;
+	header->is_closed = false;
+	header->receiver_is_sleeping = false;
+	header->receiver_is_receiving = false;
+	header->sender_wake_message_id = GenerateUniqueMessageId();
+	header->sender_is_waiting = false;
+	header->write_index = 0;
+	header->read_index = 0;
+
+	return std::unique_ptr<ChannelSender>(new ChannelSender(
+		std::move(shared_memory), rounded_capacity, receiver,
+		header->sender_wake_message_id));
+}
+
+// Returns the ID of the shared memory.
+size_t ChannelSender::GetSharedMemoryId() const {
+	return shared_memory_->GetId();
+}
+
+// Sends a message.
+bool ChannelSender::Send(const ChannelMessage& message) {
+	if (header_->is_closed.load(std::memory_order_relaxed))
+		return false;
+
+	size_t write_index = header_->write_index.load(std::memory_order_relaxed);
+	while (write_index - header_->read_index.load(std::memory_order_acquire) >=
+		capacity_) {
+		// The channel is full. Wait for room rather than letting the caller
+		// send this some other way, which would let it overtake the messages
+		// in the channel.
+		if (!WaitUntilReceived())
+			return false;
+	}
+
+	messages_[write_index & (capacity_ - 1)] = message;
+	header_->write_index.store(write_index + 1, std::memory_order_seq_cst);
+
+	// Only call the kernel if the receiver went to sleep. The receiver checks
+	// write_index again after setting receiver_is_sleeping, so one of us will
+	// see the other.
+	if (header_->receiver_is_sleeping.load(std::memory_order_seq_cst) &&
+		header_->receiver_is_sleeping.exchange(false)) {
+		SendMessage(receiver_, header_->wake_message_id);
+	}
+	return true;
+}
+
+// Have we handled every message that was sent? The receiver must also be
+// done with the last one, so a message sent another way can't overtake it.
+bool ChannelSender::HasReceiverHandledEverything() const {
+	return header_->read_index.load(std::memory_order_seq_cst) ==
+		header_->write_index.load(std::memory_order_relaxed) &&
+		!header_->receiver_is_receiving.load(std::memory_order_seq_cst);
+}
+
+// Waits until the receiver has handled every message that was sent.
+bool ChannelSender::WaitUntilReceived() {
+	while (!HasReceiverHandledEverything()) {
+		if (header_->is_closed.load(std::memory_order_relaxed) ||
+			receiver_has_gone_)
+			return false;
+
+		if (receiver_termination_message_id_ == 0) {
+			// Wake ourselves up if the receiver goes away without closing the
+			// channel.
+			receiver_termination_message_id_ = NotifyUponProcessTermination(
+				receiver_, [this]() {
+					receiver_has_gone_ = true;
+					SendMessage(GetProcessId(), wake_message_id_);
+				});
+			if (!DoesProcessExist(receiver_))
+				return false;
+		}
+
+		// Tell the receiver to wake us up, then check that it didn't finish
+		// while we were doing that.
+		header_->sender_is_waiting.store(true, std::memory_order_seq_cst);
+		if (HasReceiverHandledEverything() &&
+			header_->sender_is_waiting.exchange(false))
+			break;
+
+		// Either the receiver is still going, or it cleared the flag and is
+		// sending us a message.
+		ProcessId pid;
+		size_t metadata, param1, param2, param3, param4, param5;
+		SleepUntilMessage(wake_message_id_, pid, metadata, param1, param2,
+			param3, param4, param5);
+	}
+	return !header_->is_closed.load(std::memory_order_relaxed);
+}
+
+ChannelReceiver::ChannelReceiver(std::unique_ptr<SharedMemory> shared_memory,
+	size_t capacity, ProcessId sender,
+	std::function<void(const ChannelMessage&)> handler) :
+	shared_memory_(std::move(shared_memory)), capacity_(capacity),
+	sender_(sender), handler_(std::move(handler)), is_receiving_(false),
+	is_closed_(false) {
+	header_ = (ChannelHeader*)**shared_memory_;
+	messages_ = GetMessagesInChannel(header_);
+	wake_message_id_ = GenerateUniqueMessageId();
+}
+
+ChannelReceiver::~ChannelReceiver() {
+	Close();
+	UnregisterMessageHandler(wake_message_id_);
+}
+
+// Joins a channel created by a ChannelSender.
+std::shared_ptr<ChannelReceiver> ChannelReceiver::Join(size_t shared_memory_id,
+	ProcessId sender, std::function<void(const ChannelMessage&)> handler) {
+	auto shared_memory = std::make_unique<SharedMemory>(shared_memory_id);
+	size_t size = shared_memory->GetSize();
+	if (size < sizeof(ChannelHeader))
+		return nullptr;
+
+	// Don't trust the sender to tell us a capacity that fits.
+	ChannelHeader* header = (ChannelHeader*)**shared_memory;
+	size_t capacity = header->capacity;
+	if (capacity == 0 || (capacity & (capacity - 1)) != 0 ||
+		capacity > (size - sizeof(ChannelHeader)) / sizeof(ChannelMessage))
+		return nullptr;
+
+	auto receiver = std::shared_ptr<ChannelReceiver>(new ChannelReceiver(
+		std::move(shared_memory), capacity, sender, std::move(handler)));
+	header->wake_message_id = receiver->wake_message_id_;
+
+	// Hold on to the receiver while we're handling messages, in case whoever
+	// owns it lets go of it while a handler is running.
+	std::weak_ptr<ChannelReceiver> weak_receiver = receiver;
+	RegisterMessageHandler(receiver->wake_message_id_,
+		[weak_receiver](ProcessId, size_t, size_t, size_t, size_t, size_t) {
+			if (auto receiver = weak_receiver.lock())
+				receiver->ReceiveMessages();
+		});
+
+	// Handle anything that was sent before we joined.
+	receiver->ReceiveMessages();
+	return receiver;
+}
+
+// Closes the channel.
+void ChannelReceiver::Close() {
+	if (is_closed_)
+		return;
+	is_closed_ = true;
+	header_->is_closed = true;
+	WakeSenderIfWaiting();
+}
+
+// Handles every message in the channel, then tells the sender we're sleeping
+// until it wakes us up.
+void ChannelReceiver::ReceiveMessages() {
+	if (is_receiving_ || is_closed_) {
+		// We were woken up while a handler was sleeping. The loop that called
+		// it will pick up anything new.
+		return;
+	}
+	is_receiving_ = true;
+	header_->receiver_is_receiving.store(true, std::memory_order_seq_cst);
+
+	while (true) {
+		size_t read_index = header_->read_index.load(std::memory_order_relaxed);
+		size_t write_index = header_->write_index.load(std::memory_order_acquire);
+		if (write_index - read_index > capacity_) {
+			// The sender is misbehaving.
+			break;
+		}
+
+		while (read_index != write_index && !is_closed_) {
+			// Copy the message out before we give the slot back to the sender.
+			ChannelMessage message = messages_[read_index & (capacity_ - 1)];
+			read_index++;
+			header_->read_index.store(read_index, std::memory_order_release);
+			handler_(message);
+		}
+
+		if (is_closed_) {
+			// A handler closed the channel.
+			break;
+		}
+
+		// Tell the sender to wake us up, then check that nothing was sent
+		// while we were doing that.
+		header_->receiver_is_sleeping.store(true, std::memory_order_seq_cst);
+		if (header_->write_index.load(std::memory_order_seq_cst) == read_index)
+			break;
+
+		// Something was sent. If the sender didn't already clear the flag (and
+		// send us a message), keep going.
+		if (!header_->receiver_is_sleeping.exchange(false))
+			break;
+	}
+
+	header_->receiver_is_receiving.store(false, std::memory_order_seq_cst);
+	is_receiving_ = false;
+	WakeSenderIfWaiting();
+}
+
+// Wakes up the sender if it's waiting for us to handle its messages.
+void ChannelReceiver::WakeSenderIfWaiting() {
+	if (header_->sender_is_waiting.load(std::memory_order_seq_cst) &&
+		header_->sender_is_waiting.exchange(false)) {
+		SendMessage(sender_, header_->sender_wake_message_id);
+	}
+}
+
+}
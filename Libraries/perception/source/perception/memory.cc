@@ -12,8 +12,10 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 
+#include "perception/allocator.h"
 #include "perception/liballoc.h"
 #include "perception/memory.h"
+#include "perception/processes.h"
 
 #include <iostream>
 
@@ -25,15 +27,35 @@
 namespace perception {
 namespace {
 	size_t kOutOfMemory = 1;
+
+#if PERCEPTION
+// Resizes memory pages, returning the new address or kOutOfMemory.
+size_t ResizeMemoryPages(void* ptr, size_t current_number, size_t new_number,
+	bool may_move) {
+	volatile register size_t syscall_num asm ("rdi") = 26;
+	volatile register size_t address_r asm ("rax") = (size_t)ptr;
+	volatile register size_t current_number_r asm ("rbx") = current_number;
+	volatile register size_t new_number_r asm ("rdx") = new_number;
+	volatile register size_t may_move_r asm ("rsi") = may_move ? 1 : 0;
+	volatile register size_t return_val asm ("rax");
+
+	__asm__ __volatile__ ("syscall\n":"=r"(return_val):"r"(syscall_num),
+		"r"(address_r), "r"(current_number_r), "r"(new_number_r),
+		"r"(may_move_r): "rcx", "r11");
+	return return_val;
+}
+#endif
 }
 
-void* AllocateMemoryPages(size_t number) {
+void* AllocateMemoryPages(size_t number, bool prefer_large_pages) {
 #if PERCEPTION
 	volatile register size_t syscall_num asm ("rdi") = 12;
 	volatile register size_t param1 asm ("rax") = number;
+	volatile register size_t param2 asm ("rbx") = prefer_large_pages ? 1 : 0;
 	volatile register size_t return_val asm ("rax");
 
-	__asm__ __volatile__ ("syscall\n":"=r"(return_val):"r"(syscall_num), "r"(param1): "rcx", "r11");
+	__asm__ __volatile__ ("syscall\n":"=r"(return_val):"r"(syscall_num), "r"(param1),
+		"r"(param2): "rcx", "r11");
 	if (return_val == kOutOfMemory)
 		return nullptr;
 	else
@@ -57,15 +79,19 @@ void ReleaseMemoryPages(void* ptr, size_t number) {
 
 // Maps physical memory into this process's address space. Only drivers
 // may call this.
-void* MapPhysicalMemory(size_t physical_address, size_t pages) {
+void* MapPhysicalMemory(size_t physical_address, size_t pages,
+	bool prefer_large_pages) {
 #if PERCEPTION
 	volatile register size_t syscall_num asm ("rdi") = 41;
 	volatile register size_t physical_address_r asm ("rax") = physical_address;
 	volatile register size_t pages_r asm ("rbx") = pages;
+	volatile register size_t large_pages_r asm ("rdx") =
+		prefer_large_pages ? 1 : 0;
 	volatile register size_t return_val asm ("rax");
 
 	__asm__ __volatile__ ("syscall\n":"=r"(return_val):"r"(syscall_num),
-		"r"(physical_address_r), "r"(pages_r): "rcx", "r11");
+		"r"(physical_address_r), "r"(pages_r), "r"(large_pages_r):
+		"rcx", "r11");
 	if (return_val == kOutOfMemory)
 			return nullptr;
 	else
@@ -77,8 +103,13 @@ void* MapPhysicalMemory(size_t physical_address, size_t pages) {
 
 bool MaybeResizePages(void** ptr, size_t current_number, size_t new_number) {
 #if PERCEPTION
-	std::cout << "Implement MaybeResizePages." << std::endl;
-	return false;
+	size_t new_address = ResizeMemoryPages(*ptr, current_number, new_number,
+		/*may_move=*/true);
+	if (new_address == kOutOfMemory)
+		return false;
+
+	*ptr = (void*)new_address;
+	return true;
 #else
 	void* maybe_new_ptr = realloc(*ptr, new_number * kPageSize);
 	if (maybe_new_ptr == nullptr)
@@ -89,6 +120,16 @@ bool MaybeResizePages(void** ptr, size_t current_number, size_t new_number) {
 #endif
 }
 
+bool MaybeResizePagesInPlace(void* ptr, size_t current_number,
+	size_t new_number) {
+#if PERCEPTION
+	return ResizeMemoryPages(ptr, current_number, new_number,
+		/*may_move=*/false) != kOutOfMemory;
+#else
+	return new_number <= current_number;
+#endif
+}
+
 size_t GetFreeSystemMemory() {
 #if PERCEPTION
 	volatile register size_t syscall_num asm ("rdi") = 14;
@@ -127,6 +168,90 @@ size_t GetMemoryUsedByProcess() {
 #endif
 }
 
+bool GetKernelObjectPoolStatistics(size_t index,
+	KernelObjectPoolStatistics& statistics) {
+#if PERCEPTION
+	volatile register size_t syscall_num asm ("rdi") = 51;
+	volatile register size_t index_r asm ("rax") = index;
+	volatile register size_t exists_r asm ("rax");
+	volatile register size_t object_size_r asm ("rbx");
+	volatile register size_t objects_in_use_r asm ("rdx");
+	volatile register size_t pages_r asm ("rsi");
+	volatile register size_t allocations_r asm ("r8");
+	volatile register size_t pages_reclaimed_r asm ("r9");
+	volatile register size_t name_1 asm ("r10");
+	volatile register size_t name_2 asm ("r12");
+	volatile register size_t name_3 asm ("r13");
+	volatile register size_t name_4 asm ("r14");
+	volatile register size_t name_5 asm ("r15");
+
+	__asm__ __volatile__ ("syscall\n":
+		"=r"(exists_r), "=r"(object_size_r), "=r"(objects_in_use_r),
+		"=r"(pages_r), "=r"(allocations_r), "=r"(pages_reclaimed_r),
+		"=r"(name_1), "=r"(name_2), "=r"(name_3), "=r"(name_4),
+		"=r"(name_5):
+		"r"(syscall_num), "r"(index_r):
+		"rcx", "r11");
+
+	if (exists_r == 0)
+		return false;
+
+	size_t* name = (size_t*)statistics.name;
+	name[0] = name_1;
+	name[1] = name_2;
+	name[2] = name_3;
+	name[3] = name_4;
+	name[4] = name_5;
+	statistics.name[40] = '\0';
+	statistics.object_size = object_size_r;
+	statistics.objects_in_use = objects_in_use_r;
+	statistics.pages = pages_r;
+	statistics.allocations = allocations_r;
+	statistics.pages_reclaimed = pages_reclaimed_r;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool GetMemoryStatistics(ProcessId process, MemoryStatistics& statistics) {
+#if PERCEPTION
+	volatile register size_t syscall_num asm ("rdi") = 52;
+	volatile register size_t process_r asm ("rax") = process;
+	volatile register size_t exists_r asm ("rax");
+	volatile register size_t owned_pages_r asm ("rbx");
+	volatile register size_t shared_pages_created_r asm ("rdx");
+	volatile register size_t shared_pages_joined_r asm ("rsi");
+	volatile register size_t page_table_pages_r asm ("r8");
+	volatile register size_t pages_in_queued_messages_r asm ("r9");
+	volatile register size_t kernel_object_bytes_r asm ("r10");
+
+	__asm__ __volatile__ ("syscall\n":
+		"=r"(exists_r), "=r"(owned_pages_r), "=r"(shared_pages_created_r),
+		"=r"(shared_pages_joined_r), "=r"(page_table_pages_r),
+		"=r"(pages_in_queued_messages_r), "=r"(kernel_object_bytes_r):
+		"r"(syscall_num), "r"(process_r):
+		"rcx", "r11");
+
+	if (exists_r == 0)
+		return false;
+
+	statistics.owned_pages = owned_pages_r;
+	statistics.shared_pages_created = shared_pages_created_r;
+	statistics.shared_pages_joined = shared_pages_joined_r;
+	statistics.page_table_pages = page_table_pages_r;
+	statistics.pages_in_queued_messages = pages_in_queued_messages_r;
+	statistics.kernel_object_bytes = kernel_object_bytes_r;
+	return true;
+#else
+	return false;
+#endif
+}
+
+bool GetMemoryStatistics(MemoryStatistics& statistics) {
+	return GetMemoryStatistics(GetProcessId(), statistics);
+}
+
 }
 
 #ifdef PERCEPTION
@@ -134,20 +259,30 @@ size_t GetMemoryUsedByProcess() {
 // needs to exist.
 // extern "C" void __cxa_pure_virtual() {}
 
-// Functions to support new/delete.
+// Functions to support new/delete. These use the thread-caching allocator
+// rather than malloc, since most allocations in C++ code are small objects
+// that are allocated and released over and over.
 void *operator new(long unsigned int size) {
-    return malloc(size);
+    return ::perception::AllocateMemory(size);
 }
  
 void *operator new[](long unsigned int size) {
-    return malloc(size);
+    return ::perception::AllocateMemory(size);
+}
+ 
+void operator delete(void *address) noexcept {
+    ::perception::ReleaseMemory(address);
+}
+ 
+void operator delete[](void *address) noexcept {
+    ::perception::ReleaseMemory(address);
 }
  
 void operator delete(void *address, long unsigned int size) {
-    free(address);
+    ::perception::ReleaseMemory(address);
 }
  
 void operator delete[](void *address, long unsigned int size) {
-    free(address);
+    ::perception::ReleaseMemory(address);
 }
 #endif
@@ -15,9 +15,10 @@
 #include "perception/fibers.h"
 #include "perception/messages.h"
 #include "perception/memory.h"
+#include "perception/object_pool.h"
 #include "perception/scheduler.h"
 
-#include <map>
+#include <vector>
 
 namespace perception {
 namespace {
@@ -25,8 +26,177 @@ namespace {
 // The next unique message identifier.
 MessageId next_unique_message_id = 0;
 
+// An open addressing hash table of message handlers by message ID. The
+// handlers themselves are pooled so pointers to them stay valid when the
+// table grows, because fibers hold onto them while they run.
+class MessageHandlerTable {
+public:
+	MessageHandlerTable() : number_of_handlers_(0) {}
+
+	// Returns the handler for a message ID, or nullptr.
+	MessageHandler* Find(MessageId message_id) {
+		if (slots_.empty())
+			return nullptr;
+
+		for (size_t index = GetHomeSlot(message_id);;
+			index = (index + 1) & (slots_.size() - 1)) {
+			Slot& slot = slots_[index];
+			if (slot.handler == nullptr)
+				return nullptr;
+			if (slot.message_id == message_id)
+				return slot.handler;
+		}
+	}
+
+	// Returns the handler for a message ID, creating an empty handler if
+	// there isn't one.
+	MessageHandler* FindOrCreate(MessageId message_id) {
+		MessageHandler* handler = Find(message_id);
+		if (handler != nullptr)
+			return handler;
+
+		// Keep the table at most half full.
+		if ((number_of_handlers_ + 1) * 2 > slots_.size())
+			Grow();
+
+		handler = handler_pool_.Allocate();
+		handler->fiber_to_wake_up = nullptr;
+		InsertIntoSlots(message_id, handler);
+		number_of_handlers_++;
+		return handler;
+	}
+
+	// Removes the handler for a message ID.
+	void Erase(MessageId message_id) {
+		if (slots_.empty())
+			return;
+
+		size_t mask = slots_.size() - 1;
+		size_t index = GetHomeSlot(message_id);
+		while (slots_[index].handler != nullptr &&
+			slots_[index].message_id != message_id)
+			index = (index + 1) & mask;
+		if (slots_[index].handler == nullptr)
+			return;  // Not found.
+
+		MessageHandler* handler = slots_[index].handler;
+		handler->handler_function = nullptr;
+		handler_pool_.Release(handler);
+		number_of_handlers_--;
+
+		// Shift back any following handlers that would no longer be reachable
+		// from their home slot, so we don't need tombstones.
+		size_t empty_index = index;
+		for (index = (index + 1) & mask; slots_[index].handler != nullptr;
+			index = (index + 1) & mask) {
+			size_t home_index = GetHomeSlot(slots_[index].message_id);
+			if (((index - home_index) & mask) >=
+				((index - empty_index) & mask)) {
+				slots_[empty_index] = slots_[index];
+				empty_index = index;
+			}
+		}
+		slots_[empty_index].handler = nullptr;
+	}
+
+private:
+	struct Slot {
+		MessageId message_id;
+		// nullptr if this slot is empty.
+		MessageHandler* handler;
+	};
+
+	size_t GetHomeSlot(MessageId message_id) const {
+		// Fibonacci hashing, since message IDs are mostly sequential.
+		return (message_id * 11400714819323198485ull) >>
+			(64 - size_bits_);
+	}
+
+	void InsertIntoSlots(MessageId message_id, MessageHandler* handler) {
+		size_t index = GetHomeSlot(message_id);
+		while (slots_[index].handler != nullptr)
+			index = (index + 1) & (slots_.size() - 1);
+		slots_[index].message_id = message_id;
+		slots_[index].handler = handler;
+	}
+
+	void Grow() {
+		std::vector<Slot> old_slots = std::move(slots_);
+		size_bits_ = old_slots.empty() ? 5 : size_bits_ + 1;
+		slots_ = std::vector<Slot>((size_t)1 << size_bits_, Slot{0, nullptr});
+		for (const Slot& slot : old_slots) {
+			if (slot.handler != nullptr)
+				InsertIntoSlots(slot.message_id, slot.handler);
+		}
+	}
+
+	// The slots of the table. The size is always a power of two.
+	std::vector<Slot> slots_;
+	size_t size_bits_;
+	size_t number_of_handlers_;
+	ObjectPool<MessageHandler> handler_pool_;
+};
+
 // The handler for each message ID.
-std::map<MessageId, MessageHandler> handlers_by_message_id;
+MessageHandlerTable handlers_by_message_id;
+
+// Message IDs of reply slots have this bit set. GenerateUniqueMessageId will
+// never get this high.
+constexpr MessageId kReplySlotMessageIdBit = (MessageId)1 << 62;
+
+// The lower bits of a reply slot's message ID are the index of the slot, and
+// the upper bits are the generation of the slot, so late replies to an earlier
+// user of the slot are ignored.
+constexpr size_t kReplySlotIndexBits = 20;
+constexpr size_t kReplySlotIndexMask = ((size_t)1 << kReplySlotIndexBits) - 1;
+constexpr size_t kReplySlotGenerationMask =
+	(kReplySlotMessageIdBit - 1) >> kReplySlotIndexBits;
+
+// A slot that a fiber waits for a reply to an RPC in.
+struct ReplySlot {
+	// Incremented each time this slot is reserved.
+	size_t generation;
+
+	// Is this slot reserved?
+	bool is_reserved;
+
+	// The fiber that is sleeping until the reply, or nullptr if there is no
+	// fiber waiting right now.
+	Fiber* fiber_to_wake_up;
+
+	// The index of the next free slot, when this slot is free.
+	size_t next_free_slot;
+
+	// The reply that was received.
+	ProcessId senders_pid;
+	size_t metadata, param1, param2, param3, param4, param5;
+};
+
+// Reply slots. These are only ever added to, so once a process has reserved
+// as many slots as it will ever need at once, reserving a slot doesn't
+// allocate memory.
+std::vector<ReplySlot> reply_slots;
+
+// The first free reply slot, or kReplySlotIndexMask if there are none.
+size_t first_free_reply_slot = kReplySlotIndexMask;
+
+// Returns the reply slot for a message ID, or nullptr if it's not a reserved
+// reply slot.
+ReplySlot* GetReplySlot(MessageId message_id) {
+	if ((message_id & kReplySlotMessageIdBit) == 0)
+		return nullptr;
+
+	size_t index = message_id & kReplySlotIndexMask;
+	if (index >= reply_slots.size())
+		return nullptr;
+
+	ReplySlot& slot = reply_slots[index];
+	size_t generation = (message_id & ~kReplySlotMessageIdBit) >>
+		kReplySlotIndexBits;
+	if (!slot.is_reserved || slot.generation != generation)
+		return nullptr;
+	return &slot;
+}
 
 }
 
@@ -70,15 +240,17 @@ void DealWithUnhandledMessage(ProcessId sender, size_t metadata, size_t param1,
 	if (((metadata >> 1) & 0b11) != 0) {
 		// This is an RPC that expects a response. We need to respond
 		// to tell them this service or channel doesn't exist.
-		SendMessage(sender,
-			/*message_id=*/(::perception::MessageId)param1,
-			/*param_1=*/(size_t)Status::SERVICE_DOESNT_EXIST);
+		SendRawMessage(sender,
+			/*message_id=*/(::perception::MessageId)param1, /*metadata=*/0,
+			/*param_1=*/(size_t)Status::SERVICE_DOESNT_EXIST, 0, 0, 0, 0,
+			kMessageIsReply);
 	}
 }
 
 // Sends a message to a process.
 MessageStatus SendRawMessage(ProcessId pid, MessageId message_id, size_t metadata,
-	size_t param1, size_t param2, size_t param3, size_t param4, size_t param5) {
+	size_t param1, size_t param2, size_t param3, size_t param4, size_t param5,
+	size_t flags) {
 #if PERCEPTION
 	volatile register size_t syscall asm ("rdi") = 17;
 	volatile register size_t pid_r asm ("rbx") = pid;
@@ -89,18 +261,84 @@ MessageStatus SendRawMessage(ProcessId pid, MessageId message_id, size_t metadat
 	volatile register size_t param3_r asm ("r9") = param3;
 	volatile register size_t param4_r asm ("r10") = param4;
 	volatile register size_t param5_r asm ("r12") = param5;
+	volatile register size_t flags_r asm ("r13") = flags;
 	volatile register size_t return_val asm ("rax");
 
 	__asm__ __volatile__ ("syscall\n":"=r"(return_val):
 		"r" (syscall), "r"(pid_r), "r"(message_id_r), "r"(metadata_r),
 		"r"(param1_r), "r"(param2_r), "r"(param3_r), "r"(param4_r),
-		"r"(param5_r): "rcx", "r11");
+		"r"(param5_r), "r"(flags_r): "rcx", "r11");
 	return (MessageStatus)return_val;
 #else
 	return MessageStatus::UNSUPPORTED;
 #endif
 }
 
+// Sends a batch of messages, possibly to different processes, with one system
+// call.
+MessageStatus SendMessages(const MessageInBatch* messages,
+	size_t number_of_messages, size_t& messages_sent, size_t flags) {
+	messages_sent = 0;
+#if PERCEPTION
+	while (messages_sent < number_of_messages) {
+		// The kernel sends at most kMaxMessagesInBatch messages per call.
+		volatile register size_t syscall asm ("rdi") = 45;
+		volatile register size_t messages_r asm ("rax") =
+			(size_t)&messages[messages_sent];
+		volatile register size_t number_of_messages_r asm ("rbx") =
+			number_of_messages - messages_sent;
+		volatile register size_t flags_r asm ("r13") = flags;
+		volatile register size_t status_r asm ("rax");
+		volatile register size_t messages_sent_r asm ("rbx");
+
+		__asm__ __volatile__ ("syscall\n":
+			"=r"(status_r), "=r"(messages_sent_r):
+			"r" (syscall), "r"(messages_r), "r"(number_of_messages_r),
+			"r"(flags_r):
+			"rcx", "r11", "memory");
+
+		messages_sent += messages_sent_r;
+		if ((MessageStatus)status_r != MessageStatus::SUCCESS)
+			return (MessageStatus)status_r;
+	}
+	return MessageStatus::SUCCESS;
+#else
+	return MessageStatus::UNSUPPORTED;
+#endif
+}
+
+// Gets the statistics of a process's message queues.
+bool GetMessageQueueStatistics(ProcessId pid,
+	MessageQueueStatistics& statistics) {
+#if PERCEPTION
+	volatile register size_t syscall asm ("rdi") = 50;
+	volatile register size_t pid_r asm ("rax") = pid;
+	volatile register size_t exists_r asm ("rax");
+	volatile register size_t messages_queued_r asm ("rbx");
+	volatile register size_t priority_messages_queued_r asm ("rdx");
+	volatile register size_t messages_dropped_r asm ("rsi");
+	volatile register size_t messages_coalesced_r asm ("r8");
+
+	__asm__ __volatile__ ("syscall\n":
+		"=r"(exists_r), "=r"(messages_queued_r),
+		"=r"(priority_messages_queued_r), "=r"(messages_dropped_r),
+		"=r"(messages_coalesced_r):
+		"r" (syscall), "r"(pid_r):
+		"rcx", "r11");
+
+	if (exists_r == 0)
+		return false;
+
+	statistics.messages_queued = messages_queued_r;
+	statistics.priority_messages_queued = priority_messages_queued_r;
+	statistics.messages_dropped = messages_dropped_r;
+	statistics.messages_coalesced = messages_coalesced_r;
+	return true;
+#else
+	return false;
+#endif
+}
+
 MessageStatus SendMessage(ProcessId pid, MessageId message_id, size_t param1, size_t param2, size_t param3,
 	size_t param4, size_t param5) {
 	return SendRawMessage(pid, message_id, 0, param1, param2, param3, param4, param5);
@@ -149,23 +387,15 @@ void RegisterMessageHandler(MessageId message_id, std::function<void(ProcessId,
 // to memory leaks.
 void RegisterRawMessageHandler(MessageId message_id, std::function<void(ProcessId,
 	size_t, size_t, size_t, size_t, size_t, size_t)> callback) {
-	// Erase already existing message handler.
-	auto handlers_by_message_id_itr = handlers_by_message_id.find(message_id);
-	if (handlers_by_message_id_itr != handlers_by_message_id.end())
-		handlers_by_message_id.erase(handlers_by_message_id_itr);
-
-	MessageHandler handler;
-	handler.fiber_to_wake_up = nullptr;
-	handler.handler_function = std::move(callback);
-	handlers_by_message_id.emplace(std::make_pair(message_id,
-		std::move(handler)));
+	// This overrides any already existing message handler.
+	MessageHandler* handler = handlers_by_message_id.FindOrCreate(message_id);
+	handler->fiber_to_wake_up = nullptr;
+	handler->handler_function = std::move(callback);
 }
 
 // Unregisters the message handler, because we no longer care about handling these messages.
 void UnregisterMessageHandler(MessageId message_id) {
-	auto handlers_by_message_id_itr = handlers_by_message_id.find(message_id);
-	if (handlers_by_message_id_itr != handlers_by_message_id.end())
-		handlers_by_message_id.erase(message_id);
+	handlers_by_message_id.Erase(message_id);
 }
 
 // Sleeps the current fiber until we receive a message. Waiting for a message
@@ -197,17 +427,16 @@ void SleepUntilRawMessage(MessageId message_id, ProcessId& sender,
 	size_t& metadata, size_t& param1, size_t& param2, size_t& param3,
 	size_t& param4, size_t& param5) {
 	// Register the handler to wake us up.
-	MessageHandler handler;
-	handler.fiber_to_wake_up = GetCurrentlyExecutingFiber();
-	handlers_by_message_id.emplace(std::make_pair(message_id,
-		std::move(handler)));
+	MessageHandler* handler = handlers_by_message_id.FindOrCreate(message_id);
+	handler->fiber_to_wake_up = GetCurrentlyExecutingFiber();
+	handler->handler_function = nullptr;
 
 	// Yield this fiber.
 	Sleep();
 
 	// Get our handler.
-	auto handler_itr = handlers_by_message_id.find(message_id);
-	if (handler_itr == handlers_by_message_id.end()) {
+	handler = handlers_by_message_id.Find(message_id);
+	if (handler == nullptr) {
 		// This should never happen, but we'll have to return something.
 		sender = 0;
 		metadata = 0;
@@ -219,24 +448,147 @@ void SleepUntilRawMessage(MessageId message_id, ProcessId& sender,
 		return;
 	}
 
-	sender = handler_itr->second.senders_pid;
-	metadata = handler_itr->second.metadata;
-	param1 = handler_itr->second.param1;
-	param2 = handler_itr->second.param2;
-	param3 = handler_itr->second.param3;
-	param4 = handler_itr->second.param4;
-	param5 = handler_itr->second.param5;
+	sender = handler->senders_pid;
+	metadata = handler->metadata;
+	param1 = handler->param1;
+	param2 = handler->param2;
+	param3 = handler->param3;
+	param4 = handler->param4;
+	param5 = handler->param5;
 
 	// We can stop listening now.
-	handlers_by_message_id.erase(handler_itr);
+	handlers_by_message_id.Erase(message_id);
 }
+
 // Maybe returns a message handler for the given ID, or nullptr.
 MessageHandler* GetMessageHandler(MessageId message_id) {
-	auto handler_itr = handlers_by_message_id.find(message_id);
-	if (handler_itr == handlers_by_message_id.end())
+	return handlers_by_message_id.Find(message_id);
+}
+
+// Reserves a slot to receive the reply to an RPC in.
+MessageId ReserveReplySlot() {
+	size_t index = first_free_reply_slot;
+	if (index == kReplySlotIndexMask) {
+		// There are no free slots, so add one.
+		index = reply_slots.size();
+		reply_slots.push_back(ReplySlot{});
+	} else {
+		first_free_reply_slot = reply_slots[index].next_free_slot;
+	}
+
+	ReplySlot& slot = reply_slots[index];
+	slot.generation = (slot.generation + 1) & kReplySlotGenerationMask;
+	slot.is_reserved = true;
+	slot.fiber_to_wake_up = nullptr;
+	return kReplySlotMessageIdBit | (slot.generation << kReplySlotIndexBits) |
+		index;
+}
+
+// Sleeps the current fiber until a message is sent to a reserved reply slot.
+void SleepUntilReply(MessageId reply_id, ProcessId& sender,
+	size_t& metadata, size_t& param1, size_t& param2, size_t& param3,
+	size_t& param4, size_t& param5) {
+	ReplySlot* slot = GetReplySlot(reply_id);
+	if (slot == nullptr) {
+		// This isn't a reserved reply slot.
+		sender = 0;
+		metadata = 0;
+		param1 = 0;
+		param2 = 0;
+		param3 = 0;
+		param4 = 0;
+		param5 = 0;
+		return;
+	}
+
+	slot->fiber_to_wake_up = GetCurrentlyExecutingFiber();
+	Sleep();
+
+	// The slots may have moved while we were asleep.
+	slot = GetReplySlot(reply_id);
+	sender = slot->senders_pid;
+	metadata = slot->metadata;
+	param1 = slot->param1;
+	param2 = slot->param2;
+	param3 = slot->param3;
+	param4 = slot->param4;
+	param5 = slot->param5;
+}
+
+// Sends a message, then sleeps the current fiber until a message is sent to a
+// reserved reply slot.
+MessageStatus SendMessageAndSleepUntilReply(ProcessId pid,
+	MessageId message_id, size_t metadata, size_t param1, size_t param2,
+	size_t param3, size_t param4, size_t param5, MessageId reply_id,
+	ProcessId& sender, size_t& reply_metadata, size_t& reply_param1,
+	size_t& reply_param2, size_t& reply_param3, size_t& reply_param4,
+	size_t& reply_param5) {
+	ReplySlot* slot = GetReplySlot(reply_id);
+	if (slot == nullptr) {
+		// This isn't a reserved reply slot, so nothing would wake us up.
+		return MessageStatus::UNSUPPORTED;
+	}
+
+	// Wake us up when the reply arrives, which might be during the system call
+	// that sends the message.
+	slot->fiber_to_wake_up = GetCurrentlyExecutingFiber();
+	MessageStatus status = Scheduler::SendMessageAndSleep(pid, message_id,
+		metadata, param1, param2, param3, param4, param5);
+
+	// The slots may have moved while we were asleep.
+	slot = GetReplySlot(reply_id);
+	if (status != MessageStatus::SUCCESS) {
+		slot->fiber_to_wake_up = nullptr;
+		return status;
+	}
+
+	sender = slot->senders_pid;
+	reply_metadata = slot->metadata;
+	reply_param1 = slot->param1;
+	reply_param2 = slot->param2;
+	reply_param3 = slot->param3;
+	reply_param4 = slot->param4;
+	reply_param5 = slot->param5;
+	return MessageStatus::SUCCESS;
+}
+
+// Releases a reply slot once we are done with it.
+void ReleaseReplySlot(MessageId reply_id) {
+	ReplySlot* slot = GetReplySlot(reply_id);
+	if (slot == nullptr)
+		return;
+
+	slot->is_reserved = false;
+	slot->fiber_to_wake_up = nullptr;
+	slot->next_free_slot = first_free_reply_slot;
+	first_free_reply_slot = reply_id & kReplySlotIndexMask;
+}
+
+// Returns the fiber waiting for a reply sent to a reply slot, or nullptr if
+// no fiber is waiting on it.
+Fiber* GetFiberToHandleReply(MessageId message_id, ProcessId senders_pid,
+	size_t metadata, size_t param1, size_t param2, size_t param3,
+	size_t param4, size_t param5) {
+	ReplySlot* slot = GetReplySlot(message_id);
+	if (slot == nullptr || slot->fiber_to_wake_up == nullptr)
 		return nullptr;
-	else
-		return &handler_itr->second;
+
+	slot->senders_pid = senders_pid;
+	slot->metadata = metadata;
+	slot->param1 = param1;
+	slot->param2 = param2;
+	slot->param3 = param3;
+	slot->param4 = param4;
+	slot->param5 = param5;
+
+	Fiber* fiber = slot->fiber_to_wake_up;
+	slot->fiber_to_wake_up = nullptr;
+	return fiber;
+}
+
+// Is this the message ID of a reply slot?
+bool IsReplySlotMessageId(MessageId message_id) {
+	return (message_id & kReplySlotMessageIdBit) != 0;
 }
 
 }
@@ -32,74 +32,100 @@ namespace {
 /*thread_local*/ Fiber* fiber_to_return_to_when_were_out_of_work = nullptr;
 /*thread_local*/ Fiber* fiber_to_return_to_after_sleeping_when_were_out_of_work = nullptr;
 
-// Sleeps until a message. Returns true if a message was received.
-bool SleepThreadUntilMessage(ProcessId& senders_pid, MessageId& message_id,
-	size_t& metadata, size_t& param1, size_t& param2, size_t& param3,
-	size_t& param4, size_t& param5) {
+// The number of messages to receive from the kernel at once.
+constexpr size_t kMessagesToReceiveAtOnce = 32;
+
+// Messages we have received from the kernel but haven't dispatched yet. We
+// dispatch all of these before asking the kernel for more.
+/*thread_local*/ MessageInBatch received_messages[kMessagesToReceiveAtOnce];
+/*thread_local*/ size_t next_received_message = 0;
+/*thread_local*/ size_t number_of_received_messages = 0;
+
+// A reply that SendReplyBeforeReturning is holding on to, to send when we
+// sleep.
+/*thread_local*/ MessageInBatch pending_reply;
+/*thread_local*/ bool has_pending_reply = false;
+
+// The system calls that send a message and then sleep until messages.
+constexpr size_t kCallSyscall = 48;
+constexpr size_t kReplyAndWaitSyscall = 49;
+
+// Sleeps until there are messages, then receives as many as will fit into the
+// buffer. Returns the number of messages received.
+size_t SleepThreadUntilMessages(MessageInBatch* messages,
+	size_t max_messages) {
 #if PERCEPTION
-	volatile register size_t syscall asm ("rdi") = 19;
-	volatile register size_t pid_r asm ("rbx");
-	volatile register size_t message_id_r asm ("rax");
-	volatile register size_t metadata_r asm ("rdx");
-	volatile register size_t param1_r asm ("rsi");
-	volatile register size_t param2_r asm ("r8");
-	volatile register size_t param3_r asm ("r9");
-	volatile register size_t param4_r asm ("r10");
-	volatile register size_t param5_r asm ("r12");
+	volatile register size_t syscall asm ("rdi") = 47;
+	volatile register size_t messages_r asm ("rax") = (size_t)messages;
+	volatile register size_t max_messages_r asm ("rbx") = max_messages;
+	volatile register size_t messages_received_r asm ("rax");
 
 	__asm__ __volatile__ ("syscall\n":
-		"=r"(pid_r), "=r"(message_id_r), "=r"(metadata_r), "=r"(param1_r),
-		"=r"(param2_r), "=r"(param3_r), "=r"(param4_r), "=r"(param5_r):
-		"r" (syscall): "rcx", "r11");
-
-	senders_pid = pid_r;
-	message_id = message_id_r;
-	metadata = metadata_r;
-	param1 = param1_r;
-	param2 = param2_r;
-	param3 = param3_r;
-	param4 = param4_r;
-	param5 = param5_r;
-
-	return message_id_r != 0xFFFFFFFFFFFFFFFF;
+		"=r"(messages_received_r):
+		"r" (syscall), "r"(messages_r), "r"(max_messages_r):
+		"rcx", "r11", "memory");
+
+	return messages_received_r;
+#else
+	return 0;
+#endif
+}
+
+// Sends a message, then sleeps until there are messages and receives as many
+// as will fit into the buffer, all in one system call. Returns the number of
+// messages received, and sets status to the status of sending the message.
+size_t SendMessageAndSleepThreadUntilMessages(size_t syscall_number,
+	const MessageInBatch& message_to_send, size_t flags,
+	MessageInBatch* messages, size_t max_messages, MessageStatus& status) {
+#if PERCEPTION
+	volatile register size_t syscall asm ("rdi") = syscall_number;
+	volatile register size_t pid_r asm ("rbx") = message_to_send.pid;
+	volatile register size_t message_id_r asm ("rax") =
+		message_to_send.message_id;
+	volatile register size_t metadata_r asm ("rdx") = message_to_send.metadata;
+	volatile register size_t param1_r asm ("rsi") = message_to_send.param1;
+	volatile register size_t param2_r asm ("r8") = message_to_send.param2;
+	volatile register size_t param3_r asm ("r9") = message_to_send.param3;
+	volatile register size_t param4_r asm ("r10") = message_to_send.param4;
+	volatile register size_t param5_r asm ("r12") = message_to_send.param5;
+	volatile register size_t flags_r asm ("r13") = flags;
+	volatile register size_t messages_r asm ("r14") = (size_t)messages;
+	volatile register size_t max_messages_r asm ("r15") = max_messages;
+	volatile register size_t messages_received_r asm ("rax");
+	volatile register size_t status_r asm ("rbx");
+
+	__asm__ __volatile__ ("syscall\n":
+		"=r"(messages_received_r), "=r"(status_r):
+		"r" (syscall), "r"(pid_r), "r"(message_id_r), "r"(metadata_r),
+		"r"(param1_r), "r"(param2_r), "r"(param3_r), "r"(param4_r),
+		"r"(param5_r), "r"(flags_r), "r"(messages_r), "r"(max_messages_r):
+		"rcx", "r11", "memory");
+
+	status = (MessageStatus)status_r;
+	return messages_received_r;
 #else
-	return false;
+	status = MessageStatus::UNSUPPORTED;
+	return 0;
 #endif
 }
 
-// Polls for a message, returning false immediately if no message was received.
-bool PollForMessage(ProcessId& senders_pid, MessageId& message_id,
-	size_t& metadata, size_t& param1, size_t& param2, size_t& param3,
-	size_t& param4, size_t& param5) {
+// Polls for messages, receiving as many as will fit into the buffer. Returns
+// immediately with the number of messages received, which may be 0.
+size_t PollForMessages(MessageInBatch* messages, size_t max_messages) {
 #if PERCEPTION
-	// TODO: Handle metadata
-	volatile register size_t syscall asm ("rdi") = 18;
-	volatile register size_t pid_r asm ("rbx");
-	volatile register size_t message_id_r asm ("rax");
-	volatile register size_t metadata_r asm ("rdx");
-	volatile register size_t param1_r asm ("rsi");
-	volatile register size_t param2_r asm ("r8");
-	volatile register size_t param3_r asm ("r9");
-	volatile register size_t param4_r asm ("r10");
-	volatile register size_t param5_r asm ("r12");
+	volatile register size_t syscall asm ("rdi") = 46;
+	volatile register size_t messages_r asm ("rax") = (size_t)messages;
+	volatile register size_t max_messages_r asm ("rbx") = max_messages;
+	volatile register size_t messages_received_r asm ("rax");
 
 	__asm__ __volatile__ ("syscall\n":
-		"=r"(pid_r), "=r"(message_id_r), "=r"(metadata_r), "=r"(param1_r),
-		"=r"(param2_r), "=r"(param3_r), "=r"(param4_r), "=r"(param5_r):
-		"r" (syscall): "rcx", "r11");
-
-	senders_pid = pid_r;
-	message_id = message_id_r;
-	metadata = metadata_r;
-	param1 = param1_r;
-	param2 = param2_r;
-	param3 = param3_r;
-	param4 = param4_r;
-	param5 = param5_r;
-
-	return message_id_r != 0xFFFFFFFFFFFFFFFF;
+		"=r"(messages_received_r):
+		"r" (syscall), "r"(messages_r), "r"(max_messages_r):
+		"rcx", "r11", "memory");
+
+	return messages_received_r;
 #else
-	return false;
+	return 0;
 #endif
 }
 
@@ -174,6 +200,11 @@ void WaitForMessagesThenReturn() {
 
 // Gets the next fiber to run, or sleeps until there is one.
 Fiber* Scheduler::GetNextFiberToRun() {
+	if (has_pending_reply && !IsOutOfWork()) {
+		// There's other work to do before we'd sleep, so don't hold up the
+		// reply.
+		SendPendingReply();
+	}
 
 	// Return a fiber if there's one scheduled.
 	if (first_scheduled_fiber != nullptr) {
@@ -191,10 +222,10 @@ Fiber* Scheduler::GetNextFiberToRun() {
 		return fiber;
 	}
 
-	// Check if there are any messages.
-	ProcessId senders_pid;
-	MessageId message_id;
-	size_t metadata, param1, param2, param3, param4, param5;
+	// Handle any messages we have already received from the kernel.
+	Fiber* fiber = DispatchReceivedMessages();
+	if (fiber != nullptr)
+		return fiber;
 
 	if (fiber_to_return_to_when_were_out_of_work == nullptr) {
 		if (fiber_to_return_to_after_sleeping_when_were_out_of_work != nullptr) {
@@ -205,32 +236,39 @@ Fiber* Scheduler::GetNextFiberToRun() {
 		}
 
 		// Nothing is waiting for to finish, so we'll sleep for the next
-		// message.
+		// messages.
 		while (true) {
-			if (!SleepThreadUntilMessage(senders_pid, message_id, metadata, param1, param2,
-				param3, param4, param5)) {
-				// The thread randomly woke without a message. This shouldn't
-				// happen.
-				continue;
+			next_received_message = 0;
+			if (has_pending_reply) {
+				// Send the reply in the same system call, so the kernel can
+				// switch straight to the thread waiting for it.
+				has_pending_reply = false;
+				MessageStatus status;
+				number_of_received_messages =
+					SendMessageAndSleepThreadUntilMessages(
+						kReplyAndWaitSyscall, pending_reply, kMessageIsReply,
+						received_messages, kMessagesToReceiveAtOnce, status);
+			} else {
+				number_of_received_messages = SleepThreadUntilMessages(
+					received_messages, kMessagesToReceiveAtOnce);
 			}
-				
-			// Get the fiber to handle this message.
-			Fiber* fiber = GetFiberToHandleMessage(senders_pid, message_id, metadata,
-				param1, param2, param3, param4, param5);
 
-			// Is there a fiber to handle this message?
+			// The thread may have randomly woken without a message. This
+			// shouldn't happen, but then we'll just sleep again.
+			fiber = DispatchReceivedMessages();
 			if (fiber != nullptr)
 				return fiber;
 		}
 	} else {
 		// Keep looping while there are messages.
-		while (PollForMessage(senders_pid, message_id, metadata, param1, param2,
-			param3, param4, param5)) {
-			// Get the fiber to handle this message.
-			Fiber* fiber = GetFiberToHandleMessage(senders_pid, message_id, metadata,
-				param1, param2, param3, param4, param5);
+		while (true) {
+			next_received_message = 0;
+			number_of_received_messages = PollForMessages(
+				received_messages, kMessagesToReceiveAtOnce);
+			if (number_of_received_messages == 0)
+				break;
 
-			// Is there a fiber to handle this message?
+			fiber = DispatchReceivedMessages();
 			if (fiber != nullptr)
 				return fiber;
 		}
@@ -241,6 +279,24 @@ Fiber* Scheduler::GetNextFiberToRun() {
 	}
 }
 
+// Returns a fiber to handle the next message we have received from the kernel
+// but haven't dispatched, or nullptr if there's nothing to do for any of them.
+Fiber* Scheduler::DispatchReceivedMessages() {
+	while (next_received_message < number_of_received_messages) {
+		MessageInBatch& message = received_messages[next_received_message++];
+
+		// Get the fiber to handle this message.
+		Fiber* fiber = GetFiberToHandleMessage(message.pid, message.message_id,
+			message.metadata, message.param1, message.param2, message.param3,
+			message.param4, message.param5);
+
+		// Is there a fiber to handle this message?
+		if (fiber != nullptr)
+			return fiber;
+	}
+	return nullptr;
+}
+
 // Schedules a fiber to run.
 void Scheduler::ScheduleFiber(Fiber* fiber) {
 	if (fiber->is_scheduled_to_run_)
@@ -257,11 +313,117 @@ void Scheduler::ScheduleFiber(Fiber* fiber) {
 		last_scheduled_fiber = fiber;
 	}
 }
+// Sends a message, then sleeps the current fiber until it's woken up.
+MessageStatus Scheduler::SendMessageAndSleep(ProcessId pid,
+	MessageId message_id, size_t metadata, size_t param1, size_t param2,
+	size_t param3, size_t param4, size_t param5) {
+	SendPendingReply();
+
+	if (!IsOutOfWork()) {
+		// There's other work to do while we wait.
+		MessageStatus status = SendRawMessage(pid, message_id, metadata,
+			param1, param2, param3, param4, param5);
+		if (status == MessageStatus::SUCCESS)
+			Sleep();
+		return status;
+	}
+
+	MessageInBatch message_to_send;
+	message_to_send.pid = pid;
+	message_to_send.message_id = message_id;
+	message_to_send.metadata = metadata;
+	message_to_send.param1 = param1;
+	message_to_send.param2 = param2;
+	message_to_send.param3 = param3;
+	message_to_send.param4 = param4;
+	message_to_send.param5 = param5;
+
+	MessageStatus status;
+	next_received_message = 0;
+	number_of_received_messages = SendMessageAndSleepThreadUntilMessages(
+		kCallSyscall, message_to_send, /*flags=*/0, received_messages,
+		kMessagesToReceiveAtOnce, status);
+	if (status != MessageStatus::SUCCESS)
+		return status;
+
+	// Dispatch the messages we received, which will hopefully wake us up.
+	Sleep();
+	return MessageStatus::SUCCESS;
+}
+
+// Sends a message, without memory pages, in reply to an RPC.
+void Scheduler::SendReply(ProcessId pid, MessageId message_id,
+	size_t param1, size_t param2, size_t param3, size_t param4,
+	size_t param5) {
+	// Don't overtake a reply that we're holding on to.
+	SendPendingReply();
+	SendRawMessage(pid, message_id, 0, param1, param2, param3, param4,
+		param5, kMessageIsReply);
+}
+
+// Sends a reply to an RPC as the last thing before the fiber returns to the
+// scheduler.
+void Scheduler::SendReplyBeforeReturning(ProcessId pid, MessageId message_id,
+	size_t param1, size_t param2, size_t param3, size_t param4,
+	size_t param5) {
+	// We can only hold on to one reply.
+	SendPendingReply();
+
+	if (!IsOutOfWork()) {
+		SendRawMessage(pid, message_id, 0, param1, param2, param3, param4,
+			param5, kMessageIsReply);
+		return;
+	}
+
+	pending_reply.pid = pid;
+	pending_reply.message_id = message_id;
+	pending_reply.metadata = 0;
+	pending_reply.param1 = param1;
+	pending_reply.param2 = param2;
+	pending_reply.param3 = param3;
+	pending_reply.param4 = param4;
+	pending_reply.param5 = param5;
+	has_pending_reply = true;
+}
+
+// Returns if this thread would sleep until the next message, rather than
+// run another fiber or handle a message it has already received.
+bool Scheduler::IsOutOfWork() {
+	return first_scheduled_fiber == nullptr &&
+		next_received_message >= number_of_received_messages &&
+		fiber_to_return_to_when_were_out_of_work == nullptr &&
+		fiber_to_return_to_after_sleeping_when_were_out_of_work == nullptr;
+}
+
+// Sends the reply that SendReplyBeforeReturning is holding on to, if there is
+// one.
+void Scheduler::SendPendingReply() {
+	if (!has_pending_reply)
+		return;
+
+	has_pending_reply = false;
+	SendRawMessage(pending_reply.pid, pending_reply.message_id,
+		pending_reply.metadata, pending_reply.param1, pending_reply.param2,
+		pending_reply.param3, pending_reply.param4, pending_reply.param5,
+		kMessageIsReply);
+}
+
 // Returns a fiber to handle the message, or nullptr if there's
 // nothing to do.
 Fiber* Scheduler::GetFiberToHandleMessage(ProcessId senders_pid, MessageId message_id,
 	size_t metadata, size_t param1, size_t param2, size_t param3,
 	size_t param4, size_t param5) {
+	if (IsReplySlotMessageId(message_id)) {
+		// This is a reply to an RPC.
+		Fiber* fiber = GetFiberToHandleReply(message_id, senders_pid,
+			metadata, param1, param2, param3, param4, param5);
+		if (fiber == nullptr) {
+			// Nobody is waiting for this reply.
+			DealWithUnhandledMessage(senders_pid, metadata, param1, param4,
+				param5);
+		}
+		return fiber;
+	}
 
 	MessageHandler* handler = GetMessageHandler(message_id);
 	if (handler == nullptr) {
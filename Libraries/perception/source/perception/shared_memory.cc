@@ -44,15 +44,18 @@ std::map<size_t, SharedMemoryBlock> shared_memory_blocks;
 #endif
 
 // Performs the system call to create a region of shared memory.
-void CreateSharedMemory(size_t size_in_pages, size_t& id, void*& ptr) {
+void CreateSharedMemory(size_t size_in_pages, bool prefer_large_pages,
+	size_t& id, void*& ptr) {
 #if PERCEPTION
 	volatile register size_t syscall_num asm ("rdi") = 42;
 	volatile register size_t size_r asm ("rax") = size_in_pages;
+	volatile register size_t large_pages_r asm ("rbx") =
+		prefer_large_pages ? 1 : 0;
 	volatile register size_t id_r asm ("rax");
 	volatile register size_t address_r asm ("rbx");
 
 	__asm__ __volatile__ ("syscall\n":"=r"(id_r), "=r"(address_r):
-		"r"(syscall_num), "r"(size_r): "rcx", "r11");
+		"r"(syscall_num), "r"(size_r), "r"(large_pages_r): "rcx", "r11");
 	id = id_r;
 	ptr = (void*)address_r;
 #else
@@ -159,7 +162,8 @@ SharedMemory& SharedMemory::operator=(SharedMemory&& other)  {
 
 // Creates a shared memory block of a specific size. The size is rounded up
 // to the nearest page size.
-std::unique_ptr<SharedMemory> SharedMemory::FromSize(size_t size_in_bytes) {
+std::unique_ptr<SharedMemory> SharedMemory::FromSize(size_t size_in_bytes,
+	bool prefer_large_pages) {
 	size_t size_in_pages = (size_in_bytes + kPageSize - 1) / kPageSize;
 	if (size_in_pages == 0)
 		// Shared memory is empty.
@@ -167,7 +171,7 @@ std::unique_ptr<SharedMemory> SharedMemory::FromSize(size_t size_in_bytes) {
 
 	size_t id = 0;
 	void* ptr = nullptr;
-	CreateSharedMemory(size_in_pages, id, ptr);
+	CreateSharedMemory(size_in_pages, prefer_large_pages, id, ptr);
 
 	if (id == 0)
 		// Could not create the shared memory.
@@ -65,7 +65,9 @@ std::chrono::microseconds GetTimeSinceKernelStarted() {
 	size_t microseconds = return_val;
 	return std::chrono::microseconds(microseconds);
 #else
-	return std::chrono::microseconds(0);
+	// There's no kernel, so use the host's monotonic clock.
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch());
 #endif
 }
 
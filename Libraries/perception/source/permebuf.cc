@@ -1,5 +1,6 @@
 #include "permebuf.h"
 
+#include "perception/channel.h"
 #include "perception/memory.h"
 #include "perception/processes.h"
 #include "perception/services.h"
@@ -7,12 +8,22 @@
 #include <iostream>
 #include <string>
 
+using ::perception::ChannelMessage;
+using ::perception::ChannelReceiver;
+using ::perception::ChannelSender;
 using ::perception::DealWithUnhandledMessage;
 using ::perception::GenerateUniqueMessageId;
 using ::perception::MessageId;
+using ::perception::MessageStatus;
+using ::perception::NotifyUponProcessTermination;
 using ::perception::ProcessId;
 using ::perception::RegisterRawMessageHandler;
 using ::perception::RegisterService;
+using ::perception::SendRawMessage;
+using ::perception::SleepUntilMessage;
+using ::perception::Status;
+using ::perception::StopNotifyingUponProcessTermination;
+using ::perception::ToStatus;
 using ::perception::UnregisterMessageHandler;
 using ::perception::UnregisterService;
 
@@ -872,6 +883,44 @@ MessageId PermebufService::GetMessageId() const {
 	return message_id_;
 }
 
+// Opens a channel to the server.
+Status PermebufService::OpenChannel(size_t capacity) {
+	// Anything in the old channel has to arrive before we replace it.
+	WaitForChannel();
+
+	auto channel = ChannelSender::Create(process_id_, capacity);
+	if (!channel)
+		return Status::OUT_OF_MEMORY;
+
+	MessageId message_id_of_response = GenerateUniqueMessageId();
+	auto send_status = SendRawMessage(process_id_, message_id_,
+		kPermebufOpenChannelMetadata, message_id_of_response,
+		channel->GetSharedMemoryId(), 0, 0, 0);
+	if (send_status != MessageStatus::SUCCESS)
+		return ToStatus(send_status);
+
+	// Sleep until we get a response.
+	ProcessId pid;
+	size_t metadata, response_status, param2, param3, param4, param5;
+	do {
+		SleepUntilMessage(message_id_of_response, pid, metadata,
+			response_status, param2, param3, param4, param5);
+	} while (pid != process_id_);
+
+	if (response_status != 0)
+		return static_cast<Status>(response_status);
+
+	channel_ = std::move(channel);
+	return Status::OK;
+}
+
+// Waits until the server has handled everything we sent through the channel,
+// so a message that we send through the kernel can't overtake them.
+void PermebufService::WaitForChannel() const {
+	if (channel_)
+		channel_->WaitUntilReceived();
+}
+
 // Does this service refer to the same instance as another service?
 bool PermebufService::operator==(const PermebufService& other) const {
 	return process_id_ == other.GetProcessId() &&
@@ -883,7 +932,8 @@ bool PermebufService::operator==(const PermebufServer& other) const {
 		message_id_ == other.GetMessageId();
 }
 
-PermebufServer::PermebufServer(std::string_view service_name) {
+PermebufServer::PermebufServer(std::string_view service_name) :
+	accepts_channels_(false) {
 	message_id_ = GenerateUniqueMessageId();
 	RegisterRawMessageHandler(message_id_,
 		[this](::perception::ProcessId sender,
@@ -898,6 +948,11 @@ PermebufServer::PermebufServer(std::string_view service_name) {
 PermebufServer::~PermebufServer() {
 	UnregisterService(message_id_);
 	UnregisterMessageHandler(message_id_);
+	for (auto& channel : channels_) {
+		StopNotifyingUponProcessTermination(
+			channel.second.process_termination_message_id);
+		channel.second.receiver->Close();
+	}
 }
 
 ProcessId PermebufServer::GetProcessId() const {
@@ -920,6 +975,15 @@ bool PermebufServer::operator==(const PermebufServer& other) const {
 	return message_id_ == other.GetMessageId();
 }
 
+// Sets if clients may open channels to this server.
+void PermebufServer::SetAcceptsChannels(bool accepts_channels) {
+	accepts_channels_ = accepts_channels;
+	if (!accepts_channels) {
+		while (!channels_.empty())
+			CloseChannel(channels_.begin()->first);
+	}
+}
+
 
 size_t PermebufServer::GetFunctionNumberFromMetadata(size_t metadata) {
 	return metadata >> 3;
@@ -928,6 +992,13 @@ size_t PermebufServer::GetFunctionNumberFromMetadata(size_t metadata) {
 void PermebufServer::MessageHandler(::perception::ProcessId sender,
 	size_t metadata, size_t param_1, size_t param_2, size_t param_3,
 	size_t param_4, size_t param_5) {
+	if (metadata == kPermebufOpenChannelMetadata) {
+		// param_1 is the message to respond with, param_2 is the channel's
+		// shared memory.
+		ReplyWithStatus(sender, param_1, OpenChannel(sender, param_2));
+		return;
+	}
+
 	if (!DelegateMessage(sender, metadata, param_1, param_2,
 		param_3, param_4, param_5)) {
 		::perception::DealWithUnhandledMessage(sender, metadata,
@@ -935,11 +1006,63 @@ void PermebufServer::MessageHandler(::perception::ProcessId sender,
 	}
 }
 
+// Opens a channel that a client has asked for.
+Status PermebufServer::OpenChannel(ProcessId sender, size_t shared_memory_id) {
+	if (!accepts_channels_)
+		return Status::UNIMPLEMENTED;
+
+	// A client only has one channel open at a time.
+	CloseChannel(sender);
+
+	auto receiver = ChannelReceiver::Join(shared_memory_id, sender,
+		[this, sender](const ChannelMessage& message) {
+			if ((message.metadata & 0b111) != 0 ||
+				message.metadata == kPermebufOpenChannelMetadata) {
+				// Only mini messages without responses can be sent through a
+				// channel. Anything else would refer to memory in the client.
+				return;
+			}
+			MessageHandler(sender, message.metadata, message.param1,
+				message.param2, message.param3, message.param4,
+				message.param5);
+		});
+	if (!receiver)
+		return Status::INVALID_ARGUMENT;
+
+	ChannelFromClient channel;
+	channel.receiver = std::move(receiver);
+	channel.process_termination_message_id = NotifyUponProcessTermination(
+		sender, [this, sender]() {
+			// This notification has already fired, so don't stop it.
+			auto channel_itr = channels_.find(sender);
+			if (channel_itr == channels_.end())
+				return;
+			channel_itr->second.receiver->Close();
+			channels_.erase(channel_itr);
+		});
+	channels_.emplace(sender, std::move(channel));
+	return Status::OK;
+}
+
+// Closes the channel from a client.
+void PermebufServer::CloseChannel(ProcessId sender) {
+	auto channel_itr = channels_.find(sender);
+	if (channel_itr == channels_.end())
+		return;
+
+	StopNotifyingUponProcessTermination(
+		channel_itr->second.process_termination_message_id);
+	// If a fiber is in the middle of handling a message from the channel, it
+	// holds on to the receiver until the handler returns.
+	channel_itr->second.receiver->Close();
+	channels_.erase(channel_itr);
+}
+
 void PermebufServer::ReplyWithStatus(
 	::perception::ProcessId process,
 	::perception::MessageId response_channel,
 	::perception::Status status) {
-	::perception::SendMessage(process, response_channel,
-		(size_t)status);
+	::perception::Scheduler::SendReplyBeforeReturning(process, response_channel,
+		(size_t)status, 0, 0, 0, 0);
 }
 